@@ -3,25 +3,52 @@
 #include <stdio.h>
 #include <string.h>
 #include "../protocol/TeepTamBrokerLib/TeepTamBrokerLib.h"
+#ifdef _WIN32
 #pragma warning(push)
 #pragma warning(disable:4996)
 #include "applink.c"
 #pragma warning(pop)
+#else
+#include <stdlib.h>
+#include <wchar.h>
+#endif
 
 #define DEFAULT_DATA_DIRECTORY "../../../tam"
 
 int wmain(int argc, wchar_t** argv)
 {
     int simulated_tee = 0;
-    if ((argc > 1) && (wcscmp(argv[1], L"-s") == 0)) {
-        simulated_tee = 1;
+    int watch_configuration = 0;
+    int compile_manifests = 0;
+    while (argc > 1) {
+        if (wcscmp(argv[1], L"-s") == 0) {
+            simulated_tee = 1;
+        } else if (wcscmp(argv[1], L"-w") == 0) {
+            watch_configuration = 1;
+        } else if (wcscmp(argv[1], L"-c") == 0) {
+            compile_manifests = 1;
+        } else {
+            break;
+        }
         argc--;
         argv++;
     }
 
+    if (compile_manifests) {
+        int err = CompileTamManifests(DEFAULT_DATA_DIRECTORY);
+        if (err != 0) {
+            printf("Error %d compiling manifests\n", err);
+        }
+        return err;
+    }
+
     if (argc < 2) {
-        printf("Usage: TamHost [-s] <TAM URI>\n");
+        printf("Usage: TamHost [-s] [-w] <TAM URI>\n");
+        printf("       TamHost -c\n");
         printf("       where -s if present means to only simulate a TEE\n");
+        printf("             -w if present means to apply manifest and key changes without a restart\n");
+        printf("             -c means to compile the manifest files into the manifest pack the TAM\n");
+        printf("                loads, after changing them while no TAM was run with -w, and exit\n");
         printf("             <TAM URI> is the TAM URI to use, e.g., http://192.168.1.37:54321/TEEP\n");
         printf("\nCurrently the <TAM URI> must end in /TEEP\n");
         return 0;
@@ -30,6 +57,7 @@ int wmain(int argc, wchar_t** argv)
     const wchar_t* tamUri = argv[1];
     printf("Listening on TAM URI: %ls\n", tamUri);
 
+    SetTamBrokerConfigurationWatch(watch_configuration);
     int err = StartTamBroker(DEFAULT_DATA_DIRECTORY, simulated_tee);
     if (err != 0) {
         return err;
@@ -43,3 +71,29 @@ int wmain(int argc, wchar_t** argv)
     int c = getchar();
     return err;
 }
+
+#ifndef _WIN32
+int main(int argc, char** argv)
+{
+    // Convert arguments to wide strings to share the wmain code path.
+    wchar_t** wargv = (wchar_t**)calloc(argc + 1, sizeof(wchar_t*));
+    if (wargv == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < argc; i++) {
+        size_t length = mbstowcs(NULL, argv[i], 0) + 1;
+        wargv[i] = (wchar_t*)calloc(length, sizeof(wchar_t));
+        if (wargv[i] != NULL) {
+            mbstowcs(wargv[i], argv[i], length);
+        }
+    }
+
+    int err = wmain(argc, wargv);
+
+    for (int i = 0; i < argc; i++) {
+        free(wargv[i]);
+    }
+    free(wargv);
+    return err;
+}
+#endif
@@ -0,0 +1,255 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+
+// This file contains the 'main' function of the benchmarks, which report
+// timings only and so are kept out of the unit tests.  Run it with no
+// arguments to run every benchmark, or with the names of the ones to run.
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "CryptoProvider.h"
+#include "Manifest.h"
+#include "ManifestRepository.h"
+#include "TeepTamLib.h"
+
+// Report how many times per second an operation runs, after one untimed
+// run to warm up any per-thread state.  Returns false if the operation
+// failed.
+static bool ReportOpsPerSecond(_In_z_ const char* providerName, _In_z_ const char* operation, const std::function<bool()>& run, int iterations = 2000)
+{
+    if (!run()) {
+        printf("%-10s %-14s failed\n", providerName, operation);
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        if (!run()) {
+            printf("%-10s %-14s failed\n", providerName, operation);
+            return false;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-10s %-14s %12.0f ops/s\n", providerName, operation, iterations / seconds);
+    return true;
+}
+
+// Report how long an operation takes to run once.  Returns false if the
+// operation failed.
+static bool ReportMilliseconds(_In_z_ const char* name, _In_z_ const char* operation, const std::function<bool()>& run)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (!run()) {
+        printf("%-10s %-14s failed\n", name, operation);
+        return false;
+    }
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("%-10s %-14s %12.1f ms\n", name, operation, milliseconds);
+    return true;
+}
+
+// Add other providers to the list to compare them.
+static bool BenchmarkCryptoProviders(void)
+{
+    const teep_crypto_provider_t* providers[] = { &teep_openssl_crypto_provider };
+    std::vector<uint8_t> message(1024, 0x42);
+    UsefulBufC messageC = { message.data(), message.size() };
+    bool ok = true;
+
+    for (const teep_crypto_provider_t* provider : providers) {
+        const char* name = provider->name;
+        uint8_t hash[TEEP_SHA256_LENGTH];
+        ok &= ReportOpsPerSecond(name, "SHA-256 1KiB", [&] { return provider->sha256(&messageC, 1, hash) == TEEP_ERR_SUCCESS; });
+        uint8_t random[32];
+        ok &= ReportOpsPerSecond(name, "random 32B", [&] { return provider->random(random, sizeof(random)) == TEEP_ERR_SUCCESS; });
+
+        for (teep_signature_kind_t kind : { TEEP_SIGNATURE_ES256, TEEP_SIGNATURE_EDDSA }) {
+            struct t_cose_key key;
+            if (provider->generate_key(kind, &key) != TEEP_ERR_SUCCESS) {
+                printf("%-10s could not generate a key\n", name);
+                ok = false;
+                continue;
+            }
+            const uint8_t* data = (kind == TEEP_SIGNATURE_ES256) ? hash : message.data();
+            size_t dataLength = (kind == TEEP_SIGNATURE_ES256) ? sizeof(hash) : message.size();
+            uint8_t signature[TEEP_SIGNATURE_LENGTH];
+            bool es256 = (kind == TEEP_SIGNATURE_ES256);
+            ok &= ReportOpsPerSecond(name, (es256) ? "ES256 sign" : "EdDSA sign", [&] { return provider->sign(kind, &key, data, dataLength, signature) == TEEP_ERR_SUCCESS; });
+            ok &= ReportOpsPerSecond(name, (es256) ? "ES256 verify" : "EdDSA verify", [&] { return provider->verify(kind, &key, data, dataLength, signature) == TEEP_ERR_SUCCESS; });
+            provider->free_key(&key);
+        }
+
+        uint8_t aeadKey[TEEP_AEAD_KEY_LENGTH] = {};
+        uint8_t nonce[TEEP_AEAD_NONCE_LENGTH] = {};
+        std::vector<uint8_t> ciphertext(message.size());
+        uint8_t tag[TEEP_AEAD_TAG_LENGTH];
+        ok &= ReportOpsPerSecond(name, "AEAD seal 1KiB", [&] { return provider->aead_seal(aeadKey, nonce, NULLUsefulBufC, messageC, ciphertext.data(), tag) == TEEP_ERR_SUCCESS; });
+        ok &= ReportOpsPerSecond(name, "AEAD open 1KiB", [&] { return provider->aead_open(aeadKey, nonce, NULLUsefulBufC, { ciphertext.data(), ciphertext.size() }, tag, message.data()) == TEEP_ERR_SUCCESS; });
+    }
+    return ok;
+}
+
+// teep_random serves small requests from a per-thread buffer instead of
+// going to the provider, whose generator is the baseline.
+static bool BenchmarkRandom(void)
+{
+    const teep_crypto_provider_t* provider = teep_get_crypto_provider();
+    bool ok = true;
+    uint8_t buffer[256];
+    for (size_t length : { 16, 32, 256 }) {
+        char operation[32];
+        snprintf(operation, sizeof(operation), "random %zuB", length);
+        ok &= ReportOpsPerSecond("teep", operation, [&] { return teep_random(buffer, length) == TEEP_ERR_SUCCESS; }, 200000);
+        ok &= ReportOpsPerSecond(provider->name, operation, [&] { return provider->random(buffer, length) == TEEP_ERR_SUCCESS; }, 200000);
+    }
+    return ok;
+}
+
+// Compare verifying a burst of EdDSA-signed messages from many agents one
+// at a time with verifying them in batches, as the TAM's verification
+// stage does.  Each operation verifies the whole burst.
+static bool BenchmarkVerify(void)
+{
+    const teep_crypto_provider_t* provider = teep_get_crypto_provider();
+    const size_t keyCount = 16;
+    const size_t messageCount = 1024;
+    std::vector<struct t_cose_key> keys(keyCount);
+    for (struct t_cose_key& key : keys) {
+        if (provider->generate_key(TEEP_SIGNATURE_EDDSA, &key) != TEEP_ERR_SUCCESS) {
+            printf("%-10s could not generate a key\n", provider->name);
+            return false;
+        }
+    }
+
+    std::vector<uint8_t> payload(512, 0x42);
+    UsefulBufC unsignedMessage = { payload.data(), payload.size() };
+    std::vector<std::vector<uint8_t>> signedMessages(messageCount);
+    std::vector<teep_verification_t> verifications(messageCount);
+    bool ok = true;
+    for (size_t i = 0; ok && i < messageCount; i++) {
+        signedMessages[i].resize(teep_get_sign1_message_size(payload.size()));
+        UsefulBufC signedMessage;
+        ok = (teep_sign1_cbor_message(&keys[i % keyCount], &unsignedMessage, { signedMessages[i].data(), signedMessages[i].size() }, TEEP_SIGNATURE_EDDSA, &signedMessage) == TEEP_ERR_SUCCESS);
+        verifications[i].signature_kind = TEEP_SIGNATURE_EDDSA;
+        verifications[i].key_pair = &keys[i % keyCount];
+        verifications[i].signed_cose = signedMessage;
+    }
+    if (!ok) {
+        printf("%-10s could not sign\n", provider->name);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%zu msgs", messageCount);
+    ok = ok && ReportOpsPerSecond(name, "EdDSA alone", [&] {
+        for (teep_verification_t& verification : verifications) {
+            if (teep_verify_cbor_message(verification.signature_kind, verification.key_pair, &verification.signed_cose, &verification.encoded) != TEEP_ERR_SUCCESS) {
+                return false;
+            }
+        }
+        return true;
+    }, 20);
+    for (size_t batchSize : { 8, 16, 64, 128 }) {
+        char operation[32];
+        snprintf(operation, sizeof(operation), "EdDSA batch %zu", batchSize);
+        ok = ok && ReportOpsPerSecond(name, operation, [&] {
+            for (size_t i = 0; i < messageCount; i += batchSize) {
+                if (teep_verify_cbor_messages(&verifications[i], batchSize) != batchSize) {
+                    return false;
+                }
+            }
+            return true;
+        }, 20);
+    }
+
+    for (struct t_cose_key& key : keys) {
+        provider->free_key(&key);
+    }
+    return ok;
+}
+
+// Compare reading a data directory's manifest files with starting from a
+// compiled manifest pack, for a large number of manifests.  The manifests
+// are small and are not SUIT envelopes, so this measures the per-manifest
+// cost rather than decoding.
+static bool BenchmarkManifestPack(void)
+{
+    const int manifestCount = 100000;
+    const char* dataDirectory = "benchmark-manifests";
+    std::filesystem::path directory(dataDirectory);
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory / "manifests" / "required");
+    std::filesystem::create_directories(directory / "manifests" / "optional");
+    std::vector<uint8_t> contents(64, 0x42);
+    for (int i = 0; i < manifestCount; i++) {
+        uint8_t b[16] = {};
+        memcpy(b, &i, sizeof(i));
+        char filename[64];
+        snprintf(filename, sizeof(filename),
+            "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x.cbor",
+            b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7], b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+        std::filesystem::path path = directory / "manifests" / (((i % 2) == 0) ? "required" : "optional") / filename;
+        FILE* fp = fopen(path.string().c_str(), "wb");
+        if (fp == nullptr) {
+            printf("Could not create %s\n", path.string().c_str());
+            return false;
+        }
+        fwrite(contents.data(), 1, contents.size(), fp);
+        fclose(fp);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%dk", manifestCount / 1000);
+    std::string requiredPath = (directory / "manifests" / "required").string();
+    std::string optionalPath = (directory / "manifests" / "optional").string();
+    std::string packFilename;
+    bool ok = ReportMilliseconds(name, "read files", [&] {
+        return ManifestRepository::Update([&](ManifestRepositoryBuilder& builder) {
+            builder.Clear();
+            teep_error_code_t result = TamConfigureManifests(builder, requiredPath.c_str(), true);
+            return (result != TEEP_ERR_SUCCESS) ? result : TamConfigureManifests(builder, optionalPath.c_str(), false);
+        }) == TEEP_ERR_SUCCESS;
+    });
+    Manifest::ClearManifests();
+    ok = ok && ReportMilliseconds(name, "compile pack", [&] { return TamCompileManifestPack(dataDirectory, packFilename) == TEEP_ERR_SUCCESS; });
+    Manifest::ClearManifests();
+
+    // Startup maps the pack and creates no manifest until one is needed.
+    ok = ok && ReportMilliseconds(name, "start", [&] { return TamLoadConfiguration(dataDirectory) == TEEP_ERR_SUCCESS; });
+    teep_uuid_t last = {};
+    int lastIndex = manifestCount - 1;
+    memcpy(last.b, &lastIndex, sizeof(lastIndex));
+    ok = ok && ReportMilliseconds(name, "first find", [&] { return ManifestRepository::GetCurrent()->Find(last) != nullptr; });
+
+    Manifest::ClearManifests();
+    std::filesystem::remove_all(directory);
+    return ok;
+}
+
+typedef struct {
+    const char* Name;
+    bool (*Run)(void);
+} Benchmark;
+
+static const Benchmark g_Benchmarks[] = {
+    { "crypto", BenchmarkCryptoProviders },
+    { "random", BenchmarkRandom },
+    { "verify", BenchmarkVerify },
+    { "manifest-pack", BenchmarkManifestPack },
+};
+
+int main(int argc, const char** argv)
+{
+    int failures = 0;
+    for (const Benchmark& benchmark : g_Benchmarks) {
+        bool selected = (argc < 2);
+        for (int i = 1; i < argc; i++) {
+            selected = selected || (strcmp(argv[i], benchmark.Name) == 0);
+        }
+        if (selected && !benchmark.Run()) {
+            failures++;
+        }
+    }
+    return failures;
+}
@@ -7,6 +7,7 @@
 #include "teep_protocol.h"
 #include "HttpServer.h"
 #include "TeepTamLib.h"
+#include "MockHttpTransport.h"
 
 TeepAgentSession g_Session = { 0 };
 
@@ -23,6 +24,31 @@ uint64_t GetOutboundMessagesSent()
     return g_Session.Basic.OutboundMessagesSent;
 }
 
+static std::vector<std::vector<uint8_t>> g_AgentMessages;
+static std::vector<std::vector<uint8_t>> g_TamMessages;
+static bool g_DeliverTamMessages = true;
+
+void ClearCapturedMessages()
+{
+    g_AgentMessages.clear();
+    g_TamMessages.clear();
+}
+
+const std::vector<std::vector<uint8_t>>& GetCapturedAgentMessages()
+{
+    return g_AgentMessages;
+}
+
+const std::vector<std::vector<uint8_t>>& GetCapturedTamMessages()
+{
+    return g_TamMessages;
+}
+
+void SetTamMessageDelivery(bool deliver)
+{
+    g_DeliverTamMessages = deliver;
+}
+
 // The caller is responsible for freeing the buffer if one is returned.
 _Success_(return == NO_ERROR)
 int
@@ -61,6 +87,7 @@ teep_error_code_t TeepAgentQueueOutboundTeepMessage(
     size_t messageLength)
 {
     g_Session.Basic.OutboundMessagesSent++;
+    g_AgentMessages.emplace_back((const uint8_t*)message, (const uint8_t*)message + messageLength);
 
     // Check for error injection.
     g_TransportErrorSchedule--;
@@ -89,6 +116,10 @@ int RunHttpServer(int argc, const wchar_t** argv)
 teep_error_code_t TamQueueOutboundTeepMessage(void* sessionHandle, const char* mediaType, const char* message, size_t messageLength)
 {
     g_Session.Basic.OutboundMessagesSent++;
+    g_TamMessages.emplace_back((const uint8_t*)message, (const uint8_t*)message + messageLength);
+    if (!g_DeliverTamMessages) {
+        return TEEP_ERR_SUCCESS;
+    }
 
     // Check for error injection.
     g_TransportErrorSchedule--;
@@ -97,4 +128,12 @@ teep_error_code_t TamQueueOutboundTeepMessage(void* sessionHandle, const char* m
     }
 
     return TeepAgentProcessTeepMessage(sessionHandle, mediaType, message, messageLength);
-}
\ No newline at end of file
+}
+
+teep_error_code_t TamQueueOutboundTeepMessage(void* sessionHandle, const char* mediaType, TeepOutboundMessage&& message)
+{
+    std::vector<uint8_t> buffer;
+    message.Flatten(buffer);
+    message.Clear();
+    return TamQueueOutboundTeepMessage(sessionHandle, mediaType, (const char*)buffer.data(), buffer.size());
+}
@@ -1,6 +1,18 @@
 // Copyright (c) TEEP contributors
 // SPDX-License-Identifier: MIT
 #pragma once
+#include <stdint.h>
+#include <vector>
 
 void ScheduleTransportError(int count);
-uint64_t GetOutboundMessagesSent();
\ No newline at end of file
+uint64_t GetOutboundMessagesSent();
+
+// Every message sent is also captured, so that tests can check what is
+// on the wire.
+void ClearCapturedMessages();
+const std::vector<std::vector<uint8_t>>& GetCapturedAgentMessages();
+const std::vector<std::vector<uint8_t>>& GetCapturedTamMessages();
+
+// Stop delivering the TAM's messages to the agent, so that tests can
+// send the TAM arbitrary messages and only capture them.
+void SetTamMessageDelivery(bool deliver);
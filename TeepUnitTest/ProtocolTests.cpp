@@ -1,15 +1,31 @@
 // Copyright (c) TEEP contributors
 // SPDX-License-Identifier: MIT
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <optional>
+#include <set>
 #include <sstream>
+#include <thread>
 #include "catch.hpp"
+#include "CryptoProvider.h"
+#include "KeyHandle.h"
 #include "MockHttpTransport.h"
+#include "openssl/evp.h"
 #include "qcbor/qcbor_decode.h"
 #include "qcbor/qcbor_encode.h"
 #include "qcbor/UsefulBuf.h"
+#include "RandomGenerator.h"
+#include "SessionKey.h"
+#include "TamSession.h"
+#include "TamSigningStage.h"
+#include "TamVerificationStage.h"
 #include "TeepAgentBrokerLib.h"
 #include "TeepAgentLib.h"
+#include "TeepSession.h"
 #include "TeepTamBrokerLib.h"
 #include "TeepTamLib.h"
 #define TRUE 1
@@ -98,6 +114,45 @@ static void TestInstallComponent(_In_ const char* type, _In_ const char* taId)
     CopyFile(sourcePath.string().c_str(), destinationPath.string().c_str());
 }
 
+// Find the suit-manifest-sequence-number in a manifest file.  The test
+// manifests start their SUIT_Manifest with suit-manifest-version 1 and then
+// a sequence number small enough to fit in the same byte as its type.
+static std::vector<uint8_t>::iterator FindTestSequenceNumber(_Inout_ std::vector<uint8_t>& manifest)
+{
+    const uint8_t prefix[] = { 0x01, 0x01, 0x02 };
+    auto found = std::search(manifest.begin(), manifest.end(), std::begin(prefix), std::end(prefix));
+    REQUIRE(manifest.end() - found > (ptrdiff_t)sizeof(prefix));
+    found += sizeof(prefix);
+    REQUIRE(*found < 24);
+    return found;
+}
+
+static std::vector<uint8_t> ReadTestManifest(_In_ const std::filesystem::path& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static uint8_t TestGetSequenceNumber(_In_ const std::filesystem::path& path)
+{
+    std::vector<uint8_t> manifest = ReadTestManifest(path);
+    return *FindTestSequenceNumber(manifest);
+}
+
+// Install a TAM manifest on the agent with another sequence number, as if
+// the agent had an older or newer version.
+static void TestInstallComponentVersion(_In_ const char* type, _In_ const char* taId, uint8_t sequenceNumber)
+{
+    REQUIRE(sequenceNumber < 24);
+    TestInstallComponent(type, taId);
+    std::filesystem::path path = std::filesystem::path(TEEP_AGENT_DATA_DIRECTORY) / "manifests";
+    path /= taId + std::string(".cbor");
+    std::vector<uint8_t> manifest = ReadTestManifest(path);
+    *FindTestSequenceNumber(manifest) = sequenceNumber;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write((const char*)manifest.data(), manifest.size());
+}
+
 static void TestVerifyComponentInstalled(_In_ const char* taId, bool expected_result)
 {
     std::filesystem::path destinationPath = std::filesystem::path(TEEP_AGENT_DATA_DIRECTORY) / "manifests";
@@ -260,7 +315,159 @@ TEST_CASE("PolicyCheck with no policy change", "[protocol]")
     StopTamBroker();
 }
 
-// TODO: implement a test for a PolicyCheck when there is a policy change.
+TEST_CASE("PolicyCheck in session mode MACs the second exchange", "[protocol]")
+{
+    TestUninstallAllComponents();
+    TestInstallComponent("required", REQUIRED_TA_ID);
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    teep_set_session_key_lifetime(300);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_ES256, nullptr) == 0);
+
+    // The first exchange is signed and agrees on a session key.
+    uint64_t counter1 = GetOutboundMessagesSent();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetOutboundMessagesSent() == counter1 + 2);
+    std::shared_ptr<TamSession> session = TamGetSession(&g_Session);
+    REQUIRE(session->SessionKey);
+    REQUIRE(!session->MacExchange);
+    std::shared_ptr<const TeepSessionKey> sessionKey = session->SessionKey;
+
+    // In the next one, the QueryRequest is still signed, since the TAM does
+    // not know who is connecting, and the agent MACs its QueryResponse with
+    // the key to show that it holds it.
+    uint64_t counter2 = GetOutboundMessagesSent();
+    ClearCapturedMessages();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetOutboundMessagesSent() == counter2 + 2);
+    REQUIRE(GetCapturedTamMessages().size() == 1);
+    REQUIRE(GetCapturedAgentMessages().size() == 1);
+    UsefulBufC queryRequest = { GetCapturedTamMessages()[0].data(), GetCapturedTamMessages()[0].size() };
+    UsefulBufC queryResponse = { GetCapturedAgentMessages()[0].data(), GetCapturedAgentMessages()[0].size() };
+    REQUIRE(!teep_is_mac0_message(&queryRequest));
+    REQUIRE(teep_is_mac0_message(&queryResponse));
+    session = TamGetSession(&g_Session);
+    REQUIRE(session->MacExchange);
+    REQUIRE(session->SessionKey == sessionKey);
+
+    teep_set_session_key_lifetime(0);
+    TamCloseSession(&g_Session);
+    StopAgentBroker();
+    StopTamBroker();
+}
+
+TEST_CASE("PolicyCheck with a newer version of an installed TA", "[protocol][install]")
+{
+    // The agent has an older version of the required TA than the TAM.
+    TestUninstallAllComponents();
+    std::filesystem::path tamManifest = std::filesystem::path(TAM_DATA_DIRECTORY) / "manifests" / "required";
+    tamManifest /= REQUIRED_TA_ID ".cbor";
+    uint8_t tamSequenceNumber = TestGetSequenceNumber(tamManifest);
+    REQUIRE(tamSequenceNumber > 0);
+    TestInstallComponentVersion("required", REQUIRED_TA_ID, tamSequenceNumber - 1);
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_ES256, nullptr) == 0);
+
+    // Verify 4 messages sent (QueryRequest, QueryResponse, Update, Success),
+    // and that the Update carried the TAM's version.
+    uint64_t counter1 = GetOutboundMessagesSent();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetOutboundMessagesSent() == counter1 + 4);
+    std::filesystem::path agentManifest = std::filesystem::path(TEEP_AGENT_DATA_DIRECTORY) / "manifests";
+    agentManifest /= REQUIRED_TA_ID ".cbor";
+    REQUIRE(TestGetSequenceNumber(agentManifest) == tamSequenceNumber);
+
+    // The agent now reports the new version, so it is not sent again.
+    uint64_t counter2 = GetOutboundMessagesSent();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetOutboundMessagesSent() == counter2 + 2);
+
+    StopAgentBroker();
+    StopTamBroker();
+    TestUninstallAllComponents();
+}
+
+// Make a SUIT_Envelope for a component whose ID has two elements,
+// [h'<first>', h'<last>'], with sequence number 1.
+static std::vector<uint8_t> TestMakeTwoElementEnvelope(uint8_t first, uint8_t last)
+{
+    // SUIT_Common: { suit-components: [ [ h'<first>', h'<last>' ] ] }
+    const uint8_t common[] = { 0xA1, 0x02, 0x81, 0x82, 0x41, first, 0x41, last };
+
+    // SUIT_Manifest: { suit-manifest-version: 1,
+    //                  suit-manifest-sequence-number: 1,
+    //                  suit-common: bstr .cbor SUIT_Common }
+    std::vector<uint8_t> manifest = { 0xA3, 0x01, 0x01, 0x02, 0x01, 0x03, (uint8_t)(0x40 | sizeof(common)) };
+    manifest.insert(manifest.end(), std::begin(common), std::end(common));
+
+    // SUIT_Envelope: { suit-manifest: bstr .cbor SUIT_Manifest }
+    REQUIRE(manifest.size() < 24);
+    std::vector<uint8_t> envelope = { 0xA1, 0x03, (uint8_t)(0x40 | manifest.size()) };
+    envelope.insert(envelope.end(), manifest.begin(), manifest.end());
+    return envelope;
+}
+
+static void TestWriteManifest(_In_ const std::filesystem::path& path, _In_ const std::vector<uint8_t>& manifest)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write((const char*)manifest.data(), manifest.size());
+}
+
+TEST_CASE("Components with several ID elements are installed under their full IDs", "[protocol][install]")
+{
+    // The TAM requires two components whose IDs share their last element.
+    // Manifest files are named by the canonical encoding of such an ID, and
+    // the TAM only sees them once they are compiled into its manifest pack.
+    TestUninstallAllComponents();
+    const char* firstFilename = "82410a410b.cbor";
+    const char* secondFilename = "82410c410b.cbor";
+    std::filesystem::path tamManifests = std::filesystem::path(TAM_DATA_DIRECTORY) / "manifests" / "required";
+    std::filesystem::path agentManifests = std::filesystem::path(TEEP_AGENT_DATA_DIRECTORY) / "manifests";
+    TestWriteManifest(tamManifests / firstFilename, TestMakeTwoElementEnvelope(0x0A, 0x0B));
+    TestWriteManifest(tamManifests / secondFilename, TestMakeTwoElementEnvelope(0x0C, 0x0B));
+    REQUIRE(TamCompileManifests(TAM_DATA_DIRECTORY) == TEEP_ERR_SUCCESS);
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_ES256, nullptr) == 0);
+
+    // Both are sent in one Update, and the agent saves each under its own
+    // name rather than both under the last element.
+    uint64_t counter1 = GetOutboundMessagesSent();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetOutboundMessagesSent() == counter1 + 4);
+    REQUIRE(std::filesystem::exists(agentManifests / firstFilename));
+    REQUIRE(std::filesystem::exists(agentManifests / secondFilename));
+    REQUIRE(!std::filesystem::exists(agentManifests / "0b.cbor"));
+
+    // The agent reports both under their full IDs, so neither is sent
+    // again, including after it restarts and reloads them from disk.
+    uint64_t counter2 = GetOutboundMessagesSent();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetOutboundMessagesSent() == counter2 + 2);
+    StopAgentBroker();
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_ES256, nullptr) == 0);
+    uint64_t counter3 = GetOutboundMessagesSent();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetOutboundMessagesSent() == counter3 + 2);
+
+    // Once the TAM no longer has the second, the agent uninstalls just it.
+    StopTamBroker();
+    std::filesystem::remove(tamManifests / secondFilename);
+    REQUIRE(TamCompileManifests(TAM_DATA_DIRECTORY) == TEEP_ERR_SUCCESS);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    uint64_t counter4 = GetOutboundMessagesSent();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetOutboundMessagesSent() == counter4 + 4);
+    REQUIRE(std::filesystem::exists(agentManifests / firstFilename));
+    REQUIRE(!std::filesystem::exists(agentManifests / secondFilename));
+
+    StopAgentBroker();
+    StopTamBroker();
+    std::filesystem::remove(tamManifests / firstFilename);
+    std::filesystem::remove(agentManifests / firstFilename);
+    REQUIRE(TamCompileManifests(TAM_DATA_DIRECTORY) == TEEP_ERR_SUCCESS);
+}
 
 TEST_CASE("Unexpected ProcessError", "[protocol]")
 {
@@ -447,7 +654,741 @@ TEST_CASE("Agent receives QueryRequest with unsupported version", "[protocol]")
     TestQueryRequestVersion(1, 1, TEEP_ERR_UNSUPPORTED_MSG_VERSION, expected_message_count);
 }
 
-static teep_error_code_t TestComposeQueryResponse(int version, _Out_ UsefulBufC* encodedResponse)
+teep_error_code_t
+TamSignOutboundMessage(
+    _Inout_ TeepOutboundMessage&& unsignedMessage,
+    teep_signature_kind_t signatureKind,
+    _Out_ TeepOutboundMessage& signedMessage);
+
+TEST_CASE("Agent receives QueryRequest signed in segments", "[protocol]")
+{
+    TestUninstallAllComponents();
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_ES256, nullptr) == 0);
+
+    uint64_t counter1 = GetOutboundMessagesSent();
+
+    UsefulBuf_MAKE_STACK_UB(encoded, 4096);
+    UsefulBufC unsignedMessage = UsefulBuf_Const(encoded);
+    teep_error_code_t teep_error = TamComposeQueryRequest(0, 0, &unsignedMessage);
+    REQUIRE(teep_error == TEEP_ERR_SUCCESS);
+
+    // Split the payload into alternately copied and referenced pieces, so
+    // that it is hashed a segment at a time.
+    TeepOutboundMessage payload;
+    const uint8_t* next = (const uint8_t*)unsignedMessage.ptr;
+    bool copy = false;
+    for (size_t remaining = unsignedMessage.len; remaining > 0; copy = !copy) {
+        size_t length = (remaining < 7) ? remaining : 7;
+        if (copy) {
+            payload.AppendCopy({ next, length });
+        } else {
+            payload.AppendReference({ next, length }, nullptr);
+        }
+        next += length;
+        remaining -= length;
+    }
+    REQUIRE(payload.GetSegments().size() > 2);
+    TeepOutboundMessage signedMessage;
+    teep_error = TamSignOutboundMessage(std::move(payload), TEEP_SIGNATURE_ES256, signedMessage);
+    REQUIRE(teep_error == TEEP_ERR_SUCCESS);
+    REQUIRE(signedMessage.GetSegments().size() > 1);
+
+    std::vector<uint8_t> flattened;
+    signedMessage.Flatten(flattened);
+    void* sessionHandle = nullptr;
+    teep_error = TeepAgentProcessTeepMessage(
+        sessionHandle, TEEP_CBOR_MEDIA_TYPE, (const char*)flattened.data(), flattened.size());
+    REQUIRE(teep_error == TEEP_ERR_SUCCESS);
+
+    // QueryResponse, Update, Success.
+    uint64_t counter2 = GetOutboundMessagesSent();
+    REQUIRE(counter2 == counter1 + 3);
+
+    StopAgentBroker();
+}
+
+// What a test needs from a TEEP message captured on the wire.
+struct TestTeepMessage
+{
+    int64_t Type;
+    std::set<int64_t> Labels; // Labels present in the options map.
+    size_t ComponentCount;    // Entries in tc-list.
+};
+
+// Parse a COSE_Sign1 TEEP message without verifying it.
+static TestTeepMessage ParseTestTeepMessage(_In_ const std::vector<uint8_t>& signedMessage)
+{
+    QCBORDecodeContext context;
+    QCBORItem item;
+    QCBORDecode_Init(&context, { signedMessage.data(), signedMessage.size() }, QCBOR_DECODE_MODE_NORMAL);
+    QCBORDecode_GetNext(&context, &item);
+    REQUIRE(item.uDataType == QCBOR_TYPE_ARRAY);
+    REQUIRE(item.val.uCount == 4);
+    QCBORDecode_GetNext(&context, &item); // Protected headers.
+    QCBORDecode_GetNext(&context, &item); // Unprotected headers.
+    do {
+        QCBORDecode_GetNext(&context, &item);
+    } while (item.uNestingLevel > 1);
+    REQUIRE(item.uDataType == QCBOR_TYPE_BYTE_STRING);
+    UsefulBufC payload = item.val.string;
+
+    TestTeepMessage message = {};
+    QCBORDecode_Init(&context, payload, QCBOR_DECODE_MODE_NORMAL);
+    QCBORDecode_GetNext(&context, &item);
+    REQUIRE(item.uDataType == QCBOR_TYPE_ARRAY);
+    QCBORDecode_GetNext(&context, &item);
+    REQUIRE(item.uDataType == QCBOR_TYPE_INT64);
+    message.Type = item.val.int64;
+    QCBORDecode_GetNext(&context, &item);
+    REQUIRE(item.uDataType == QCBOR_TYPE_MAP);
+    uint8_t optionLevel = item.uNextNestLevel;
+    while (QCBORDecode_GetNext(&context, &item) == QCBOR_SUCCESS && item.uNestingLevel >= optionLevel) {
+        if (item.uNestingLevel > optionLevel) {
+            continue;
+        }
+        REQUIRE(item.uLabelType == QCBOR_TYPE_INT64);
+        message.Labels.insert(item.label.int64);
+        if (item.label.int64 == TEEP_LABEL_TC_LIST) {
+            REQUIRE(item.uDataType == QCBOR_TYPE_ARRAY);
+            message.ComponentCount = item.val.uCount;
+        }
+    }
+    return message;
+}
+
+#define COSE_HEADER_PARAM_ALG 1 // RFC 9052 section 3.1
+
+// Get the algorithm in a COSE protected header.
+static int64_t GetTestProtectedAlgorithm(UsefulBufC protectedHeaders)
+{
+    QCBORDecodeContext context;
+    QCBORItem item;
+    QCBORDecode_Init(&context, protectedHeaders, QCBOR_DECODE_MODE_NORMAL);
+    QCBORDecode_GetNext(&context, &item);
+    REQUIRE(item.uDataType == QCBOR_TYPE_MAP);
+    while (QCBORDecode_GetNext(&context, &item) == QCBOR_SUCCESS) {
+        if (item.uLabelType == QCBOR_TYPE_INT64 && item.label.int64 == COSE_HEADER_PARAM_ALG) {
+            REQUIRE(item.uDataType == QCBOR_TYPE_INT64);
+            return item.val.int64;
+        }
+    }
+    FAIL("No algorithm in protected headers");
+    return 0;
+}
+
+// Get the algorithm of each signature on a COSE_Sign1 or COSE_Sign
+// message captured on the wire.
+static std::vector<int64_t> GetTestSignatureAlgorithms(_In_ const std::vector<uint8_t>& signedMessage)
+{
+    QCBORDecodeContext context;
+    QCBORItem item;
+    QCBORDecode_Init(&context, { signedMessage.data(), signedMessage.size() }, QCBOR_DECODE_MODE_NORMAL);
+    QCBORDecode_GetNext(&context, &item);
+    REQUIRE(item.uDataType == QCBOR_TYPE_ARRAY);
+    REQUIRE(item.val.uCount == 4);
+    QCBORDecode_GetNext(&context, &item);
+    REQUIRE(item.uDataType == QCBOR_TYPE_BYTE_STRING);
+    UsefulBufC protectedHeaders = item.val.string;
+    QCBORDecode_GetNext(&context, &item); // Unprotected headers.
+    do {
+        QCBORDecode_GetNext(&context, &item);
+    } while (item.uNestingLevel > 1); // Payload.
+
+    std::vector<int64_t> algorithms;
+    QCBORDecode_GetNext(&context, &item);
+    if (item.uDataType == QCBOR_TYPE_BYTE_STRING) {
+        // COSE_Sign1 has a single signature, described by the body headers.
+        algorithms.push_back(GetTestProtectedAlgorithm(protectedHeaders));
+        return algorithms;
+    }
+
+    // COSE_Sign has an array of [protected, unprotected, signature].
+    REQUIRE(item.uDataType == QCBOR_TYPE_ARRAY);
+    while (QCBORDecode_GetNext(&context, &item) == QCBOR_SUCCESS) {
+        if (item.uNestingLevel == 2 && item.uDataType == QCBOR_TYPE_ARRAY) {
+            QCBORDecode_GetNext(&context, &item);
+            REQUIRE(item.uDataType == QCBOR_TYPE_BYTE_STRING);
+            algorithms.push_back(GetTestProtectedAlgorithm(item.val.string));
+        }
+    }
+    return algorithms;
+}
+
+TEST_CASE("QueryRequest and QueryResponse round trip between TAM and agent", "[protocol]")
+{
+    TestUninstallAllComponents();
+    TestInstallComponent("required", REQUIRED_TA_ID);
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_ES256, nullptr) == 0);
+
+    ClearCapturedMessages();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetCapturedTamMessages().size() == 1);
+    REQUIRE(GetCapturedAgentMessages().size() == 1);
+
+    TestTeepMessage request = ParseTestTeepMessage(GetCapturedTamMessages()[0]);
+    REQUIRE(request.Type == TEEP_MESSAGE_QUERY_REQUEST);
+    REQUIRE(request.Labels.count(TEEP_LABEL_CHALLENGE) == 1);
+    REQUIRE(request.Labels.count(TEEP_LABEL_VERSIONS) == 1);
+
+    // The QueryResponse answers each part of the QueryRequest, and reports
+    // the installed component.
+    TestTeepMessage response = ParseTestTeepMessage(GetCapturedAgentMessages()[0]);
+    REQUIRE(response.Type == TEEP_MESSAGE_QUERY_RESPONSE);
+    REQUIRE(response.Labels.count(TEEP_LABEL_SELECTED_VERSION) == 1);
+    REQUIRE(response.Labels.count(TEEP_LABEL_SELECTED_CIPHER_SUITE) == 1);
+    REQUIRE(response.Labels.count(TEEP_LABEL_ATTESTATION_PAYLOAD) == 1);
+    REQUIRE(response.Labels.count(TEEP_LABEL_TC_LIST) == 1);
+    REQUIRE(response.ComponentCount == 1);
+
+    StopAgentBroker();
+    StopTamBroker();
+}
+
+static void CountCompletedRequest(_In_opt_ void* context, teep_error_code_t result)
+{
+    (void)result;
+    (*(std::atomic<int>*)context)++;
+}
+
+TEST_CASE("TAM signing stage keeps each session's messages in order", "[protocol]")
+{
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    REQUIRE(TamStartSigningStage(2, 8) == 0);
+    char tamPublicKeyFilename[256];
+    TamGetPublicKey(TEEP_SIGNATURE_ES256, tamPublicKeyFilename);
+    struct t_cose_key verifyingKey;
+    REQUIRE(teep_get_verifying_key_pair(&verifyingKey, tamPublicKeyFilename) == TEEP_ERR_SUCCESS);
+
+    // Interleave messages that must be signed with ones that need not be.
+    // Once the first is on the signing stage, the unsigned ones must wait
+    // behind it rather than being sent first.
+    const int messageCount = 8;
+    SetTamMessageDelivery(false);
+    ClearCapturedMessages();
+    int session;
+    std::atomic<int> completed{ 0 };
+    TamProcessRequestAsync([&]() {
+        for (int i = 0; i < messageCount; i++) {
+            uint8_t payload = (uint8_t)i;
+            TeepOutboundMessage message;
+            message.AppendCopy({ &payload, sizeof(payload) });
+            teep_signature_kind_t signatureKind = ((i % 2) == 0) ? TEEP_SIGNATURE_ES256 : TEEP_SIGNATURE_NONE;
+            teep_error_code_t result = TamSignAndQueueOutboundMessage(&session, TEEP_CBOR_MEDIA_TYPE, std::move(message), signatureKind);
+            if (result != TEEP_ERR_SUCCESS) {
+                return result;
+            }
+        }
+        return TEEP_ERR_SUCCESS;
+    }, CountCompletedRequest, &completed);
+    for (int i = 0; i < 1000 && completed == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(completed == 1);
+
+    TamSigningStageStatistics statistics;
+    TamGetSigningStageStatistics(&statistics);
+    REQUIRE(statistics.JobsQueued > 0);
+
+    const std::vector<std::vector<uint8_t>>& messages = GetCapturedTamMessages();
+    REQUIRE(messages.size() == messageCount);
+    for (int i = 0; i < messageCount; i++) {
+        UsefulBufC payload = { messages[i].data(), messages[i].size() };
+        if ((i % 2) == 0) {
+            UsefulBufC signedMessage = payload;
+            REQUIRE(teep_verify_cbor_message(TEEP_SIGNATURE_ES256, &verifyingKey, &signedMessage, &payload) == TEEP_ERR_SUCCESS);
+        }
+        REQUIRE(payload.len == 1);
+        REQUIRE(((const uint8_t*)payload.ptr)[0] == i);
+    }
+
+    SetTamMessageDelivery(true);
+    TamCloseSession(&session);
+    teep_get_crypto_provider()->free_key(&verifyingKey);
+    TamStopSigningStage();
+    StopTamBroker();
+}
+
+struct TestPendingRequest
+{
+    std::atomic<bool> Completed{ false };
+    teep_error_code_t Result = TEEP_ERR_SUCCESS;
+};
+
+static void RecordCompletedRequest(_In_opt_ void* context, teep_error_code_t result)
+{
+    TestPendingRequest* request = (TestPendingRequest*)context;
+    request->Result = result;
+    request->Completed = true;
+}
+
+TEST_CASE("TAM verification stage checks EdDSA messages in batches", "[protocol]")
+{
+    TestUninstallAllComponents();
+    TestInstallComponent("required", REQUIRED_TA_ID);
+    TestConfigureKeys(TEEP_SIGNATURE_EDDSA);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_EDDSA, nullptr) == 0);
+
+    // Capture a QueryResponse to replay on other sessions, and see how the
+    // TAM handles it when verified alone.
+    ClearCapturedMessages();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetCapturedAgentMessages().size() == 1);
+    const std::vector<uint8_t> response = GetCapturedAgentMessages()[0];
+    std::vector<uint8_t> badResponse = response;
+    badResponse.back() ^= 1; // Corrupt the signature.
+    StopAgentBroker();
+
+    SetTamMessageDelivery(false);
+    int inlineSession;
+    teep_error_code_t expected = TamProcessTeepMessage(&inlineSession, TEEP_CBOR_MEDIA_TYPE, (const char*)response.data(), response.size());
+    TamCloseSession(&inlineSession);
+
+    // With a long window, a batch is only taken once it is full.
+    const int batchSize = 4;
+    REQUIRE(TamStartVerificationStage(1, batchSize, 10 * 1000 * 1000) == 0);
+    REQUIRE(TamStartVerificationStage(1, batchSize, 10 * 1000 * 1000) != 0);
+    TamVerificationStageStatistics before;
+    TamGetVerificationStageStatistics(&before);
+
+    // A batch of good messages passes together.  In a batch with one bad
+    // message, every message is verified alone and only that one fails.
+    for (int round = 0; round < 2; round++) {
+        int sessions[batchSize];
+        TestPendingRequest requests[batchSize];
+        for (int i = 0; i < batchSize; i++) {
+            const std::vector<uint8_t>& message = (round == 1 && i == 2) ? badResponse : response;
+            TamProcessTeepMessageAsync(&sessions[i], TEEP_CBOR_MEDIA_TYPE, (const char*)message.data(), message.size(), RecordCompletedRequest, &requests[i]);
+        }
+        for (int i = 0; i < batchSize; i++) {
+            for (int wait = 0; wait < 1000 && !requests[i].Completed; wait++) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            REQUIRE(requests[i].Completed);
+            REQUIRE(requests[i].Result == ((round == 1 && i == 2) ? TEEP_ERR_PERMANENT_ERROR : expected));
+            TamCloseSession(&sessions[i]);
+        }
+    }
+
+    TamVerificationStageStatistics after;
+    TamGetVerificationStageStatistics(&after);
+    REQUIRE(after.MessagesQueued - before.MessagesQueued == 2 * batchSize);
+    REQUIRE(after.Batches - before.Batches == 2);
+    REQUIRE(after.MessagesBatched - before.MessagesBatched == batchSize);
+    REQUIRE(after.BatchesFailed - before.BatchesFailed == 1);
+    REQUIRE(after.MaxBatchSize == batchSize);
+
+    // Outside a request, a message is verified inline.
+    int session;
+    REQUIRE(TamProcessTeepMessage(&session, TEEP_CBOR_MEDIA_TYPE, (const char*)response.data(), response.size()) == expected);
+    TamCloseSession(&session);
+    TamGetVerificationStageStatistics(&before);
+    REQUIRE(before.MessagesVerifiedInline - after.MessagesVerifiedInline == 1);
+
+    TamStopVerificationStage();
+    SetTamMessageDelivery(true);
+    StopTamBroker();
+}
+
+TEST_CASE("COSE_Sign1 size is computed from the payload length", "[protocol]")
+{
+    for (teep_signature_kind_t signatureKind : { TEEP_SIGNATURE_ES256, TEEP_SIGNATURE_EDDSA }) {
+        TestConfigureKeys(signatureKind);
+        for (size_t payloadLength : { 0, 23, 24, 255, 256, 5000 }) {
+            std::vector<uint8_t> payload(payloadLength, 0x42);
+            UsefulBufC unsignedMessage = { payload.data(), payload.size() };
+            size_t expectedLength = teep_get_sign1_message_size(payloadLength);
+
+            // An exact-size buffer is enough, and one byte less is not.
+            std::vector<uint8_t> buffer(expectedLength);
+            UsefulBufC signedMessage;
+            REQUIRE(TamSignMessage(&unsignedMessage, { buffer.data(), buffer.size() }, signatureKind, &signedMessage) == TEEP_ERR_SUCCESS);
+            REQUIRE(signedMessage.len == expectedLength);
+            REQUIRE(TamSignMessage(&unsignedMessage, { buffer.data(), buffer.size() - 1 }, signatureKind, &signedMessage) == TEEP_ERR_TEMPORARY_ERROR);
+        }
+    }
+}
+
+// Hidden, since it only reports timings.  Run with "[benchmark]".
+TEST_CASE("ES256 COSE_Sign1 signing and verification latency", "[.][benchmark]")
+{
+    const int iterations = 1000;
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    char tamPublicKeyFilename[256];
+    TamGetPublicKey(TEEP_SIGNATURE_ES256, tamPublicKeyFilename);
+    struct t_cose_key verifyingKey;
+    REQUIRE(teep_get_verifying_key_pair(&verifyingKey, tamPublicKeyFilename) == TEEP_ERR_SUCCESS);
+
+    std::vector<uint8_t> payload(512, 0x42);
+    UsefulBufC unsignedMessage = { payload.data(), payload.size() };
+    std::vector<uint8_t> buffer(teep_get_sign1_message_size(payload.size()));
+    UsefulBufC signedMessage;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        REQUIRE(TamSignMessage(&unsignedMessage, { buffer.data(), buffer.size() }, TEEP_SIGNATURE_ES256, &signedMessage) == TEEP_ERR_SUCCESS);
+    }
+    auto signEnd = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        UsefulBufC encoded;
+        REQUIRE(teep_verify_cbor_message(TEEP_SIGNATURE_ES256, &verifyingKey, &signedMessage, &encoded) == TEEP_ERR_SUCCESS);
+        REQUIRE(encoded.len == payload.size());
+    }
+    auto verifyEnd = std::chrono::steady_clock::now();
+
+    auto microseconds = [](auto duration) {
+        return (double)std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / iterations;
+    };
+    printf("ES256 sign: %.1f us/op, verify: %.1f us/op\n", microseconds(signEnd - start), microseconds(verifyEnd - signEnd));
+    teep_get_crypto_provider()->free_key(&verifyingKey);
+}
+
+TEST_CASE("Key IDs are remembered until the key is freed", "[protocol]")
+{
+    const teep_crypto_provider_t* provider = teep_get_crypto_provider();
+    struct t_cose_key key;
+    REQUIRE(provider->generate_key(TEEP_SIGNATURE_ES256, &key) == TEEP_ERR_SUCCESS);
+
+    size_t count = TeepKeyHandle::GetKeyIdCount();
+    uint8_t keyIdBuffer[2][TEEP_SHA256_LENGTH];
+    UsefulBuf keyIds[2] = { { keyIdBuffer[0], sizeof(keyIdBuffer[0]) }, { keyIdBuffer[1], sizeof(keyIdBuffer[1]) } };
+    for (UsefulBuf& keyId : keyIds) {
+        REQUIRE(provider->get_key_id(TEEP_SIGNATURE_ES256, &key, &keyId) == TEEP_ERR_SUCCESS);
+        REQUIRE(keyId.len == TEEP_SHA256_LENGTH);
+        REQUIRE(TeepKeyHandle::GetKeyIdCount() == count + 1);
+    }
+    REQUIRE(UsefulBuf_Compare(UsefulBuf_Const(keyIds[0]), UsefulBuf_Const(keyIds[1])) == 0);
+
+    provider->free_key(&key);
+    REQUIRE(TeepKeyHandle::GetKeyIdCount() == count);
+}
+
+// Sign copies of a payload with the TAM key of a given kind.
+static void TestSignMessages(
+    teep_signature_kind_t signatureKind,
+    size_t count,
+    _Out_ std::vector<std::vector<uint8_t>>& signedMessages)
+{
+    std::vector<uint8_t> payload(512, 0x42);
+    UsefulBufC unsignedMessage = { payload.data(), payload.size() };
+    signedMessages.resize(count);
+    for (std::vector<uint8_t>& signedMessage : signedMessages) {
+        signedMessage.resize(teep_get_sign1_message_size(payload.size()));
+        UsefulBufC signedMessageC;
+        REQUIRE(TamSignMessage(&unsignedMessage, { signedMessage.data(), signedMessage.size() }, signatureKind, &signedMessageC) == TEEP_ERR_SUCCESS);
+        signedMessage.resize(signedMessageC.len);
+    }
+}
+
+TEST_CASE("Verification fails only the messages with bad signatures", "[protocol]")
+{
+    for (teep_signature_kind_t signatureKind : { TEEP_SIGNATURE_ES256, TEEP_SIGNATURE_EDDSA }) {
+        TestConfigureKeys(signatureKind);
+        char tamPublicKeyFilename[256];
+        TamGetPublicKey(signatureKind, tamPublicKeyFilename);
+        struct t_cose_key verifyingKey;
+        REQUIRE(teep_get_verifying_key_pair(&verifyingKey, tamPublicKeyFilename) == TEEP_ERR_SUCCESS);
+
+        std::vector<std::vector<uint8_t>> signedMessages;
+        TestSignMessages(signatureKind, 8, signedMessages);
+        std::vector<teep_verification_t> verifications(signedMessages.size());
+        for (size_t i = 0; i < signedMessages.size(); i++) {
+            verifications[i].signature_kind = signatureKind;
+            verifications[i].key_pair = &verifyingKey;
+            verifications[i].signed_cose = { signedMessages[i].data(), signedMessages[i].size() };
+        }
+
+        // Only EdDSA signatures are checked as a batch.
+        size_t batchCount = (signatureKind == TEEP_SIGNATURE_EDDSA) ? signedMessages.size() : 0;
+        REQUIRE(teep_verify_cbor_messages(verifications.data(), verifications.size()) == batchCount);
+        for (const teep_verification_t& verification : verifications) {
+            REQUIRE(verification.result == TEEP_ERR_SUCCESS);
+            REQUIRE(verification.encoded.len == 512);
+        }
+
+        // A batch with a bad signature fails, and each message is then
+        // verified alone.
+        signedMessages[3].back() ^= 1; // Corrupt one signature.
+        REQUIRE(teep_verify_cbor_messages(verifications.data(), verifications.size()) == 0);
+        for (size_t i = 0; i < signedMessages.size(); i++) {
+            UsefulBufC encoded = NULLUsefulBufC;
+            REQUIRE(teep_verify_cbor_message(signatureKind, &verifyingKey, &verifications[i].signed_cose, &encoded) == ((i == 3) ? TEEP_ERR_PERMANENT_ERROR : TEEP_ERR_SUCCESS));
+            REQUIRE(encoded.len == ((i == 3) ? 0 : 512));
+            REQUIRE(verifications[i].result == ((i == 3) ? TEEP_ERR_PERMANENT_ERROR : TEEP_ERR_SUCCESS));
+            REQUIRE(verifications[i].encoded.len == ((i == 3) ? 0 : 512));
+        }
+        teep_get_crypto_provider()->free_key(&verifyingKey);
+    }
+}
+
+TEST_CASE("Messages larger than the pooled auxiliary space verify", "[protocol]")
+{
+    // Larger than the 64 KiB of auxiliary space each thread keeps.
+    std::vector<uint8_t> payload(100 * 1024, 0x5A);
+    UsefulBufC unsignedMessage = { payload.data(), payload.size() };
+
+    for (teep_signature_kind_t signatureKind : { TEEP_SIGNATURE_ES256, TEEP_SIGNATURE_EDDSA }) {
+        TestConfigureKeys(signatureKind);
+        char tamPublicKeyFilename[256];
+        TamGetPublicKey(signatureKind, tamPublicKeyFilename);
+        struct t_cose_key verifyingKey;
+        REQUIRE(teep_get_verifying_key_pair(&verifyingKey, tamPublicKeyFilename) == TEEP_ERR_SUCCESS);
+
+        // A COSE_Sign1 message with one signature, and a COSE_Sign message
+        // with both kinds.
+        for (teep_signature_kind_t signingKind : { signatureKind, TEEP_SIGNATURE_BOTH }) {
+            std::vector<uint8_t> buffer(teep_get_sign1_message_size(payload.size()) + TEEP_MAX_COSE_OVERHEAD);
+            UsefulBufC signedMessage;
+            REQUIRE(TamSignMessage(&unsignedMessage, { buffer.data(), buffer.size() }, signingKind, &signedMessage) == TEEP_ERR_SUCCESS);
+
+            UsefulBufC encoded;
+            REQUIRE(teep_verify_cbor_message(signatureKind, &verifyingKey, &signedMessage, &encoded) == TEEP_ERR_SUCCESS);
+            REQUIRE(encoded.len == payload.size());
+            REQUIRE(memcmp(encoded.ptr, payload.data(), payload.size()) == 0);
+
+            // A change in the middle of the payload is caught.
+            buffer[signedMessage.len / 2] ^= 1;
+            REQUIRE(teep_verify_cbor_message(signatureKind, &verifyingKey, &signedMessage, &encoded) == TEEP_ERR_PERMANENT_ERROR);
+        }
+        teep_get_crypto_provider()->free_key(&verifyingKey);
+    }
+}
+
+TEST_CASE("ES256 signatures from precomputed nonces verify", "[protocol]")
+{
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    char tamPublicKeyFilename[256];
+    TamGetPublicKey(TEEP_SIGNATURE_ES256, tamPublicKeyFilename);
+    struct t_cose_key verifyingKey;
+    REQUIRE(teep_get_verifying_key_pair(&verifyingKey, tamPublicKeyFilename) == TEEP_ERR_SUCCESS);
+
+    // Turning precomputation off and on between rounds discards the pool
+    // that the key handle got, so the last round needs a new one.
+    for (int enabled : { 1, 0, 1 }) {
+        teep_set_es256_precomputation(0);
+        teep_set_es256_precomputation(enabled);
+
+        // Sign more messages than a pool holds, so it has to be refilled
+        // or bypassed along the way.
+        std::vector<std::vector<uint8_t>> signedMessages;
+        TestSignMessages(TEEP_SIGNATURE_ES256, 200, signedMessages);
+
+        std::set<std::vector<uint8_t>> signatures;
+        for (const std::vector<uint8_t>& signedMessage : signedMessages) {
+            UsefulBufC signedMessageC = { signedMessage.data(), signedMessage.size() };
+            UsefulBufC encoded;
+            REQUIRE(teep_verify_cbor_message(TEEP_SIGNATURE_ES256, &verifyingKey, &signedMessageC, &encoded) == TEEP_ERR_SUCCESS);
+            signatures.emplace(signedMessage.end() - 64, signedMessage.end());
+        }
+
+        // The payloads are the same, so a reused nonce would show up as a
+        // repeated signature.
+        REQUIRE(signatures.size() == signedMessages.size());
+    }
+    teep_set_es256_precomputation(1);
+    teep_get_crypto_provider()->free_key(&verifyingKey);
+}
+
+// Hidden, since it only reports timings.  Run with "[benchmark]".  The
+// message count is a multiple of each batch size.
+TEST_CASE("EdDSA COSE_Sign1 verification throughput", "[.][benchmark]")
+{
+    const size_t messageCount = 2048;
+    TestConfigureKeys(TEEP_SIGNATURE_EDDSA);
+    char tamPublicKeyFilename[256];
+    TamGetPublicKey(TEEP_SIGNATURE_EDDSA, tamPublicKeyFilename);
+    struct t_cose_key verifyingKey;
+    REQUIRE(teep_get_verifying_key_pair(&verifyingKey, tamPublicKeyFilename) == TEEP_ERR_SUCCESS);
+
+    std::vector<std::vector<uint8_t>> signedMessages;
+    TestSignMessages(TEEP_SIGNATURE_EDDSA, messageCount, signedMessages);
+
+    std::vector<teep_verification_t> verifications(messageCount);
+    for (size_t i = 0; i < messageCount; i++) {
+        verifications[i].signature_kind = TEEP_SIGNATURE_EDDSA;
+        verifications[i].key_pair = &verifyingKey;
+        verifications[i].signed_cose = { signedMessages[i].data(), signedMessages[i].size() };
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (teep_verification_t& verification : verifications) {
+        REQUIRE(teep_verify_cbor_message(TEEP_SIGNATURE_EDDSA, &verifyingKey, &verification.signed_cose, &verification.encoded) == TEEP_ERR_SUCCESS);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("EdDSA verify alone: %.0f messages/s\n", messageCount / seconds);
+
+    for (size_t batchSize : { 8, 64 }) {
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < messageCount; i += batchSize) {
+            REQUIRE(teep_verify_cbor_messages(&verifications[i], batchSize) == batchSize);
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("EdDSA verify in batches of %zu: %.0f messages/s\n", batchSize, messageCount / seconds);
+    }
+    teep_get_crypto_provider()->free_key(&verifyingKey);
+}
+
+TEST_CASE("Crypto provider signs, verifies and seals", "[protocol]")
+{
+    const teep_crypto_provider_t* provider = teep_get_crypto_provider();
+    std::vector<uint8_t> message(256, 0x42);
+    UsefulBufC messageC = { message.data(), message.size() };
+
+    for (teep_signature_kind_t kind : { TEEP_SIGNATURE_ES256, TEEP_SIGNATURE_EDDSA }) {
+        struct t_cose_key key;
+        REQUIRE(provider->generate_key(kind, &key) == TEEP_ERR_SUCCESS);
+
+        // ES256 signs a hash, while EdDSA signs the message itself.
+        uint8_t hash[TEEP_SHA256_LENGTH];
+        REQUIRE(provider->sha256(&messageC, 1, hash) == TEEP_ERR_SUCCESS);
+        const uint8_t* data = (kind == TEEP_SIGNATURE_ES256) ? hash : message.data();
+        size_t dataLength = (kind == TEEP_SIGNATURE_ES256) ? sizeof(hash) : message.size();
+
+        uint8_t signature[TEEP_SIGNATURE_LENGTH];
+        REQUIRE(provider->sign(kind, &key, data, dataLength, signature) == TEEP_ERR_SUCCESS);
+        REQUIRE(provider->verify(kind, &key, data, dataLength, signature) == TEEP_ERR_SUCCESS);
+        signature[0] ^= 1;
+        REQUIRE(provider->verify(kind, &key, data, dataLength, signature) != TEEP_ERR_SUCCESS);
+        provider->free_key(&key);
+    }
+
+    uint8_t aeadKey[TEEP_AEAD_KEY_LENGTH];
+    uint8_t nonce[TEEP_AEAD_NONCE_LENGTH];
+    REQUIRE(provider->random(aeadKey, sizeof(aeadKey)) == TEEP_ERR_SUCCESS);
+    REQUIRE(provider->random(nonce, sizeof(nonce)) == TEEP_ERR_SUCCESS);
+    UsefulBufC aad = UsefulBuf_FROM_SZ_LITERAL("header");
+    std::vector<uint8_t> ciphertext(message.size());
+    std::vector<uint8_t> plaintext(message.size());
+    uint8_t tag[TEEP_AEAD_TAG_LENGTH];
+    REQUIRE(provider->aead_seal(aeadKey, nonce, aad, messageC, ciphertext.data(), tag) == TEEP_ERR_SUCCESS);
+    REQUIRE(ciphertext != message);
+    REQUIRE(provider->aead_open(aeadKey, nonce, aad, { ciphertext.data(), ciphertext.size() }, tag, plaintext.data()) == TEEP_ERR_SUCCESS);
+    REQUIRE(plaintext == message);
+
+    // Any change to the ciphertext is caught by the tag.
+    ciphertext[0] ^= 1;
+    REQUIRE(provider->aead_open(aeadKey, nonce, aad, { ciphertext.data(), ciphertext.size() }, tag, plaintext.data()) == TEEP_ERR_PERMANENT_ERROR);
+}
+
+TEST_CASE("Session keys agree and protect COSE_Mac0 messages", "[protocol]")
+{
+    teep_set_session_key_lifetime(60);
+    struct t_cose_key tamKey;
+    struct t_cose_key agentKey;
+    std::vector<uint8_t> tamShare;
+    std::vector<uint8_t> agentShare;
+    REQUIRE(TeepSessionKey::GenerateAgreementKey(&tamKey, tamShare) == TEEP_ERR_SUCCESS);
+    REQUIRE(TeepSessionKey::GenerateAgreementKey(&agentKey, agentShare) == TEEP_ERR_SUCCESS);
+
+    // Both sides derive the same key from the same QueryResponse.
+    UsefulBufC queryResponse = UsefulBuf_FROM_SZ_LITERAL("query response");
+    std::shared_ptr<const TeepSessionKey> tamSessionKey;
+    std::shared_ptr<const TeepSessionKey> agentSessionKey;
+    REQUIRE(TeepSessionKey::Derive(&tamKey, { agentShare.data(), agentShare.size() }, queryResponse, tamSessionKey) == TEEP_ERR_SUCCESS);
+    REQUIRE(TeepSessionKey::Derive(&agentKey, { tamShare.data(), tamShare.size() }, queryResponse, agentSessionKey) == TEEP_ERR_SUCCESS);
+    REQUIRE(UsefulBuf_Compare(tamSessionKey->GetKey(), agentSessionKey->GetKey()) == 0);
+    REQUIRE(UsefulBuf_Compare(tamSessionKey->GetKeyId(), agentSessionKey->GetKeyId()) == 0);
+    REQUIRE(tamSessionKey->CanSend());
+
+    // A different QueryResponse gives a different key.
+    std::shared_ptr<const TeepSessionKey> otherSessionKey;
+    REQUIRE(TeepSessionKey::Derive(&tamKey, { agentShare.data(), agentShare.size() }, UsefulBuf_FROM_SZ_LITERAL("other"), otherSessionKey) == TEEP_ERR_SUCCESS);
+    REQUIRE(UsefulBuf_Compare(tamSessionKey->GetKey(), otherSessionKey->GetKey()) != 0);
+
+    // A message MACed by one side verifies on the other, unless altered.
+    std::vector<uint8_t> message(300, 0x42);
+    TeepOutboundMessage payload;
+    payload.AppendCopy({ message.data(), message.size() });
+    TeepOutboundMessage macedMessage;
+    REQUIRE(teep_mac0_outbound_message(*tamSessionKey, std::move(payload), macedMessage) == TEEP_ERR_SUCCESS);
+    std::vector<uint8_t> maced;
+    macedMessage.Flatten(maced);
+    UsefulBufC macedC = { maced.data(), maced.size() };
+    REQUIRE(teep_is_mac0_message(&macedC));
+    UsefulBufC encoded;
+    REQUIRE(teep_verify_mac0_message(*agentSessionKey, &macedC, &encoded) == TEEP_ERR_SUCCESS);
+    REQUIRE(UsefulBuf_Compare(encoded, { message.data(), message.size() }) == 0);
+    REQUIRE(teep_verify_mac0_message(*otherSessionKey, &macedC, &encoded) != TEEP_ERR_SUCCESS);
+
+    // The kid is unprotected, so it is checked against the session key.
+    UsefulBufC keyId = tamSessionKey->GetKeyId();
+    auto kid = std::search(maced.begin(), maced.end(), (const uint8_t*)keyId.ptr, (const uint8_t*)keyId.ptr + keyId.len);
+    REQUIRE(kid != maced.end());
+    *kid ^= 1;
+    REQUIRE(teep_verify_mac0_message(*agentSessionKey, &macedC, &encoded) != TEEP_ERR_SUCCESS);
+    *kid ^= 1;
+    REQUIRE(teep_verify_mac0_message(*agentSessionKey, &macedC, &encoded) == TEEP_ERR_SUCCESS);
+    maced[maced.size() / 2] ^= 1;
+    REQUIRE(teep_verify_mac0_message(*agentSessionKey, &macedC, &encoded) != TEEP_ERR_SUCCESS);
+
+    // Session mode is off with no lifetime.
+    teep_set_session_key_lifetime(0);
+    REQUIRE(TeepSessionKey::Derive(&agentKey, { tamShare.data(), tamShare.size() }, queryResponse, otherSessionKey) != TEEP_ERR_SUCCESS);
+    teep_get_crypto_provider()->free_key(&tamKey);
+    teep_get_crypto_provider()->free_key(&agentKey);
+}
+
+TEST_CASE("ChaCha20 block matches RFC 8439", "[protocol]")
+{
+    // RFC 8439 section 2.3.2.
+    uint8_t key[TEEP_CHACHA20_KEY_LENGTH];
+    for (int i = 0; i < TEEP_CHACHA20_KEY_LENGTH; i++) {
+        key[i] = (uint8_t)i;
+    }
+    const uint8_t nonce[TEEP_CHACHA20_NONCE_LENGTH] = { 0, 0, 0, 0x09, 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+    const uint8_t expected[TEEP_CHACHA20_BLOCK_LENGTH] = {
+        0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+        0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+        0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+        0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e };
+    uint8_t block[TEEP_CHACHA20_BLOCK_LENGTH];
+    TeepRandomGenerator::Block(key, 1, nonce, block);
+    REQUIRE(memcmp(block, expected, sizeof(block)) == 0);
+}
+
+TEST_CASE("teep_random gives distinct output on each thread", "[protocol]")
+{
+    // Enough tokens per thread to cross several buffer refills.
+    const int threadCount = 8;
+    const int tokensPerThread = 1000;
+    std::vector<std::vector<std::vector<uint8_t>>> tokens(threadCount);
+    std::atomic<int> failures{ 0 };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.emplace_back([&tokens, &failures, t] {
+            for (int i = 0; i < tokensPerThread; i++) {
+                std::vector<uint8_t> token(16);
+                if (teep_random(token.data(), token.size()) != TEEP_ERR_SUCCESS) {
+                    failures++;
+                }
+                tokens[t].push_back(token);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    REQUIRE(failures == 0);
+    std::set<std::vector<uint8_t>> unique;
+    for (const auto& threadTokens : tokens) {
+        unique.insert(threadTokens.begin(), threadTokens.end());
+    }
+    REQUIRE(unique.size() == (size_t)threadCount * tokensPerThread);
+
+    // A request larger than the buffer is served across refills.
+    std::vector<uint8_t> large(5 * TEEP_RANDOM_BUFFER_SIZE);
+    REQUIRE(teep_random(large.data(), large.size()) == TEEP_ERR_SUCCESS);
+    size_t zeros = std::count(large.begin(), large.end(), 0);
+    REQUIRE(zeros < large.size() / 64);
+}
+
+// Compose a QueryResponse, with a selected-cipher-suite if selectedAlgorithm
+// is not 0.
+static teep_error_code_t TestComposeQueryResponse(int version, int64_t selectedAlgorithm, _Out_ UsefulBufC* encodedResponse)
 {
     UsefulBufC challenge = NULLUsefulBufC;
     *encodedResponse = NULLUsefulBufC;
@@ -472,6 +1413,18 @@ static teep_error_code_t TestComposeQueryResponse(int version, _Out_ UsefulBufC*
         QCBOREncode_OpenMap(&context);
         {
             QCBOREncode_AddInt64ToMapN(&context, TEEP_LABEL_SELECTED_VERSION, version);
+            if (selectedAlgorithm != 0) {
+                QCBOREncode_OpenArrayInMapN(&context, TEEP_LABEL_SELECTED_CIPHER_SUITE);
+                {
+                    QCBOREncode_OpenArray(&context);
+                    {
+                        QCBOREncode_AddInt64(&context, CBOR_TAG_COSE_SIGN1);
+                        QCBOREncode_AddInt64(&context, selectedAlgorithm);
+                    }
+                    QCBOREncode_CloseArray(&context);
+                }
+                QCBOREncode_CloseArray(&context);
+            }
         }
         QCBOREncode_CloseMap(&context);
     }
@@ -499,7 +1452,7 @@ static void TestQueryResponseVersion(int version, teep_signature_kind_t signatur
     // Compose a TEEP QueryResponse with an unsupported version.
     UsefulBuf_MAKE_STACK_UB(encoded, 4096);
     UsefulBufC unsignedMessage = UsefulBuf_Const(encoded);
-    teep_error_code_t teep_error = TestComposeQueryResponse(version, &unsignedMessage);
+    teep_error_code_t teep_error = TestComposeQueryResponse(version, 0, &unsignedMessage);
     UsefulBufC signedMessage;
     UsefulBuf_MAKE_STACK_UB(signedMessageBuffer, 300);
     teep_error = TeepAgentSignMessage(&unsignedMessage, signedMessageBuffer, &signedMessage);
@@ -535,4 +1488,288 @@ TEST_CASE("TAM receives QueryResponse with supported version and EdDSA", "[proto
 {
     const uint64_t expected_message_count = 2;
     TestQueryResponseVersion(0, TEEP_SIGNATURE_EDDSA, TEEP_ERR_SUCCESS, expected_message_count);
-}
\ No newline at end of file
+}
+
+static void TestQueryResponseCipherSuite(teep_signature_kind_t signatureKind, int64_t selectedAlgorithm, teep_error_code_t expected_result)
+{
+    TestUninstallAllComponents();
+    TestConfigureKeys(signatureKind);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, signatureKind, nullptr) == 0);
+
+    UsefulBuf_MAKE_STACK_UB(encoded, 4096);
+    UsefulBufC unsignedMessage = UsefulBuf_Const(encoded);
+    teep_error_code_t teep_error = TestComposeQueryResponse(0, selectedAlgorithm, &unsignedMessage);
+    REQUIRE(teep_error == TEEP_ERR_SUCCESS);
+    UsefulBufC signedMessage;
+    UsefulBuf_MAKE_STACK_UB(signedMessageBuffer, 300);
+    teep_error = TeepAgentSignMessage(&unsignedMessage, signedMessageBuffer, &signedMessage);
+    REQUIRE(teep_error == TEEP_ERR_SUCCESS);
+
+    int sessionHandle;
+    teep_error = TamProcessTeepMessage(
+        &sessionHandle, TEEP_CBOR_MEDIA_TYPE, (const char*)signedMessage.ptr, signedMessage.len);
+    REQUIRE(teep_error == expected_result);
+
+    if (expected_result == TEEP_ERR_SUCCESS) {
+        REQUIRE(TamGetSession(&sessionHandle)->SignatureKind == signatureKind);
+        TamDevice device;
+        REQUIRE(TamGetDevice(TamGetSession(&sessionHandle)->AgentKeyId, device));
+        REQUIRE(device.SignatureKind == signatureKind);
+
+        // A reconnect does not say which device it is, so the QueryRequest
+        // still carries one signature of each kind.
+        SetTamMessageDelivery(false);
+        ClearCapturedMessages();
+        REQUIRE(TamProcessConnect(&sessionHandle, TEEP_CBOR_MEDIA_TYPE) == TEEP_ERR_SUCCESS);
+        REQUIRE(TamGetSession(&sessionHandle)->SignatureKind == TEEP_SIGNATURE_BOTH);
+        REQUIRE(GetCapturedTamMessages().size() == 1);
+        std::vector<int64_t> algorithms = GetTestSignatureAlgorithms(GetCapturedTamMessages()[0]);
+        REQUIRE(algorithms.size() == 2);
+
+        // Once the QueryResponse identifies the device, the Update carries
+        // a single signature of the negotiated kind.
+        ClearCapturedMessages();
+        REQUIRE(TamProcessTeepMessage(&sessionHandle, TEEP_CBOR_MEDIA_TYPE, (const char*)signedMessage.ptr, signedMessage.len) == TEEP_ERR_SUCCESS);
+        SetTamMessageDelivery(true);
+        REQUIRE(TamGetSession(&sessionHandle)->SignatureKind == signatureKind);
+        REQUIRE(GetCapturedTamMessages().size() == 1);
+        algorithms = GetTestSignatureAlgorithms(GetCapturedTamMessages()[0]);
+        REQUIRE(algorithms.size() == 1);
+        REQUIRE(algorithms[0] == selectedAlgorithm);
+    }
+
+    TamCloseSession(&sessionHandle);
+    StopAgentBroker();
+}
+
+TEST_CASE("TAM negotiates the EdDSA cipher suite", "[protocol]")
+{
+    TestQueryResponseCipherSuite(TEEP_SIGNATURE_EDDSA, T_COSE_ALGORITHM_EDDSA, TEEP_ERR_SUCCESS);
+}
+
+TEST_CASE("TAM negotiates the ES256 cipher suite", "[protocol]")
+{
+    TestQueryResponseCipherSuite(TEEP_SIGNATURE_ES256, T_COSE_ALGORITHM_ES256, TEEP_ERR_SUCCESS);
+}
+
+TEST_CASE("TAM rejects a cipher suite that does not match the agent key", "[protocol]")
+{
+    TestQueryResponseCipherSuite(TEEP_SIGNATURE_EDDSA, T_COSE_ALGORITHM_ES256, TEEP_ERR_UNSUPPORTED_CIPHER_SUITES);
+}
+
+// Sign a QueryResponse with the agent key of the given kind, as a device
+// holding that key would.
+static std::vector<uint8_t> TestSignQueryResponse(teep_signature_kind_t signatureKind, int64_t selectedAlgorithm)
+{
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, signatureKind, nullptr) == 0);
+    UsefulBufC unsignedMessage;
+    REQUIRE(TestComposeQueryResponse(0, selectedAlgorithm, &unsignedMessage) == TEEP_ERR_SUCCESS);
+    UsefulBufC signedMessage;
+    UsefulBuf_MAKE_STACK_UB(signedMessageBuffer, 300);
+    REQUIRE(TeepAgentSignMessage(&unsignedMessage, signedMessageBuffer, &signedMessage) == TEEP_ERR_SUCCESS);
+    free((void*)unsignedMessage.ptr);
+    StopAgentBroker();
+    const uint8_t* p = (const uint8_t*)signedMessage.ptr;
+    return std::vector<uint8_t>(p, p + signedMessage.len);
+}
+
+// Run an exchange with a device on a session, and check the signature
+// algorithms on the QueryRequest and the Update.
+static void TestDeviceExchange(_In_ void* sessionHandle, _In_ const std::vector<uint8_t>& queryResponse, int64_t updateAlgorithm)
+{
+    SetTamMessageDelivery(false);
+    ClearCapturedMessages();
+    REQUIRE(TamProcessConnect(sessionHandle, TEEP_CBOR_MEDIA_TYPE) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetCapturedTamMessages().size() == 1);
+    REQUIRE(GetTestSignatureAlgorithms(GetCapturedTamMessages()[0]).size() == 2);
+
+    ClearCapturedMessages();
+    REQUIRE(TamProcessTeepMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, (const char*)queryResponse.data(), queryResponse.size()) == TEEP_ERR_SUCCESS);
+    SetTamMessageDelivery(true);
+    REQUIRE(GetCapturedTamMessages().size() == 1);
+    std::vector<int64_t> algorithms = GetTestSignatureAlgorithms(GetCapturedTamMessages()[0]);
+    REQUIRE(algorithms.size() == 1);
+    REQUIRE(algorithms[0] == updateAlgorithm);
+}
+
+TEST_CASE("TAM remembers the cipher suite per device when devices share a session", "[protocol]")
+{
+    TestUninstallAllComponents();
+    TestConfigureKeys(TEEP_SIGNATURE_EDDSA);
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    TamClearDevices();
+    std::vector<uint8_t> responseA = TestSignQueryResponse(TEEP_SIGNATURE_EDDSA, T_COSE_ALGORITHM_EDDSA);
+    std::vector<uint8_t> responseB = TestSignQueryResponse(TEEP_SIGNATURE_ES256, 0);
+
+    // Devices take turns on one transport session, as they do when the
+    // transport shares a session between connections.  Neither is sent
+    // what was negotiated with the other.
+    int sessionHandle;
+    TestDeviceExchange(&sessionHandle, responseA, T_COSE_ALGORITHM_EDDSA);
+    TestDeviceExchange(&sessionHandle, responseB, T_COSE_ALGORITHM_ES256);
+    TestDeviceExchange(&sessionHandle, responseA, T_COSE_ALGORITHM_EDDSA);
+    TamCloseSession(&sessionHandle);
+
+    StopTamBroker();
+}
+
+TEST_CASE("TAM remembers the cipher suite of a device that reconnects", "[protocol]")
+{
+    TestUninstallAllComponents();
+    TestConfigureKeys(TEEP_SIGNATURE_EDDSA);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    TamClearDevices();
+    std::vector<uint8_t> firstResponse = TestSignQueryResponse(TEEP_SIGNATURE_EDDSA, T_COSE_ALGORITHM_EDDSA);
+    std::vector<uint8_t> laterResponse = TestSignQueryResponse(TEEP_SIGNATURE_EDDSA, 0);
+
+    int firstSessionHandle;
+    TestDeviceExchange(&firstSessionHandle, firstResponse, T_COSE_ALGORITHM_EDDSA);
+    std::string agentKeyId = TamGetSession(&firstSessionHandle)->AgentKeyId;
+    TamCloseSession(&firstSessionHandle);
+
+    // On a new connection, the suite is known again as soon as the device
+    // is identified, even though the QueryResponse does not repeat it.
+    int secondSessionHandle;
+    TestDeviceExchange(&secondSessionHandle, laterResponse, T_COSE_ALGORITHM_EDDSA);
+    REQUIRE(TamGetSession(&secondSessionHandle)->AgentKeyId == agentKeyId);
+    REQUIRE(TamGetSession(&secondSessionHandle)->SignatureKind == TEEP_SIGNATURE_EDDSA);
+    TamDevice device;
+    REQUIRE(TamGetDevice(agentKeyId, device));
+    REQUIRE(device.SignatureKind == TEEP_SIGNATURE_EDDSA);
+    TamCloseSession(&secondSessionHandle);
+
+    StopTamBroker();
+}
+
+// Protect a message with a session key, as the agent would.
+static std::vector<uint8_t> TestMacMessage(_In_ const TeepSessionKey& sessionKey, UsefulBufC message)
+{
+    TeepOutboundMessage payload;
+    payload.AppendCopy(message);
+    TeepOutboundMessage macedMessage;
+    REQUIRE(teep_mac0_outbound_message(sessionKey, std::move(payload), macedMessage) == TEEP_ERR_SUCCESS);
+    std::vector<uint8_t> maced;
+    macedMessage.Flatten(maced);
+    return maced;
+}
+
+TEST_CASE("TAM accepts MACed messages only from an identified device", "[protocol]")
+{
+    TestUninstallAllComponents();
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    teep_set_session_key_lifetime(300);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_ES256, nullptr) == 0);
+
+    // Agree on a session key, then start a new exchange that the agent
+    // does not answer.
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    std::string agentKeyId = TamGetSession(&g_Session)->AgentKeyId;
+    std::shared_ptr<const TeepSessionKey> sessionKey = TamGetSession(&g_Session)->SessionKey;
+    REQUIRE(sessionKey);
+    SetTamMessageDelivery(false);
+    REQUIRE(TamProcessConnect(&g_Session, TEEP_CBOR_MEDIA_TYPE) == TEEP_ERR_SUCCESS);
+    REQUIRE(!TamGetSession(&g_Session)->SessionKey);
+    REQUIRE(!TamGetSession(&g_Session)->MacExchange);
+
+    // A MACed message other than a QueryResponse does not identify the
+    // device, so it is not taken.
+    const uint8_t success[] = { 0x82, TEEP_MESSAGE_SUCCESS, 0xA0 }; // [5, {}]
+    std::vector<uint8_t> macedSuccess = TestMacMessage(*sessionKey, { success, sizeof(success) });
+    REQUIRE(TamProcessTeepMessage(&g_Session, TEEP_CBOR_MEDIA_TYPE, (const char*)macedSuccess.data(), macedSuccess.size()) == TEEP_ERR_PERMANENT_ERROR);
+    REQUIRE(!TamGetSession(&g_Session)->DeviceIdentified);
+
+    // A QueryResponse MACed with the device's key identifies it, and the
+    // Update is MACed with the same key.
+    UsefulBufC queryResponse;
+    REQUIRE(TestComposeQueryResponse(0, 0, &queryResponse) == TEEP_ERR_SUCCESS);
+    std::vector<uint8_t> macedResponse = TestMacMessage(*sessionKey, queryResponse);
+    ClearCapturedMessages();
+    REQUIRE(TamProcessTeepMessage(&g_Session, TEEP_CBOR_MEDIA_TYPE, (const char*)macedResponse.data(), macedResponse.size()) == TEEP_ERR_SUCCESS);
+    std::shared_ptr<TamSession> session = TamGetSession(&g_Session);
+    REQUIRE(session->DeviceIdentified);
+    REQUIRE(session->MacExchange);
+    REQUIRE(session->AgentKeyId == agentKeyId);
+    REQUIRE(session->SignatureKind == TEEP_SIGNATURE_ES256);
+    REQUIRE(GetCapturedTamMessages().size() == 1);
+    UsefulBufC update = { GetCapturedTamMessages()[0].data(), GetCapturedTamMessages()[0].size() };
+    REQUIRE(teep_is_mac0_message(&update));
+
+    // Now a MACed Success is taken.
+    REQUIRE(TamProcessTeepMessage(&g_Session, TEEP_CBOR_MEDIA_TYPE, (const char*)macedSuccess.data(), macedSuccess.size()) == TEEP_ERR_SUCCESS);
+
+    // A session key the TAM never agreed identifies nobody.
+    REQUIRE(TamProcessConnect(&g_Session, TEEP_CBOR_MEDIA_TYPE) == TEEP_ERR_SUCCESS);
+    struct t_cose_key agreementKey;
+    std::vector<uint8_t> share;
+    REQUIRE(TeepSessionKey::GenerateAgreementKey(&agreementKey, share) == TEEP_ERR_SUCCESS);
+    std::shared_ptr<const TeepSessionKey> unknownKey;
+    REQUIRE(TeepSessionKey::Derive(&agreementKey, { share.data(), share.size() }, queryResponse, unknownKey) == TEEP_ERR_SUCCESS);
+    teep_get_crypto_provider()->free_key(&agreementKey);
+    std::vector<uint8_t> unknownResponse = TestMacMessage(*unknownKey, queryResponse);
+    REQUIRE(TamProcessTeepMessage(&g_Session, TEEP_CBOR_MEDIA_TYPE, (const char*)unknownResponse.data(), unknownResponse.size()) == TEEP_ERR_PERMANENT_ERROR);
+    REQUIRE(!TamGetSession(&g_Session)->DeviceIdentified);
+
+    free((void*)queryResponse.ptr);
+    SetTamMessageDelivery(true);
+    teep_set_session_key_lifetime(0);
+    TamCloseSession(&g_Session);
+    StopAgentBroker();
+    StopTamBroker();
+}
+
+TEST_CASE("Session keys stay with their device when devices share a session", "[protocol]")
+{
+    TestUninstallAllComponents();
+    TestInstallComponent("required", REQUIRED_TA_ID);
+    TestConfigureKeys(TEEP_SIGNATURE_EDDSA);
+    TestConfigureKeys(TEEP_SIGNATURE_ES256);
+    teep_set_session_key_lifetime(300);
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    TamClearDevices();
+
+    // Device A agrees on a session key, and uses it in its next exchange.
+    // The test transport has a single session, so every device shares it.
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_ES256, nullptr) == 0);
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    std::string agentKeyIdA = TamGetSession(&g_Session)->AgentKeyId;
+    std::shared_ptr<const TeepSessionKey> sessionKeyA = TamGetSession(&g_Session)->SessionKey;
+    REQUIRE(sessionKeyA);
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(TamGetSession(&g_Session)->MacExchange);
+    StopAgentBroker();
+
+    // Device B, connecting next on the same session, is sent a signed
+    // QueryRequest it can verify, rather than one MACed with A's key, and
+    // agrees on a key of its own.
+    REQUIRE(StartAgentBroker(TEEP_AGENT_DATA_DIRECTORY, TRUE, TEEP_SIGNATURE_EDDSA, nullptr) == 0);
+    ClearCapturedMessages();
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    REQUIRE(GetCapturedTamMessages().size() == 1);
+    UsefulBufC queryRequest = { GetCapturedTamMessages()[0].data(), GetCapturedTamMessages()[0].size() };
+    REQUIRE(!teep_is_mac0_message(&queryRequest));
+    std::shared_ptr<TamSession> session = TamGetSession(&g_Session);
+    REQUIRE(session->AgentKeyId != agentKeyIdA);
+    REQUIRE(!session->MacExchange);
+    REQUIRE(session->SessionKey);
+    REQUIRE(session->SessionKey != sessionKeyA);
+    std::string agentKeyIdB = session->AgentKeyId;
+    std::shared_ptr<const TeepSessionKey> sessionKeyB = session->SessionKey;
+
+    // B's next exchange is MACed with B's key, and A's key is untouched.
+    REQUIRE(TeepAgentRequestPolicyCheck(DEFAULT_TAM_URI) == TEEP_ERR_SUCCESS);
+    session = TamGetSession(&g_Session);
+    REQUIRE(session->MacExchange);
+    REQUIRE(session->AgentKeyId == agentKeyIdB);
+    REQUIRE(session->SessionKey == sessionKeyB);
+    TamDevice device;
+    REQUIRE(TamGetDevice(agentKeyIdA, device));
+    REQUIRE(device.SessionKey == sessionKeyA);
+    StopAgentBroker();
+
+    teep_set_session_key_lifetime(0);
+    TamCloseSession(&g_Session);
+    StopTamBroker();
+}
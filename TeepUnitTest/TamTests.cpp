@@ -1,11 +1,1094 @@
 // Copyright (c) TEEP contributors
 // SPDX-License-Identifier: MIT
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include "AgentKeyStore.h"
 #include "catch.hpp"
+#include "ComponentIdTable.h"
+#include "CryptoProvider.h"
+#include "../protocol/LinuxHttpServerLib/HttpRequestParser.h"
+#include "Manifest.h"
+#include "MappedFile.h"
+#include "ManifestRepository.h"
+#include "openssl/x509.h"
+#include "QueryRequestCache.h"
+#include "TamConfigurationWatcher.h"
+#include "TamKeys.h"
+#include "TamSession.h"
+#include "TamSigningStage.h"
+#include "TamWorkerPool.h"
 #include "TeepTamBrokerLib.h"
+#include "TeepTamLib.h"
+#include "UpdateCache.h"
+#include "UpdatePlan.h"
 #define TRUE 1
+#define FALSE 0
 #define TAM_DATA_DIRECTORY "../../../tam"
 
 TEST_CASE("Start-Stop TAM Broker", "[tam]") {
     REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
     StopTamBroker();
-}
\ No newline at end of file
+}
+TEST_CASE("TAM session state is per session", "[tam]") {
+    int session1;
+    int session2;
+
+    TamGetSession(&session1)->MessagesReceived = 3;
+    REQUIRE(TamGetSession(&session1)->MessagesReceived == 3);
+    REQUIRE(TamGetSession(&session2)->MessagesReceived == 0);
+
+    TamCloseSession(&session1);
+    REQUIRE(TamGetSession(&session1)->MessagesReceived == 0);
+    TamCloseSession(&session2);
+}
+
+static void CountWorkItem(_In_opt_ void* context)
+{
+    std::atomic<int>* count = (std::atomic<int>*)context;
+    (*count)++;
+}
+
+TEST_CASE("TAM worker pool runs all work items", "[tam]") {
+    std::atomic<int> count{ 0 };
+
+    REQUIRE(TamQueueWorkItem(CountWorkItem, &count) != 0);
+
+    REQUIRE(TamStartWorkerPool(4) == 0);
+    for (int i = 0; i < 1000; i++) {
+        REQUIRE(TamQueueWorkItem(CountWorkItem, &count) == 0);
+    }
+    TamStopWorkerPool();
+
+    REQUIRE(count == 1000);
+}
+
+TEST_CASE("TAM worker pool can stop while work is being queued", "[tam]") {
+    for (int round = 0; round < 20; round++) {
+        std::atomic<int> count{ 0 };
+        std::atomic<int> accepted{ 0 };
+        REQUIRE(TamStartWorkerPool(2) == 0);
+
+        // Every item the pool accepts must run, however the stop lands.
+        std::vector<std::thread> producers;
+        for (int i = 0; i < 4; i++) {
+            producers.emplace_back([&] {
+                for (int j = 0; j < 500; j++) {
+                    if (TamQueueWorkItem(CountWorkItem, &count) == 0) {
+                        accepted++;
+                    }
+                }
+            });
+        }
+        TamStopWorkerPool();
+        for (std::thread& producer : producers) {
+            producer.join();
+        }
+        REQUIRE(count == accepted);
+    }
+}
+
+// Busy work standing in for processing one TEEP message.
+static void SpinWorkItem(_In_opt_ void* context)
+{
+    volatile uint64_t value = 0;
+    for (int i = 0; i < 20000; i++) {
+        value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    std::atomic<int>* count = (std::atomic<int>*)context;
+    (*count)++;
+}
+
+// Hidden, since it only reports timings.  Run with "[benchmark]".
+TEST_CASE("TAM worker pool throughput by worker count", "[.][benchmark]") {
+    const int itemCount = 20000;
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    double baseline = 0;
+    for (unsigned int workers = 1; workers <= cores; workers *= 2) {
+        std::atomic<int> count{ 0 };
+        REQUIRE(TamStartWorkerPool((int)workers) == 0);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < itemCount; i++) {
+            REQUIRE(TamQueueWorkItem(SpinWorkItem, &count) == 0);
+        }
+        TamStopWorkerPool();
+        auto end = std::chrono::steady_clock::now();
+        REQUIRE(count == itemCount);
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        double itemsPerSecond = itemCount / seconds;
+        if (workers == 1) {
+            baseline = itemsPerSecond;
+        }
+        printf("%2u workers: %8.0f items/s (%.2fx)\n", workers, itemsPerSecond, itemsPerSecond / baseline);
+        if (workers < cores && workers * 2 > cores) {
+            workers = cores / 2; // Also measure one worker per core.
+        }
+    }
+}
+
+static void CountFailedRequest(_In_opt_ void* context, teep_error_code_t result)
+{
+    std::atomic<int>* count = (std::atomic<int>*)context;
+    if (result != TEEP_ERR_SUCCESS) {
+        (*count)++;
+    }
+}
+
+TEST_CASE("TAM signing stage completes each request once", "[tam]") {
+    REQUIRE(TamStartSigningStage(2, 4) == 0);
+    REQUIRE(TamStartSigningStage(2, 4) != 0);
+
+    TamSigningStageStatistics statistics;
+    TamGetSigningStageStatistics(&statistics);
+    REQUIRE(statistics.QueueCapacity == 4);
+    REQUIRE(statistics.QueueDepth == 0);
+    REQUIRE(TamIsSigningStageSaturated() == 0);
+
+    // A request that fails before anything is signed completes inline.
+    std::atomic<int> count{ 0 };
+    int session;
+    const char message[] = "{}";
+    TamProcessTeepMessageAsync(&session, "application/json", message, sizeof(message) - 1, CountFailedRequest, &count);
+    REQUIRE(count == 1);
+    TamCloseSession(&session);
+
+    TamStopSigningStage();
+    TamGetSigningStageStatistics(&statistics);
+    REQUIRE(statistics.JobsQueued == 0);
+}
+
+// Get the canonical form of a component ID that is a single UUID.
+static std::string EncodeTestComponentId(_In_ const teep_uuid_t& uuid)
+{
+    std::string encoded;
+    UsefulBufC element = { uuid.b, sizeof(uuid.b) };
+    REQUIRE(TeepEncodeComponentId(&element, 1, encoded) == TEEP_ERR_SUCCESS);
+    return encoded;
+}
+
+TEST_CASE("Manifest index finds manifests by component ID", "[tam]") {
+    Manifest::ClearManifests();
+
+    // Add the manifests one at a time, so that the index grows with each
+    // snapshot rather than being sized once for all of them.
+    const int manifestCount = 1000;
+    for (int i = 0; i < manifestCount; i++) {
+        teep_uuid_t component_id = {};
+        memcpy(component_id.b, &i, sizeof(i));
+        Manifest::AddManifest(component_id, (const char*)&i, sizeof(i), (i % 2) == 0);
+    }
+    std::shared_ptr<const ManifestRepository> repository = ManifestRepository::GetCurrent();
+    REQUIRE(repository->RequiredRows().size() == manifestCount / 2);
+    REQUIRE(repository->OptionalRows().size() == manifestCount / 2);
+
+    for (int i = 0; i < manifestCount; i++) {
+        teep_uuid_t component_id = {};
+        memcpy(component_id.b, &i, sizeof(i));
+        std::string key = EncodeTestComponentId(component_id);
+        const Manifest* manifest = repository->Find({ key.data(), key.size() });
+        REQUIRE(manifest != nullptr);
+        REQUIRE(manifest == repository->Find(component_id));
+        REQUIRE(manifest->HasComponentId({ key.data(), key.size() }));
+        REQUIRE(manifest->IsRequired == ((i % 2) == 0));
+    }
+
+    teep_uuid_t unknown_id = {};
+    unknown_id.b[15] = 0xFF;
+    REQUIRE(repository->Find(unknown_id) == nullptr);
+
+    Manifest::ClearManifests();
+    REQUIRE(ManifestRepository::GetCurrent()->RequiredRows().empty());
+}
+
+TEST_CASE("Manifest pack serves manifests from the mapping", "[tam]") {
+    Manifest::ClearManifests();
+    const int manifestCount = 1000;
+    for (int i = 0; i < manifestCount; i++) {
+        teep_uuid_t component_id = {};
+        memcpy(component_id.b, &i, sizeof(i));
+        Manifest::AddManifest(component_id, (const char*)&i, sizeof(i), (i % 3) == 0);
+    }
+    size_t requiredCount = ManifestRepository::GetCurrent()->RequiredRows().size();
+    size_t optionalCount = ManifestRepository::GetCurrent()->OptionalRows().size();
+    const char* packfile = "test-manifests.pack";
+    REQUIRE(Manifest::WritePack(packfile) == TEEP_ERR_SUCCESS);
+
+    Manifest::ClearManifests();
+    REQUIRE(Manifest::LoadPack(packfile) == TEEP_ERR_SUCCESS);
+    std::shared_ptr<const ManifestRepository> repository = ManifestRepository::GetCurrent();
+    REQUIRE(repository->RequiredRows().size() == requiredCount);
+    REQUIRE(repository->OptionalRows().size() == optionalCount);
+    const std::vector<uint32_t>& requiredRows = repository->RequiredRows();
+    for (size_t i = 1; i < requiredRows.size(); i++) {
+        REQUIRE(Manifest::CompareComponentIds(repository->GetManifest(requiredRows[i - 1]), repository->GetManifest(requiredRows[i])));
+    }
+    for (int i = 0; i < manifestCount; i++) {
+        teep_uuid_t component_id = {};
+        memcpy(component_id.b, &i, sizeof(i));
+        const Manifest* manifest = repository->Find(component_id);
+        REQUIRE(manifest != nullptr);
+        REQUIRE(manifest == repository->Find(component_id));
+        REQUIRE(manifest->IsRequired == ((i % 3) == 0));
+        REQUIRE(UsefulBuf_Compare(manifest->ManifestContents, { &i, sizeof(i) }) == 0);
+    }
+
+    // A change shares the rows it does not touch, which are still served
+    // from the pack, and a pack written from the result has both.
+    teep_uuid_t added = {};
+    added.b[15] = 0xFF;
+    Manifest::AddManifest(added, "a", 1, true);
+    std::shared_ptr<const ManifestRepository> changed = ManifestRepository::GetCurrent();
+    REQUIRE(changed->Count() == manifestCount + 1);
+    teep_uuid_t unchanged = {};
+    REQUIRE(changed->Find(unchanged) == repository->Find(unchanged));
+    const char* changedPackfile = "test-manifests-changed.pack";
+    REQUIRE(Manifest::WritePack(changedPackfile) == TEEP_ERR_SUCCESS);
+    changed.reset();
+    REQUIRE(Manifest::LoadPack(changedPackfile) == TEEP_ERR_SUCCESS);
+    changed = ManifestRepository::GetCurrent();
+    REQUIRE(changed->Count() == manifestCount + 1);
+    REQUIRE(UsefulBuf_Compare(changed->Find(added)->ManifestContents, { "a", 1 }) == 0);
+    int last = manifestCount - 1;
+    teep_uuid_t lastId = {};
+    memcpy(lastId.b, &last, sizeof(last));
+    REQUIRE(UsefulBuf_Compare(changed->Find(lastId)->ManifestContents, { &last, sizeof(last) }) == 0);
+    changed.reset();
+
+    // A manifest still being sent keeps the mapping alive.
+    const Manifest* firstRequired = repository->GetManifest(repository->RequiredRows()[0]);
+    std::shared_ptr<const void> owner = firstRequired->ContentsOwner();
+    UsefulBufC contents = firstRequired->ManifestContents;
+    repository.reset();
+    Manifest::ClearManifests();
+    int first = 0;
+    REQUIRE(UsefulBuf_Compare(contents, { &first, sizeof(first) }) == 0);
+    owner.reset();
+
+    // A file that is not a pack leaves the repository alone.
+    teep_uuid_t component_id = {};
+    Manifest::AddManifest(component_id, "x", 1, true);
+    FILE* fp = fopen(packfile, "wb");
+    REQUIRE(fp != nullptr);
+    fputs("not a manifest pack", fp);
+    fclose(fp);
+    REQUIRE(Manifest::LoadPack(packfile) == TEEP_ERR_PERMANENT_ERROR);
+    REQUIRE(ManifestRepository::GetCurrent()->RequiredRows().size() == 1);
+
+    Manifest::ClearManifests();
+    remove(packfile);
+    remove(changedPackfile);
+}
+
+TEST_CASE("Manifest pack is authoritative until it is compiled again", "[tam]") {
+    const char* dataDirectory = "test-pack-data";
+    const char* manifestName = "f1a2c3bb-7c62-4b19-a030-5d9f1758f10a.cbor";
+    const char* addedName = "f1a2c3bb-7c62-4b19-a030-5d9f1758f10b.cbor";
+    std::filesystem::remove_all(dataDirectory);
+    std::filesystem::path required = std::filesystem::path(dataDirectory) / "manifests" / "required";
+    std::filesystem::path optional = std::filesystem::path(dataDirectory) / "manifests" / "optional";
+    std::filesystem::create_directories(required);
+    std::filesystem::create_directories(optional);
+    std::filesystem::copy_file(std::filesystem::path(TAM_DATA_DIRECTORY) / "manifests" / "required" / manifestName, required / manifestName);
+
+    // With no pack yet, loading the configuration compiles one.
+    std::string packFilename;
+    REQUIRE(!TamFindManifestPack(dataDirectory, packFilename));
+    REQUIRE(TamLoadConfiguration(dataDirectory) == TEEP_ERR_SUCCESS);
+    REQUIRE(TamFindManifestPack(dataDirectory, packFilename));
+    REQUIRE(ManifestRepository::GetCurrent()->Count() == 1);
+
+    // The files are not checked against the pack, so one added while no
+    // watcher is running is only seen once the pack is compiled again,
+    // which writes the next generation and removes the older one.
+    std::filesystem::copy_file(required / manifestName, optional / addedName);
+    REQUIRE(TamLoadConfiguration(dataDirectory) == TEEP_ERR_SUCCESS);
+    REQUIRE(ManifestRepository::GetCurrent()->Count() == 1);
+    Manifest::ClearManifests();
+    REQUIRE(TamCompileManifests(dataDirectory) == TEEP_ERR_SUCCESS);
+    std::string filename;
+    REQUIRE(TamFindManifestPack(dataDirectory, filename));
+    REQUIRE(filename != packFilename);
+    REQUIRE(!std::filesystem::exists(packFilename));
+    REQUIRE(TamLoadConfiguration(dataDirectory) == TEEP_ERR_SUCCESS);
+    std::shared_ptr<const ManifestRepository> repository = ManifestRepository::GetCurrent();
+    REQUIRE(repository->RequiredRows().size() == 1);
+    REQUIRE(repository->OptionalRows().size() == 1);
+    REQUIRE(repository->GetManifest(repository->RequiredRows()[0])->Metadata.SequenceNumber == 7);
+
+    // Changes applied as the watcher does are saved in the next pack, so
+    // a TAM started later sees them without compiling it again.
+    std::filesystem::remove(optional / addedName);
+    REQUIRE(TamApplyConfigurationChanges(dataDirectory, { { TAM_OPTIONAL_MANIFESTS_DIRECTORY, addedName } }) == TEEP_ERR_SUCCESS);
+    std::string savedFilename;
+    REQUIRE(TamFindManifestPack(dataDirectory, savedFilename));
+    REQUIRE(savedFilename != filename);
+    repository.reset();
+    Manifest::ClearManifests();
+    REQUIRE(TamLoadConfiguration(dataDirectory) == TEEP_ERR_SUCCESS);
+    repository = ManifestRepository::GetCurrent();
+    REQUIRE(repository->RequiredRows().size() == 1);
+    REQUIRE(repository->OptionalRows().empty());
+
+    repository.reset();
+    Manifest::ClearManifests();
+    std::filesystem::remove_all(dataDirectory);
+}
+
+TEST_CASE("Manifest metadata is decoded once at load", "[tam]") {
+    Manifest::ClearManifests();
+
+    std::shared_ptr<const Manifest> manifest;
+    REQUIRE(TamLoadManifestFile(TAM_DATA_DIRECTORY "/manifests/required", "f1a2c3bb-7c62-4b19-a030-5d9f1758f10a.cbor", TRUE, manifest) == TEEP_ERR_SUCCESS);
+    REQUIRE(manifest->Metadata.SequenceNumber == 7);
+    REQUIRE(manifest->Metadata.PayloadSize == 34768);
+    const uint8_t digestPrefix[] = { 0x00, 0x11, 0x22, 0x33 };
+    REQUIRE(memcmp(manifest->Metadata.PayloadDigest, digestPrefix, sizeof(digestPrefix)) == 0);
+
+    // Contents that are not a SUIT envelope get empty metadata.
+    teep_uuid_t other = { { 1 } };
+    REQUIRE(ManifestRepository::Update([&](ManifestRepositoryBuilder& builder) {
+        builder.Add(manifest);
+        builder.Add(Manifest::Create(other, "x", 1, false));
+        return TEEP_ERR_SUCCESS;
+    }) == TEEP_ERR_SUCCESS);
+
+    // The repository table has a row per manifest in component ID order.
+    std::shared_ptr<const ManifestRepository> repository = ManifestRepository::GetCurrent();
+    const ManifestMetadataTable& table = repository->Metadata();
+    REQUIRE(table.RowCount() == 2);
+    REQUIRE(repository->RequiredRows().size() == 1);
+    size_t row = repository->RequiredRows()[0];
+    REQUIRE(repository->GetManifest(row) == manifest.get());
+    REQUIRE(table.ComponentHandles[row] == manifest->ComponentHandle());
+    REQUIRE(table.SequenceNumbers[row] == 7);
+    REQUIRE(table.EncodedSizes[row] == manifest->ManifestContents.len);
+    REQUIRE(table.PayloadSizes[row] == 34768);
+    REQUIRE(memcmp(table.PayloadDigests[row].data(), manifest->Metadata.PayloadDigest, TAM_SUIT_DIGEST_LENGTH) == 0);
+    REQUIRE(table.IsRequired[row]);
+
+    size_t otherRow = repository->FindRow(TeepComponentIdTable::Find(other));
+    REQUIRE(otherRow == 0);
+    REQUIRE(!table.IsRequired[otherRow]);
+    REQUIRE(table.SequenceNumbers[otherRow] == 0);
+    REQUIRE(table.PayloadSizes[otherRow] == 0);
+
+    // A manifest pack carries the metadata, so loading one decodes nothing.
+    const char* packfile = "test-metadata.pack";
+    REQUIRE(Manifest::WritePack(packfile) == TEEP_ERR_SUCCESS);
+    Manifest::ClearManifests();
+    REQUIRE(Manifest::LoadPack(packfile) == TEEP_ERR_SUCCESS);
+    repository = ManifestRepository::GetCurrent();
+    row = repository->RequiredRows()[0];
+    REQUIRE(repository->Metadata().SequenceNumbers[row] == 7);
+    REQUIRE(repository->Metadata().PayloadSizes[row] == 34768);
+    REQUIRE(memcmp(repository->GetManifest(row)->Metadata.PayloadDigest, digestPrefix, sizeof(digestPrefix)) == 0);
+
+    repository.reset();
+    Manifest::ClearManifests();
+    remove(packfile);
+}
+
+TEST_CASE("Update plan computes install and uninstall sets", "[tam]") {
+    Manifest::ClearManifests();
+
+    teep_uuid_t required1 = { { 1 } };
+    teep_uuid_t required2 = { { 2 } };
+    teep_uuid_t optional = { { 3 } };
+    teep_uuid_t unknown = { { 4 } };
+    Manifest::AddManifest(required2, "r2", 2, TRUE);
+    Manifest::AddManifest(required1, "r1", 2, TRUE);
+    Manifest::AddManifest(optional, "o", 1, FALSE);
+
+    // The device has one required component and one unknown component,
+    // and requests the optional component.
+    RequestedComponentInfo current(unknown);
+    current.Next = new RequestedComponentInfo(required1);
+    RequestedComponentInfo requested(optional);
+
+    std::shared_ptr<const ManifestRepository> repository = ManifestRepository::GetCurrent();
+    UpdatePlan plan;
+    plan.Build(*repository, &current, &requested, nullptr);
+    REQUIRE(plan.Unchanged == 1);
+    REQUIRE(plan.Uninstall.size() == 1);
+    REQUIRE(UsefulBuf_Compare(plan.Uninstall[0], current.ComponentId) == 0);
+    REQUIRE(plan.Install.size() == 2);
+    REQUIRE(plan.Install[0]->ComponentHandle() == TeepComponentIdTable::Find(required2));
+    REQUIRE(plan.Install[1]->ComponentHandle() == TeepComponentIdTable::Find(optional));
+    REQUIRE(plan.Count() == 3);
+
+    // Reusing the plan discards the previous result.  A device with
+    // nothing installed needs every required component.
+    plan.Build(*repository, nullptr, nullptr, &requested);
+    REQUIRE(plan.Unchanged == 0);
+    REQUIRE(plan.Install.size() == 2);
+    REQUIRE(plan.Uninstall.size() == 1);
+    REQUIRE(UsefulBuf_Compare(plan.Uninstall[0], requested.ComponentId) == 0);
+
+    Manifest::ClearManifests();
+}
+
+static std::shared_ptr<const Manifest> CreateTestManifest(const teep_uuid_t& component_id, uint64_t sequenceNumber, int isRequired)
+{
+    ManifestMetadata metadata = {};
+    metadata.SequenceNumber = sequenceNumber;
+    return Manifest::Create(component_id, UsefulBuf_FROM_SZ_LITERAL("manifest"), nullptr, isRequired, metadata);
+}
+
+TEST_CASE("Update plan only sends newer manifests", "[tam]") {
+    teep_uuid_t current = { { 1 } };
+    teep_uuid_t old = { { 2 } };
+    teep_uuid_t unreported = { { 3 } };
+    teep_uuid_t optional = { { 4 } };
+    teep_uuid_t unneeded = { { 5 } };
+    REQUIRE(ManifestRepository::Update([&](ManifestRepositoryBuilder& builder) {
+        builder.Clear();
+        builder.Add(CreateTestManifest(current, 5, TRUE));
+        builder.Add(CreateTestManifest(old, 3, TRUE));
+        builder.Add(CreateTestManifest(unreported, 9, TRUE));
+        builder.Add(CreateTestManifest(optional, 2, FALSE));
+        builder.Add(CreateTestManifest(unneeded, 4, FALSE));
+        return TEEP_ERR_SUCCESS;
+    }) == TEEP_ERR_SUCCESS);
+
+    // The device has one required component that is up to date, one that
+    // is old, and one whose sequence number it does not report.  It also
+    // has an up to date optional component that it requests again, and
+    // an old optional component that it no longer needs.
+    RequestedComponentInfo installed(current);
+    installed.ManifestSequenceNumber = 5;
+    installed.HaveManifestSequenceNumber = true;
+    RequestedComponentInfo* rci = installed.Next = new RequestedComponentInfo(old);
+    rci->ManifestSequenceNumber = 1;
+    rci->HaveManifestSequenceNumber = true;
+    rci = rci->Next = new RequestedComponentInfo(unreported);
+    rci = rci->Next = new RequestedComponentInfo(optional);
+    rci->ManifestSequenceNumber = 2;
+    rci->HaveManifestSequenceNumber = true;
+    rci = rci->Next = new RequestedComponentInfo(unneeded);
+    rci->ManifestSequenceNumber = 1;
+    rci->HaveManifestSequenceNumber = true;
+    RequestedComponentInfo requested(optional);
+    RequestedComponentInfo unneededList(unneeded);
+
+    std::shared_ptr<const ManifestRepository> repository = ManifestRepository::GetCurrent();
+    UpdatePlan plan;
+    plan.Build(*repository, &installed, &requested, &unneededList);
+    REQUIRE(plan.Install.size() == 1);
+    REQUIRE(plan.Install[0]->ComponentHandle() == TeepComponentIdTable::Find(old));
+    REQUIRE(plan.Uninstall.size() == 1);
+    REQUIRE(UsefulBuf_Compare(plan.Uninstall[0], unneededList.ComponentId) == 0);
+    REQUIRE(plan.Unchanged == 3);
+
+    // Once the device has the upgrades, it needs nothing.
+    installed.Next->ManifestSequenceNumber = 3;
+    rci->ManifestSequenceNumber = 4;
+    plan.Build(*repository, &installed, &requested, nullptr);
+    REQUIRE(plan.Count() == 0);
+    REQUIRE(plan.Unchanged == 5);
+
+    Manifest::ClearManifests();
+}
+
+TEST_CASE("Component IDs are interned in canonical form", "[tam]") {
+    // A component ID with several elements.
+    UsefulBufC elements[] = { UsefulBuf_FROM_SZ_LITERAL("vendor"), UsefulBuf_FROM_SZ_LITERAL("component") };
+    std::string encoded;
+    REQUIRE(TeepEncodeComponentId(elements, 2, encoded) == TEEP_ERR_SUCCESS);
+    size_t count = TeepComponentIdTable::Count();
+    teep_component_handle_t handle = TeepComponentIdTable::Intern({ encoded.data(), encoded.size() });
+    REQUIRE(handle != TEEP_NO_COMPONENT_HANDLE);
+    REQUIRE(TeepComponentIdTable::Intern({ encoded.data(), encoded.size() }) == handle);
+    REQUIRE(TeepComponentIdTable::Find({ encoded.data(), encoded.size() }) == handle);
+    REQUIRE(TeepComponentIdTable::Count() == count + 1);
+    REQUIRE(UsefulBuf_Compare(TeepComponentIdTable::GetEncoded(handle), { encoded.data(), encoded.size() }) == 0);
+    teep_uuid_t uuid;
+    REQUIRE(!TeepComponentIdTable::GetUuid(handle, &uuid));
+
+    // The ID stays in the table until its last reference is dropped, and
+    // its handle is then reused.
+    TeepComponentIdTable::Release(handle);
+    REQUIRE(TeepComponentIdTable::Find({ encoded.data(), encoded.size() }) == handle);
+    TeepComponentIdTable::Release(handle);
+    REQUIRE(TeepComponentIdTable::Find({ encoded.data(), encoded.size() }) == TEEP_NO_COMPONENT_HANDLE);
+    REQUIRE(TeepComponentIdTable::GetEncoded(handle).ptr == nullptr);
+    REQUIRE(TeepComponentIdTable::Count() == count);
+    REQUIRE(TeepEncodeComponentId(elements + 1, 1, encoded) == TEEP_ERR_SUCCESS);
+    REQUIRE(TeepComponentIdTable::Intern({ encoded.data(), encoded.size() }) == handle);
+    TeepComponentIdTable::Release(handle);
+    REQUIRE(TeepComponentIdTable::Count() == count);
+
+    // Interning several IDs at once gives each the handle Intern() would.
+    std::string second;
+    REQUIRE(TeepEncodeComponentId(elements, 2, second) == TEEP_ERR_SUCCESS);
+    UsefulBufC batch[] = { { encoded.data(), encoded.size() }, NULLUsefulBufC, { second.data(), second.size() }, { encoded.data(), encoded.size() } };
+    teep_component_handle_t handles[4];
+    TeepComponentIdTable::Intern(batch, 4, handles);
+    REQUIRE(handles[0] != TEEP_NO_COMPONENT_HANDLE);
+    REQUIRE(handles[1] == TEEP_NO_COMPONENT_HANDLE);
+    REQUIRE(handles[2] != handles[0]);
+    REQUIRE(handles[3] == handles[0]);
+    REQUIRE(TeepComponentIdTable::Intern(batch[2]) == handles[2]);
+    TeepComponentIdTable::Release(handles[0]);
+    TeepComponentIdTable::Release(handles[2]);
+    TeepComponentIdTable::Release(handles[2]);
+    TeepComponentIdTable::Release(handles[3]);
+    REQUIRE(TeepComponentIdTable::Count() == count);
+
+    // A UUID is the same component ID as a single element holding it.
+    teep_uuid_t component = { { 0xC1, 0xD2 } };
+    UsefulBufC element = { component.b, sizeof(component.b) };
+    REQUIRE(TeepEncodeComponentId(&element, 1, encoded) == TEEP_ERR_SUCCESS);
+    handle = TeepComponentIdTable::Intern(component);
+    REQUIRE(TeepComponentIdTable::Find({ encoded.data(), encoded.size() }) == handle);
+    REQUIRE(TeepComponentIdTable::GetUuid(handle, &uuid));
+    REQUIRE(memcmp(&uuid, &component, sizeof(uuid)) == 0);
+
+    // A device's report of an ID in the table holds a reference to it.
+    {
+        RequestedComponentInfo reported(component);
+        REQUIRE(reported.ComponentHandle == handle);
+        TeepComponentIdTable::Release(handle);
+        REQUIRE(TeepComponentIdTable::Find(component) == handle);
+    }
+    REQUIRE(TeepComponentIdTable::Find(component) == TEEP_NO_COMPONENT_HANDLE);
+
+    // An ID encoded with a longer head than needed parses to the same
+    // canonical form: [h'61'] with the array count in a one-byte argument.
+    const uint8_t loose[] = { 0x98, 0x01, 0x41, 0x61 };
+    const uint8_t canonical[] = { 0x81, 0x41, 0x61 };
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, { loose, sizeof(loose) }, QCBOR_DECODE_MODE_NORMAL);
+    QCBORItem item;
+    REQUIRE(QCBORDecode_GetNext(&context, &item) == QCBOR_SUCCESS);
+    std::ostringstream errorMessage;
+    REQUIRE(TeepParseComponentId(&context, &item, encoded, errorMessage) == TEEP_ERR_SUCCESS);
+    REQUIRE(UsefulBuf_Compare({ encoded.data(), encoded.size() }, { canonical, sizeof(canonical) }) == 0);
+
+    // IDs reported by a device are never interned.  One the TAM has no
+    // manifest for is uninstalled using the ID as the device sent it.
+    REQUIRE(TeepEncodeComponentId(elements, 1, encoded) == TEEP_ERR_SUCCESS);
+    count = TeepComponentIdTable::Count();
+    RequestedComponentInfo reported({ encoded.data(), encoded.size() });
+    REQUIRE(reported.ComponentHandle == TEEP_NO_COMPONENT_HANDLE);
+    REQUIRE(TeepComponentIdTable::Count() == count);
+
+    Manifest::ClearManifests();
+    UpdatePlan plan;
+    plan.Build(*ManifestRepository::GetCurrent(), &reported, nullptr, nullptr);
+    REQUIRE(plan.Uninstall.size() == 1);
+    REQUIRE(UsefulBuf_Compare(plan.Uninstall[0], { encoded.data(), encoded.size() }) == 0);
+}
+
+TEST_CASE("Component handles are reused as manifests are replaced", "[tam]") {
+    Manifest::ClearManifests();
+    size_t count = TeepComponentIdTable::Count();
+
+    // Replace the repository with manifests for new components many times
+    // over.  Neither the table nor the handles should keep growing.
+    teep_component_handle_t firstMaxHandle = 0;
+    for (uint32_t round = 0; round < 100; round++) {
+        Manifest::ClearManifests();
+        for (uint32_t i = 0; i < 4; i++) {
+            teep_uuid_t component_id = { { 0xC4, 0x25 } };
+            memcpy(component_id.b + 8, &round, sizeof(round));
+            memcpy(component_id.b + 12, &i, sizeof(i));
+            Manifest::AddManifest(component_id, "m", 1, TRUE);
+        }
+        std::shared_ptr<const ManifestRepository> repository = ManifestRepository::GetCurrent();
+        REQUIRE(repository->Count() == 4);
+        REQUIRE(TeepComponentIdTable::Count() == count + 4);
+        const std::vector<teep_component_handle_t>& handles = repository->Metadata().ComponentHandles;
+        teep_component_handle_t maxHandle = *std::max_element(handles.begin(), handles.end());
+        if (round == 0) {
+            firstMaxHandle = maxHandle;
+        }
+        REQUIRE(maxHandle <= firstMaxHandle + 4);
+    }
+
+    Manifest::ClearManifests();
+    REQUIRE(TeepComponentIdTable::Count() == count);
+}
+
+static void WriteTestFile(_In_ const std::filesystem::path& path, _In_z_ const char* contents)
+{
+    FILE* fp = fopen(path.string().c_str(), "wb");
+    REQUIRE(fp != nullptr);
+    fputs(contents, fp);
+    fclose(fp);
+}
+
+TEST_CASE("Configuration changes publish a new manifest snapshot", "[tam]") {
+    std::filesystem::path data = "test-configuration";
+    std::filesystem::path required = data / "manifests" / "required";
+    std::filesystem::path optional = data / "manifests" / "optional";
+    std::filesystem::create_directories(required);
+    std::filesystem::create_directories(optional);
+
+    Manifest::ClearManifests();
+    teep_uuid_t unchanged = { { 1 } };
+    Manifest::AddManifest(unchanged, "u", 1, TRUE);
+
+    // A session holding the current snapshot keeps seeing it after a
+    // manifest is added.
+    std::shared_ptr<const ManifestRepository> before = ManifestRepository::GetCurrent();
+    const char* filename = "00000000-0000-0000-0000-000000000002.cbor";
+    teep_uuid_t added = {};
+    added.b[15] = 2;
+    WriteTestFile(required / filename, "a");
+    REQUIRE(TamApplyConfigurationChanges(data.string().c_str(), { { TAM_REQUIRED_MANIFESTS_DIRECTORY, filename } }) == TEEP_ERR_SUCCESS);
+    std::shared_ptr<const ManifestRepository> after = ManifestRepository::GetCurrent();
+    REQUIRE(after->GetEpoch() != before->GetEpoch());
+    REQUIRE(before->Count() == 1);
+    REQUIRE(before->Find(added) == nullptr);
+    const Manifest* manifest = after->Find(added);
+    REQUIRE(manifest != nullptr);
+    REQUIRE(manifest->IsRequired);
+    REQUIRE(UsefulBuf_Compare(manifest->ManifestContents, { "a", 1 }) == 0);
+
+    // The manifest that did not change is shared rather than reloaded.
+    REQUIRE(after->Find(unchanged) == before->Find(unchanged));
+
+    // Moving a manifest between directories is a removal plus an addition.
+    std::filesystem::rename(required / filename, optional / filename);
+    REQUIRE(TamApplyConfigurationChanges(data.string().c_str(), {
+        { TAM_REQUIRED_MANIFESTS_DIRECTORY, filename },
+        { TAM_OPTIONAL_MANIFESTS_DIRECTORY, filename } }) == TEEP_ERR_SUCCESS);
+    manifest = ManifestRepository::GetCurrent()->Find(added);
+    REQUIRE(manifest != nullptr);
+    REQUIRE(!manifest->IsRequired);
+    REQUIRE(ManifestRepository::GetCurrent()->RequiredRows().size() == 1);
+
+    std::filesystem::remove(optional / filename);
+    REQUIRE(TamApplyConfigurationChanges(data.string().c_str(), { { TAM_OPTIONAL_MANIFESTS_DIRECTORY, filename } }) == TEEP_ERR_SUCCESS);
+    REQUIRE(ManifestRepository::GetCurrent()->Find(added) == nullptr);
+    REQUIRE(ManifestRepository::GetCurrent()->Count() == 1);
+    REQUIRE(after->Find(added) != nullptr);
+
+    Manifest::ClearManifests();
+    std::filesystem::remove_all(data);
+}
+
+TEST_CASE("Manifests are keyed by component IDs with several elements", "[tam]") {
+    // Two IDs that share their last element, and one that is a UUID.
+    UsefulBufC firstElements[] = { UsefulBuf_FROM_SZ_LITERAL("vendor1"), UsefulBuf_FROM_SZ_LITERAL("app") };
+    UsefulBufC secondElements[] = { UsefulBuf_FROM_SZ_LITERAL("vendor2"), UsefulBuf_FROM_SZ_LITERAL("app") };
+    std::string first;
+    std::string second;
+    REQUIRE(TeepEncodeComponentId(firstElements, 2, first) == TEEP_ERR_SUCCESS);
+    REQUIRE(TeepEncodeComponentId(secondElements, 2, second) == TEEP_ERR_SUCCESS);
+    teep_uuid_t uuid = { { 0x5A } };
+    std::string uuidId = EncodeTestComponentId(uuid);
+
+    // Each ID names its own manifest file, and the name gives the ID back.
+    std::string firstFilename;
+    std::string secondFilename;
+    std::string uuidFilename;
+    REQUIRE(TeepGetManifestFilename({ first.data(), first.size() }, firstFilename) == TEEP_ERR_SUCCESS);
+    REQUIRE(TeepGetManifestFilename({ second.data(), second.size() }, secondFilename) == TEEP_ERR_SUCCESS);
+    REQUIRE(TeepGetManifestFilename({ uuidId.data(), uuidId.size() }, uuidFilename) == TEEP_ERR_SUCCESS);
+    REQUIRE(firstFilename != secondFilename);
+    REQUIRE(uuidFilename == "5a000000-0000-0000-0000-000000000000.cbor");
+    std::string encoded;
+    REQUIRE(TeepGetComponentIdFromManifestFilename(firstFilename.c_str(), encoded) == TEEP_ERR_SUCCESS);
+    REQUIRE(encoded == first);
+    REQUIRE(TeepGetComponentIdFromManifestFilename(uuidFilename.c_str(), encoded) == TEEP_ERR_SUCCESS);
+    REQUIRE(encoded == uuidId);
+
+    // Only the canonical encoding names an ID: [h'61'] with the array
+    // count in a one-byte argument is not a name.
+    REQUIRE(TeepGetComponentIdFromManifestFilename("98014161.cbor", encoded) != TEEP_ERR_SUCCESS);
+    REQUIRE(TeepGetComponentIdFromManifestFilename("not-an-id.cbor", encoded) != TEEP_ERR_SUCCESS);
+
+    // An ID too long to name in full is named by its hash, and the name is
+    // neither truncated nor shared with an ID that differs only at the end.
+    std::string longElement(200, 'x');
+    UsefulBufC longElements[] = { { longElement.data(), longElement.size() }, UsefulBuf_FROM_SZ_LITERAL("1") };
+    std::string longId;
+    std::string longFilename;
+    REQUIRE(TeepEncodeComponentId(longElements, 2, longId) == TEEP_ERR_SUCCESS);
+    REQUIRE(TeepGetManifestFilename({ longId.data(), longId.size() }, longFilename) == TEEP_ERR_SUCCESS);
+    REQUIRE(longFilename.compare(0, strlen(TEEP_HASHED_MANIFEST_FILENAME_PREFIX), TEEP_HASHED_MANIFEST_FILENAME_PREFIX) == 0);
+    REQUIRE(longFilename.size() <= TEEP_MAX_MANIFEST_FILENAME_LENGTH);
+    REQUIRE(TeepGetComponentIdFromManifestFilename(longFilename.c_str(), encoded) != TEEP_ERR_SUCCESS);
+    longElements[1] = UsefulBuf_FROM_SZ_LITERAL("2");
+    std::string otherLongFilename;
+    REQUIRE(TeepEncodeComponentId(longElements, 2, longId) == TEEP_ERR_SUCCESS);
+    REQUIRE(TeepGetManifestFilename({ longId.data(), longId.size() }, otherLongFilename) == TEEP_ERR_SUCCESS);
+    REQUIRE(otherLongFilename != longFilename);
+
+    // Manifest files named that way are loaded under their full IDs.
+    std::filesystem::path data = "test-component-ids";
+    std::filesystem::path required = data / "manifests" / "required";
+    std::filesystem::create_directories(required);
+    std::filesystem::create_directories(data / "manifests" / "optional");
+    WriteTestFile(required / firstFilename, "1");
+    WriteTestFile(required / secondFilename, "2");
+    Manifest::ClearManifests();
+    REQUIRE(TamApplyConfigurationChanges(data.string().c_str(), {
+        { TAM_REQUIRED_MANIFESTS_DIRECTORY, firstFilename },
+        { TAM_REQUIRED_MANIFESTS_DIRECTORY, secondFilename } }) == TEEP_ERR_SUCCESS);
+    Manifest::AddManifest(uuid, "u", 1, TRUE);
+    std::shared_ptr<const ManifestRepository> repository = ManifestRepository::GetCurrent();
+    REQUIRE(repository->Count() == 3);
+    const Manifest* manifest = repository->Find({ first.data(), first.size() });
+    REQUIRE(manifest != nullptr);
+    REQUIRE(manifest->HasComponentId({ first.data(), first.size() }));
+    REQUIRE(UsefulBuf_Compare(manifest->ManifestContents, { "1", 1 }) == 0);
+    manifest = repository->Find({ second.data(), second.size() });
+    REQUIRE(manifest != nullptr);
+    REQUIRE(UsefulBuf_Compare(manifest->ManifestContents, { "2", 1 }) == 0);
+
+    // A device reporting the ID finds the manifest by handle.
+    RequestedComponentInfo reported({ first.data(), first.size() });
+    REQUIRE(repository->GetManifest(repository->FindRow(reported.ComponentHandle))->HasComponentId({ first.data(), first.size() }));
+
+    // A manifest pack keeps the full IDs.
+    const char* packfile = "test-component-ids.pack";
+    REQUIRE(Manifest::WritePack(packfile) == TEEP_ERR_SUCCESS);
+    repository.reset();
+    Manifest::ClearManifests();
+    REQUIRE(Manifest::LoadPack(packfile) == TEEP_ERR_SUCCESS);
+    repository = ManifestRepository::GetCurrent();
+    REQUIRE(repository->Count() == 3);
+    REQUIRE(repository->GetManifest(0)->HasComponentId({ first.data(), first.size() }));
+    REQUIRE(repository->GetManifest(1)->HasComponentId({ second.data(), second.size() }));
+    REQUIRE(repository->GetManifest(2)->HasComponentId({ uuidId.data(), uuidId.size() }));
+    manifest = repository->Find({ second.data(), second.size() });
+    REQUIRE(manifest != nullptr);
+    REQUIRE(UsefulBuf_Compare(manifest->ManifestContents, { "2", 1 }) == 0);
+    REQUIRE(repository->Find(uuid) != nullptr);
+
+    // Removing one file removes only its own manifest.
+    std::filesystem::remove(required / secondFilename);
+    REQUIRE(TamApplyConfigurationChanges(data.string().c_str(), { { TAM_REQUIRED_MANIFESTS_DIRECTORY, secondFilename } }) == TEEP_ERR_SUCCESS);
+    repository = ManifestRepository::GetCurrent();
+    REQUIRE(repository->Find({ second.data(), second.size() }) == nullptr);
+    REQUIRE(repository->Find({ first.data(), first.size() }) != nullptr);
+
+    repository.reset();
+    Manifest::ClearManifests();
+    remove(packfile);
+    std::filesystem::remove_all(data);
+}
+
+// Wait up to a few seconds for the watcher to apply a change.
+static bool WaitForConfiguration(_In_ const std::function<bool()>& applied)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!applied()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+TEST_CASE("Configuration watcher applies changes on its own thread", "[tam]") {
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    std::filesystem::path data = "test-watcher";
+    std::filesystem::path required = data / "manifests" / "required";
+    std::filesystem::path trusted = data / "trusted";
+    std::filesystem::create_directories(required);
+    std::filesystem::create_directories(data / "manifests" / "optional");
+    std::filesystem::create_directories(trusted);
+    Manifest::ClearManifests();
+    REQUIRE(TamStartConfigurationWatcher(data.string().c_str()) == TEEP_ERR_SUCCESS);
+
+    const char* filename = "00000000-0000-0000-0000-000000000002.cbor";
+    teep_uuid_t added = {};
+    added.b[15] = 2;
+    WriteTestFile(required / filename, "a");
+    REQUIRE(WaitForConfiguration([&]() { return ManifestRepository::GetCurrent()->Find(added) != nullptr; }));
+
+    std::filesystem::copy_file(TAM_DATA_DIRECTORY "/tam-es256-public-key.pem", trusted / "watched-es256.pem",
+        std::filesystem::copy_options::overwrite_existing);
+    REQUIRE(WaitForConfiguration([]() { return TamGetTeepAgentKeyFiles()->Files.count("watched-es256.pem") == 1; }));
+
+    std::filesystem::remove(required / filename);
+    REQUIRE(WaitForConfiguration([&]() { return ManifestRepository::GetCurrent()->Find(added) == nullptr; }));
+
+    TamStopConfigurationWatcher();
+    Manifest::ClearManifests();
+    REQUIRE(TamConfigureAgentKeys(TAM_DATA_DIRECTORY "/trusted") == TEEP_ERR_SUCCESS);
+    std::filesystem::remove_all(data);
+    StopTamBroker();
+}
+
+TEST_CASE("Agent key files that cannot be loaded are skipped", "[tam]") {
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    std::filesystem::path trusted = "test-agent-key-files";
+    std::filesystem::create_directories(trusted);
+    WriteTestFile(trusted / "bad-es256.pem", "not a key");
+    std::filesystem::copy_file(TAM_DATA_DIRECTORY "/tam-es256-public-key.pem", trusted / "good-es256.pem",
+        std::filesystem::copy_options::overwrite_existing);
+
+    // A bad file fails the reload, but the rest are still loaded.
+    std::vector<std::string> failed;
+    REQUIRE(TamReloadAgentKeyFiles(trusted.string().c_str(), { "bad-es256.pem", "good-es256.pem" }, &failed) != TEEP_ERR_SUCCESS);
+    REQUIRE(failed == std::vector<std::string>{ "bad-es256.pem" });
+    REQUIRE(TamGetTeepAgentKeyFiles()->Files.count("good-es256.pem") == 1);
+    REQUIRE(TamGetTeepAgentKeyFiles()->Files.count("bad-es256.pem") == 0);
+
+    // The same goes for loading the whole directory.
+    REQUIRE(TamConfigureAgentKeys(trusted.string().c_str()) != TEEP_ERR_SUCCESS);
+    REQUIRE(TamGetTeepAgentKeyFiles()->Files.size() == 1);
+    REQUIRE(TamGetTeepAgentKeyFiles()->Files.count("good-es256.pem") == 1);
+
+    REQUIRE(TamConfigureAgentKeys(TAM_DATA_DIRECTORY "/trusted") == TEEP_ERR_SUCCESS);
+    std::filesystem::remove_all(trusted);
+    StopTamBroker();
+}
+
+TEST_CASE("QueryRequest is cached until keys are reloaded", "[tam]") {
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+
+    TamSession session;
+    std::shared_ptr<const std::vector<uint8_t>> first;
+    std::shared_ptr<const std::vector<uint8_t>> second;
+    REQUIRE(TamGetQueryRequest({}, {}, TEEP_SIGNATURE_BOTH, &session, first) == TEEP_ERR_SUCCESS);
+    REQUIRE(TamGetQueryRequest({}, {}, TEEP_SIGNATURE_BOTH, &session, second) == TEEP_ERR_SUCCESS);
+    REQUIRE(first == second);
+
+    // Reloading keys invalidates the cache.
+    REQUIRE(TamInitializeKeys(TAM_DATA_DIRECTORY) == TEEP_ERR_SUCCESS);
+    REQUIRE(TamGetQueryRequest({}, {}, TEEP_SIGNATURE_BOTH, &session, second) == TEEP_ERR_SUCCESS);
+    REQUIRE(first != second);
+
+    // With a challenge, each QueryRequest carries a fresh one.
+    TamSetQueryRequestChallengeLength(16);
+    REQUIRE(TamGetQueryRequest({}, {}, TEEP_SIGNATURE_BOTH, &session, first) == TEEP_ERR_SUCCESS);
+    std::vector<uint8_t> firstChallenge = session.Challenge;
+    REQUIRE(firstChallenge.size() == 16);
+    REQUIRE(std::search(first->begin(), first->end(), firstChallenge.begin(), firstChallenge.end()) != first->end());
+    REQUIRE(TamGetQueryRequest({}, {}, TEEP_SIGNATURE_BOTH, &session, second) == TEEP_ERR_SUCCESS);
+    REQUIRE(session.Challenge != firstChallenge);
+    TamSetQueryRequestChallengeLength(0);
+
+    StopTamBroker();
+}
+
+TEST_CASE("Update is cached by device inventory", "[tam]") {
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+    TamInvalidateUpdateCache();
+
+    teep_uuid_t component1 = { { 1 } };
+    teep_uuid_t component2 = { { 2 } };
+
+    // Two devices report the same components in a different order.
+    RequestedComponentInfo device1(component1);
+    device1.Next = new RequestedComponentInfo(component2);
+    RequestedComponentInfo device2(component2);
+    device2.Next = new RequestedComponentInfo(component1);
+
+    TamUpdateCacheStatistics before;
+    TamGetUpdateCacheStatistics(&before);
+    std::shared_ptr<const TeepOutboundMessage> first;
+    std::shared_ptr<const TeepOutboundMessage> second;
+    std::shared_ptr<const ManifestRepository> repository = ManifestRepository::GetCurrent();
+    REQUIRE(TamGetUpdate(*repository, &device1, nullptr, nullptr, TEEP_SIGNATURE_ES256, first) == TEEP_ERR_SUCCESS);
+    REQUIRE(TamGetUpdate(*repository, &device2, nullptr, nullptr, TEEP_SIGNATURE_ES256, second) == TEEP_ERR_SUCCESS);
+    REQUIRE(first == second);
+
+    TamUpdateCacheStatistics after;
+    TamGetUpdateCacheStatistics(&after);
+    REQUIRE(after.Misses == before.Misses + 1);
+    REQUIRE(after.Hits == before.Hits + 1);
+    REQUIRE(after.EntryCount == 1);
+
+    // Changing the manifest repository changes the key.
+    teep_uuid_t component3 = { { 3 } };
+    Manifest::AddManifest(component3, "m3", 2, FALSE);
+    repository = ManifestRepository::GetCurrent();
+    REQUIRE(TamGetUpdate(*repository, &device1, nullptr, nullptr, TEEP_SIGNATURE_ES256, second) == TEEP_ERR_SUCCESS);
+    TamGetUpdateCacheStatistics(&after);
+    REQUIRE(after.Misses == before.Misses + 2);
+
+    // The cache is bounded by memory.
+    TamSetUpdateCacheCapacity(0);
+    TamGetUpdateCacheStatistics(&after);
+    REQUIRE(after.EntryCount == 0);
+    REQUIRE(after.ByteCount == 0);
+    TamSetUpdateCacheCapacity(TAM_DEFAULT_UPDATE_CACHE_CAPACITY);
+
+    Manifest::ClearManifests();
+    StopTamBroker();
+}
+
+static std::vector<uint8_t> GetPublicKeyDer(_In_z_ const char* filename)
+{
+    struct t_cose_key key;
+    REQUIRE(teep_get_verifying_key_pair(&key, filename) == TEEP_ERR_SUCCESS);
+    std::vector<uint8_t> der(i2d_PUBKEY((EVP_PKEY*)key.key.ptr, nullptr));
+    unsigned char* p = der.data();
+    i2d_PUBKEY((EVP_PKEY*)key.key.ptr, &p);
+    teep_get_crypto_provider()->free_key(&key);
+    return der;
+}
+
+static std::string GetKeyId(teep_signature_kind_t kind, _In_ const std::vector<uint8_t>& der)
+{
+    const unsigned char* p = der.data();
+    struct t_cose_key key;
+    key.key.ptr = d2i_PUBKEY(nullptr, &p, (long)der.size());
+    UsefulBuf_MAKE_STACK_UB(keyId, TAM_AGENT_KEY_ID_LENGTH);
+    REQUIRE(teep_compute_key_id(kind, &key, &keyId) == TEEP_ERR_SUCCESS);
+    teep_get_crypto_provider()->free_key(&key);
+    return std::string((const char*)keyId.ptr, keyId.len);
+}
+
+TEST_CASE("Agent key store adds and revokes keys without a restart", "[tam]") {
+    REQUIRE(StartTamBroker(TAM_DATA_DIRECTORY, TRUE) == 0);
+
+    std::vector<uint8_t> es256 = GetPublicKeyDer(TAM_DATA_DIRECTORY "/tam-es256-public-key.pem");
+    std::vector<uint8_t> eddsa = GetPublicKeyDer(TAM_DATA_DIRECTORY "/tam-eddsa-public-key.pem");
+    std::string es256Id = GetKeyId(TEEP_SIGNATURE_ES256, es256);
+    std::string eddsaId = GetKeyId(TEEP_SIGNATURE_EDDSA, eddsa);
+    UsefulBufC es256KeyId = { es256Id.data(), es256Id.size() };
+    UsefulBufC eddsaKeyId = { eddsaId.data(), eddsaId.size() };
+    const char* packfile = "test-agent-keys.pack";
+
+    REQUIRE(AgentKeyStore::WritePack(packfile, { { TEEP_SIGNATURE_ES256, { es256.data(), es256.size() } } }) == TEEP_ERR_SUCCESS);
+    AgentKeyStore store;
+    REQUIRE(store.Open(packfile) == TEEP_ERR_SUCCESS);
+    std::shared_ptr<const AgentKey> key = store.Find(es256KeyId);
+    REQUIRE(key);
+    REQUIRE(key->Kind == TEEP_SIGNATURE_ES256);
+    REQUIRE(store.Find(es256KeyId) == key);
+    REQUIRE(!store.Find(eddsaKeyId));
+
+    // Changes take effect immediately.
+    REQUIRE(store.Add(TEEP_SIGNATURE_EDDSA, { eddsa.data(), eddsa.size() }) == TEEP_ERR_SUCCESS);
+    REQUIRE(store.Find(eddsaKeyId));
+    REQUIRE(store.Revoke(es256KeyId) == TEEP_ERR_SUCCESS);
+    REQUIRE(!store.Find(es256KeyId));
+
+    // The cache is bounded.
+    store.SetCacheCapacity(0);
+    REQUIRE(store.GetCachedKeyCount() == 0);
+    REQUIRE(store.Find(eddsaKeyId));
+    REQUIRE(store.GetCachedKeyCount() == 0);
+
+    // Revoking masks keys the store does not hold, such as key files.
+    std::string fileKeyId(TAM_AGENT_KEY_ID_LENGTH, 'F');
+    UsefulBufC fileKeyIdBuffer = { fileKeyId.data(), fileKeyId.size() };
+    REQUIRE(!store.IsRevoked(fileKeyIdBuffer));
+    REQUIRE(store.Revoke(fileKeyIdBuffer) == TEEP_ERR_SUCCESS);
+    REQUIRE(store.IsRevoked(fileKeyIdBuffer));
+    REQUIRE(store.IsRevoked(es256KeyId));
+    REQUIRE(!store.IsRevoked(eddsaKeyId));
+
+    // Saving folds the changes into a new generation of the pack, without
+    // touching the mapped one.
+    REQUIRE(store.Save(packfile) == TEEP_ERR_SUCCESS);
+    REQUIRE(std::filesystem::exists(GetPackGenerationFilename(packfile, 1)));
+    REQUIRE(!std::filesystem::exists(packfile));
+    REQUIRE(key->Kind == TEEP_SIGNATURE_ES256);
+    REQUIRE(store.Find(eddsaKeyId));
+    AgentKeyStore reloaded;
+    REQUIRE(reloaded.Open(packfile) == TEEP_ERR_SUCCESS);
+    REQUIRE(reloaded.Find(eddsaKeyId));
+    REQUIRE(!reloaded.Find(es256KeyId));
+    REQUIRE(reloaded.IsRevoked(es256KeyId));
+    REQUIRE(reloaded.IsRevoked(fileKeyIdBuffer));
+
+    // Revocations survive later saves, and reopening the current
+    // generation keeps unsaved changes.
+    REQUIRE(store.Save(packfile) == TEEP_ERR_SUCCESS);
+    REQUIRE(std::filesystem::exists(GetPackGenerationFilename(packfile, 2)));
+    REQUIRE(store.Revoke(eddsaKeyId) == TEEP_ERR_SUCCESS);
+    REQUIRE(store.Open(packfile) == TEEP_ERR_SUCCESS);
+    REQUIRE(!store.Find(eddsaKeyId));
+    REQUIRE(reloaded.Open(packfile) == TEEP_ERR_SUCCESS);
+    REQUIRE(reloaded.Find(eddsaKeyId));
+    REQUIRE(reloaded.IsRevoked(fileKeyIdBuffer));
+
+    store.Close();
+    reloaded.Close();
+    RemoveOlderPackGenerations(packfile, UINT64_MAX);
+    StopTamBroker();
+}
+
+TEST_CASE("Outbound message references shared bytes in place", "[tam]") {
+    auto storage = std::make_shared<std::vector<uint8_t>>(10000, (uint8_t)0xA5);
+    const char framing[] = { 1, 2, 3 };
+
+    TeepOutboundMessage message;
+    message.AppendCopy({ framing, sizeof(framing) });
+    message.AppendReference({ storage->data(), 5000 }, storage);
+    message.AppendReference({ storage->data() + 5000, 5000 }, storage);
+    REQUIRE(message.GetLength() == sizeof(framing) + 10000);
+
+    // Adjacent references are merged, and nothing is copied.
+    const std::vector<UsefulBufC>& segments = message.GetSegments();
+    REQUIRE(segments.size() == 2);
+    REQUIRE(segments[1].ptr == storage->data());
+    REQUIRE(segments[1].len == 10000);
+
+    // The message keeps the storage alive.
+    std::weak_ptr<std::vector<uint8_t>> weak = storage;
+    storage.reset();
+    REQUIRE(!weak.expired());
+
+    TeepOutboundMessage moved = std::move(message);
+    REQUIRE(message.IsEmpty());
+    std::vector<uint8_t> flat;
+    moved.Flatten(flat);
+    REQUIRE(flat.size() == sizeof(framing) + 10000);
+    REQUIRE(flat[0] == 1);
+    REQUIRE(flat[3] == 0xA5);
+    REQUIRE(flat.back() == 0xA5);
+
+    moved.Clear();
+    REQUIRE(weak.expired());
+}
+
+TEST_CASE("HTTP request parser enforces header and body limits", "[tam]") {
+    HttpRequestHead head;
+
+    // A complete request, with a second one pipelined behind it.
+    std::string inbound = "POST /TEEP HTTP/1.1\r\nContent-Type: application/teep+cbor\r\nContent-Length: 3\r\n\r\nabcGET / HTTP/1.1\r\n";
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == HTTP_REQUEST_COMPLETE);
+    REQUIRE(head.Verb == "POST");
+    REQUIRE(head.Path == "/TEEP");
+    REQUIRE(head.ContentType == "application/teep+cbor");
+    REQUIRE(head.KeepAlive);
+    REQUIRE(inbound.compare(head.BodyOffset, head.ContentLength, "abc") == 0);
+    inbound.erase(0, head.BodyOffset + head.ContentLength);
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == HTTP_REQUEST_INCOMPLETE);
+
+    // A body that has not all arrived yet.
+    inbound = "POST /TEEP HTTP/1.1\r\nContent-Length: 10\r\n\r\nabc";
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == HTTP_REQUEST_INCOMPLETE);
+
+    // A header that never ends is rejected once it reaches the limit,
+    // rather than buffered without bound.
+    inbound = "GET / HTTP/1.1\r\nX-Padding: " + std::string(MAX_HTTP_HEADER_SIZE - 40, 'a');
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == HTTP_REQUEST_INCOMPLETE);
+    inbound.append(40, 'a');
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == 431);
+    inbound += "\r\n\r\n";
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == 431);
+
+    // A body over the limit is rejected from its Content-Length alone.
+    inbound = "POST /TEEP HTTP/1.1\r\nContent-Length: " + std::to_string(MAX_HTTP_BODY_SIZE + 1) + "\r\n\r\n";
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == 413);
+    inbound = "POST /TEEP HTTP/1.1\r\nContent-Length: " + std::to_string(MAX_HTTP_BODY_SIZE) + "\r\n\r\n";
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == HTTP_REQUEST_INCOMPLETE);
+
+    // So a whole request of the largest size always fits in the buffer.
+    REQUIRE(head.BodyOffset + head.ContentLength <= MAX_HTTP_REQUEST_SIZE);
+
+    inbound = "POST /TEEP HTTP/1.1\r\nContent-Length: -1\r\n\r\n";
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == 400);
+    inbound = "POST /TEEP HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n";
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == 501);
+    inbound = "POST /TEEP HTTP/1.0\r\n\r\n";
+    REQUIRE(ParseHttpRequestHead(inbound, &head) == HTTP_REQUEST_COMPLETE);
+    REQUIRE(!head.KeepAlive);
+}
@@ -0,0 +1,100 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "HttpRequestParser.h"
+
+static bool EqualsIgnoreCase(_In_ const std::string& line, size_t length, _In_z_ const char* value)
+{
+    if (length != strlen(value)) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (tolower((unsigned char)line[i]) != tolower((unsigned char)value[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int ParseHttpRequestHead(_In_ const std::string& inbound, _Out_ HttpRequestHead* head)
+{
+    head->ContentType.clear();
+    head->AcceptType.clear();
+    head->BodyOffset = 0;
+    head->ContentLength = 0;
+    head->KeepAlive = false;
+
+    size_t headerEnd = inbound.find("\r\n\r\n");
+    if (headerEnd == std::string::npos) {
+        return (inbound.size() >= MAX_HTTP_HEADER_SIZE) ? 431 : HTTP_REQUEST_INCOMPLETE;
+    }
+    head->BodyOffset = headerEnd + 4;
+    if (head->BodyOffset > MAX_HTTP_HEADER_SIZE) {
+        return 431;
+    }
+
+    // Parse the request line.
+    size_t lineEnd = inbound.find("\r\n");
+    std::string requestLine = inbound.substr(0, lineEnd);
+    size_t firstSpace = requestLine.find(' ');
+    size_t secondSpace = (firstSpace == std::string::npos) ? std::string::npos : requestLine.find(' ', firstSpace + 1);
+    if (secondSpace == std::string::npos) {
+        return 400;
+    }
+    head->Verb = requestLine.substr(0, firstSpace);
+    head->Path = requestLine.substr(firstSpace + 1, secondSpace - firstSpace - 1);
+    head->KeepAlive = (requestLine.compare(secondSpace + 1, std::string::npos, "HTTP/1.1") == 0);
+
+    // Parse the headers we care about.
+    bool chunked = false;
+    for (size_t pos = lineEnd + 2; pos < headerEnd; ) {
+        size_t next = inbound.find("\r\n", pos);
+        std::string line = inbound.substr(pos, next - pos);
+        pos = next + 2;
+
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+        std::string value = (valueStart == std::string::npos) ? std::string() : line.substr(valueStart);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+            value.pop_back();
+        }
+
+        if (EqualsIgnoreCase(line, colon, "Content-Length")) {
+            char* end;
+            unsigned long long contentLength = strtoull(value.c_str(), &end, 10);
+            if (value.empty() || *end != 0 || value[0] == '-') {
+                return 400;
+            }
+            if (contentLength > MAX_HTTP_BODY_SIZE) {
+                return 413;
+            }
+            head->ContentLength = (size_t)contentLength;
+        } else if (EqualsIgnoreCase(line, colon, "Content-Type")) {
+            head->ContentType = value;
+        } else if (EqualsIgnoreCase(line, colon, "Accept")) {
+            head->AcceptType = value;
+        } else if (EqualsIgnoreCase(line, colon, "Transfer-Encoding")) {
+            chunked = !EqualsIgnoreCase(value, value.size(), "identity");
+        } else if (EqualsIgnoreCase(line, colon, "Connection")) {
+            if (EqualsIgnoreCase(value, value.size(), "close")) {
+                head->KeepAlive = false;
+            } else if (EqualsIgnoreCase(value, value.size(), "keep-alive")) {
+                head->KeepAlive = true;
+            }
+        }
+    }
+
+    if (chunked) {
+        return 501;
+    }
+    if (inbound.size() < head->BodyOffset + head->ContentLength) {
+        // Wait for the rest of the body.
+        return HTTP_REQUEST_INCOMPLETE;
+    }
+    return HTTP_REQUEST_COMPLETE;
+}
@@ -0,0 +1,34 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <stddef.h>
+#include <string>
+#include "teep_sal.h"
+
+#define MAX_HTTP_HEADER_SIZE 8192 // Including the request line and the blank line.
+#define MAX_HTTP_BODY_SIZE (1024 * 1024)
+
+// The most a connection ever needs to buffer to see a whole request.
+// Anything beyond that is left in the socket until a request is consumed.
+#define MAX_HTTP_REQUEST_SIZE (MAX_HTTP_HEADER_SIZE + MAX_HTTP_BODY_SIZE)
+
+#define HTTP_REQUEST_INCOMPLETE 0 // More data is needed.
+#define HTTP_REQUEST_COMPLETE 200 // A whole request is buffered.
+
+struct HttpRequestHead
+{
+    std::string Verb;
+    std::string Path;
+    std::string ContentType;
+    std::string AcceptType;
+    size_t BodyOffset;    // Offset of the body in the inbound buffer.
+    size_t ContentLength;
+    bool KeepAlive;
+};
+
+// Parse the request at the start of an inbound buffer.  Returns
+// HTTP_REQUEST_INCOMPLETE, HTTP_REQUEST_COMPLETE, or the status code of
+// an error response, after which the connection should be closed: 400 if
+// the request is malformed, 413 if the body is too large, 431 if the
+// header is too large, or 501 if the body uses a transfer encoding.
+int ParseHttpRequestHead(_In_ const std::string& inbound, _Out_ HttpRequestHead* head);
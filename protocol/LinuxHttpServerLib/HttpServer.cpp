@@ -0,0 +1,725 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+//
+// HTTP server module for Linux.  A single non-blocking epoll event loop
+// serves any number of concurrent TEEP Agent connections, each with its
+// own session state and outbound messages, and supports HTTP/1.1 keep-alive.
+// Responses are written with sendmsg straight from the message segments, so
+// manifests go from the repository to the socket without being copied.
+// TEEP messages are handed to the TAM worker pool, so this thread only does
+// I/O; workers post completions back to the loop through an eventfd.
+// Signing is a further stage with its own threads: a worker that has
+// parsed a request moves on, and the request completes once its response
+// is signed.  While the signing queue is full, new TEEP requests are left
+// unread in their connection buffers.
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "teep_sal.h"
+#include "HttpRequestParser.h"
+#include "HttpServer.h"
+#include "TamSigningStage.h"
+#include "TamVerificationStage.h"
+#include "TamWorkerPool.h"
+#include "TeepTamBrokerLib.h"
+
+#define MAX_EPOLL_EVENTS 256
+#define SOCKET_READ_SIZE 16384
+#define MAX_SEND_SEGMENTS 64
+
+struct TeepBasicSession {
+    char OutboundMediaType[80];
+    TeepOutboundMessage OutboundMessage;
+};
+
+teep_error_code_t TamQueueOutboundTeepMessage(void* sessionHandle, const char* mediaType, TeepOutboundMessage&& message)
+{
+    TeepBasicSession* session = (TeepBasicSession*)sessionHandle;
+
+    assert(session->OutboundMessage.IsEmpty());
+
+    // Save message for later transmission.
+    session->OutboundMessage = std::move(message);
+    printf("Sending %zd bytes...\n", session->OutboundMessage.GetLength());
+
+    snprintf(session->OutboundMediaType, sizeof(session->OutboundMediaType), "%s", mediaType);
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TamQueueOutboundTeepMessage(void* sessionHandle, const char* mediaType, const char* message, size_t messageLength)
+{
+    TeepOutboundMessage outboundMessage;
+    outboundMessage.AppendCopy({ message, messageLength });
+    return TamQueueOutboundTeepMessage(sessionHandle, mediaType, std::move(outboundMessage));
+}
+
+static void ClearOutboundMessage(_Inout_ TeepBasicSession* session)
+{
+    session->OutboundMessage.Clear();
+    session->OutboundMediaType[0] = 0;
+}
+
+// State for one TCP connection from a TEEP Agent.  Each connection owns
+// its own TEEP session, so concurrent agents never share outbound state.
+class HttpConnection
+{
+public:
+    HttpConnection(int socket) : Socket(socket), OutboundSegment(0), OutboundOffset(0), CloseAfterSend(false), PeerClosed(false), Busy(false), Throttled(false), Closed(false)
+    {
+        Session.OutboundMediaType[0] = 0;
+    }
+    ~HttpConnection()
+    {
+        TamCloseSession(&Session);
+        ClearOutboundMessage(&Session);
+        close(Socket);
+    }
+
+    TeepBasicSession Session;
+    int Socket;
+    std::string InboundBuffer;
+    TeepOutboundMessage Outbound; // Queued responses.
+    size_t OutboundSegment;       // Index of the first unsent segment.
+    size_t OutboundOffset;        // Bytes of that segment already sent.
+    bool CloseAfterSend;
+    bool PeerClosed;
+    bool Busy;    // A request is being processed by a worker.
+    bool Throttled; // A request is waiting for the signing stage to drain.
+    bool Closed;  // Removed from the connection table.
+};
+
+// A TEEP request being processed on the worker pool.  The request holds a
+// reference to its connection, so the session outlives the work even if
+// the agent disconnects in the meantime.
+struct TamRequest
+{
+    std::shared_ptr<HttpConnection> Connection;
+    std::string ContentType;
+    std::string AcceptType;
+    std::string Body;
+    teep_error_code_t Result;
+};
+
+// Per-connection session table, indexed by socket.
+static std::unordered_map<int, std::shared_ptr<HttpConnection>> g_Connections;
+static std::unordered_set<int> g_ListenSockets;
+static std::vector<int> g_ThrottledSockets;
+static std::string g_TeepPath;
+
+static const char* GetReasonPhrase(int statusCode)
+{
+    switch (statusCode) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    default: return "Internal Server Error";
+    }
+}
+
+static void QueueHttpResponse(
+    _Inout_ HttpConnection* connection,
+    int statusCode,
+    _In_opt_z_ const char* contentType,
+    _Inout_ TeepOutboundMessage&& entity)
+{
+    char header[512];
+    int headerLength = snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\n"
+        "%s%s%s"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n"
+        "\r\n",
+        statusCode, GetReasonPhrase(statusCode),
+        (contentType && *contentType) ? "Content-Type: " : "",
+        (contentType && *contentType) ? contentType : "",
+        (contentType && *contentType) ? "\r\n" : "",
+        entity.GetLength(),
+        connection->CloseAfterSend ? "close" : "keep-alive");
+    connection->Outbound.AppendCopy({ header, (size_t)headerLength });
+    connection->Outbound.Append(std::move(entity));
+}
+
+static void QueueHttpResponse(
+    _Inout_ HttpConnection* connection,
+    int statusCode,
+    _In_opt_z_ const char* contentType,
+    _In_reads_opt_(entityLength) const char* entity,
+    size_t entityLength)
+{
+    TeepOutboundMessage message;
+    if (entity != nullptr) {
+        message.AppendCopy({ entity, entityLength });
+    }
+    QueueHttpResponse(connection, statusCode, contentType, std::move(message));
+}
+
+// Send the session's outbound TEEP message, if any, as the response.
+static void QueueSessionResponse(_Inout_ HttpConnection* connection, int statusCode)
+{
+    TeepBasicSession* session = &connection->Session;
+    if (statusCode == 200) {
+        QueueHttpResponse(connection, 200, session->OutboundMediaType, std::move(session->OutboundMessage));
+    } else {
+        QueueHttpResponse(connection, statusCode, nullptr, nullptr, 0);
+    }
+    ClearOutboundMessage(session);
+}
+
+// Completed requests waiting to be picked up by the event loop.
+static std::mutex g_CompletionLock;
+static std::vector<TamRequest*> g_Completions;
+static int g_CompletionEventFd = -1;
+
+static teep_error_code_t ProcessTeepRequest(_Inout_ TamRequest* request)
+{
+    TeepBasicSession* session = &request->Connection->Session;
+
+    if (request->Body.empty()) {
+        // A 0-byte post is a connect.
+        return TamProcessConnect(session, request->AcceptType.c_str());
+    }
+
+    return TamProcessTeepMessage(session, request->ContentType.c_str(), request->Body.data(), request->Body.size());
+}
+
+// Runs on a worker or signing thread.
+static void TamRequestCompleted(_In_opt_ void* context, teep_error_code_t result)
+{
+    TamRequest* request = (TamRequest*)context;
+    request->Result = result;
+
+    {
+        std::lock_guard<std::mutex> lock(g_CompletionLock);
+        g_Completions.push_back(request);
+    }
+    uint64_t one = 1;
+    ssize_t written = write(g_CompletionEventFd, &one, sizeof(one));
+    (void)written;
+}
+
+// Runs on a worker thread.
+static void TamRequestWorkItem(_In_opt_ void* context)
+{
+    TamRequest* request = (TamRequest*)context;
+    if (request->Body.empty()) {
+        // A 0-byte post is a connect, whose QueryRequest needs no signing
+        // stage since it comes from a cache.
+        TamRequestCompleted(request, ProcessTeepRequest(request));
+        return;
+    }
+
+    TeepBasicSession* session = &request->Connection->Session;
+    TamProcessTeepMessageAsync(session, request->ContentType.c_str(), request->Body.data(), request->Body.size(), TamRequestCompleted, request);
+}
+
+// Handle an incoming POST request on the TEEP path.
+static void HandleHttpPost(
+    _In_ const std::shared_ptr<HttpConnection>& connection,
+    _In_z_ const char* contentType,
+    _In_z_ const char* acceptType,
+    _In_reads_(bodyLength) const char* body,
+    size_t bodyLength)
+{
+    TamRequest* request = new TamRequest{ connection, contentType, acceptType, std::string(body, bodyLength), TEEP_ERR_SUCCESS };
+
+    connection->Busy = true;
+    if (TamQueueWorkItem(TamRequestWorkItem, request) == 0) {
+        return;
+    }
+
+    // No worker pool, so process the request inline.
+    connection->Busy = false;
+    teep_error_code_t result = ProcessTeepRequest(request);
+    delete request;
+    QueueSessionResponse(connection.get(), (result == TEEP_ERR_SUCCESS) ? 200 : 400);
+}
+
+// Try to handle one complete request from the inbound buffer.
+// Returns true if a request was consumed, false if more data is needed
+// or the connection should be closed.
+static bool HandleNextHttpRequest(_In_ const std::shared_ptr<HttpConnection>& connection)
+{
+    std::string& inbound = connection->InboundBuffer;
+    HttpRequestHead head;
+    int status = ParseHttpRequestHead(inbound, &head);
+    if (status == HTTP_REQUEST_INCOMPLETE) {
+        return false;
+    }
+    if (status != HTTP_REQUEST_COMPLETE) {
+        // Nothing more can be read from this connection, since where the
+        // next request starts is unknown.
+        connection->CloseAfterSend = true;
+        QueueHttpResponse(connection.get(), status, nullptr, nullptr, 0);
+        inbound.clear();
+        return false;
+    }
+    const char* body = inbound.data() + head.BodyOffset;
+
+    if (head.Verb == "POST" && head.Path == g_TeepPath && TamIsSigningStageSaturated()) {
+        // Leave the request unread until the signing stage drains.
+        if (!connection->Throttled) {
+            connection->Throttled = true;
+            g_ThrottledSockets.push_back(connection->Socket);
+        }
+        return false;
+    }
+
+    connection->CloseAfterSend = !head.KeepAlive;
+
+    if (head.Verb == "GET") {
+        printf("Got a GET request for %s\n", head.Path.c_str());
+        const char* responseString = "This is a TEEP TAM endpoint. The TEEP protocol uses only POST.\r\n";
+        QueueHttpResponse(connection.get(), 200, "text/plain", responseString, strlen(responseString));
+    } else if (head.Verb == "POST") {
+        printf("Got a POST request for %s\n", head.Path.c_str());
+        if (head.Path == g_TeepPath) {
+            HandleHttpPost(connection, head.ContentType.c_str(), head.AcceptType.c_str(), body, head.ContentLength);
+        } else {
+            QueueHttpResponse(connection.get(), 404, nullptr, nullptr, 0);
+        }
+    } else {
+        printf("Got a unknown request for %s\n", head.Path.c_str());
+        QueueHttpResponse(connection.get(), 501, nullptr, nullptr, 0);
+    }
+
+    inbound.erase(0, head.BodyOffset + head.ContentLength);
+    return !connection->CloseAfterSend && !connection->Busy;
+}
+
+static void CloseConnection(int epollFd, int socket)
+{
+    auto it = g_Connections.find(socket);
+    if (it == g_Connections.end()) {
+        return;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+    it->second->Closed = true;
+
+    // If a worker still holds a reference, the socket is closed when
+    // its completion is dropped.
+    g_Connections.erase(it);
+}
+
+static void UpdateInterest(int epollFd, _In_ HttpConnection* connection)
+{
+    // Stop reading once a whole request's worth of data is buffered, and
+    // let TCP flow control hold back the rest until a request is consumed.
+    bool canRead = !connection->PeerClosed && (connection->InboundBuffer.size() < MAX_HTTP_REQUEST_SIZE);
+
+    struct epoll_event event = {};
+    event.events = (canRead) ? (EPOLLIN | EPOLLRDHUP) : 0;
+    if (!connection->Outbound.IsEmpty()) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.fd = connection->Socket;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->Socket, &event);
+}
+
+// Write as much pending output as the socket will take.
+// Returns false if the connection should be closed.
+static bool FlushConnection(int epollFd, _Inout_ HttpConnection* connection)
+{
+    const std::vector<UsefulBufC>& segments = connection->Outbound.GetSegments();
+    while (connection->OutboundSegment < segments.size()) {
+        struct iovec iov[MAX_SEND_SEGMENTS];
+        size_t count = 0;
+        for (size_t i = connection->OutboundSegment; i < segments.size() && count < MAX_SEND_SEGMENTS; i++, count++) {
+            size_t skip = (i == connection->OutboundSegment) ? connection->OutboundOffset : 0;
+            iov[count].iov_base = (uint8_t*)segments[i].ptr + skip;
+            iov[count].iov_len = segments[i].len - skip;
+        }
+        struct msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t bytesSent = sendmsg(connection->Socket, &message, MSG_NOSIGNAL);
+        if (bytesSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                UpdateInterest(epollFd, connection);
+                return true;
+            }
+            return false;
+        }
+
+        // Advance past whatever the socket took.
+        size_t remaining = (size_t)bytesSent;
+        while (remaining > 0) {
+            size_t left = segments[connection->OutboundSegment].len - connection->OutboundOffset;
+            if (remaining < left) {
+                connection->OutboundOffset += remaining;
+                break;
+            }
+            remaining -= left;
+            connection->OutboundSegment++;
+            connection->OutboundOffset = 0;
+        }
+    }
+
+    connection->Outbound.Clear();
+    connection->OutboundSegment = 0;
+    connection->OutboundOffset = 0;
+    if (connection->CloseAfterSend && !connection->Busy) {
+        return false;
+    }
+    UpdateInterest(epollFd, connection);
+    return true;
+}
+
+// Read what is available, up to MAX_HTTP_REQUEST_SIZE buffered, and
+// handle any complete requests.
+// Returns false if the connection should be closed.
+static bool ReadConnection(_In_ const std::shared_ptr<HttpConnection>& connection)
+{
+    char buffer[SOCKET_READ_SIZE];
+    for (;;) {
+        size_t room = MAX_HTTP_REQUEST_SIZE - connection->InboundBuffer.size();
+        if (room == 0) {
+            break;
+        }
+        ssize_t bytesRead = recv(connection->Socket, buffer, (room < sizeof(buffer)) ? room : sizeof(buffer), 0);
+        if (bytesRead > 0) {
+            connection->InboundBuffer.append(buffer, bytesRead);
+            continue;
+        }
+        if (bytesRead == 0) {
+            // Peer closed its side.
+            connection->PeerClosed = true;
+            if (connection->Busy) {
+                // Send the response still being computed, then close.
+                connection->CloseAfterSend = true;
+                return true;
+            }
+            return false;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        return false;
+    }
+
+    while (!connection->CloseAfterSend && !connection->Busy && HandleNextHttpRequest(connection));
+    return true;
+}
+
+// Pick up requests held back while the signing stage was saturated.
+static void ResumeThrottledConnections(int epollFd)
+{
+    if (g_ThrottledSockets.empty() || TamIsSigningStageSaturated()) {
+        return;
+    }
+
+    std::vector<int> sockets;
+    sockets.swap(g_ThrottledSockets);
+    for (int socket : sockets) {
+        auto it = g_Connections.find(socket);
+        if (it == g_Connections.end()) {
+            continue;
+        }
+        std::shared_ptr<HttpConnection> connection = it->second;
+        connection->Throttled = false;
+        while (!connection->CloseAfterSend && !connection->Busy && HandleNextHttpRequest(connection));
+        if (!FlushConnection(epollFd, connection.get())) {
+            CloseConnection(epollFd, socket);
+        }
+    }
+}
+
+// Send responses for requests completed by the worker pool.
+static void HandleCompletions(int epollFd)
+{
+    uint64_t count;
+    ssize_t bytesRead = read(g_CompletionEventFd, &count, sizeof(count));
+    (void)bytesRead;
+
+    std::vector<TamRequest*> completions;
+    {
+        std::lock_guard<std::mutex> lock(g_CompletionLock);
+        completions.swap(g_Completions);
+    }
+
+    for (TamRequest* request : completions) {
+        std::shared_ptr<HttpConnection> connection = request->Connection;
+        teep_error_code_t result = request->Result;
+        delete request;
+
+        connection->Busy = false;
+        if (connection->Closed) {
+            ClearOutboundMessage(&connection->Session);
+            continue;
+        }
+        QueueSessionResponse(connection.get(), (result == TEEP_ERR_SUCCESS) ? 200 : 400);
+
+        // Handle any requests that were pipelined behind this one.
+        while (!connection->CloseAfterSend && !connection->Busy && HandleNextHttpRequest(connection));
+
+        if (!FlushConnection(epollFd, connection.get())) {
+            CloseConnection(epollFd, connection->Socket);
+        }
+    }
+
+    ResumeThrottledConnections(epollFd);
+}
+
+static void AcceptConnections(int epollFd, int listenSocket)
+{
+    for (;;) {
+        int socket = accept4(listenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN means there are no more pending connections.
+            return;
+        }
+
+        int one = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct epoll_event event = {};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = socket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) < 0) {
+            close(socket);
+            continue;
+        }
+        g_Connections[socket] = std::make_shared<HttpConnection>(socket);
+    }
+}
+
+// Handle a series of incoming requests, which might be for different sessions.
+static int DoReceiveRequests(int epollFd)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    for (;;) {
+        int count = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int socket = events[i].data.fd;
+            if (socket == g_CompletionEventFd) {
+                HandleCompletions(epollFd);
+                continue;
+            }
+            if (g_ListenSockets.count(socket) > 0) {
+                AcceptConnections(epollFd, socket);
+                continue;
+            }
+
+            auto it = g_Connections.find(socket);
+            if (it == g_Connections.end()) {
+                continue;
+            }
+            std::shared_ptr<HttpConnection> connectionReference = it->second;
+            HttpConnection* connection = connectionReference.get();
+
+            bool keep = true;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                keep = false;
+            }
+            if (keep && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+                keep = ReadConnection(connectionReference);
+                if (!keep && !connection->Outbound.IsEmpty()) {
+                    // Deliver any final response before closing.
+                    connection->CloseAfterSend = true;
+                    keep = true;
+                }
+            }
+            if (keep) {
+                keep = FlushConnection(epollFd, connection);
+            }
+            if (!keep) {
+                CloseConnection(epollFd, socket);
+            }
+        }
+    }
+}
+
+// Parse a URI of the form http://host:port/path.
+static bool ParseHttpUri(_In_z_ const char* uri, _Out_ std::string& host, _Out_ std::string& port, _Out_ std::string& path)
+{
+    const char* scheme = "http://";
+    if (strncasecmp(uri, scheme, strlen(scheme)) != 0) {
+        return false;
+    }
+    const char* authority = uri + strlen(scheme);
+    const char* slash = strchr(authority, '/');
+    std::string hostPort = (slash != nullptr) ? std::string(authority, slash - authority) : std::string(authority);
+    path = (slash != nullptr) ? std::string(slash) : std::string("/");
+
+    size_t colon = hostPort.rfind(':');
+    if (colon != std::string::npos && hostPort.find(']', colon) == std::string::npos) {
+        host = hostPort.substr(0, colon);
+        port = hostPort.substr(colon + 1);
+    } else {
+        host = hostPort;
+        port = "80";
+    }
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    if (host == "+" || host == "*") {
+        // HTTP.sys-style wildcard.
+        host.clear();
+    }
+    return true;
+}
+
+static int CreateListenSocket(_In_z_ const char* host, _In_z_ const char* port)
+{
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo* ai;
+    int err = getaddrinfo((*host) ? host : nullptr, port, &hints, &ai);
+    if (err != 0) {
+        printf("getaddrinfo failed with %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    int listenSocket = -1;
+    for (struct addrinfo* p = ai; p != nullptr; p = p->ai_next) {
+        listenSocket = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+        if (listenSocket < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listenSocket, p->ai_addr, p->ai_addrlen) == 0 &&
+            listen(listenSocket, SOMAXCONN) == 0) {
+            break;
+        }
+        close(listenSocket);
+        listenSocket = -1;
+    }
+    freeaddrinfo(ai);
+    return listenSocket;
+}
+
+int RunHttpServer(int argc, const wchar_t** argv)
+{
+    // The TEEP path is the same for every URI we listen on.
+    char teepPath[80];
+    wcstombs(teepPath, TEEP_PATH, sizeof(teepPath));
+    g_TeepPath = teepPath;
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        printf("epoll_create1 failed with %d\n", errno);
+        return errno;
+    }
+
+    g_CompletionEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_CompletionEventFd < 0) {
+        printf("eventfd failed with %d\n", errno);
+        close(epollFd);
+        return errno;
+    }
+    struct epoll_event completionEvent = {};
+    completionEvent.events = EPOLLIN;
+    completionEvent.data.fd = g_CompletionEventFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, g_CompletionEventFd, &completionEvent);
+
+    // Message processing runs on the worker pool, one worker per core,
+    // and signing and batched verification on their own stages, also one
+    // worker per core.
+    TamStartWorkerPool(0);
+    TamStartSigningStage(0, TAM_DEFAULT_SIGNING_QUEUE_CAPACITY);
+    TamStartVerificationStage(0, TAM_DEFAULT_VERIFICATION_BATCH_SIZE, TAM_DEFAULT_VERIFICATION_WINDOW_MICROSECONDS);
+
+    //
+    // The arguments represent URIs that to
+    // listen on. Create a listen socket for each URI.
+    //
+    int retCode = 0;
+    for (int i = 1; i < argc; i++) {
+        printf("Listening for requests on the following URL: %ls\n", argv[i]);
+
+        char uri[1024];
+        if (wcstombs(uri, argv[i], sizeof(uri)) == (size_t)-1) {
+            retCode = EINVAL;
+            break;
+        }
+        uri[sizeof(uri) - 1] = 0;
+
+        std::string host;
+        std::string port;
+        std::string path;
+        if (!ParseHttpUri(uri, host, port, path)) {
+            printf("Unsupported URI %s\n", uri);
+            retCode = EINVAL;
+            break;
+        }
+
+        int listenSocket = CreateListenSocket(host.c_str(), port.c_str());
+        if (listenSocket < 0) {
+            printf("Could not listen on %s:%s\n", host.c_str(), port.c_str());
+            retCode = EADDRNOTAVAIL;
+            break;
+        }
+
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = listenSocket;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSocket, &event);
+        g_ListenSockets.insert(listenSocket);
+    }
+
+    if (retCode == 0 && !g_ListenSockets.empty()) {
+        retCode = DoReceiveRequests(epollFd);
+    }
+
+    // Clean up.
+    TamStopWorkerPool();
+    TamStopVerificationStage(); // Handling a verified message can queue signing jobs.
+    TamStopSigningStage();
+    for (TamRequest* request : g_Completions) {
+        delete request;
+    }
+    g_Completions.clear();
+    g_Connections.clear();
+    g_ThrottledSockets.clear();
+    for (int listenSocket : g_ListenSockets) {
+        close(listenSocket);
+    }
+    g_ListenSockets.clear();
+    close(g_CompletionEventFd);
+    g_CompletionEventFd = -1;
+    close(epollFd);
+
+    return retCode;
+}
@@ -26,7 +26,7 @@ void TeepAgentGetSigningKeyPair(_Out_ struct t_cose_key* keyPair, _Out_ teep_sig
     *kind = g_teep_agent_signing_key_kind;
 }
 
-map<teep_signature_kind_t,struct t_cose_key> g_tam_key_pairs;
+teep_key_index_t g_tam_key_index;
 
 /* TODO: This is just a placeholder for a real implementation.
  * Currently we provide untrusted keys into the TAM.
@@ -36,7 +36,7 @@ map<teep_signature_kind_t,struct t_cose_key> g_tam_key_pairs;
  */
 teep_error_code_t TeepAgentConfigureTamKeys(_In_z_ const char* directory_name)
 {
-    g_tam_key_pairs.clear();
+    g_tam_key_index.clear();
 
     teep_error_code_t result = TEEP_ERR_SUCCESS;
     DIR* dir = opendir(directory_name);
@@ -65,16 +65,19 @@ teep_error_code_t TeepAgentConfigureTamKeys(_In_z_ const char* directory_name)
             break;
         }
         teep_signature_kind_t kind = (strstr(filename, "es256") != nullptr) ? TEEP_SIGNATURE_ES256 : TEEP_SIGNATURE_EDDSA;
-        g_tam_key_pairs[kind] = key_pair;
+        result = teep_add_verification_key(g_tam_key_index, kind, &key_pair);
+        if (result != TEEP_ERR_SUCCESS) {
+            break;
+        }
     }
     closedir(dir);
     return result;
 }
 
 /* Get the TEEP Agents' public keys to verify an incoming message against. */
-map<teep_signature_kind_t, struct t_cose_key> TeepAgentGetTamKeys()
+const teep_key_index_t& TeepAgentGetTamKeyIndex()
 {
-    return g_tam_key_pairs;
+    return g_tam_key_index;
 }
 
 teep_error_code_t TeepAgentInitializeKeys(_In_z_ const char* dataDirectory,
@@ -5,6 +5,6 @@
 
 teep_error_code_t TeepAgentConfigureTamKeys(_In_z_ const char* directory_name);
 
-std::map<teep_signature_kind_t, struct t_cose_key> TeepAgentGetTamKeys();
+const teep_key_index_t& TeepAgentGetTamKeyIndex();
 
 void TeepAgentGetSigningKeyPair(_Out_ struct t_cose_key* keyPair, _Out_ teep_signature_kind_t* kind);
\ No newline at end of file
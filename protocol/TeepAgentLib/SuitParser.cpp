@@ -5,82 +5,29 @@
 #endif
 #include <stdlib.h>
 #include "common.h"
+#include "ComponentIdTable.h"
 extern "C" {
 #include "suit_manifest.h"
 };
 #include "qcbor/qcbor_decode.h"
 #include "SuitParser.h"
 
-// Construct a filename from a SUIT_Digest.
-static teep_error_code_t GetFilenameFromSuitDigest(_Out_ filesystem::path& filename, UsefulBufC encoded)
+// Get a SUIT_Component_Identifier, whose array item has just been read,
+// in canonical form.
+static teep_error_code_t GetSuitComponentIdentifier(_Out_ std::string& componentId, QCBORDecodeContext* context, QCBORItem* item, ostream& errorMessage)
 {
-    teep_error_code_t errorCode = TEEP_ERR_PERMANENT_ERROR;
-    QCBORDecodeContext context;
-    QCBORDecode_Init(&context, encoded, QCBOR_DECODE_MODE_NORMAL);
-
-    QCBORItem item;
-    QCBORDecode_GetNext(&context, &item);
-    if (item.uDataType != QCBOR_TYPE_ARRAY && item.val.uCount > 0) {
-        QCBORDecode_GetNext(&context, &item);
-        if (item.uDataType == QCBOR_TYPE_BYTE_STRING) {
-            // Base16 encode item.val.string.
-            TeepAgentMakeManifestFilename(filename, (const char*)item.val.string.ptr, item.val.string.len);
-            errorCode = TEEP_ERR_SUCCESS;
-        }
-    }
-    QCBORDecode_Finish(&context);
-    return errorCode;
-}
-
-// Construct a filename from a SUIT_Authentication.
-static teep_error_code_t GetFilenameFromSuitAuthentication(_Out_ filesystem::path& filename, UsefulBufC encoded)
-{
-    teep_error_code_t errorCode = TEEP_ERR_PERMANENT_ERROR;
-    QCBORDecodeContext context;
-    QCBORDecode_Init(&context, encoded, QCBOR_DECODE_MODE_NORMAL);
-
-    QCBORItem item;
-    QCBORDecode_GetNext(&context, &item);
-    if (item.uDataType == QCBOR_TYPE_ARRAY && item.val.uCount > 0) {
-        QCBORDecode_GetNext(&context, &item);
-        if (item.uDataType == QCBOR_TYPE_BYTE_STRING) {
-            errorCode = GetFilenameFromSuitDigest(filename, item.val.string);
-        }
-    }
-    QCBORDecode_Finish(&context);
-    return errorCode;
-}
-
-// Construct a filename from a SUIT_Component_Identifier.
-static teep_error_code_t GetFilenameFromSuitComponentIdentifier(_Out_ filesystem::path& filename, QCBORDecodeContext* context, QCBORItem* item, ostream& errorMessage)
-{
-    if (item->uDataType != QCBOR_TYPE_ARRAY) {
-        REPORT_TYPE_ERROR(errorMessage, "suit-manifest-component-id", QCBOR_TYPE_ARRAY, *item);
+    if (item->uDataType == QCBOR_TYPE_ARRAY && item->val.uCount < 1) {
+        componentId.clear();
         return TEEP_ERR_MANIFEST_PROCESSING_FAILED;
     }
-
-    // Get array size.
-    uint16_t componentIdEntryCount = item->val.uCount;
-    if (componentIdEntryCount < 1) {
+    if (TeepParseComponentId(context, item, componentId, errorMessage) != TEEP_ERR_SUCCESS) {
         return TEEP_ERR_MANIFEST_PROCESSING_FAILED;
     }
-
-    for (uint16_t i = 0; i < componentIdEntryCount; i++) {
-        // Read bstr from component id array.
-        QCBORDecode_GetNext(context, item);
-        if (item->uDataType != QCBOR_TYPE_BYTE_STRING) {
-            REPORT_TYPE_ERROR(errorMessage, "component-id", QCBOR_TYPE_BYTE_STRING, *item);
-            return TEEP_ERR_MANIFEST_PROCESSING_FAILED;
-        }
-    }
-
-    // Return the last bstr as the suffix.
-    TeepAgentMakeManifestFilename(filename, (const char*)item->val.string.ptr, item->val.string.len);
     return TEEP_ERR_SUCCESS;
 }
 
-// Construct a filename from a SUIT_Common.
-static teep_error_code_t GetFilenameFromSuitCommon(_Out_ filesystem::path& filename, UsefulBufC encoded, std::ostream& errorMessage)
+// Get the first component ID in a SUIT_Common.
+static teep_error_code_t GetComponentIdFromSuitCommon(_Out_ std::string& componentId, UsefulBufC encoded, std::ostream& errorMessage)
 {
     teep_error_code_t errorCode = TEEP_ERR_PERMANENT_ERROR;
     QCBORDecodeContext context;
@@ -105,7 +52,7 @@ static teep_error_code_t GetFilenameFromSuitCommon(_Out_ filesystem::path& filen
 
             // Get first array entry.
             QCBORDecode_GetNext(&context, &item);
-            errorCode = GetFilenameFromSuitComponentIdentifier(filename, &context, &item, errorMessage);
+            errorCode = GetSuitComponentIdentifier(componentId, &context, &item, errorMessage);
             break;
         }
     }
@@ -113,8 +60,8 @@ static teep_error_code_t GetFilenameFromSuitCommon(_Out_ filesystem::path& filen
     return errorCode;
 }
 
-// Construct a filename from a SUIT_Manifest.
-static teep_error_code_t GetFilenameFromSuitManifest(_Out_ filesystem::path& filename, UsefulBufC encoded, std::ostream& errorMessage)
+// Get the component ID of a SUIT_Manifest.
+static teep_error_code_t GetComponentIdFromSuitManifest(_Out_ std::string& componentId, UsefulBufC encoded, std::ostream& errorMessage)
 {
     teep_error_code_t errorCode = TEEP_ERR_PERMANENT_ERROR;
     QCBORDecodeContext context;
@@ -131,13 +78,13 @@ static teep_error_code_t GetFilenameFromSuitManifest(_Out_ filesystem::path& fil
                 if (item.uDataType != QCBOR_TYPE_BYTE_STRING) {
                     break;
                 }
-                errorCode = GetFilenameFromSuitCommon(filename, item.val.string, errorMessage);
+                errorCode = GetComponentIdFromSuitCommon(componentId, item.val.string, errorMessage);
 
                 // Keep going in case we actually find a manifest component ID.
                 continue;
             }
             if (label == SUIT_MANIFEST_LABEL_COMPONENT_ID) {
-                errorCode = GetFilenameFromSuitComponentIdentifier(filename, &context, &item, errorMessage);
+                errorCode = GetSuitComponentIdentifier(componentId, &context, &item, errorMessage);
                 break;
             }
         }
@@ -146,12 +93,12 @@ static teep_error_code_t GetFilenameFromSuitManifest(_Out_ filesystem::path& fil
     return errorCode;
 }
 
-// Construct a filename from a SUIT_Envelope.
-static teep_error_code_t GetFilenameFromSuitEnvelope(_Out_ filesystem::path& filename, UsefulBufC encoded, std::ostream& errorMessage)
+teep_error_code_t SuitGetComponentId(UsefulBufC envelope, _Out_ std::string& componentId, std::ostream& errorMessage)
 {
+    componentId.clear();
     teep_error_code_t errorCode = TEEP_ERR_PERMANENT_ERROR;
     QCBORDecodeContext context;
-    QCBORDecode_Init(&context, encoded, QCBOR_DECODE_MODE_NORMAL);
+    QCBORDecode_Init(&context, envelope, QCBOR_DECODE_MODE_NORMAL);
 
     QCBORItem item;
     QCBORDecode_GetNext(&context, &item);
@@ -160,25 +107,11 @@ static teep_error_code_t GetFilenameFromSuitEnvelope(_Out_ filesystem::path& fil
         for (size_t entryIndex = 0; entryIndex < entryCount; entryIndex++) {
             QCBORDecode_GetNext(&context, &item);
             suit_envelope_label_t label = (suit_envelope_label_t)item.label.int64;
-            if (label == SUIT_ENVELOPE_LABEL_AUTHENTICATION_WRAPPER) {
-                if (item.uDataType != QCBOR_TYPE_BYTE_STRING) {
-                    break;
-                }
-                errorCode = GetFilenameFromSuitAuthentication(filename, item.val.string);
-                if (errorCode == TEEP_ERR_SUCCESS) {
-                    break;
-                }
-                continue;
-            }
             if (label == SUIT_ENVELOPE_LABEL_MANIFEST) {
-                if (item.uDataType != QCBOR_TYPE_BYTE_STRING) {
-                    break;
+                if (item.uDataType == QCBOR_TYPE_BYTE_STRING) {
+                    errorCode = GetComponentIdFromSuitManifest(componentId, item.val.string, errorMessage);
                 }
-                errorCode = GetFilenameFromSuitManifest(filename, item.val.string, errorMessage);
-                if (errorCode == TEEP_ERR_SUCCESS) {
-                    break;
-                }
-                continue;
+                break;
             }
         }
     }
@@ -186,6 +119,81 @@ static teep_error_code_t GetFilenameFromSuitEnvelope(_Out_ filesystem::path& fil
     return errorCode;
 }
 
+// Skip over the contents of an item that has already been read,
+// if it is an array or map.
+static QCBORError SkipNestedItems(_Inout_ QCBORDecodeContext* context, _In_ const QCBORItem* item)
+{
+    QCBORItem next = *item;
+    while (next.uNextNestLevel > item->uNestingLevel) {
+        QCBORError err = QCBORDecode_GetNext(context, &next);
+        if (err != QCBOR_SUCCESS) {
+            return err;
+        }
+    }
+    return QCBOR_SUCCESS;
+}
+
+// Get the sequence number from a SUIT_Manifest.
+static teep_error_code_t GetSequenceNumberFromSuitManifest(UsefulBufC encoded, _Out_ uint64_t* sequenceNumber)
+{
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, encoded, QCBOR_DECODE_MODE_NORMAL);
+
+    QCBORItem item;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS || item.uDataType != QCBOR_TYPE_MAP) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    uint16_t entryCount = item.val.uCount;
+    for (uint16_t entryIndex = 0; entryIndex < entryCount; entryIndex++) {
+        if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        if (item.uLabelType == QCBOR_TYPE_INT64 && item.label.int64 == SUIT_MANIFEST_LABEL_SEQUENCE_NUMBER) {
+            if (item.uDataType == QCBOR_TYPE_UINT64) {
+                *sequenceNumber = item.val.uint64;
+                return TEEP_ERR_SUCCESS;
+            }
+            if (item.uDataType == QCBOR_TYPE_INT64 && item.val.int64 >= 0) {
+                *sequenceNumber = (uint64_t)item.val.int64;
+                return TEEP_ERR_SUCCESS;
+            }
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        if (SkipNestedItems(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+    }
+    return TEEP_ERR_PERMANENT_ERROR;
+}
+
+teep_error_code_t SuitGetManifestSequenceNumber(UsefulBufC envelope, _Out_ uint64_t* sequenceNumber)
+{
+    *sequenceNumber = 0;
+
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, envelope, QCBOR_DECODE_MODE_NORMAL);
+
+    QCBORItem item;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS || item.uDataType != QCBOR_TYPE_MAP) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    uint16_t entryCount = item.val.uCount;
+    for (uint16_t entryIndex = 0; entryIndex < entryCount; entryIndex++) {
+        if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        if (item.uLabelType == QCBOR_TYPE_INT64 &&
+            item.label.int64 == SUIT_ENVELOPE_LABEL_MANIFEST &&
+            item.uDataType == QCBOR_TYPE_BYTE_STRING) {
+            return GetSequenceNumberFromSuitManifest(item.val.string, sequenceNumber);
+        }
+        if (SkipNestedItems(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+    }
+    return TEEP_ERR_PERMANENT_ERROR;
+}
+
 #if 0
 // TODO(issue #7): implement SUIT processing.
 // Parse a SUIT_Common out of a decode context and try to install it.
@@ -299,8 +307,11 @@ static teep_error_code_t TryProcessSuitManifest(_Inout_ filesystem::path& filena
 #endif
             break;
         case SUIT_MANIFEST_LABEL_COMPONENT_ID:
-            errorCode = GetFilenameFromSuitComponentIdentifier(filename, &context, &item, errorMessage);
+        {
+            std::string componentId;
+            errorCode = GetSuitComponentIdentifier(componentId, &context, &item, errorMessage);
             break;
+        }
         default:
             errorCode = TEEP_ERR_PERMANENT_ERROR;
         }
@@ -311,11 +322,18 @@ static teep_error_code_t TryProcessSuitManifest(_Inout_ filesystem::path& filena
 }
 
 // Parse a SUIT_Envelope out of a decode context and try to install it.
-teep_error_code_t TryProcessSuitEnvelope(UsefulBufC encoded, std::ostream& errorMessage)
+teep_error_code_t TryProcessSuitEnvelope(
+    UsefulBufC encoded,
+    _Out_ std::string& componentId,
+    _Out_ filesystem::path& filename,
+    std::ostream& errorMessage)
 {
-    // Try to extract a filename out of the SUIT envelope.
-    filesystem::path filename;
-    teep_error_code_t errorCode = GetFilenameFromSuitEnvelope(filename, encoded, errorMessage);
+    // The manifest is saved under the component ID it is for.
+    teep_error_code_t errorCode = SuitGetComponentId(encoded, componentId, errorMessage);
+    if (errorCode != TEEP_ERR_SUCCESS) {
+        return errorCode;
+    }
+    errorCode = TeepAgentMakeManifestFilename(filename, { componentId.data(), componentId.size() });
     if (errorCode != TEEP_ERR_SUCCESS) {
         return errorCode;
     }
@@ -364,11 +382,18 @@ teep_error_code_t TryProcessSuitEnvelope(UsefulBufC encoded, std::ostream& error
     return errorCode;
 }
 
-teep_error_code_t SuitUninstallComponent(UsefulBufC componentId)
+teep_error_code_t SuitUninstallComponent(UsefulBufC componentId, std::ostream& errorMessage)
 {
-    // TODO(issue #7): SUIT manifest support
+    // Manifests are saved under their component ID, so derive the
+    // filename the same way installing it did.
+    TEEP_UNUSED(errorMessage);
     filesystem::path filename;
-    TeepAgentMakeManifestFilename(filename, (const char*)componentId.ptr, componentId.len);
+    teep_error_code_t errorCode = TeepAgentMakeManifestFilename(filename, componentId);
+    if (errorCode != TEEP_ERR_SUCCESS) {
+        return errorCode;
+    }
+
+    // TODO(issue #7): SUIT manifest support
     _unlink(filename.string().c_str());
     return TEEP_ERR_SUCCESS;
 }
\ No newline at end of file
@@ -3,11 +3,31 @@
 #pragma once
 #include <filesystem>
 #include <ostream>
+#include <string>
 using namespace std;
 #ifdef TEEP_USE_TEE
 using namespace std::__fs;
 #endif
 
-teep_error_code_t TryProcessSuitEnvelope(UsefulBufC encoded, std::ostream& errorMessage);
-void TeepAgentMakeManifestFilename(_Out_ filesystem::path& filename, _In_reads_(buffer_len) const char* buffer, size_t buffer_len);
-teep_error_code_t SuitUninstallComponent(UsefulBufC componentId);
\ No newline at end of file
+// Install a SUIT_Envelope, saving it under filename, which is named for
+// the component ID it is for.
+teep_error_code_t TryProcessSuitEnvelope(
+    UsefulBufC encoded,
+    _Out_ std::string& componentId,
+    _Out_ filesystem::path& filename,
+    std::ostream& errorMessage);
+
+// Get the component ID of a SUIT_Envelope, in canonical form, which is the
+// ID of its first component.
+teep_error_code_t SuitGetComponentId(UsefulBufC envelope, _Out_ std::string& componentId, std::ostream& errorMessage);
+
+// Get the suit-manifest-sequence-number from a SUIT_Envelope.
+teep_error_code_t SuitGetManifestSequenceNumber(UsefulBufC envelope, _Out_ uint64_t* sequenceNumber);
+
+// Get the path of the manifest saved for a component ID in canonical form
+// (see TeepGetManifestFilename()).
+teep_error_code_t TeepAgentMakeManifestFilename(_Out_ filesystem::path& filename, UsefulBufC componentId);
+
+// Remove the manifest saved for a component, given its
+// SUIT_Component_Identifier in canonical form.
+teep_error_code_t SuitUninstallComponent(UsefulBufC componentId, std::ostream& errorMessage);
\ No newline at end of file
@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: MIT
 
 #include <dirent.h>
+#include <mutex>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,8 @@
 #include <string.h>
 #include <string.h>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include "TrustedComponent.h"
 #include "teep_protocol.h"
 #include "TeepAgentLib.h"
@@ -22,6 +25,8 @@
 #include "TeepDeviceEcallHandler.h"
 #include "SuitParser.h"
 #include "AgentKeys.h"
+#include "CryptoProvider.h"
+#include "SessionKey.h"
 
 static teep_error_code_t TeepAgentComposeError(UsefulBufC token, teep_error_code_t errorCode, const std::string& errorMessage, UsefulBufC* encoded);
 
@@ -34,6 +39,56 @@ TrustedComponent* g_InstalledComponentList = nullptr;
 // List of unneeded Trusted Components.
 TrustedComponent* g_UnneededComponentList = nullptr;
 
+// State the agent keeps for each session with a TAM.
+struct TeepAgentTamSession
+{
+    // COSE key ID of the TAM key that signed the last signed message.
+    std::string TamKeyId;
+};
+
+static std::unordered_map<void*, TeepAgentTamSession> g_TamSessions;
+
+// In session mode, the key agreed with each TAM, by the COSE key ID of the
+// TAM key.  A session key belongs to the TAM it was agreed with, not to a
+// transport session, so it is used wherever that TAM is next reached.
+static std::unordered_map<std::string, std::shared_ptr<const TeepSessionKey>> g_TamSessionKeys;
+static std::mutex g_TamSessionsLock;
+
+// Get the session key agreed with the TAM of a session, if any.
+static std::shared_ptr<const TeepSessionKey> TeepAgentGetSessionKey(_In_ void* sessionHandle)
+{
+    std::lock_guard<std::mutex> lock(g_TamSessionsLock);
+    auto session = g_TamSessions.find(sessionHandle);
+    if (session == g_TamSessions.end()) {
+        return nullptr;
+    }
+    auto it = g_TamSessionKeys.find(session->second.TamKeyId);
+    return (it != g_TamSessionKeys.end()) ? it->second : nullptr;
+}
+
+// Set the session key agreed with the TAM of a session, or forget it if
+// sessionKey is nullptr.
+static void TeepAgentSetSessionKey(_In_ void* sessionHandle, _In_ const std::shared_ptr<const TeepSessionKey>& sessionKey)
+{
+    std::lock_guard<std::mutex> lock(g_TamSessionsLock);
+    auto session = g_TamSessions.find(sessionHandle);
+    if (session == g_TamSessions.end()) {
+        return;
+    }
+    if (sessionKey) {
+        g_TamSessionKeys[session->second.TamKeyId] = sessionKey;
+    } else {
+        g_TamSessionKeys.erase(session->second.TamKeyId);
+    }
+}
+
+// Record the TAM key that signed a message.
+static void TeepAgentSetTamKeyId(_In_ void* sessionHandle, _In_ const std::string& keyId)
+{
+    std::lock_guard<std::mutex> lock(g_TamSessionsLock);
+    g_TamSessions[sessionHandle].TamKeyId = keyId;
+}
+
 teep_error_code_t
 TeepAgentSignMessage(
     _In_ const UsefulBufC* unsignedMessage,
@@ -50,7 +105,9 @@ TeepAgentSignMessage(
 // Process a transport error.
 teep_error_code_t TeepAgentProcessError(_In_ void* sessionHandle)
 {
-    (void)sessionHandle;
+    // The TAM may not know our session key any more, so agree on a new one
+    // in the next exchange rather than being turned away until it expires.
+    TeepAgentSetSessionKey(sessionHandle, nullptr);
 
     return TEEP_ERR_TEMPORARY_ERROR;
 }
@@ -81,32 +138,70 @@ teep_error_code_t TeepAgentRequestPolicyCheck(_In_z_ const char* tamUri)
     return err;
 }
 
-static void AddComponentIdToMap(_Inout_ QCBOREncodeContext* context, _In_ TrustedComponent* tc)
+static _Ret_maybenull_ TrustedComponent* FindComponentInList(_In_opt_ TrustedComponent* head, teep_component_handle_t handle)
 {
-    QCBOREncode_OpenArrayInMapN(context, TEEP_LABEL_COMPONENT_ID);
-    {
-        UsefulBuf tc_id = UsefulBuf_FROM_BYTE_ARRAY(tc->ID.b);
-        QCBOREncode_AddBytes(context, UsefulBuf_Const(tc_id));
+    for (TrustedComponent* ta = head; ta != nullptr; ta = ta->Next) {
+        if (ta->Handle == handle) {
+            return ta;
+        }
+    }
+    return nullptr;
+}
+
+// Add a component to the installed list, or update its entry, given its
+// component ID in canonical form and its manifest.
+static teep_error_code_t TeepAgentAddInstalledComponent(UsefulBufC componentId, UsefulBufC manifest)
+{
+    TrustedComponent* tc = FindComponentInList(g_InstalledComponentList, TeepComponentIdTable::Find(componentId));
+    if (tc == nullptr) {
+        tc = new TrustedComponent(componentId);
+        tc->Next = g_InstalledComponentList;
+        g_InstalledComponentList = tc;
+    }
+
+    // A component whose sequence number cannot be read is reported without
+    // one, which the TAM takes to mean it is current.
+    tc->HaveManifestSequenceNumber = (SuitGetManifestSequenceNumber(manifest, &tc->ManifestSequenceNumber) == TEEP_ERR_SUCCESS);
+    return TEEP_ERR_SUCCESS;
+}
+
+static void RemoveComponentFromList(_Inout_ TrustedComponent** componentList, teep_component_handle_t handle)
+{
+    for (TrustedComponent** link = componentList; *link != nullptr; link = &(*link)->Next) {
+        TrustedComponent* tc = *link;
+        if (tc->Handle == handle) {
+            *link = tc->Next;
+            delete tc;
+            return;
+        }
     }
-    QCBOREncode_CloseArray(context);
 }
 
-// Parse QueryRequest and compose QueryResponse.
-static teep_error_code_t TeepAgentComposeQueryResponse(_Inout_ QCBORDecodeContext* decodeContext, _Out_ UsefulBufC* encodedResponse, _Out_ UsefulBufC* errorResponse)
+static void AddComponentIdToMap(_Inout_ QCBOREncodeContext* context, _In_ TrustedComponent* tc)
+{
+    // The component ID table holds the ID already encoded.
+    QCBOREncode_AddEncodedToMapN(context, TEEP_LABEL_COMPONENT_ID, TeepComponentIdTable::GetEncoded(tc->Handle));
+}
+
+// Parse QueryRequest and encode QueryResponse into a buffer.  With a NULL
+// buffer pointer this just computes the size of the QueryResponse.  If the
+// QueryRequest carries a session key share, it is returned in tamShare and
+// our own share, if any, is added to the QueryResponse.
+static teep_error_code_t TeepAgentEncodeQueryResponse(
+    _Inout_ QCBORDecodeContext* decodeContext,
+    UsefulBufC agentShare,
+    UsefulBuf buffer,
+    _Out_ UsefulBufC* tamShare,
+    _Out_ UsefulBufC* encodedResponse,
+    _Out_ UsefulBufC* errorResponse)
 {
     UsefulBufC challenge = NULLUsefulBufC;
+    *tamShare = NULLUsefulBufC;
     *encodedResponse = NULLUsefulBufC;
     UsefulBufC errorToken = NULLUsefulBufC;
     std::ostringstream errorMessage;
 
-    size_t maxBufferLength = 4096;
-    char* rawBuffer = (char*)malloc(maxBufferLength);
-    if (rawBuffer == nullptr) {
-        return TeepAgentComposeError(errorToken, TEEP_ERR_TEMPORARY_ERROR, "Out of memory", errorResponse);
-    }
-
     QCBOREncodeContext context;
-    UsefulBuf buffer{ rawBuffer, maxBufferLength };
     QCBOREncode_Init(&context, buffer);
 
     QCBOREncode_OpenArray(&context);
@@ -195,12 +290,31 @@ static teep_error_code_t TeepAgentComposeQueryResponse(_Inout_ QCBORDecodeContex
                     }
                     break;
                 }
+                case TEEP_LABEL_SESSION_KEY_SHARE:
+                    if (item.uDataType != QCBOR_TYPE_BYTE_STRING) {
+                        REPORT_TYPE_ERROR(errorMessage, "session-key-share", QCBOR_TYPE_BYTE_STRING, item);
+                        return TeepAgentComposeError(errorToken, TEEP_ERR_PERMANENT_ERROR, errorMessage.str(), errorResponse);
+                    }
+                    *tamShare = item.val.string;
+                    break;
                 }
             }
 
-            // Parse the supported-teep-cipher-suites.
+            // Answer a session key share with ours.
+            if (tamShare->len > 0 && agentShare.len > 0) {
+                QCBOREncode_AddBytesToMapN(&context, TEEP_LABEL_SESSION_KEY_SHARE, agentShare);
+            }
+
+            // Parse the supported-teep-cipher-suites.  The agent can only
+            // use a suite that signs with the kind of its own key, and
+            // prefers EdDSA, which is cheaper to sign and verify, when the
+            // TAM offers both.
             {
-                bool found = false;
+                struct t_cose_key agentKeyPair;
+                teep_signature_kind_t agentKeyKind;
+                TeepAgentGetSigningKeyPair(&agentKeyPair, &agentKeyKind);
+                bool es256Offered = false;
+                bool eddsaOffered = false;
                 QCBORDecode_GetNext(decodeContext, &item);
                 if (item.uDataType != QCBOR_TYPE_ARRAY) {
                     REPORT_TYPE_ERROR(errorMessage, "supported-teep-cipher-suites", QCBOR_TYPE_ARRAY, item);
@@ -235,24 +349,33 @@ static teep_error_code_t TeepAgentComposeQueryResponse(_Inout_ QCBORDecodeContex
                             return TeepAgentComposeError(errorToken, TEEP_ERR_PERMANENT_ERROR, errorMessage.str(), errorResponse);
                         }
                         int64_t coseAlgorithm = item.val.int64;
-                        if (coseType == CBOR_TAG_COSE_SIGN1 &&
-                            coseAlgorithm == T_COSE_ALGORITHM_ES256) {
-                            found = true;
+                        if (coseType == CBOR_TAG_COSE_SIGN1 && operationCount == 1) {
+                            if (coseAlgorithm == T_COSE_ALGORITHM_ES256) {
+                                es256Offered = true;
+                            } else if (coseAlgorithm == T_COSE_ALGORITHM_EDDSA) {
+                                eddsaOffered = true;
+                            }
                         }
                     }
                 }
-                if (!found) {
-                    // TODO: include teep-cipher-suite-sign1-es256 or eddsa depending on configuration.
-                    return TEEP_ERR_UNSUPPORTED_CIPHER_SUITES;
+                int64_t selectedAlgorithm;
+                if (eddsaOffered && agentKeyKind == TEEP_SIGNATURE_EDDSA) {
+                    selectedAlgorithm = T_COSE_ALGORITHM_EDDSA;
+                } else if (es256Offered && agentKeyKind == TEEP_SIGNATURE_ES256) {
+                    selectedAlgorithm = T_COSE_ALGORITHM_ES256;
+                } else {
+                    errorMessage << "No cipher suite in common, TEEP Agent only supports sign1-"
+                                 << ((agentKeyKind == TEEP_SIGNATURE_EDDSA) ? "eddsa" : "es256") << std::endl;
+                    return TeepAgentComposeError(errorToken, TEEP_ERR_UNSUPPORTED_CIPHER_SUITES, errorMessage.str(), errorResponse);
                 }
                 // Add selected-cipher-suite to the QueryResponse.
                 QCBOREncode_OpenArrayInMapN(&context, TEEP_LABEL_SELECTED_CIPHER_SUITE);
                 {
-                    // Add teep-operation-sign1-es256.
+                    // Add teep-operation-sign1-es256 or teep-operation-sign1-eddsa.
                     QCBOREncode_OpenArray(&context);
                     {
                         QCBOREncode_AddInt64(&context, CBOR_TAG_COSE_SIGN1);
-                        QCBOREncode_AddInt64(&context, T_COSE_ALGORITHM_ES256);
+                        QCBOREncode_AddInt64(&context, selectedAlgorithm);
                     }
                     QCBOREncode_CloseArray(&context);
                 }
@@ -321,6 +444,9 @@ static teep_error_code_t TeepAgentComposeQueryResponse(_Inout_ QCBORDecodeContex
                         QCBOREncode_OpenMap(&context);
                         {
                             AddComponentIdToMap(&context, ta);
+                            if (ta->HaveManifestSequenceNumber) {
+                                QCBOREncode_AddUInt64ToMapN(&context, TEEP_LABEL_TC_MANIFEST_SEQUENCE_NUMBER, ta->ManifestSequenceNumber);
+                            }
                         }
                         QCBOREncode_CloseMap(&context);
                     }
@@ -358,12 +484,7 @@ static teep_error_code_t TeepAgentComposeQueryResponse(_Inout_ QCBORDecodeContex
                 QCBOREncode_OpenArrayInMapN(&context, TEEP_LABEL_UNNEEDED_MANIFEST_LIST);
                 {
                     for (TrustedComponent* tc = g_UnneededComponentList; tc != nullptr; tc = tc->Next) {
-                        QCBOREncode_OpenArray(&context);
-                        {
-                            UsefulBuf tc_id = UsefulBuf_FROM_BYTE_ARRAY(tc->ID.b);
-                            QCBOREncode_AddBytes(&context, UsefulBuf_Const(tc_id));
-                        }
-                        QCBOREncode_CloseArray(&context);
+                        QCBOREncode_AddEncoded(&context, TeepComponentIdTable::GetEncoded(tc->Handle));
                     }
                 }
                 QCBOREncode_CloseArray(&context);
@@ -383,22 +504,80 @@ static teep_error_code_t TeepAgentComposeQueryResponse(_Inout_ QCBORDecodeContex
     return TEEP_ERR_SUCCESS;
 }
 
+// Parse QueryRequest and compose QueryResponse.  The QueryRequest is parsed
+// twice, first from a new decode context over the encoded message to
+// compute the size of the QueryResponse, and then from decodeContext to
+// encode it into a buffer of exactly that size, so there is no limit on
+// the number of components reported.
+static teep_error_code_t TeepAgentComposeQueryResponse(
+    UsefulBufC encodedRequest,
+    _Inout_ QCBORDecodeContext* decodeContext,
+    UsefulBufC agentShare,
+    _Out_ UsefulBufC* tamShare,
+    _Out_ UsefulBufC* encodedResponse,
+    _Out_ UsefulBufC* errorResponse)
+{
+    *encodedResponse = NULLUsefulBufC;
+    *errorResponse = NULLUsefulBufC;
+
+    // Decode contexts cannot be copied, so start a new one and skip to
+    // where decodeContext is, just after the TYPE the caller checked.
+    QCBORDecodeContext sizingContext;
+    QCBORItem item;
+    QCBORDecode_Init(&sizingContext, encodedRequest, QCBOR_DECODE_MODE_NORMAL);
+    QCBORDecode_GetNext(&sizingContext, &item);
+    QCBORDecode_GetNext(&sizingContext, &item);
+    UsefulBufC sized;
+    teep_error_code_t result = TeepAgentEncodeQueryResponse(&sizingContext, agentShare, SizeCalculateUsefulBuf, tamShare, &sized, errorResponse);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+
+    char* rawBuffer = (char*)malloc(sized.len);
+    if (rawBuffer == nullptr) {
+        return TeepAgentComposeError(NULLUsefulBufC, TEEP_ERR_TEMPORARY_ERROR, "Out of memory", errorResponse);
+    }
+    result = TeepAgentEncodeQueryResponse(decodeContext, agentShare, { rawBuffer, sized.len }, tamShare, encodedResponse, errorResponse);
+    if (result != TEEP_ERR_SUCCESS) {
+        free(rawBuffer);
+        *encodedResponse = NULLUsefulBufC;
+    }
+    return result;
+}
+
+// Send a message, MACed with a session key if one is given and otherwise
+// signed.
 static teep_error_code_t TeepAgentSendMessage(
     _In_ void* sessionHandle,
     _In_z_ const char* mediaType,
-    _In_ const UsefulBufC* unsignedMessage)
+    _In_ const UsefulBufC* unsignedMessage,
+    _In_opt_ const TeepSessionKey* sessionKey)
 {
 #ifdef TEEP_USE_COSE
-    UsefulBufC signedMessage;
-    Q_USEFUL_BUF_MAKE_STACK_UB(signed_cose_buffer, 1000);
-    teep_error_code_t error = TeepAgentSignMessage(unsignedMessage, signed_cose_buffer, &signedMessage);
+    // The payload is referenced rather than copied while it is protected.
+    TeepOutboundMessage payload;
+    payload.AppendReference(*unsignedMessage, nullptr);
+    TeepOutboundMessage signedMessage;
+    teep_error_code_t error;
+    if (sessionKey != nullptr) {
+        error = teep_mac0_outbound_message(*sessionKey, std::move(payload), signedMessage);
+    } else {
+        struct t_cose_key key_pair;
+        teep_signature_kind_t signatureKind;
+        TeepAgentGetSigningKeyPair(&key_pair, &signatureKind);
+        error = teep_sign1_outbound_message(&key_pair, signatureKind, std::move(payload), signedMessage);
+    }
     if (error != TEEP_ERR_SUCCESS) {
         return error;
     }
 
-    const char* output_buffer = (const char*)signedMessage.ptr;
-    size_t output_buffer_length = signedMessage.len;
+    // The transport takes one buffer.
+    std::vector<uint8_t> signedBuffer;
+    signedMessage.Flatten(signedBuffer);
+    const char* output_buffer = (const char*)signedBuffer.data();
+    size_t output_buffer_length = signedBuffer.size();
 #else
+    TEEP_UNUSED(sessionKey);
     const char* output_buffer = (const char*)unsignedMessage->ptr;
     size_t output_buffer_length = unsignedMessage->len;
 #endif
@@ -507,7 +686,7 @@ static void TeepAgentSendError(UsefulBufC reply, void* sessionHandle)
 
     HexPrintBuffer("Sending CBOR message: ", reply.ptr, reply.len);
 
-    (void)TeepAgentSendMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, &reply);
+    (void)TeepAgentSendMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, &reply, nullptr);
     free((void*)reply.ptr);
 }
 
@@ -525,16 +704,48 @@ static teep_error_code_t TeepAgentHandleInvalidMessage(_In_ void* sessionHandle,
     return TEEP_ERR_PERMANENT_ERROR;
 }
 
-static teep_error_code_t TeepAgentHandleQueryRequest(void* sessionHandle, QCBORDecodeContext* context)
+static teep_error_code_t TeepAgentHandleQueryRequest(void* sessionHandle, UsefulBufC encoded, QCBORDecodeContext* context)
 {
     TeepLogMessage("TeepAgentHandleQueryRequest\n");
 
+    // In session mode, a session key agreed with this TAM before is used to
+    // MAC the QueryResponse, which proves to the TAM that this is the device
+    // it agreed the key with.  Without one, answer the QueryRequest's key
+    // share so that later exchanges can be MACed.
+    std::shared_ptr<const TeepSessionKey> replyKey;
+    if (teep_get_session_key_lifetime() > 0) {
+        replyKey = TeepAgentGetSessionKey(sessionHandle);
+        if (replyKey && !replyKey->CanSend()) {
+            replyKey.reset();
+        }
+    }
+    struct t_cose_key agreementKey = {};
+    std::vector<uint8_t> agentShare;
+    if (teep_get_session_key_lifetime() > 0 && !replyKey) {
+        if (TeepSessionKey::GenerateAgreementKey(&agreementKey, agentShare) != TEEP_ERR_SUCCESS) {
+            TeepLogMessage("Could not generate a session key share\n");
+        }
+    }
+
     /* Compose a raw response. */
+    UsefulBufC tamShare;
     UsefulBufC queryResponse;
     UsefulBufC errorResponse;
-    teep_error_code_t errorCode = TeepAgentComposeQueryResponse(context, &queryResponse, &errorResponse);
+    teep_error_code_t errorCode = TeepAgentComposeQueryResponse(encoded, context, { agentShare.data(), agentShare.size() }, &tamShare, &queryResponse, &errorResponse);
+    if (errorCode == TEEP_ERR_SUCCESS && queryResponse.len > 0 && tamShare.len > 0 && !agentShare.empty()) {
+        // The TAM derives the same key once it has verified the QueryResponse.
+        std::shared_ptr<const TeepSessionKey> sessionKey;
+        errorCode = TeepSessionKey::Derive(&agreementKey, tamShare, queryResponse, sessionKey);
+        if (errorCode == TEEP_ERR_SUCCESS) {
+            TeepAgentSetSessionKey(sessionHandle, sessionKey);
+        }
+    }
+    if (!agentShare.empty()) {
+        teep_get_crypto_provider()->free_key(&agreementKey);
+    }
     if (errorCode != TEEP_ERR_SUCCESS) {
         TeepAgentSendError(errorResponse, sessionHandle);
+        free((void*)queryResponse.ptr);
         return errorCode;
     }
     if (queryResponse.len == 0) {
@@ -545,47 +756,46 @@ static teep_error_code_t TeepAgentHandleQueryRequest(void* sessionHandle, QCBORD
 
     TeepLogMessage("Sending QueryResponse...\n");
 
-    errorCode = TeepAgentSendMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, &queryResponse);
+    // The QueryResponse carries the attestation evidence, so it is signed
+    // unless it is MACed with a key that was bound to an earlier attested
+    // exchange.
+    errorCode = TeepAgentSendMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, &queryResponse, replyKey.get());
     free((void*)queryResponse.ptr);
+    if (errorCode != TEEP_ERR_SUCCESS && replyKey) {
+        // The TAM may not know the key any more.
+        TeepAgentSetSessionKey(sessionHandle, nullptr);
+    }
     return errorCode;
 }
 
+// Parse a component ID and get its handle, which is TEEP_NO_COMPONENT_HANDLE
+// if it has never been interned, and so is not any component we know of.
+// encoded is scratch space that can be reused across calls.
 static teep_error_code_t TeepAgentParseComponentId(
     _Inout_ QCBORDecodeContext* context,
     _In_ const QCBORItem* arrayItem,
-    _Out_ UsefulBufC* componentId,
+    _Inout_ std::string& encoded,
+    _Out_ teep_component_handle_t* componentHandle,
     _Out_ std::ostringstream& errorMessage)
 {
-    if (arrayItem->uDataType != QCBOR_TYPE_ARRAY) {
-        REPORT_TYPE_ERROR(errorMessage, "component-id", QCBOR_TYPE_ARRAY, *arrayItem);
-        return TEEP_ERR_PERMANENT_ERROR;
+    *componentHandle = TEEP_NO_COMPONENT_HANDLE;
+    teep_error_code_t result = TeepParseComponentId(context, arrayItem, encoded, errorMessage);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
     }
 
-    // Get array size.
-    uint16_t componentIdEntryCount = arrayItem->val.uCount;
-    if (componentIdEntryCount != 1) {
-        // TODO: support more general component ids.
-        return TEEP_ERR_PERMANENT_ERROR;
-    }
-
-    // Read bstr from component id array.
-    QCBORItem item;
-    QCBORDecode_GetNext(context, &item);
-
-    if (item.uDataType != QCBOR_TYPE_BYTE_STRING) {
-        REPORT_TYPE_ERROR(errorMessage, "component-id", QCBOR_TYPE_BYTE_STRING, item);
-        return TEEP_ERR_PERMANENT_ERROR;
-    }
-
-    *componentId = item.val.string;
+    // Only look the ID up, since interning IDs from the TAM would let it
+    // grow the table without bound.
+    *componentHandle = TeepComponentIdTable::Find({ encoded.data(), encoded.size() });
     return TEEP_ERR_SUCCESS;
 }
 
-static teep_error_code_t TeepAgentHandleUpdate(void* sessionHandle, QCBORDecodeContext* context)
+static teep_error_code_t TeepAgentHandleUpdate(void* sessionHandle, QCBORDecodeContext* context, _In_opt_ const TeepSessionKey* inboundKey)
 {
     TeepLogMessage("TeepAgentHandleUpdate\n");
 
     std::ostringstream errorMessage;
+    std::string componentId; // Scratch space for parsing component IDs.
     QCBORItem item;
     UsefulBufC token = NULLUsefulBufC;
     teep_error_code_t teep_error = TEEP_ERR_SUCCESS;
@@ -631,17 +841,18 @@ static teep_error_code_t TeepAgentHandleUpdate(void* sessionHandle, QCBORDecodeC
 #endif
             for (int arrayEntryIndex = 0; arrayEntryIndex < arrayEntryCount; arrayEntryIndex++) {
                 QCBORDecode_GetNext(context, &item);
-                UsefulBufC componentId;
-                teep_error = TeepAgentParseComponentId(context, &item, &componentId, errorMessage);
+                teep_component_handle_t componentHandle;
+                teep_error = TeepAgentParseComponentId(context, &item, componentId, &componentHandle, errorMessage);
                 if (teep_error != TEEP_ERR_SUCCESS) {
                     teep_error = TeepAgentComposeError(token, TEEP_ERR_PERMANENT_ERROR, errorMessage.str(), &errorResponse);
                     TeepAgentSendError(errorResponse, sessionHandle);
                     return teep_error;
                 }
-                errorCode = SuitUninstallComponent(componentId);
+                errorCode = SuitUninstallComponent({ componentId.data(), componentId.size() }, errorMessage);
                 if (errorCode != TEEP_ERR_SUCCESS) {
                     break;
                 }
+                RemoveComponentFromList(&g_InstalledComponentList, componentHandle);
             }
             break;
         }
@@ -667,10 +878,16 @@ static teep_error_code_t TeepAgentHandleUpdate(void* sessionHandle, QCBORDecodeC
                 }
                 if (errorCode == TEEP_ERR_SUCCESS) {
                     // Try until we hit the first error.
-                    errorCode = TryProcessSuitEnvelope(item.val.string, errorMessage);
+                    filesystem::path filename;
+                    errorCode = TryProcessSuitEnvelope(item.val.string, componentId, filename, errorMessage);
                     if (errorCode != TEEP_ERR_SUCCESS) {
                         break;
                     }
+
+                    // Report the new sequence number from now on.
+                    if (TeepAgentAddInstalledComponent({ componentId.data(), componentId.size() }, item.val.string) != TEEP_ERR_SUCCESS) {
+                        TeepLogMessage("Not tracking installed manifest %s\n", filename.string().c_str());
+                    }
                 }
             }
             break;
@@ -739,7 +956,9 @@ static teep_error_code_t TeepAgentHandleUpdate(void* sessionHandle, QCBORDecodeC
 
     HexPrintBuffer("Sending CBOR message: ", reply.ptr, reply.len);
 
-    teep_error = TeepAgentSendMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, &reply);
+    // Answer a MACed Update in kind while the key can still be used.
+    const TeepSessionKey* replyKey = (inboundKey != nullptr && inboundKey->CanSend()) ? inboundKey : nullptr;
+    teep_error = TeepAgentSendMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, &reply, replyKey);
     free((void*)reply.ptr);
     return teep_error;
 }
@@ -748,49 +967,38 @@ static teep_error_code_t TeepAgentVerifyMessageSignature(
     _In_ void* sessionHandle,
     _In_reads_(messageLength) const char* message,
     size_t messageLength,
-    _Out_ UsefulBufC* pencoded)
+    _Out_ UsefulBufC* pencoded,
+    _Out_ std::shared_ptr<const TeepSessionKey>& sessionKey)
 {
-    TEEP_UNUSED(sessionHandle);
     UsefulBufC signed_cose;
     signed_cose.ptr = message;
     signed_cose.len = messageLength;
-    for (auto [kind, key_pair] : TeepAgentGetTamKeys()) {
-        teep_error_code_t teeperr = teep_verify_cbor_message(kind, &key_pair, &signed_cose, pencoded);
-        if (teeperr == TEEP_ERR_SUCCESS) {
-            // TODO(#114): save key_pair in session
-            return TEEP_ERR_SUCCESS;
+    sessionKey.reset();
+
+    // In session mode, a message may be MACed with the session key.
+    if (teep_is_mac0_message(&signed_cose)) {
+        sessionKey = TeepAgentGetSessionKey(sessionHandle);
+        if (!sessionKey) {
+            TeepLogMessage("TEEP agent has no session key\n");
+            return TEEP_ERR_PERMANENT_ERROR;
         }
-    }
-    TeepLogMessage("TEEP agent failed verification of TAM key\n");
-    return TEEP_ERR_PERMANENT_ERROR;
-
-#if 0
-#ifdef TEEP_USE_COSE
-    // Determine whether message is COSE_Sign1 or not.
-    if ((messageLength >= 2) && (message[0] == (char)0x84) && (message[1] == TEEP_MESSAGE_QUERY_REQUEST)) {
-        // The only message that isn't is a query request where
-        // the first byte means array of size 4 and the second byte is a 1.
-#endif
-        encoded.ptr = message;
-        encoded.len = messageLength;
-#ifdef TEEP_USE_COSE
-    } else {
-        struct t_cose_key key_pair;
-        teeperr = TeepAgentGetTamKey(&key_pair);
+        teep_error_code_t teeperr = teep_verify_mac0_message(*sessionKey, &signed_cose, pencoded);
         if (teeperr != TEEP_ERR_SUCCESS) {
-            return teeperr;
+            TeepLogMessage("TEEP agent failed verification of session key MAC\n");
+            sessionKey.reset();
         }
+        return teeperr;
+    }
 
-        UsefulBufC signed_cose;
-        signed_cose.ptr = message;
-        signed_cose.len = messageLength;
-        teeperr = teep_verify_cbor_message(&key_pair, &signed_cose, pencoded);
-        if (teeperr != TEEP_ERR_SUCCESS) {
-            return teeperr;
-        }
+    std::string keyId;
+    teep_error_code_t teeperr = teep_verify_cbor_message_by_key_id(TeepAgentGetTamKeyIndex(), &signed_cose, pencoded, &keyId);
+    if (teeperr != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("TEEP agent failed verification of TAM key\n");
+        return teeperr;
     }
-#endif
-#endif
+
+    TeepAgentSetTamKeyId(sessionHandle, keyId);
+    return TEEP_ERR_SUCCESS;
 }
 
 /* Handle an incoming message from a TAM. */
@@ -808,7 +1016,8 @@ static teep_error_code_t TeepAgentHandleMessage(
 
     // Verify signature and save which signing key was used.
     UsefulBufC encoded;
-    teep_error_code_t teeperr = TeepAgentVerifyMessageSignature(sessionHandle, message, messageLength, &encoded);
+    std::shared_ptr<const TeepSessionKey> sessionKey;
+    teep_error_code_t teeperr = TeepAgentVerifyMessageSignature(sessionHandle, message, messageLength, &encoded, sessionKey);
     if (teeperr != TEEP_ERR_SUCCESS) {
         return teeperr;
     }
@@ -833,10 +1042,17 @@ static teep_error_code_t TeepAgentHandleMessage(
     TeepLogMessage("Received CBOR TEEP message type=%d\n", messageType);
     switch (messageType) {
     case TEEP_MESSAGE_QUERY_REQUEST:
-        teeperr = TeepAgentHandleQueryRequest(sessionHandle, &context);
+        // A QueryRequest comes before the agent has shown that it holds a
+        // session key, so it is always signed.
+        if (sessionKey) {
+            TeepLogMessage("TEEP agent got a MACed QueryRequest\n");
+            teeperr = TEEP_ERR_PERMANENT_ERROR;
+            break;
+        }
+        teeperr = TeepAgentHandleQueryRequest(sessionHandle, encoded, &context);
         break;
     case TEEP_MESSAGE_UPDATE:
-        teeperr = TeepAgentHandleUpdate(sessionHandle, &context);
+        teeperr = TeepAgentHandleUpdate(sessionHandle, &context, sessionKey.get());
         break;
     default:
         teeperr = TeepAgentHandleInvalidMessage(sessionHandle, &context);
@@ -873,24 +1089,17 @@ teep_error_code_t TeepAgentProcessTeepMessage(
     return err;
 }
 
-static _Ret_maybenull_ TrustedComponent* FindComponentInList(_In_opt_ TrustedComponent* head, teep_uuid_t taid)
-{
-    for (TrustedComponent* ta = head; ta != nullptr; ta = ta->Next) {
-        if (memcmp(&ta->ID, &taid, sizeof(taid)) == 0) {
-            return ta;
-        }
-    }
-    return nullptr;
-}
-
 teep_error_code_t TeepAgentRequestTA(
     teep_uuid_t requestedTaid,
     _In_z_ const char* tamUri)
 {
     teep_error_code_t err = TEEP_ERR_SUCCESS;
 
-    // See whether requestedTaid is already installed.
-    TrustedComponent* found = FindComponentInList(g_InstalledComponentList, requestedTaid);
+    // See whether requestedTaid is already installed or requested.  Listed
+    // components hold a reference to their IDs, so an ID that is not in the
+    // table is in neither list.
+    teep_component_handle_t requestedHandle = TeepComponentIdTable::Find(requestedTaid);
+    TrustedComponent* found = FindComponentInList(g_InstalledComponentList, requestedHandle);
     if (found != nullptr) {
         // Already installed, nothing to do.
         // This counts as "pass no data back" in the broker spec.
@@ -898,13 +1107,11 @@ teep_error_code_t TeepAgentRequestTA(
     }
 
     // See whether requestedTaid has already been requested.
-    TrustedComponent* tc;
-    for (tc = g_RequestedComponentList; tc != nullptr; tc = tc->Next) {
-        if (memcmp(tc->ID.b, requestedTaid.b, TEEP_UUID_SIZE) == 0) {
-            // Already requested, nothing to do.
-            // This counts as "pass no data back" in the broker spec.
-            return TEEP_ERR_SUCCESS;
-        }
+    TrustedComponent* tc = FindComponentInList(g_RequestedComponentList, requestedHandle);
+    if (tc != nullptr) {
+        // Already requested, nothing to do.
+        // This counts as "pass no data back" in the broker spec.
+        return TEEP_ERR_SUCCESS;
     }
 
     // Add requestedTaid to the request list.
@@ -940,8 +1147,11 @@ teep_error_code_t TeepAgentUnrequestTA(
 {
     teep_error_code_t teep_error = TEEP_ERR_SUCCESS;
 
-    // See whether unneededTaid is installed.
-    TrustedComponent* found = FindComponentInList(g_InstalledComponentList, unneededTaid);
+    // See whether unneededTaid is installed.  Installed components hold a
+    // reference to their IDs, so an ID that is not in the table cannot be
+    // installed.
+    teep_component_handle_t unneededHandle = TeepComponentIdTable::Find(unneededTaid);
+    TrustedComponent* found = FindComponentInList(g_InstalledComponentList, unneededHandle);
     if (found == nullptr) {
         // Already not installed, nothing to do.
         // This counts as "pass no data back" in the broker spec.
@@ -949,7 +1159,7 @@ teep_error_code_t TeepAgentUnrequestTA(
     }
 
     // See whether unneededTaid has already been notified to the TAM.
-    TrustedComponent* tc = FindComponentInList(g_UnneededComponentList, unneededTaid);
+    TrustedComponent* tc = FindComponentInList(g_UnneededComponentList, unneededHandle);
     if (tc != nullptr) {
         // Already requested, nothing to do.
         // This counts as "pass no data back" in the broker spec.
@@ -1008,20 +1218,38 @@ teep_error_code_t TeepAgentConfigureManifests(
             continue;
         }
 
-        // Convert filename to a uuid.
-        teep_uuid_t component_id;
-        result = GetUuidFromFilename(filename, &component_id);
-        if (result != TEEP_ERR_SUCCESS) {
+        // Read the manifest for its sequence number.
+        std::string path = std::string(directory_name) + "/" + filename;
+        std::vector<uint8_t> manifest;
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            result = TEEP_ERR_TEMPORARY_ERROR;
             break;
         }
+        uint8_t chunk[4096];
+        size_t length;
+        while ((length = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+            manifest.insert(manifest.end(), chunk, chunk + length);
+        }
+        fclose(fp);
 
-        TrustedComponent* tc = new TrustedComponent(component_id);
-        if (tc == nullptr) {
-            result = TEEP_ERR_TEMPORARY_ERROR;
+        // A manifest is named by its component ID, unless the ID is too
+        // long and the name is only its hash, in which case the ID is read
+        // from the manifest itself.
+        std::string componentId;
+        result = TeepGetComponentIdFromManifestFilename(filename, componentId);
+        if (result != TEEP_ERR_SUCCESS) {
+            std::ostringstream errorMessage;
+            result = SuitGetComponentId({ manifest.data(), manifest.size() }, componentId, errorMessage);
+        }
+        if (result != TEEP_ERR_SUCCESS) {
+            TeepLogMessage("Manifest %s has no component ID\n", filename);
+            break;
+        }
+        result = TeepAgentAddInstalledComponent({ componentId.data(), componentId.size() }, { manifest.data(), manifest.size() });
+        if (result != TEEP_ERR_SUCCESS) {
             break;
         }
-        tc->Next = g_InstalledComponentList;
-        g_InstalledComponentList = tc;
     }
     closedir(dir);
     return result;
@@ -1053,36 +1281,20 @@ void TeepAgentShutdown()
     ClearComponentList(&g_InstalledComponentList);
     ClearComponentList(&g_UnneededComponentList);
     ClearComponentList(&g_RequestedComponentList);
+    std::lock_guard<std::mutex> lock(g_TamSessionsLock);
+    g_TamSessions.clear();
+    g_TamSessionKeys.clear();
 }
 
-#define TOXDIGIT(x) ("0123456789abcdef"[x])
-
-void TeepAgentMakeManifestFilename(_Out_ filesystem::path& manifestPath, _In_reads_(buffer_len) const char* buffer, size_t buffer_len)
+teep_error_code_t TeepAgentMakeManifestFilename(_Out_ filesystem::path& manifestPath, UsefulBufC componentId)
 {
+    std::string filename;
+    teep_error_code_t result = TeepGetManifestFilename(componentId, filename);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
     manifestPath = g_agent_data_directory;
     manifestPath /= "manifests";
-
-    char filename[_MAX_PATH];
-#if 1
-    // Hex encode buffer.
-    for (size_t i = 0, fi = 0; i < buffer_len; i++) {
-        uint8_t ch = buffer[i];
-        if (i == 4 || i == 6 || i == 8 || i == 10) {
-            filename[fi++] = '-';
-        }
-        filename[fi++] = TOXDIGIT(ch >> 4);
-        filename[fi++] = TOXDIGIT(ch & 0xf);
-        filename[fi] = 0;
-    }
-#else
-    // Escape illegal characters.
-    size_t i;
-    for (i = 0; (i < buffer_len) && (i < filename_len - 1) && buffer[i]; i++) {
-        filename[i] = (isalnum(buffer[i]) || (strchr("-_", buffer[i]) != nullptr)) ? buffer[i] : '-';
-    }
-    filename[i] = 0;
-#endif
-
     manifestPath /= filename;
-    manifestPath += ".cbor";
+    return TEEP_ERR_SUCCESS;
 }
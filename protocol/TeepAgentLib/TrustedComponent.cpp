@@ -7,12 +7,29 @@
 TrustedComponent::TrustedComponent(teep_uuid_t id)
 {
     this->ID = id;
+    this->Handle = TeepComponentIdTable::Intern(id);
     ConvertUUIDToString(this->Name, sizeof(this->Name), id);
+    this->ManifestSequenceNumber = 0;
+    this->HaveManifestSequenceNumber = false;
+    this->Next = nullptr;
+}
+
+TrustedComponent::TrustedComponent(UsefulBufC encodedId)
+{
+    this->Handle = TeepComponentIdTable::Intern(encodedId);
+    if (TeepGetComponentIdUuid(encodedId, &this->ID)) {
+        ConvertUUIDToString(this->Name, sizeof(this->Name), this->ID);
+    } else {
+        memset(this->Name, 0, sizeof(this->Name));
+    }
+    this->ManifestSequenceNumber = 0;
+    this->HaveManifestSequenceNumber = false;
     this->Next = nullptr;
 }
 
 TrustedComponent::~TrustedComponent()
 {
+    TeepComponentIdTable::Release(this->Handle);
 }
 
 // Returns TRUE on success, FALSE on failure.
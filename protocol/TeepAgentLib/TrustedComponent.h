@@ -2,16 +2,31 @@
 // SPDX-License-Identifier: MIT
 #pragma once
 #include "common.h"
+#include "ComponentIdTable.h"
 
 class TrustedComponent
 {
 public:
     TrustedComponent(teep_uuid_t id);
+
+    // Takes a component ID in canonical form, which may have any number of
+    // elements.
+    TrustedComponent(UsefulBufC encodedId);
     ~TrustedComponent();
     static int ConvertUUIDToString(char* buffer, size_t buffer_length, teep_uuid_t uuid);
 
+    // Only set for a component ID that is a single UUID; otherwise zero.
     char Name[256];
     teep_uuid_t ID;
+    teep_component_handle_t Handle; // Interned ID, compared instead of the bytes.
+
+    // Sequence number of the installed manifest, reported in the tc-list.
+    uint64_t ManifestSequenceNumber;
+    bool HaveManifestSequenceNumber;
 
     TrustedComponent* Next;
+
+private:
+    TrustedComponent(const TrustedComponent&) = delete;
+    TrustedComponent& operator=(const TrustedComponent&) = delete;
 };
@@ -0,0 +1,362 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <mutex>
+#include <sstream>
+#include <string.h>
+#include "ComponentIdTable.h"
+#include "CryptoProvider.h"
+#include "qcbor/qcbor_encode.h"
+
+// The canonical encoding of a component ID that is a single UUID is an
+// array of one element (0x81) holding a 16-byte byte string (0x50).
+#define TEEP_UUID_COMPONENT_ID_LENGTH (2 + TEEP_UUID_SIZE)
+
+static void EncodeUuidComponentId(
+    _In_ const teep_uuid_t& uuid,
+    _Out_writes_(TEEP_UUID_COMPONENT_ID_LENGTH) uint8_t* encoded)
+{
+    encoded[0] = 0x81;
+    encoded[1] = 0x40 | TEEP_UUID_SIZE;
+    memcpy(encoded + 2, uuid.b, TEEP_UUID_SIZE);
+}
+
+teep_error_code_t TeepEncodeComponentId(
+    _In_reads_(elementCount) const UsefulBufC* elements,
+    size_t elementCount,
+    _Out_ std::string& encoded)
+{
+    // Compute the exact size so the encoding is done in place.
+    size_t length = teep_get_cbor_head_size(elementCount);
+    for (size_t i = 0; i < elementCount; i++) {
+        length += teep_get_cbor_head_size(elements[i].len) + elements[i].len;
+    }
+    encoded.resize(length);
+
+    QCBOREncodeContext context;
+    QCBOREncode_Init(&context, { &encoded[0], encoded.size() });
+    QCBOREncode_OpenArray(&context);
+    for (size_t i = 0; i < elementCount; i++) {
+        QCBOREncode_AddBytes(&context, elements[i]);
+    }
+    QCBOREncode_CloseArray(&context);
+
+    UsefulBufC result;
+    if (QCBOREncode_Finish(&context, &result) != QCBOR_SUCCESS || result.len != length) {
+        encoded.clear();
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TeepParseComponentId(
+    _Inout_ QCBORDecodeContext* context,
+    _In_ const QCBORItem* arrayItem,
+    _Out_ std::string& encoded,
+    _Inout_ std::ostream& errorMessage)
+{
+    encoded.clear();
+    if (arrayItem->uDataType != QCBOR_TYPE_ARRAY) {
+        REPORT_TYPE_ERROR(errorMessage, "component-id", QCBOR_TYPE_ARRAY, *arrayItem);
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    uint16_t elementCount = arrayItem->val.uCount;
+    if (elementCount > TEEP_MAX_COMPONENT_ID_ELEMENTS) {
+        errorMessage << "Too many component-id elements: " << elementCount << std::endl;
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    // The elements point into the message being parsed.
+    UsefulBufC elements[TEEP_MAX_COMPONENT_ID_ELEMENTS];
+    for (uint16_t i = 0; i < elementCount; i++) {
+        QCBORItem item;
+        QCBORDecode_GetNext(context, &item);
+        if (item.uDataType != QCBOR_TYPE_BYTE_STRING) {
+            REPORT_TYPE_ERROR(errorMessage, "component-id", QCBOR_TYPE_BYTE_STRING, item);
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        elements[i] = item.val.string;
+    }
+    return TeepEncodeComponentId(elements, elementCount, encoded);
+}
+
+int TeepCompareComponentIds(UsefulBufC left, UsefulBufC right)
+{
+    if (left.len != right.len) {
+        return (left.len < right.len) ? -1 : 1;
+    }
+    return (left.len == 0) ? 0 : memcmp(left.ptr, right.ptr, left.len);
+}
+
+bool TeepGetComponentIdUuid(UsefulBufC encoded, _Out_ teep_uuid_t* uuid)
+{
+    const uint8_t* bytes = (const uint8_t*)encoded.ptr;
+    if (encoded.len != TEEP_UUID_COMPONENT_ID_LENGTH || bytes[0] != 0x81 || bytes[1] != (0x40 | TEEP_UUID_SIZE)) {
+        memset(uuid, 0, sizeof(*uuid));
+        return false;
+    }
+    memcpy(uuid->b, bytes + 2, TEEP_UUID_SIZE);
+    return true;
+}
+
+#define TEEP_MANIFEST_FILENAME_EXTENSION ".cbor"
+#define TEEP_UUID_STRING_LENGTH 36
+
+static void AppendBase16(UsefulBufC buffer, _Inout_ std::string& text)
+{
+    static const char digits[] = "0123456789abcdef";
+    const uint8_t* bytes = (const uint8_t*)buffer.ptr;
+    for (size_t i = 0; i < buffer.len; i++) {
+        text += digits[bytes[i] >> 4];
+        text += digits[bytes[i] & 0xf];
+    }
+}
+
+static bool DecodeBase16(std::string_view text, _Out_ std::string& buffer)
+{
+    buffer.clear();
+    if (text.empty() || (text.size() % 2) != 0) {
+        return false;
+    }
+    buffer.reserve(text.size() / 2);
+    for (size_t i = 0; i < text.size(); i += 2) {
+        int value = 0;
+        for (size_t j = i; j < i + 2; j++) {
+            char c = text[j];
+            int digit = (c >= '0' && c <= '9') ? c - '0' :
+                        (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                        (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+            if (digit < 0) {
+                buffer.clear();
+                return false;
+            }
+            value = (value << 4) | digit;
+        }
+        buffer += (char)value;
+    }
+    return true;
+}
+
+teep_error_code_t TeepGetManifestFilename(UsefulBufC encoded, _Out_ std::string& filename)
+{
+    filename.clear();
+    if (encoded.len == 0) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    teep_uuid_t uuid;
+    if (TeepGetComponentIdUuid(encoded, &uuid)) {
+        char name[TEEP_UUID_STRING_LENGTH + 1];
+        sprintf_s(name, sizeof(name),
+            "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+            uuid.b[0], uuid.b[1], uuid.b[2], uuid.b[3], uuid.b[4], uuid.b[5], uuid.b[6], uuid.b[7],
+            uuid.b[8], uuid.b[9], uuid.b[10], uuid.b[11], uuid.b[12], uuid.b[13], uuid.b[14], uuid.b[15]);
+        filename = name;
+    } else if (encoded.len * 2 + strlen(TEEP_MANIFEST_FILENAME_EXTENSION) <= TEEP_MAX_MANIFEST_FILENAME_LENGTH) {
+        AppendBase16(encoded, filename);
+    } else {
+        uint8_t hash[TEEP_SHA256_LENGTH];
+        teep_error_code_t result = teep_get_crypto_provider()->sha256(&encoded, 1, hash);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+        filename = TEEP_HASHED_MANIFEST_FILENAME_PREFIX;
+        AppendBase16({ hash, sizeof(hash) }, filename);
+    }
+    filename += TEEP_MANIFEST_FILENAME_EXTENSION;
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TeepGetComponentIdFromManifestFilename(_In_z_ const char* filename, _Out_ std::string& encoded)
+{
+    encoded.clear();
+    std::string_view name(filename);
+    std::string_view extension(TEEP_MANIFEST_FILENAME_EXTENSION);
+    if (name.size() > extension.size() && name.substr(name.size() - extension.size()) == extension) {
+        name.remove_suffix(extension.size());
+    }
+
+    if (name.size() == TEEP_UUID_STRING_LENGTH &&
+        name[8] == '-' && name[13] == '-' && name[18] == '-' && name[23] == '-') {
+        std::string digits;
+        digits.reserve(2 * TEEP_UUID_SIZE);
+        digits.append(name.substr(0, 8)).append(name.substr(9, 4)).append(name.substr(14, 4));
+        digits.append(name.substr(19, 4)).append(name.substr(24, 12));
+        std::string bytes;
+        if (!DecodeBase16(digits, bytes)) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        UsefulBufC element = { bytes.data(), bytes.size() };
+        return TeepEncodeComponentId(&element, 1, encoded);
+    }
+
+    // Only the canonical encoding of an ID names it, so each ID has just
+    // one name.
+    std::string bytes;
+    if (!DecodeBase16(name, bytes)) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, { bytes.data(), bytes.size() }, QCBOR_DECODE_MODE_NORMAL);
+    QCBORItem item;
+    std::ostringstream errorMessage;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS ||
+        TeepParseComponentId(&context, &item, encoded, errorMessage) != TEEP_ERR_SUCCESS ||
+        QCBORDecode_Finish(&context) != QCBOR_SUCCESS ||
+        encoded != bytes) {
+        encoded.clear();
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+TeepComponentIdTable& TeepComponentIdTable::GetGlobal(void)
+{
+    static TeepComponentIdTable table;
+    return table;
+}
+
+teep_component_handle_t TeepComponentIdTable::FindLocked(std::string_view encoded) const
+{
+    auto found = _handles.find(encoded);
+    return (found == _handles.end()) ? TEEP_NO_COMPONENT_HANDLE : found->second;
+}
+
+teep_component_handle_t TeepComponentIdTable::Intern(UsefulBufC encoded)
+{
+    if (encoded.len == 0) {
+        return TEEP_NO_COMPONENT_HANDLE;
+    }
+    teep_component_handle_t handle = Acquire(encoded);
+    if (handle != TEEP_NO_COMPONENT_HANDLE) {
+        return handle;
+    }
+
+    // Interned by another thread meanwhile, if InternLocked() finds it.
+    TeepComponentIdTable& table = GetGlobal();
+    std::unique_lock<std::shared_mutex> lock(table._lock);
+    return table.InternLocked(encoded);
+}
+
+void TeepComponentIdTable::Intern(
+    _In_reads_(count) const UsefulBufC* encoded,
+    size_t count,
+    _Out_writes_(count) teep_component_handle_t* handles)
+{
+    TeepComponentIdTable& table = GetGlobal();
+    std::unique_lock<std::shared_mutex> lock(table._lock);
+    table._handles.reserve(table._handles.size() + count);
+    for (size_t i = 0; i < count; i++) {
+        handles[i] = (encoded[i].len == 0) ? TEEP_NO_COMPONENT_HANDLE : table.InternLocked(encoded[i]);
+    }
+}
+
+teep_component_handle_t TeepComponentIdTable::InternLocked(UsefulBufC encoded)
+{
+    std::string_view key((const char*)encoded.ptr, encoded.len);
+    teep_component_handle_t handle = FindLocked(key);
+    if (handle != TEEP_NO_COMPONENT_HANDLE) {
+        _references[handle]++;
+        return handle;
+    }
+    if (!_freeHandles.empty()) {
+        handle = _freeHandles.back();
+        _freeHandles.pop_back();
+        _encodings[handle].assign(key);
+    } else {
+        if (_encodings.size() >= TEEP_NO_COMPONENT_HANDLE) {
+            return TEEP_NO_COMPONENT_HANDLE;
+        }
+        handle = (teep_component_handle_t)_encodings.size();
+        _encodings.emplace_back(key);
+        _references.emplace_back();
+    }
+    _references[handle] = 1;
+    _handles.emplace(_encodings[handle], handle);
+    return handle;
+}
+
+teep_component_handle_t TeepComponentIdTable::Intern(_In_ const teep_uuid_t& uuid)
+{
+    uint8_t encoded[TEEP_UUID_COMPONENT_ID_LENGTH];
+    EncodeUuidComponentId(uuid, encoded);
+    return Intern({ encoded, sizeof(encoded) });
+}
+
+teep_component_handle_t TeepComponentIdTable::Acquire(UsefulBufC encoded)
+{
+    // References are counted atomically, so the usual case of an ID that
+    // is already in the table only needs a shared lock.  An ID whose last
+    // reference was just dropped but that has not been removed yet is
+    // simply in use again.
+    TeepComponentIdTable& table = GetGlobal();
+    std::shared_lock<std::shared_mutex> lock(table._lock);
+    teep_component_handle_t handle = table.FindLocked(std::string_view((const char*)encoded.ptr, encoded.len));
+    if (handle != TEEP_NO_COMPONENT_HANDLE) {
+        table._references[handle]++;
+    }
+    return handle;
+}
+
+void TeepComponentIdTable::Release(teep_component_handle_t handle)
+{
+    if (handle == TEEP_NO_COMPONENT_HANDLE) {
+        return;
+    }
+    TeepComponentIdTable& table = GetGlobal();
+    {
+        std::shared_lock<std::shared_mutex> lock(table._lock);
+        if (handle >= table._references.size() || --table._references[handle] != 0) {
+            return;
+        }
+    }
+
+    // Remove the ID unless it was acquired again, or already removed by
+    // another thread that dropped a later last reference, meanwhile.
+    std::unique_lock<std::shared_mutex> lock(table._lock);
+    std::string& encoded = table._encodings[handle];
+    if (table._references[handle] != 0 || encoded.empty() || table.FindLocked(encoded) != handle) {
+        return;
+    }
+    table._handles.erase(encoded);
+    std::string().swap(encoded);
+    table._freeHandles.push_back(handle);
+}
+
+teep_component_handle_t TeepComponentIdTable::Find(UsefulBufC encoded)
+{
+    TeepComponentIdTable& table = GetGlobal();
+    std::shared_lock<std::shared_mutex> lock(table._lock);
+    return table.FindLocked(std::string_view((const char*)encoded.ptr, encoded.len));
+}
+
+teep_component_handle_t TeepComponentIdTable::Find(_In_ const teep_uuid_t& uuid)
+{
+    uint8_t encoded[TEEP_UUID_COMPONENT_ID_LENGTH];
+    EncodeUuidComponentId(uuid, encoded);
+    return Find({ encoded, sizeof(encoded) });
+}
+
+UsefulBufC TeepComponentIdTable::GetEncoded(teep_component_handle_t handle)
+{
+    TeepComponentIdTable& table = GetGlobal();
+    std::shared_lock<std::shared_mutex> lock(table._lock);
+    if (handle >= table._encodings.size() || table._encodings[handle].empty()) {
+        return NULLUsefulBufC;
+    }
+
+    // Entries are never moved, and are not modified while referenced, so
+    // the bytes stay valid after the lock is released.
+    const std::string& encoded = table._encodings[handle];
+    return { encoded.data(), encoded.size() };
+}
+
+bool TeepComponentIdTable::GetUuid(teep_component_handle_t handle, _Out_ teep_uuid_t* uuid)
+{
+    return TeepGetComponentIdUuid(GetEncoded(handle), uuid);
+}
+
+size_t TeepComponentIdTable::Count(void)
+{
+    TeepComponentIdTable& table = GetGlobal();
+    std::shared_lock<std::shared_mutex> lock(table._lock);
+    return table._handles.size();
+}
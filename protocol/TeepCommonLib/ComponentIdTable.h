@@ -0,0 +1,128 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <atomic>
+#include <deque>
+#include <ostream>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "common.h"
+#include "qcbor/qcbor_decode.h"
+
+// A dense handle for an interned component ID, so handles can index arrays
+// directly.  The handle of an ID that is no longer referenced is reused.
+typedef uint32_t teep_component_handle_t;
+#define TEEP_NO_COMPONENT_HANDLE UINT32_MAX
+
+// Most component IDs are a single UUID, but a SUIT_Component_Identifier
+// may have several elements.
+#define TEEP_MAX_COMPONENT_ID_ELEMENTS 16
+
+// Encode a SUIT_Component_Identifier in canonical form: a definite-length
+// array of definite-length byte strings, with every head in preferred
+// (shortest) form, so equal IDs always have equal encodings.
+teep_error_code_t TeepEncodeComponentId(
+    _In_reads_(elementCount) const UsefulBufC* elements,
+    size_t elementCount,
+    _Out_ std::string& encoded);
+
+// Parse a SUIT_Component_Identifier whose array item has just been read,
+// and encode it in canonical form.  encoded is reused, so a caller that
+// parses many IDs with the same string does not allocate for each.
+teep_error_code_t TeepParseComponentId(
+    _Inout_ QCBORDecodeContext* context,
+    _In_ const QCBORItem* arrayItem,
+    _Out_ std::string& encoded,
+    _Inout_ std::ostream& errorMessage);
+
+// Order canonically encoded component IDs by length, then bytewise, so
+// that IDs that are single UUIDs sort as the UUIDs do.  Returns less than,
+// equal to, or greater than zero, like memcmp().
+int TeepCompareComponentIds(UsefulBufC left, UsefulBufC right);
+
+// Get the UUID of a canonically encoded component ID that is a single UUID.
+bool TeepGetComponentIdUuid(UsefulBufC encoded, _Out_ teep_uuid_t* uuid);
+
+// Manifest files, on the TAM and the agent alike, are named by the
+// component ID they are for, so that distinct IDs never share a file.  An
+// ID that is a single UUID is named by the UUID, as manifests always have
+// been, and any other ID by the base16 encoding of its canonical form.
+// Names are limited to TEEP_MAX_MANIFEST_FILENAME_LENGTH characters, so a
+// longer ID is named "sha256-" plus the base16 SHA-256 hash of its
+// canonical form instead, and can only be learned from the manifest itself.
+#define TEEP_MAX_MANIFEST_FILENAME_LENGTH 255
+#define TEEP_HASHED_MANIFEST_FILENAME_PREFIX "sha256-"
+
+// Get the name, without a directory, of the manifest file for a
+// canonically encoded component ID.
+teep_error_code_t TeepGetManifestFilename(UsefulBufC encoded, _Out_ std::string& filename);
+
+// Get the canonically encoded component ID that a manifest file is named
+// for.  Fails for a hashed name, or a name that is not a component ID.
+teep_error_code_t TeepGetComponentIdFromManifestFilename(_In_z_ const char* filename, _Out_ std::string& encoded);
+
+// The process-wide table of interned component IDs.  Interning maps each
+// canonical SUIT_Component_Identifier to a handle, so lists, indexes, and
+// caches compare and hash fixed-width integers rather than byte strings.
+//
+// Each Intern() or Acquire() that returns a handle adds a reference, which
+// is dropped with Release().  An ID is removed when its last reference is
+// dropped, and its handle is then reused, so the table and arrays indexed
+// by handle are bounded by the number of IDs in use rather than by every
+// ID ever seen.  IDs received from a peer should only be looked up, with
+// Find() or Acquire(), which cannot add to the table.
+class TeepComponentIdTable
+{
+public:
+    // Get the handle of a canonically encoded component ID, adding it if
+    // it is new, and add a reference.
+    static teep_component_handle_t Intern(UsefulBufC encoded);
+
+    // Same, for a component ID that is a single UUID.
+    static teep_component_handle_t Intern(_In_ const teep_uuid_t& uuid);
+
+    // Same, for many component IDs at once under a single lock, e.g. every
+    // record of a manifest pack.
+    static void Intern(
+        _In_reads_(count) const UsefulBufC* encoded,
+        size_t count,
+        _Out_writes_(count) teep_component_handle_t* handles);
+
+    // Get the handle of a component ID and add a reference, or return
+    // TEEP_NO_COMPONENT_HANDLE if the ID is not in the table.
+    static teep_component_handle_t Acquire(UsefulBufC encoded);
+
+    // Drop a reference added by Intern() or Acquire().
+    static void Release(teep_component_handle_t handle);
+
+    // Get the handle of a component ID, or TEEP_NO_COMPONENT_HANDLE if it
+    // is not in the table.  No reference is added, so the handle only
+    // identifies the ID while something else holds a reference to it.
+    static teep_component_handle_t Find(UsefulBufC encoded);
+    static teep_component_handle_t Find(_In_ const teep_uuid_t& uuid);
+
+    // Get the canonical encoding of an interned component ID, which stays
+    // valid while the caller holds a reference to it.
+    static UsefulBufC GetEncoded(teep_component_handle_t handle);
+
+    // Get the UUID of a component ID that is a single UUID.
+    static bool GetUuid(teep_component_handle_t handle, _Out_ teep_uuid_t* uuid);
+
+    // Number of component IDs in the table.
+    static size_t Count(void);
+
+private:
+    static TeepComponentIdTable& GetGlobal(void);
+
+    teep_component_handle_t FindLocked(std::string_view encoded) const;
+    teep_component_handle_t InternLocked(UsefulBufC encoded);
+
+    mutable std::shared_mutex _lock; // Protects everything below.
+    std::deque<std::string> _encodings; // Indexed by handle; empty if free.  Never moved.
+    std::deque<std::atomic<uint32_t>> _references; // Indexed by handle; 0 if free.
+    std::vector<teep_component_handle_t> _freeHandles;
+    std::unordered_map<std::string_view, teep_component_handle_t> _handles; // Keys point into _encodings.
+};
@@ -0,0 +1,146 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include "common.h"
+
+// A crypto provider implements every cryptographic primitive the TAM and
+// TEEP Agent use, so that a different library can be substituted without
+// touching the protocol code.  The provider is chosen at build time by
+// defining TEEP_DEFAULT_CRYPTO_PROVIDER to the name of a provider object,
+// or at initialization with teep_set_crypto_provider().  OpenSSL is the
+// reference implementation.
+//
+// Keys are passed as struct t_cose_key, whose key.ptr is owned by the
+// provider that loaded the key.  COSE_Sign messages (TEEP_SIGNATURE_BOTH)
+// are still built and checked by t_cose, which requires OpenSSL keys.
+
+#define TEEP_SHA256_LENGTH 32
+#define TEEP_SIGNATURE_LENGTH 64 // ES256 in r|s form, or Ed25519.
+#define TEEP_AEAD_KEY_LENGTH 16  // AES-128-GCM.
+#define TEEP_AEAD_NONCE_LENGTH 12
+#define TEEP_AEAD_TAG_LENGTH 16
+#define TEEP_HMAC_SHA256_LENGTH 32
+#define TEEP_ECDH_SECRET_LENGTH 32            // P-256.
+#define TEEP_MAX_AGREEMENT_PUBLIC_KEY_LENGTH 128 // DER-encoded P-256 key.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // An EdDSA signature to verify as part of a batch, over data held as
+    // segments.
+    typedef struct {
+        const struct t_cose_key* key;
+        const UsefulBufC* segments;
+        size_t segment_count;
+        const uint8_t* signature; // TEEP_SIGNATURE_LENGTH bytes.
+    } teep_eddsa_batch_entry_t;
+
+    typedef struct {
+        const char* name;
+
+        // Load a key pair from a private key file, or a public key from a
+        // public key file.  Returns TEEP_ERR_PERMANENT_ERROR if the file
+        // does not exist or cannot be parsed.
+        teep_error_code_t (*load_private_key)(_In_z_ const char* file_name, _Out_ struct t_cose_key* key);
+        teep_error_code_t (*load_public_key)(_In_z_ const char* file_name, _Out_ struct t_cose_key* key);
+
+        // Import a DER-encoded SubjectPublicKeyInfo.
+        teep_error_code_t (*import_public_key)(UsefulBufC der, _Out_ struct t_cose_key* key);
+
+        // Generate a new key pair.
+        teep_error_code_t (*generate_key)(teep_signature_kind_t kind, _Out_ struct t_cose_key* key);
+
+        // Save a key pair as a private key file and a public key file.
+        teep_error_code_t (*save_key)(_In_ const struct t_cose_key* key, _In_z_ const char* private_file_name, _In_z_ const char* public_file_name);
+
+        void (*free_key)(_Inout_ struct t_cose_key* key);
+
+        // Get the COSE key ID (kid) of a key, which is the SHA-256 hash of
+        // its DER-encoded public key.  key_id must have room for 32 bytes.
+        teep_error_code_t (*get_key_id)(teep_signature_kind_t kind, _In_ const struct t_cose_key* key, _Inout_ UsefulBuf* key_id);
+
+        // Hash a message held as segments with SHA-256.
+        teep_error_code_t (*sha256)(
+            _In_reads_(segment_count) const UsefulBufC* segments,
+            size_t segment_count,
+            _Out_writes_(TEEP_SHA256_LENGTH) uint8_t* hash);
+
+        // Sign or verify.  ES256 takes the SHA-256 hash of the data, while
+        // EdDSA takes the data itself.
+        teep_error_code_t (*sign)(
+            teep_signature_kind_t kind,
+            _In_ const struct t_cose_key* key,
+            _In_reads_(data_length) const uint8_t* data,
+            size_t data_length,
+            _Out_writes_(TEEP_SIGNATURE_LENGTH) uint8_t* signature);
+        teep_error_code_t (*verify)(
+            teep_signature_kind_t kind,
+            _In_ const struct t_cose_key* key,
+            _In_reads_(data_length) const uint8_t* data,
+            size_t data_length,
+            _In_reads_(TEEP_SIGNATURE_LENGTH) const uint8_t* signature);
+
+        // Fill a buffer from a cryptographically secure generator.
+        teep_error_code_t (*random)(_Out_writes_(length) void* buffer, size_t length);
+
+        // AES-128-GCM.  Seal writes plaintext_length bytes of ciphertext
+        // and a tag; open fails if the tag does not match.
+        teep_error_code_t (*aead_seal)(
+            _In_reads_(TEEP_AEAD_KEY_LENGTH) const uint8_t* key,
+            _In_reads_(TEEP_AEAD_NONCE_LENGTH) const uint8_t* nonce,
+            UsefulBufC aad,
+            UsefulBufC plaintext,
+            _Out_writes_(plaintext.len) uint8_t* ciphertext,
+            _Out_writes_(TEEP_AEAD_TAG_LENGTH) uint8_t* tag);
+        teep_error_code_t (*aead_open)(
+            _In_reads_(TEEP_AEAD_KEY_LENGTH) const uint8_t* key,
+            _In_reads_(TEEP_AEAD_NONCE_LENGTH) const uint8_t* nonce,
+            UsefulBufC aad,
+            UsefulBufC ciphertext,
+            _In_reads_(TEEP_AEAD_TAG_LENGTH) const uint8_t* tag,
+            _Out_writes_(ciphertext.len) uint8_t* plaintext);
+
+        // HMAC-SHA256 of a message held as segments.
+        teep_error_code_t (*hmac_sha256)(
+            _In_reads_(key_length) const uint8_t* key,
+            size_t key_length,
+            _In_reads_(segment_count) const UsefulBufC* segments,
+            size_t segment_count,
+            _Out_writes_(TEEP_HMAC_SHA256_LENGTH) uint8_t* mac);
+
+        // Generate an ephemeral P-256 key for ECDH, and get its public key
+        // as a DER-encoded SubjectPublicKeyInfo.  The key is freed with
+        // free_key.
+        teep_error_code_t (*generate_agreement_key)(_Out_ struct t_cose_key* key, _Inout_ UsefulBuf* public_key);
+
+        // Compute the ECDH shared secret of a key from
+        // generate_agreement_key and a peer's DER-encoded public key.
+        teep_error_code_t (*agree)(
+            _In_ const struct t_cose_key* key,
+            UsefulBufC peer_public_key,
+            _Out_writes_(TEEP_ECDH_SECRET_LENGTH) uint8_t* secret);
+
+        // Verify a batch of EdDSA signatures at once, which costs less per
+        // signature than verify.  Succeeds only if every signature is
+        // valid, without saying which are not, so after a failure the
+        // caller verifies each with verify.  NULL if the provider has no
+        // batch verification.
+        teep_error_code_t (*verify_eddsa_batch)(
+            _In_reads_(count) const teep_eddsa_batch_entry_t* entries,
+            size_t count);
+    } teep_crypto_provider_t;
+
+    extern const teep_crypto_provider_t teep_openssl_crypto_provider;
+
+    // Get the provider in use.
+    const teep_crypto_provider_t* teep_get_crypto_provider(void);
+
+    // Select a provider, or the build-time default if provider is NULL.
+    // This must be done before any keys are loaded, since keys cannot be
+    // passed from one provider to another.
+    void teep_set_crypto_provider(_In_opt_ const teep_crypto_provider_t* provider);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,218 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "common.h"
+#include "EcdsaNoncePool.h"
+extern "C" {
+#include "openssl/ec.h"
+#include "openssl/ecdsa.h"
+};
+
+// Signing keys are loaded rarely, so once this many pools exist most are
+// for stale keys, and all are dropped.
+#define MAX_ECDSA_NONCE_POOLS 16
+
+// State shared by all pools.  It is destroyed at exit, which stops the
+// background thread before anything it uses goes away.
+struct TeepEcdsaNoncePoolState
+{
+    ~TeepEcdsaNoncePoolState() { Stop(); }
+
+    // Stop and wait for the background thread.  Must not be called with
+    // Lock held.
+    void Stop(void)
+    {
+        {
+            std::lock_guard<std::mutex> lock(Lock);
+            Stopping = true;
+        }
+        PoolsLow.notify_all();
+        if (Thread.joinable()) {
+            Thread.join();
+        }
+        std::lock_guard<std::mutex> lock(Lock);
+        Stopping = false;
+        LowPools.clear();
+    }
+
+    std::mutex Lock; // Protects everything below.
+    std::condition_variable PoolsLow;
+    std::unordered_map<EVP_PKEY*, std::shared_ptr<TeepEcdsaNoncePool>> Pools;
+    std::vector<std::shared_ptr<TeepEcdsaNoncePool>> LowPools; // Pools waiting to be refilled.
+    std::thread Thread;
+    std::atomic<bool> Stopping{ false };
+};
+
+static std::atomic<bool> g_EcdsaNoncePoolEnabled{ false };
+static std::atomic<uint64_t> g_EcdsaNoncePoolGeneration{ 0 };
+
+static TeepEcdsaNoncePoolState& GetState(void)
+{
+    static TeepEcdsaNoncePoolState state;
+    return state;
+}
+
+static EC_KEY* GetEcKey(_In_ EVP_PKEY* key)
+{
+    return (EVP_PKEY_id(key) == EVP_PKEY_EC) ? (EC_KEY*)EVP_PKEY_get0_EC_KEY(key) : nullptr;
+}
+
+TeepEcdsaNoncePool::TeepEcdsaNoncePool(_In_ EVP_PKEY* key)
+    : _key(key)
+{
+    // Hold a reference, so the key cannot be freed and its address reused
+    // by another key while the pool exists.
+    EVP_PKEY_up_ref(key);
+}
+
+TeepEcdsaNoncePool::~TeepEcdsaNoncePool()
+{
+    Clear();
+    EVP_PKEY_free(_key);
+}
+
+void TeepEcdsaNoncePool::Clear(void)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    for (auto& [kinv, r] : _pairs) {
+        BN_clear_free(kinv);
+        BN_clear_free(r);
+    }
+    _pairs.clear();
+}
+
+std::shared_ptr<TeepEcdsaNoncePool> TeepEcdsaNoncePool::Get(_In_ EVP_PKEY* key)
+{
+    if (!g_EcdsaNoncePoolEnabled) {
+        return nullptr;
+    }
+    EC_KEY* ecKey = GetEcKey(key);
+    if (ecKey == nullptr || EC_KEY_get0_private_key(ecKey) == nullptr) {
+        return nullptr;
+    }
+
+    TeepEcdsaNoncePoolState& state = GetState();
+    std::lock_guard<std::mutex> lock(state.Lock);
+    auto it = state.Pools.find(key);
+    if (it != state.Pools.end()) {
+        return it->second;
+    }
+
+    if (state.Pools.size() >= MAX_ECDSA_NONCE_POOLS) {
+        state.Pools.clear();
+        state.LowPools.clear();
+        g_EcdsaNoncePoolGeneration++;
+    }
+    std::shared_ptr<TeepEcdsaNoncePool> pool(new TeepEcdsaNoncePool(key));
+    state.Pools[key] = pool;
+    state.LowPools.push_back(pool);
+    if (!state.Thread.joinable()) {
+        state.Thread = std::thread(RefillThread);
+    }
+    state.PoolsLow.notify_one();
+    return pool;
+}
+
+void TeepEcdsaNoncePool::SetEnabled(bool enabled)
+{
+    g_EcdsaNoncePoolEnabled = enabled;
+    if (enabled) {
+        return;
+    }
+
+    TeepEcdsaNoncePoolState& state = GetState();
+    state.Stop();
+    std::lock_guard<std::mutex> lock(state.Lock);
+    state.Pools.clear();
+    g_EcdsaNoncePoolGeneration++;
+}
+
+bool TeepEcdsaNoncePool::IsEnabled(void)
+{
+    return g_EcdsaNoncePoolEnabled;
+}
+
+uint64_t TeepEcdsaNoncePool::GetGeneration(void)
+{
+    return g_EcdsaNoncePoolGeneration;
+}
+
+size_t TeepEcdsaNoncePool::GetCount(void)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    return _pairs.size();
+}
+
+bool TeepEcdsaNoncePool::Take(_Out_ BIGNUM** kinv, _Out_ BIGNUM** r)
+{
+    size_t remaining;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (_pairs.empty()) {
+            *kinv = nullptr;
+            *r = nullptr;
+            remaining = 0;
+        } else {
+            *kinv = _pairs.front().first;
+            *r = _pairs.front().second;
+            _pairs.pop_front();
+            remaining = _pairs.size();
+        }
+    }
+
+    if (remaining == TEEP_ECDSA_NONCE_POOL_LOW_WATER - 1 || remaining == 0) {
+        // Ask for a refill.  The background thread fills the pool to the
+        // top, so a pool already waiting only needs to be listed once.
+        TeepEcdsaNoncePoolState& state = GetState();
+        std::lock_guard<std::mutex> lock(state.Lock);
+        auto it = state.Pools.find(_key);
+        if (it != state.Pools.end() && it->second.get() == this) {
+            bool queued = false;
+            for (const std::shared_ptr<TeepEcdsaNoncePool>& pool : state.LowPools) {
+                queued = queued || (pool.get() == this);
+            }
+            if (!queued) {
+                state.LowPools.push_back(it->second);
+                state.PoolsLow.notify_one();
+            }
+        }
+    }
+    return (*kinv != nullptr);
+}
+
+void TeepEcdsaNoncePool::Fill(void)
+{
+    EC_KEY* ecKey = GetEcKey(_key);
+    TeepEcdsaNoncePoolState& state = GetState();
+    while (!state.Stopping && GetCount() < TEEP_ECDSA_NONCE_POOL_SIZE) {
+        BIGNUM* kinv = nullptr;
+        BIGNUM* r = nullptr;
+        if (!ECDSA_sign_setup(ecKey, nullptr, &kinv, &r)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(_lock);
+        _pairs.emplace_back(kinv, r);
+    }
+}
+
+void TeepEcdsaNoncePool::RefillThread(void)
+{
+    TeepEcdsaNoncePoolState& state = GetState();
+    for (;;) {
+        std::shared_ptr<TeepEcdsaNoncePool> pool;
+        {
+            std::unique_lock<std::mutex> lock(state.Lock);
+            state.PoolsLow.wait(lock, [&state] { return state.Stopping || !state.LowPools.empty(); });
+            if (state.Stopping) {
+                return;
+            }
+            pool = state.LowPools.front();
+            state.LowPools.erase(state.LowPools.begin());
+        }
+        pool->Fill();
+    }
+}
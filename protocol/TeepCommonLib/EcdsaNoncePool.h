@@ -0,0 +1,60 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <deque>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include "openssl/bn.h"
+#include "openssl/evp.h"
+
+#define TEEP_ECDSA_NONCE_POOL_SIZE 64
+#define TEEP_ECDSA_NONCE_POOL_LOW_WATER 32
+
+// Precomputed ECDSA signing values for one key.  Each (k^-1, r) pair costs
+// a scalar multiplication of the base point, which is most of the work of
+// signing; a background thread computes pairs ahead of time so that an
+// online signature is left with a hash and a modular multiply-add.  Each
+// pair is handed out once and cleared when freed.
+class TeepEcdsaNoncePool
+{
+public:
+    ~TeepEcdsaNoncePool();
+
+    // Get the pool for an EC private key, creating it and starting to fill
+    // it if needed.  Returns nullptr if precomputation is disabled or the
+    // key is not an EC key.
+    static std::shared_ptr<TeepEcdsaNoncePool> Get(_In_ EVP_PKEY* key);
+
+    // Turn precomputation on or off.  It is off by default, so that only
+    // the TAM, which turns it on, runs the background thread.  Turning it
+    // off discards every pool and stops the thread.
+    static void SetEnabled(bool enabled);
+    static bool IsEnabled(void);
+
+    // Incremented whenever pools are discarded.  A pool got before the
+    // generation changed is no longer refilled, so must be got again.
+    static uint64_t GetGeneration(void);
+
+    // Take a pair, which the caller must free with BN_clear_free.
+    // Returns false if the pool is empty.
+    bool Take(_Out_ BIGNUM** kinv, _Out_ BIGNUM** r);
+
+    // Number of pairs ready for use.
+    size_t GetCount(void);
+
+private:
+    TeepEcdsaNoncePool(_In_ EVP_PKEY* key);
+    TeepEcdsaNoncePool(const TeepEcdsaNoncePool&) = delete;
+    TeepEcdsaNoncePool& operator=(const TeepEcdsaNoncePool&) = delete;
+
+    // Compute pairs until the pool is full.  Runs on the background thread.
+    void Fill(void);
+    void Clear(void);
+
+    static void RefillThread(void);
+
+    EVP_PKEY* _key;
+    std::mutex _lock;
+    std::deque<std::pair<BIGNUM*, BIGNUM*>> _pairs;
+};
@@ -0,0 +1,839 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+//
+// This file contains batch verification of Ed25519 signatures.  The group
+// and scalar arithmetic follows the public domain ref10 code of Bernstein,
+// Duif, Lange, Schwabe and Yang, from which OpenSSL's Ed25519 is also
+// derived, and the field arithmetic its 64-bit successors.
+#include <string.h>
+#include "Ed25519BatchVerifier.h"
+#include "RandomGenerator.h"
+
+// Get count bits, at most 56, from a little-endian number.
+static uint64_t load_bits(_In_reads_(length) const uint8_t* s, size_t length, unsigned offset, unsigned count)
+{
+    uint64_t value = 0;
+    size_t first = offset / 8;
+    for (size_t i = 0; i < 8 && first + i < length; i++) {
+        value |= (uint64_t)s[first + i] << (8 * i);
+    }
+    return (value >> (offset % 8)) & ((UINT64_C(1) << count) - 1);
+}
+
+// Add a nonnegative limb of at most 56 bits into a little-endian number.
+static void store_bits(_Inout_updates_(length) uint8_t* s, size_t length, unsigned offset, uint64_t value)
+{
+    value <<= offset % 8;
+    for (size_t i = offset / 8; value != 0 && i < length; i++) {
+        s[i] |= (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+// An element of GF(2^255 - 19), as five limbs of 51 bits, each of which
+// may run a little over, so that products of limbs are 128 bits wide.
+// The limbs of every element here are less than 2^52.
+typedef uint64_t fe[5];
+
+#define FE_LIMB_BITS 51
+#define FE_LIMB_MASK ((UINT64_C(1) << FE_LIMB_BITS) - 1)
+
+// A 128-bit sum of limb products.
+#if defined(__SIZEOF_INT128__)
+typedef unsigned __int128 fe_wide;
+
+static inline fe_wide fe_wide_mul(uint64_t a, uint64_t b)
+{
+    return (fe_wide)a * b;
+}
+
+static inline void fe_wide_add(fe_wide* r, fe_wide a)
+{
+    *r += a;
+}
+
+static inline uint64_t fe_wide_low(fe_wide a)
+{
+    return (uint64_t)a;
+}
+
+static inline fe_wide fe_wide_shift(fe_wide a)
+{
+    return a >> FE_LIMB_BITS;
+}
+#else
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} fe_wide;
+
+static inline fe_wide fe_wide_mul(uint64_t a, uint64_t b)
+{
+    fe_wide r;
+#if defined(_MSC_VER) && defined(_M_X64)
+    r.lo = _umul128(a, b, &r.hi);
+#else
+    uint64_t a0 = (uint32_t)a, a1 = a >> 32;
+    uint64_t b0 = (uint32_t)b, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint64_t middle = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    r.lo = (middle << 32) | (uint32_t)p00;
+    r.hi = p11 + (p01 >> 32) + (p10 >> 32) + (middle >> 32);
+#endif
+    return r;
+}
+
+static inline void fe_wide_add(fe_wide* r, fe_wide a)
+{
+    r->lo += a.lo;
+    r->hi += a.hi + (r->lo < a.lo);
+}
+
+static inline uint64_t fe_wide_low(fe_wide a)
+{
+    return a.lo;
+}
+
+static inline fe_wide fe_wide_shift(fe_wide a)
+{
+    return { (a.lo >> FE_LIMB_BITS) | (a.hi << (64 - FE_LIMB_BITS)), a.hi >> FE_LIMB_BITS };
+}
+#endif
+
+// 4p, which is added before subtracting so limbs stay nonnegative.
+static const fe fe_four_p = {
+    (FE_LIMB_MASK - 18) * 4, FE_LIMB_MASK * 4, FE_LIMB_MASK * 4, FE_LIMB_MASK * 4, FE_LIMB_MASK * 4,
+};
+
+static void fe_0(fe h)
+{
+    memset(h, 0, sizeof(fe));
+}
+
+static void fe_1(fe h)
+{
+    fe_0(h);
+    h[0] = 1;
+}
+
+static void fe_copy(fe h, const fe f)
+{
+    memcpy(h, f, sizeof(fe));
+}
+
+// Carry each limb into the next, and the top one around times 19, since
+// 2^255 = 19.  Every limb ends up less than 2^51, except that the bottom
+// one may be a little more.
+static void fe_carry(fe h)
+{
+    for (int i = 0; i < 4; i++) {
+        h[i + 1] += h[i] >> FE_LIMB_BITS;
+        h[i] &= FE_LIMB_MASK;
+    }
+    h[0] += 19 * (h[4] >> FE_LIMB_BITS);
+    h[4] &= FE_LIMB_MASK;
+}
+
+static void fe_add(fe h, const fe f, const fe g)
+{
+    for (int i = 0; i < 5; i++) {
+        h[i] = f[i] + g[i];
+    }
+    fe_carry(h);
+}
+
+static void fe_sub(fe h, const fe f, const fe g)
+{
+    for (int i = 0; i < 5; i++) {
+        h[i] = f[i] + fe_four_p[i] - g[i];
+    }
+    fe_carry(h);
+}
+
+static void fe_neg(fe h, const fe f)
+{
+    fe zero;
+    fe_0(zero);
+    fe_sub(h, zero, f);
+}
+
+// Carry a product into limbs.
+static void fe_from_wide(fe h, _Inout_updates_(5) fe_wide* t)
+{
+    for (int i = 0; i < 4; i++) {
+        h[i] = fe_wide_low(t[i]) & FE_LIMB_MASK;
+        fe_wide_add(&t[i + 1], fe_wide_shift(t[i]));
+    }
+    h[4] = fe_wide_low(t[4]) & FE_LIMB_MASK;
+    h[0] += 19 * fe_wide_low(fe_wide_shift(t[4]));
+    h[1] += h[0] >> FE_LIMB_BITS;
+    h[0] &= FE_LIMB_MASK;
+}
+
+static void fe_mul(fe h, const fe f, const fe g)
+{
+    // A product that reaches past the top limb wraps around times 19.
+    uint64_t g19[5];
+    for (int j = 1; j < 5; j++) {
+        g19[j] = 19 * g[j];
+    }
+    fe_wide t[5];
+    t[0] = fe_wide_mul(f[0], g[0]);
+    fe_wide_add(&t[0], fe_wide_mul(f[1], g19[4]));
+    fe_wide_add(&t[0], fe_wide_mul(f[2], g19[3]));
+    fe_wide_add(&t[0], fe_wide_mul(f[3], g19[2]));
+    fe_wide_add(&t[0], fe_wide_mul(f[4], g19[1]));
+    t[1] = fe_wide_mul(f[0], g[1]);
+    fe_wide_add(&t[1], fe_wide_mul(f[1], g[0]));
+    fe_wide_add(&t[1], fe_wide_mul(f[2], g19[4]));
+    fe_wide_add(&t[1], fe_wide_mul(f[3], g19[3]));
+    fe_wide_add(&t[1], fe_wide_mul(f[4], g19[2]));
+    t[2] = fe_wide_mul(f[0], g[2]);
+    fe_wide_add(&t[2], fe_wide_mul(f[1], g[1]));
+    fe_wide_add(&t[2], fe_wide_mul(f[2], g[0]));
+    fe_wide_add(&t[2], fe_wide_mul(f[3], g19[4]));
+    fe_wide_add(&t[2], fe_wide_mul(f[4], g19[3]));
+    t[3] = fe_wide_mul(f[0], g[3]);
+    fe_wide_add(&t[3], fe_wide_mul(f[1], g[2]));
+    fe_wide_add(&t[3], fe_wide_mul(f[2], g[1]));
+    fe_wide_add(&t[3], fe_wide_mul(f[3], g[0]));
+    fe_wide_add(&t[3], fe_wide_mul(f[4], g19[4]));
+    t[4] = fe_wide_mul(f[0], g[4]);
+    fe_wide_add(&t[4], fe_wide_mul(f[1], g[3]));
+    fe_wide_add(&t[4], fe_wide_mul(f[2], g[2]));
+    fe_wide_add(&t[4], fe_wide_mul(f[3], g[1]));
+    fe_wide_add(&t[4], fe_wide_mul(f[4], g[0]));
+    fe_from_wide(h, t);
+}
+
+// Square, or with doubled set, twice the square.
+static void fe_sq(fe h, const fe f, bool doubled = false)
+{
+    uint64_t scale = doubled ? 2 : 1;
+    uint64_t f0 = f[0] * scale;
+    uint64_t f0_2 = 2 * f0;
+    uint64_t f1_2 = 2 * f[1] * scale;
+    uint64_t f2 = f[2] * scale;
+    uint64_t f2_2 = 2 * f2;
+    uint64_t f3_19 = 19 * f[3];
+    uint64_t f4_19 = 19 * f[4];
+    fe_wide t[5];
+    t[0] = fe_wide_mul(f0, f[0]);
+    fe_wide_add(&t[0], fe_wide_mul(f1_2, f4_19));
+    fe_wide_add(&t[0], fe_wide_mul(f2_2, f3_19));
+    t[1] = fe_wide_mul(f0_2, f[1]);
+    fe_wide_add(&t[1], fe_wide_mul(f2_2, f4_19));
+    fe_wide_add(&t[1], fe_wide_mul(f[3] * scale, f3_19));
+    t[2] = fe_wide_mul(f0_2, f[2]);
+    fe_wide_add(&t[2], fe_wide_mul(f[1] * scale, f[1]));
+    fe_wide_add(&t[2], fe_wide_mul(2 * f[3] * scale, f4_19));
+    t[3] = fe_wide_mul(f0_2, f[3]);
+    fe_wide_add(&t[3], fe_wide_mul(f1_2, f[2]));
+    fe_wide_add(&t[3], fe_wide_mul(f[4] * scale, f4_19));
+    t[4] = fe_wide_mul(f0_2, f[4]);
+    fe_wide_add(&t[4], fe_wide_mul(f1_2, f[3]));
+    fe_wide_add(&t[4], fe_wide_mul(f2, f[2]));
+    fe_from_wide(h, t);
+}
+
+// Load a field element, ignoring the top bit.
+static void fe_frombytes(fe h, _In_reads_(32) const uint8_t* s)
+{
+    for (int i = 0; i < 5; i++) {
+        h[i] = load_bits(s, 32, FE_LIMB_BITS * i, FE_LIMB_BITS);
+    }
+}
+
+// Store the canonical form of a field element.
+static void fe_tobytes(_Out_writes_(32) uint8_t* s, const fe f)
+{
+    fe h;
+    fe_copy(h, f);
+    fe_carry(h);
+
+    // h is now less than 2p, so subtract p if h + 19 reaches 2^255.
+    uint64_t q = (h[0] + 19) >> FE_LIMB_BITS;
+    for (int i = 1; i < 5; i++) {
+        q = (h[i] + q) >> FE_LIMB_BITS;
+    }
+    h[0] += 19 * q;
+    for (int i = 0; i < 4; i++) {
+        h[i + 1] += h[i] >> FE_LIMB_BITS;
+        h[i] &= FE_LIMB_MASK;
+    }
+    h[4] &= FE_LIMB_MASK;
+
+    memset(s, 0, 32);
+    for (int i = 0; i < 5; i++) {
+        store_bits(s, 32, FE_LIMB_BITS * i, h[i]);
+    }
+}
+
+static bool fe_isnonzero(const fe f)
+{
+    uint8_t s[32];
+    fe_tobytes(s, f);
+    uint8_t bits = 0;
+    for (uint8_t b : s) {
+        bits |= b;
+    }
+    return bits != 0;
+}
+
+static bool fe_isnegative(const fe f)
+{
+    uint8_t s[32];
+    fe_tobytes(s, f);
+    return (s[0] & 1) != 0;
+}
+
+// Raise to a power given as a little-endian number, for constants.
+static void fe_pow(fe h, const fe f, _In_reads_(32) const uint8_t* exponent)
+{
+    fe result;
+    fe_1(result);
+    for (int bit = 255; bit >= 0; bit--) {
+        fe_sq(result, result);
+        if ((exponent[bit / 8] >> (bit % 8)) & 1) {
+            fe_mul(result, result, f);
+        }
+    }
+    fe_copy(h, result);
+}
+
+// z^((p - 5) / 8) = z^(2^252 - 3), the core of a square root.
+static void fe_pow22523(fe out, const fe z)
+{
+    fe t0, t1, t2;
+    fe_sq(t0, z);
+    fe_sq(t1, t0);
+    fe_sq(t1, t1);
+    fe_mul(t1, z, t1);
+    fe_mul(t0, t0, t1);
+    fe_sq(t0, t0);
+    fe_mul(t0, t1, t0); // 2^5 - 1
+    fe_sq(t1, t0);
+    for (int i = 1; i < 5; i++) {
+        fe_sq(t1, t1);
+    }
+    fe_mul(t0, t1, t0); // 2^10 - 1
+    fe_sq(t1, t0);
+    for (int i = 1; i < 10; i++) {
+        fe_sq(t1, t1);
+    }
+    fe_mul(t1, t1, t0); // 2^20 - 1
+    fe_sq(t2, t1);
+    for (int i = 1; i < 20; i++) {
+        fe_sq(t2, t2);
+    }
+    fe_mul(t1, t2, t1); // 2^40 - 1
+    fe_sq(t1, t1);
+    for (int i = 1; i < 10; i++) {
+        fe_sq(t1, t1);
+    }
+    fe_mul(t0, t1, t0); // 2^50 - 1
+    fe_sq(t1, t0);
+    for (int i = 1; i < 50; i++) {
+        fe_sq(t1, t1);
+    }
+    fe_mul(t1, t1, t0); // 2^100 - 1
+    fe_sq(t2, t1);
+    for (int i = 1; i < 100; i++) {
+        fe_sq(t2, t2);
+    }
+    fe_mul(t1, t2, t1); // 2^200 - 1
+    fe_sq(t1, t1);
+    for (int i = 1; i < 50; i++) {
+        fe_sq(t1, t1);
+    }
+    fe_mul(t0, t1, t0); // 2^250 - 1
+    fe_sq(t0, t0);
+    fe_sq(t0, t0);
+    fe_mul(out, t0, z); // 2^252 - 3
+}
+
+// Points on the curve -x^2 + y^2 = 1 + d x^2 y^2, in the coordinate
+// systems of "Twisted Edwards curves revisited" (Hisil et al.):
+// projective (X:Y:Z), extended (X:Y:Z:T) with XY = ZT, the completed
+// ((X:Z),(Y:T)) that an addition or doubling yields, and the form in
+// which a point is added to another.
+struct ge_p2 {
+    fe X, Y, Z;
+};
+struct ge_p3 {
+    fe X, Y, Z, T;
+};
+struct ge_p1p1 {
+    fe X, Y, Z, T;
+};
+struct TeepEd25519BatchVerifier::Cached {
+    fe YplusX, YminusX, Z, T2d;
+};
+typedef TeepEd25519BatchVerifier::Cached ge_cached;
+
+struct TeepEd25519BatchVerifier::Term {
+    ge_p3 Point;
+    uint8_t Scalar[32];
+};
+
+struct ed25519_constants {
+    fe d;      // -121665 / 121666
+    fe d2;     // 2d
+    fe sqrtm1; // sqrt(-1)
+    ge_cached base_multiples[8]; // B, 3B, 5B, ..., 15B.
+
+    ed25519_constants();
+};
+
+static const ed25519_constants& get_constants(void);
+
+static void ge_p1p1_to_p2(ge_p2* r, const ge_p1p1* p)
+{
+    fe_mul(r->X, p->X, p->T);
+    fe_mul(r->Y, p->Y, p->Z);
+    fe_mul(r->Z, p->Z, p->T);
+}
+
+static void ge_p1p1_to_p3(ge_p3* r, const ge_p1p1* p)
+{
+    fe_mul(r->X, p->X, p->T);
+    fe_mul(r->Y, p->Y, p->Z);
+    fe_mul(r->Z, p->Z, p->T);
+    fe_mul(r->T, p->X, p->Y);
+}
+
+static void ge_p3_to_cached(ge_cached* r, const ge_p3* p, const fe d2)
+{
+    fe_add(r->YplusX, p->Y, p->X);
+    fe_sub(r->YminusX, p->Y, p->X);
+    fe_copy(r->Z, p->Z);
+    fe_mul(r->T2d, p->T, d2);
+}
+
+static void ge_p2_dbl(ge_p1p1* r, const ge_p2* p)
+{
+    fe t0;
+    fe_sq(r->X, p->X);
+    fe_sq(r->Z, p->Y);
+    fe_sq(r->T, p->Z, true);
+    fe_add(r->Y, p->X, p->Y);
+    fe_sq(t0, r->Y);
+    fe_add(r->Y, r->Z, r->X);
+    fe_sub(r->Z, r->Z, r->X);
+    fe_sub(r->X, t0, r->Y);
+    fe_sub(r->T, r->T, r->Z);
+}
+
+static void ge_p3_dbl(ge_p1p1* r, const ge_p3* p)
+{
+    ge_p2 q;
+    fe_copy(q.X, p->X);
+    fe_copy(q.Y, p->Y);
+    fe_copy(q.Z, p->Z);
+    ge_p2_dbl(r, &q);
+}
+
+// r = p + q, or with subtract set, p - q.
+static void ge_add(ge_p1p1* r, const ge_p3* p, const ge_cached* q, bool subtract = false)
+{
+    fe t0;
+    fe_add(r->X, p->Y, p->X);
+    fe_sub(r->Y, p->Y, p->X);
+    fe_mul(r->Z, r->X, subtract ? q->YminusX : q->YplusX);
+    fe_mul(r->Y, r->Y, subtract ? q->YplusX : q->YminusX);
+    fe_mul(r->T, q->T2d, p->T);
+    fe_mul(r->X, p->Z, q->Z);
+    fe_add(t0, r->X, r->X);
+    fe_sub(r->X, r->Z, r->Y);
+    fe_add(r->Y, r->Z, r->Y);
+    if (subtract) {
+        fe_sub(r->Z, t0, r->T);
+        fe_add(r->T, t0, r->T);
+    } else {
+        fe_add(r->Z, t0, r->T);
+        fe_sub(r->T, t0, r->T);
+    }
+}
+
+// Decode a point and negate it.  Fails if the encoding is not canonical
+// (RFC 8032 section 5.1.3) or is not of a point on the curve.
+static bool ge_frombytes_negate(ge_p3* h, _In_reads_(32) const uint8_t* s, const ed25519_constants& constants)
+{
+    // y must be less than p = 2^255 - 19.
+    bool canonical = (s[0] < 0xED) || ((s[31] & 0x7F) != 0x7F);
+    for (int i = 1; i < 31 && !canonical; i++) {
+        canonical = (s[i] != 0xFF);
+    }
+    if (!canonical) {
+        return false;
+    }
+
+    fe u, v, v3, vxx, check;
+    fe_frombytes(h->Y, s);
+    fe_1(h->Z);
+    fe_sq(u, h->Y);
+    fe_mul(v, u, constants.d);
+    fe_sub(u, u, h->Z); // u = y^2 - 1
+    fe_add(v, v, h->Z); // v = dy^2 + 1
+
+    // x = uv^3 (uv^7)^((p - 5) / 8)
+    fe_sq(v3, v);
+    fe_mul(v3, v3, v);
+    fe_sq(h->X, v3);
+    fe_mul(h->X, h->X, v);
+    fe_mul(h->X, h->X, u);
+    fe_pow22523(h->X, h->X);
+    fe_mul(h->X, h->X, v3);
+    fe_mul(h->X, h->X, u);
+
+    // Check that vx^2 = u, or else -u, in which case x is off by a
+    // factor of sqrt(-1).
+    fe_sq(vxx, h->X);
+    fe_mul(vxx, vxx, v);
+    fe_sub(check, vxx, u);
+    if (fe_isnonzero(check)) {
+        fe_add(check, vxx, u);
+        if (fe_isnonzero(check)) {
+            return false;
+        }
+        fe_mul(h->X, h->X, constants.sqrtm1);
+    }
+
+    // x = 0 has no negative form to encode.
+    int sign = s[31] >> 7;
+    if (sign && !fe_isnonzero(h->X)) {
+        return false;
+    }
+    if ((int)fe_isnegative(h->X) == sign) {
+        fe_neg(h->X, h->X);
+    }
+    fe_mul(h->T, h->X, h->Y);
+    return true;
+}
+
+// Compute P, 3P, 5P, ..., 15P.
+static void ge_odd_multiples(_Out_writes_(8) ge_cached* multiples, const ge_p3* p, const fe d2)
+{
+    ge_p1p1 t;
+    ge_p3 p2, u;
+    ge_p3_to_cached(&multiples[0], p, d2);
+    ge_p3_dbl(&t, p);
+    ge_p1p1_to_p3(&p2, &t);
+    for (int i = 1; i < 8; i++) {
+        ge_add(&t, &p2, &multiples[i - 1]);
+        ge_p1p1_to_p3(&u, &t);
+        ge_p3_to_cached(&multiples[i], &u, d2);
+    }
+}
+
+ed25519_constants::ed25519_constants()
+{
+    // p - 2 and (p - 1) / 4, little-endian.
+    uint8_t p_minus_2[32];
+    uint8_t p_minus_1_over_4[32];
+    memset(p_minus_2, 0xFF, sizeof(p_minus_2));
+    p_minus_2[0] = 0xEB;
+    p_minus_2[31] = 0x7F;
+    memset(p_minus_1_over_4, 0xFF, sizeof(p_minus_1_over_4));
+    p_minus_1_over_4[0] = 0xFB;
+    p_minus_1_over_4[31] = 0x1F;
+
+    fe numerator;
+    fe denominator;
+    fe_0(numerator);
+    numerator[0] = 121665;
+    fe_neg(numerator, numerator);
+    fe_0(denominator);
+    denominator[0] = 121666;
+    fe_pow(denominator, denominator, p_minus_2);
+    fe_mul(d, numerator, denominator);
+    fe_add(d2, d, d);
+
+    fe two;
+    fe_0(two);
+    two[0] = 2;
+    fe_pow(sqrtm1, two, p_minus_1_over_4);
+
+    // B is the point with y = 4/5 and x even.
+    uint8_t encoded_base[32];
+    memset(encoded_base, 0x66, sizeof(encoded_base));
+    encoded_base[0] = 0x58;
+    ge_p3 base;
+    ge_frombytes_negate(&base, encoded_base, *this);
+    fe_neg(base.X, base.X);
+    fe_neg(base.T, base.T);
+    ge_odd_multiples(base_multiples, &base, d2);
+}
+
+static const ed25519_constants& get_constants(void)
+{
+    static const ed25519_constants constants;
+    return constants;
+}
+
+// Scalars modulo the group order L = 2^252 + 27742317777372353535851937790883648493
+// are worked on as signed 21-bit limbs, so that 2^252 = -27742317777372353535851937790883648493
+// folds a limb at bit 252 into six limbs below it.
+static const uint8_t group_order[32] = {
+    0xED, 0xD3, 0xF5, 0x5C, 0x1A, 0x63, 0x12, 0x58, 0xD6, 0x9C, 0xF7, 0xA2, 0xDE, 0xF9, 0xDE, 0x14,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10,
+};
+
+// Check that a scalar is less than L.
+static bool sc_is_canonical(_In_reads_(32) const uint8_t* s)
+{
+    for (int i = 31; i >= 0; i--) {
+        if (s[i] != group_order[i]) {
+            return s[i] < group_order[i];
+        }
+    }
+    return false;
+}
+
+// Load 21-bit limbs, with whatever bits are left over in the top one.
+static void sc_load(_Out_writes_(limb_count) int64_t* limbs, size_t limb_count, _In_reads_(length) const uint8_t* s, size_t length)
+{
+    for (size_t i = 0; i < limb_count; i++) {
+        unsigned offset = (unsigned)(21 * i);
+        unsigned count = (i + 1 < limb_count) ? 21 : (unsigned)(8 * length - offset);
+        limbs[i] = (int64_t)load_bits(s, length, offset, count);
+    }
+}
+
+// Fold limbs top down to bottom into the limbs 12 places below them.
+static void sc_fold(_Inout_updates_(24) int64_t* s, int top, int bottom)
+{
+    for (int k = top; k >= bottom; k--) {
+        s[k - 12] += s[k] * 666643;
+        s[k - 11] += s[k] * 470296;
+        s[k - 10] += s[k] * 654183;
+        s[k - 9] -= s[k] * 997805;
+        s[k - 8] += s[k] * 136657;
+        s[k - 7] -= s[k] * 683901;
+        s[k] = 0;
+    }
+}
+
+// Carry limbs first, first + step, ..., last into the next, rounded or not.
+static void sc_carry(_Inout_updates_(24) int64_t* s, int first, int last, int step, bool rounded)
+{
+    for (int i = first; i <= last; i += step) {
+        int64_t carry = (s[i] + (rounded ? ((int64_t)1 << 20) : 0)) >> 21;
+        s[i + 1] += carry;
+        s[i] -= carry * ((int64_t)1 << 21);
+    }
+}
+
+// Reduce 24 limbs modulo L, in the order ref10 does, which keeps every
+// intermediate within 64 bits.
+static void sc_reduce_limbs(_Out_writes_(32) uint8_t* out, _Inout_updates_(24) int64_t* s)
+{
+    sc_fold(s, 23, 18);
+    sc_carry(s, 6, 16, 2, true);
+    sc_carry(s, 7, 15, 2, true);
+    sc_fold(s, 17, 12);
+    sc_carry(s, 0, 10, 2, true);
+    sc_carry(s, 1, 11, 2, true);
+    sc_fold(s, 12, 12);
+    sc_carry(s, 0, 11, 1, false);
+    sc_fold(s, 12, 12);
+    sc_carry(s, 0, 10, 1, false);
+
+    memset(out, 0, 32);
+    for (int i = 0; i < 12; i++) {
+        store_bits(out, 32, 21 * i, (uint64_t)s[i]);
+    }
+}
+
+// out = s mod L, for a 64-byte s.
+static void sc_reduce(_Out_writes_(32) uint8_t* out, _In_reads_(64) const uint8_t* s)
+{
+    int64_t limbs[24];
+    sc_load(limbs, 24, s, 64);
+    sc_reduce_limbs(out, limbs);
+}
+
+// out = (a * b + c) mod L.
+static void sc_muladd(_Out_writes_(32) uint8_t* out, _In_reads_(32) const uint8_t* a, _In_reads_(32) const uint8_t* b, _In_reads_(32) const uint8_t* c)
+{
+    int64_t al[12], bl[12], cl[12];
+    sc_load(al, 12, a, 32);
+    sc_load(bl, 12, b, 32);
+    sc_load(cl, 12, c, 32);
+
+    int64_t s[24] = { 0 };
+    for (int i = 0; i < 12; i++) {
+        s[i] = cl[i];
+    }
+    for (int i = 0; i < 12; i++) {
+        for (int j = 0; j < 12; j++) {
+            s[i + j] += al[i] * bl[j];
+        }
+    }
+    sc_carry(s, 0, 22, 2, true);
+    sc_carry(s, 1, 21, 2, true);
+    sc_reduce_limbs(out, s);
+}
+
+// Write a scalar less than 2^255 as 256 signed digits, each zero or odd
+// and between -15 and 15, with every nonzero digit followed by at least
+// four zeros, so that multiplying by it takes about one addition of an
+// odd multiple of the point per five bits.  The digits are stored stride
+// apart.
+static void slide(_Out_writes_(256 * stride) int8_t* r, size_t stride, _In_reads_(32) const uint8_t* a)
+{
+    int8_t digits[256];
+    for (int i = 0; i < 256; i++) {
+        digits[i] = 1 & (a[i >> 3] >> (i & 7));
+    }
+    for (int i = 0; i < 256; i++) {
+        if (digits[i] == 0) {
+            continue;
+        }
+        for (int b = 1; b <= 6 && i + b < 256; b++) {
+            if (digits[i + b] == 0) {
+                continue;
+            }
+            if (digits[i] + (digits[i + b] << b) <= 15) {
+                digits[i] += digits[i + b] << b;
+                digits[i + b] = 0;
+            } else if (digits[i] - (digits[i + b] << b) >= -15) {
+                digits[i] -= digits[i + b] << b;
+                for (int k = i + b; k < 256; k++) {
+                    if (digits[k] == 0) {
+                        digits[k] = 1;
+                        break;
+                    }
+                    digits[k] = 0;
+                }
+            } else {
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < 256; i++) {
+        r[i * stride] = digits[i];
+    }
+}
+
+TeepEd25519BatchVerifier::TeepEd25519BatchVerifier()
+{
+    memset(_baseScalar, 0, sizeof(_baseScalar));
+}
+
+TeepEd25519BatchVerifier::~TeepEd25519BatchVerifier()
+{
+}
+
+size_t TeepEd25519BatchVerifier::GetCount(void) const
+{
+    return _terms.size() / 2;
+}
+
+void TeepEd25519BatchVerifier::Clear(void)
+{
+    _terms.clear();
+    memset(_baseScalar, 0, sizeof(_baseScalar));
+}
+
+bool TeepEd25519BatchVerifier::Add(
+    _In_reads_(TEEP_ED25519_PUBLIC_KEY_LENGTH) const uint8_t* publicKey,
+    _In_reads_(TEEP_ED25519_SIGNATURE_LENGTH) const uint8_t* signature,
+    _In_reads_(TEEP_ED25519_HASH_LENGTH) const uint8_t* hash)
+{
+    const ed25519_constants& constants = get_constants();
+    const uint8_t* s = signature + 32;
+    Term r;
+    Term a;
+    if (!sc_is_canonical(s) ||
+        !ge_frombytes_negate(&r.Point, signature, constants) ||
+        !ge_frombytes_negate(&a.Point, publicKey, constants)) {
+        return false;
+    }
+
+    // The coefficient must be secret, or a forger could pick bad
+    // signatures whose errors cancel out.
+    memset(r.Scalar, 0, sizeof(r.Scalar));
+    if (TeepRandomGenerator::GetForThread().Generate(r.Scalar, 16) != TEEP_ERR_SUCCESS) {
+        return false;
+    }
+
+    // -R gets z and -A gets z k, while B gets the sum of z S.
+    static const uint8_t zero[32] = { 0 };
+    uint8_t k[32];
+    sc_reduce(k, hash);
+    sc_muladd(a.Scalar, r.Scalar, k, zero);
+    sc_muladd(_baseScalar, r.Scalar, s, _baseScalar);
+    _terms.push_back(r);
+    _terms.push_back(a);
+    return true;
+}
+
+bool TeepEd25519BatchVerifier::Verify(void)
+{
+    if (_terms.empty()) {
+        return true;
+    }
+    const ed25519_constants& constants = get_constants();
+
+    // Get the odd multiples of each point, and the digits of each scalar,
+    // with those of B first.  The digits are stored by bit, so each step
+    // below reads them in order.
+    size_t pointCount = _terms.size() + 1;
+    _tables.resize(_terms.size() * 8);
+    _digits.resize(256 * pointCount);
+    slide(&_digits[0], pointCount, _baseScalar);
+    for (size_t i = 0; i < _terms.size(); i++) {
+        ge_odd_multiples(&_tables[i * 8], &_terms[i].Point, constants.d2);
+        slide(&_digits[i + 1], pointCount, _terms[i].Scalar);
+    }
+
+    // Straus's method: double once per bit for every point together, and
+    // add in each point's multiple for its digit at that bit.
+    int top = 255;
+    while (top >= 0) {
+        const int8_t* digits = &_digits[top * pointCount];
+        size_t i = 0;
+        while (i < pointCount && digits[i] == 0) {
+            i++;
+        }
+        if (i < pointCount) {
+            break;
+        }
+        top--;
+    }
+
+    ge_p2 sum;
+    fe_0(sum.X);
+    fe_1(sum.Y);
+    fe_1(sum.Z);
+    ge_p1p1 t;
+    ge_p3 u;
+    for (int bit = top; bit >= 0; bit--) {
+        ge_p2_dbl(&t, &sum);
+        const int8_t* digits = &_digits[bit * pointCount];
+        for (size_t i = 0; i < pointCount; i++) {
+            int digit = digits[i];
+            if (digit == 0) {
+                continue;
+            }
+            const ge_cached* multiples = (i == 0) ? constants.base_multiples : &_tables[(i - 1) * 8];
+            ge_p1p1_to_p3(&u, &t);
+            if (digit > 0) {
+                ge_add(&t, &u, &multiples[digit / 2]);
+            } else {
+                ge_add(&t, &u, &multiples[-digit / 2], true);
+            }
+        }
+        ge_p1p1_to_p2(&sum, &t);
+    }
+
+    // Multiply by the cofactor 8, and check for the identity (0:1:1).
+    for (int i = 0; i < 3; i++) {
+        ge_p2_dbl(&t, &sum);
+        ge_p1p1_to_p2(&sum, &t);
+    }
+    fe difference;
+    fe_sub(difference, sum.Y, sum.Z);
+    return !fe_isnonzero(sum.X) && !fe_isnonzero(difference);
+}
@@ -0,0 +1,69 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "common.h"
+
+#define TEEP_ED25519_PUBLIC_KEY_LENGTH 32
+#define TEEP_ED25519_SIGNATURE_LENGTH 64
+#define TEEP_ED25519_HASH_LENGTH 64 // SHA-512.
+
+// Verifies many Ed25519 signatures (RFC 8032) at once.  A signature (R, S)
+// by key A on message M is valid if [S]B = R + [k]A, where B is the base
+// point and k is the SHA-512 hash of R || A || M.  Rather than check each
+// equation, a batch checks a random linear combination of them,
+//
+//     [8][sum(z_i S_i)]B = [8] sum([z_i]R_i + [z_i k_i]A_i),
+//
+// with a secret random 128-bit z_i for each signature, so a batch with any
+// invalid signature fails but with probability 2^-128.  The sum is one
+// multi-scalar multiplication, whose doublings are shared by every point
+// in it, and R is never encoded back to bytes, so a batch of 64 costs
+// well under half as much per signature as verifying alone.  Run
+// TeepBenchmark "verify" to compare.
+//
+// A failed batch does not say which signatures are bad, so the caller
+// verifies them alone to find out.  Because of the factor of 8, a
+// signature whose R has a small-order component, which only the holder of
+// the private key can make, may pass in a batch but fail alone.
+//
+// Everything here is public, so the arithmetic is variable time.
+class TeepEd25519BatchVerifier
+{
+public:
+    TeepEd25519BatchVerifier();
+    ~TeepEd25519BatchVerifier();
+
+    // Add a signature, given the SHA-512 hash of R || A || M.  Returns
+    // false, adding nothing, if the public key or R is not the encoding
+    // of a point or S is not reduced, so that the signature cannot be
+    // checked in a batch.
+    bool Add(
+        _In_reads_(TEEP_ED25519_PUBLIC_KEY_LENGTH) const uint8_t* publicKey,
+        _In_reads_(TEEP_ED25519_SIGNATURE_LENGTH) const uint8_t* signature,
+        _In_reads_(TEEP_ED25519_HASH_LENGTH) const uint8_t* hash);
+
+    // Check every signature added since the last Clear.  An empty batch
+    // passes.
+    bool Verify(void);
+
+    void Clear(void);
+
+    // Get how many signatures have been added.
+    size_t GetCount(void) const;
+
+    // Defined where they are used.
+    struct Term;   // A point and its scalar.
+    struct Cached; // A point in the form added to others.
+
+private:
+    TeepEd25519BatchVerifier(const TeepEd25519BatchVerifier&) = delete;
+    TeepEd25519BatchVerifier& operator=(const TeepEd25519BatchVerifier&) = delete;
+
+    std::vector<Term> _terms;    // -R and -A of each signature.
+    uint8_t _baseScalar[32];     // sum(z_i S_i) mod L.
+    std::vector<Cached> _tables; // Odd multiples of each point, kept for reuse.
+    std::vector<int8_t> _digits; // Signed digits of each scalar, by bit.
+};
@@ -0,0 +1,263 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "EcdsaNoncePool.h"
+#include "KeyHandle.h"
+extern "C" {
+#include "openssl/bn.h"
+#include "openssl/ec.h"
+#include "openssl/ecdsa.h"
+#include "openssl/sha.h"
+#include "openssl/x509.h"
+};
+
+#define ES256_MAX_DER_SIGNATURE_LENGTH 80
+#define ES256_COORDINATE_LENGTH (TEEP_ES256_SIGNATURE_LENGTH / 2)
+
+// Key IDs already computed, each holding a reference to its key.
+static std::mutex g_KeyIdsLock;
+static std::unordered_map<EVP_PKEY*, std::string> g_KeyIds;
+
+TeepKeyHandle::TeepKeyHandle(_In_ const struct t_cose_key* key)
+    : _key((EVP_PKEY*)key->key.ptr), _signContext(nullptr), _verifyContext(nullptr), _messageSignContext(nullptr), _messageVerifyContext(nullptr)
+{
+}
+
+TeepKeyHandle::~TeepKeyHandle()
+{
+    EVP_PKEY_CTX_free(_signContext);
+    EVP_PKEY_CTX_free(_verifyContext);
+    EVP_MD_CTX_free(_messageSignContext);
+    EVP_MD_CTX_free(_messageVerifyContext);
+}
+
+bool TeepKeyHandle::GetKeyId(_In_ const struct t_cose_key* key, _Out_ std::string& keyId)
+{
+    EVP_PKEY* pkey = (EVP_PKEY*)key->key.ptr;
+    if (pkey == nullptr) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_KeyIdsLock);
+        auto it = g_KeyIds.find(pkey);
+        if (it != g_KeyIds.end()) {
+            keyId = it->second;
+            return true;
+        }
+    }
+
+    if (!ComputeKeyId(pkey, keyId)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(g_KeyIdsLock);
+    if (g_KeyIds.emplace(pkey, keyId).second) {
+        EVP_PKEY_up_ref(pkey);
+    }
+    return true;
+}
+
+void TeepKeyHandle::Release(_In_ const struct t_cose_key* key)
+{
+    EVP_PKEY* pkey = (EVP_PKEY*)key->key.ptr;
+    std::lock_guard<std::mutex> lock(g_KeyIdsLock);
+    if (g_KeyIds.erase(pkey) > 0) {
+        EVP_PKEY_free(pkey);
+    }
+}
+
+size_t TeepKeyHandle::GetKeyIdCount(void)
+{
+    std::lock_guard<std::mutex> lock(g_KeyIdsLock);
+    return g_KeyIds.size();
+}
+
+void TeepKeyHandle::Precompute(_In_ const struct t_cose_key* key)
+{
+    EVP_PKEY* pkey = (EVP_PKEY*)key->key.ptr;
+    if (pkey == nullptr || EVP_PKEY_id(pkey) != EVP_PKEY_EC) {
+        return;
+    }
+
+    // This is only an optimization, so failure is ignored.  Curves with
+    // built-in tables, such as P-256 on most platforms, already have them.
+    EC_KEY* ec_key = (EC_KEY*)EVP_PKEY_get0_EC_KEY(pkey);
+    if (ec_key != nullptr) {
+        (void)EC_KEY_precompute_mult(ec_key, nullptr);
+    }
+
+    // Start precomputing signing nonces if this is a private key.
+    (void)TeepEcdsaNoncePool::Get(pkey);
+}
+
+// Convert an ECDSA signature to r|s form.
+static bool GetRawSignature(_In_ const ECDSA_SIG* ecdsaSignature, _Out_writes_(TEEP_ES256_SIGNATURE_LENGTH) uint8_t* signature)
+{
+    const BIGNUM* r;
+    const BIGNUM* s;
+    ECDSA_SIG_get0(ecdsaSignature, &r, &s);
+    return (BN_bn2binpad(r, signature, ES256_COORDINATE_LENGTH) == ES256_COORDINATE_LENGTH) &&
+           (BN_bn2binpad(s, signature + ES256_COORDINATE_LENGTH, ES256_COORDINATE_LENGTH) == ES256_COORDINATE_LENGTH);
+}
+
+bool TeepKeyHandle::ComputeKeyId(_In_ EVP_PKEY* key, _Out_ std::string& keyId)
+{
+    // Get the public key in DER form.  This works for both key pairs and
+    // public keys, so signers and verifiers compute the same kid.
+    int derLength = i2d_PUBKEY(key, nullptr);
+    if (derLength <= 0) {
+        return false;
+    }
+    std::vector<unsigned char> der(derLength);
+    unsigned char* out = der.data();
+    i2d_PUBKEY(key, &out);
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    unsigned int hashLength;
+    if (!EVP_Digest(der.data(), der.size(), hash, &hashLength, EVP_sha256(), nullptr)) {
+        return false;
+    }
+    keyId.assign((const char*)hash, hashLength);
+    return true;
+}
+
+teep_error_code_t TeepKeyHandle::SignHash(
+    _In_reads_(hashLength) const uint8_t* hash,
+    size_t hashLength,
+    _Out_writes_(TEEP_ES256_SIGNATURE_LENGTH) uint8_t* signature)
+{
+    std::shared_ptr<TeepEcdsaNoncePool> noncePool = TeepEcdsaNoncePool::IsEnabled() ? TeepEcdsaNoncePool::Get(_key) : nullptr;
+    if (noncePool) {
+        BIGNUM* kinv;
+        BIGNUM* r;
+        if (noncePool->Take(&kinv, &r)) {
+            ECDSA_SIG* ecdsaSignature = ECDSA_do_sign_ex(hash, (int)hashLength, kinv, r, (EC_KEY*)EVP_PKEY_get0_EC_KEY(_key));
+            BN_clear_free(kinv);
+            BN_clear_free(r);
+            if (ecdsaSignature != nullptr) {
+                bool ok = GetRawSignature(ecdsaSignature, signature);
+                ECDSA_SIG_free(ecdsaSignature);
+                return (ok) ? TEEP_ERR_SUCCESS : TEEP_ERR_PERMANENT_ERROR;
+            }
+
+            // The pair was unusable for this hash (s came out as 0), so
+            // sign the ordinary way.
+        }
+    }
+
+    if (_signContext == nullptr) {
+        _signContext = EVP_PKEY_CTX_new(_key, nullptr);
+        if (_signContext == nullptr) {
+            return TEEP_ERR_TEMPORARY_ERROR;
+        }
+        if (EVP_PKEY_sign_init(_signContext) <= 0) {
+            EVP_PKEY_CTX_free(_signContext);
+            _signContext = nullptr;
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+    }
+
+    uint8_t der[ES256_MAX_DER_SIGNATURE_LENGTH];
+    size_t derLength = sizeof(der);
+    if (EVP_PKEY_sign(_signContext, der, &derLength, hash, hashLength) <= 0) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    // Convert from DER to r|s.
+    const unsigned char* next = der;
+    ECDSA_SIG* ecdsaSignature = d2i_ECDSA_SIG(nullptr, &next, (long)derLength);
+    if (ecdsaSignature == nullptr) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    bool ok = GetRawSignature(ecdsaSignature, signature);
+    ECDSA_SIG_free(ecdsaSignature);
+    return (ok) ? TEEP_ERR_SUCCESS : TEEP_ERR_PERMANENT_ERROR;
+}
+
+teep_error_code_t TeepKeyHandle::VerifyHash(
+    _In_reads_(hashLength) const uint8_t* hash,
+    size_t hashLength,
+    _In_reads_(TEEP_ES256_SIGNATURE_LENGTH) const uint8_t* signature)
+{
+    if (_verifyContext == nullptr) {
+        _verifyContext = EVP_PKEY_CTX_new(_key, nullptr);
+        if (_verifyContext == nullptr) {
+            return TEEP_ERR_TEMPORARY_ERROR;
+        }
+        if (EVP_PKEY_verify_init(_verifyContext) <= 0) {
+            EVP_PKEY_CTX_free(_verifyContext);
+            _verifyContext = nullptr;
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+    }
+
+    // Convert from r|s to DER.
+    ECDSA_SIG* ecdsaSignature = ECDSA_SIG_new();
+    if (ecdsaSignature == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    BIGNUM* r = BN_bin2bn(signature, ES256_COORDINATE_LENGTH, nullptr);
+    BIGNUM* s = BN_bin2bn(signature + ES256_COORDINATE_LENGTH, ES256_COORDINATE_LENGTH, nullptr);
+    if (r == nullptr || s == nullptr || !ECDSA_SIG_set0(ecdsaSignature, r, s)) {
+        BN_free(r);
+        BN_free(s);
+        ECDSA_SIG_free(ecdsaSignature);
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    uint8_t der[ES256_MAX_DER_SIGNATURE_LENGTH];
+    int derLength = i2d_ECDSA_SIG(ecdsaSignature, nullptr);
+    if (derLength <= 0 || derLength > (int)sizeof(der)) {
+        ECDSA_SIG_free(ecdsaSignature);
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    unsigned char* out = der;
+    i2d_ECDSA_SIG(ecdsaSignature, &out);
+    ECDSA_SIG_free(ecdsaSignature);
+
+    int result = EVP_PKEY_verify(_verifyContext, der, derLength, hash, hashLength);
+    return (result == 1) ? TEEP_ERR_SUCCESS : TEEP_ERR_PERMANENT_ERROR;
+}
+
+teep_error_code_t TeepKeyHandle::SignMessage(
+    _In_reads_(messageLength) const uint8_t* message,
+    size_t messageLength,
+    _Out_writes_(TEEP_EDDSA_SIGNATURE_LENGTH) uint8_t* signature)
+{
+    if (_messageSignContext == nullptr) {
+        _messageSignContext = EVP_MD_CTX_new();
+        if (_messageSignContext == nullptr) {
+            return TEEP_ERR_TEMPORARY_ERROR;
+        }
+    }
+
+    if (EVP_DigestSignInit(_messageSignContext, nullptr, nullptr, nullptr, _key) <= 0) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    size_t signatureLength = TEEP_EDDSA_SIGNATURE_LENGTH;
+    if (EVP_DigestSign(_messageSignContext, signature, &signatureLength, message, messageLength) <= 0 ||
+        signatureLength != TEEP_EDDSA_SIGNATURE_LENGTH) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TeepKeyHandle::VerifyMessage(
+    _In_reads_(messageLength) const uint8_t* message,
+    size_t messageLength,
+    _In_reads_(TEEP_EDDSA_SIGNATURE_LENGTH) const uint8_t* signature)
+{
+    if (_messageVerifyContext == nullptr) {
+        _messageVerifyContext = EVP_MD_CTX_new();
+        if (_messageVerifyContext == nullptr) {
+            return TEEP_ERR_TEMPORARY_ERROR;
+        }
+    }
+
+    if (EVP_DigestVerifyInit(_messageVerifyContext, nullptr, nullptr, nullptr, _key) <= 0) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    int result = EVP_DigestVerify(_messageVerifyContext, signature, TEEP_EDDSA_SIGNATURE_LENGTH, message, messageLength);
+    return (result == 1) ? TEEP_ERR_SUCCESS : TEEP_ERR_PERMANENT_ERROR;
+}
@@ -0,0 +1,75 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <string>
+#include "common.h"
+#include "openssl/evp.h"
+
+#define TEEP_ES256_SIGNATURE_LENGTH 64 // r|s form (RFC 9053 section 2.1).
+#define TEEP_EDDSA_SIGNATURE_LENGTH 64
+
+// OpenSSL state for signing or verifying with a key, set up for each
+// operation.  Only the key ID is remembered across operations, since
+// keeping the EVP contexts warm made no measurable difference next to the
+// EC arithmetic.
+class TeepKeyHandle
+{
+public:
+    explicit TeepKeyHandle(_In_ const struct t_cose_key* key);
+    ~TeepKeyHandle();
+
+    bool IsValid(void) const { return _key != nullptr; }
+
+    // Get the ID of a key, the SHA-256 hash of its DER-encoded public key.
+    // It is computed once per key and remembered until Release.  The
+    // remembered ID holds a reference to the key, so a key freed any
+    // other way is leaked rather than giving its ID to a new key that
+    // gets the same address.
+    static bool GetKeyId(_In_ const struct t_cose_key* key, _Out_ std::string& keyId);
+
+    // Forget the ID of a key that is about to be freed.  The crypto
+    // provider's free_key calls this.
+    static void Release(_In_ const struct t_cose_key* key);
+
+    // Get how many key IDs are remembered.
+    static size_t GetKeyIdCount(void);
+
+    // Set up fixed-base precomputation for an EC key, where OpenSSL
+    // supports it, and start filling its nonce pool if it is a signing
+    // key.  Call this when a key is loaded, before the key is shared
+    // between threads.
+    static void Precompute(_In_ const struct t_cose_key* key);
+
+    // ES256 operations on a SHA-256 hash, with the signature in r|s form.
+    teep_error_code_t SignHash(
+        _In_reads_(hashLength) const uint8_t* hash,
+        size_t hashLength,
+        _Out_writes_(TEEP_ES256_SIGNATURE_LENGTH) uint8_t* signature);
+    teep_error_code_t VerifyHash(
+        _In_reads_(hashLength) const uint8_t* hash,
+        size_t hashLength,
+        _In_reads_(TEEP_ES256_SIGNATURE_LENGTH) const uint8_t* signature);
+
+    // EdDSA operations on a whole message, with a 64-byte signature.
+    teep_error_code_t SignMessage(
+        _In_reads_(messageLength) const uint8_t* message,
+        size_t messageLength,
+        _Out_writes_(TEEP_EDDSA_SIGNATURE_LENGTH) uint8_t* signature);
+    teep_error_code_t VerifyMessage(
+        _In_reads_(messageLength) const uint8_t* message,
+        size_t messageLength,
+        _In_reads_(TEEP_EDDSA_SIGNATURE_LENGTH) const uint8_t* signature);
+
+private:
+    TeepKeyHandle(const TeepKeyHandle&) = delete;
+    TeepKeyHandle& operator=(const TeepKeyHandle&) = delete;
+
+    // Compute the key ID, the SHA-256 hash of the DER-encoded public key.
+    static bool ComputeKeyId(_In_ EVP_PKEY* key, _Out_ std::string& keyId);
+
+    EVP_PKEY* _key;
+    EVP_PKEY_CTX* _signContext;
+    EVP_PKEY_CTX* _verifyContext;
+    EVP_MD_CTX* _messageSignContext;
+    EVP_MD_CTX* _messageVerifyContext;
+};
@@ -0,0 +1,452 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+//
+// This file contains the OpenSSL crypto provider, which is the reference
+// implementation of teep_crypto_provider_t.
+#include <limits.h>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include "t_cose/t_cose_common.h"
+#include "common.h"
+#include "CryptoProvider.h"
+#include "EcdsaNoncePool.h"
+#include "Ed25519BatchVerifier.h"
+#include "KeyHandle.h"
+extern "C" {
+#include "openssl/evp.h"
+#include "openssl/hmac.h"
+#include "openssl/pem.h"
+#include "openssl/rand.h"
+#include "openssl/x509.h"
+};
+
+static teep_error_code_t openssl_load_private_key(
+    _In_z_ const char* file_name,
+    _Out_ struct t_cose_key* key)
+{
+    FILE* fp = fopen(file_name, "rb");
+    if (fp == nullptr) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    key->key.ptr = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if (key->key.ptr == nullptr) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+static teep_error_code_t openssl_load_public_key(
+    _In_z_ const char* file_name,
+    _Out_ struct t_cose_key* key)
+{
+    FILE* fp = fopen(file_name, "rb");
+    if (fp == nullptr) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    key->key.ptr = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if (key->key.ptr == nullptr) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+static teep_error_code_t openssl_import_public_key(
+    UsefulBufC der,
+    _Out_ struct t_cose_key* key)
+{
+    const unsigned char* p = (const unsigned char*)der.ptr;
+    key->key.ptr = d2i_PUBKEY(nullptr, &p, (long)der.len);
+    if (key->key.ptr == nullptr) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+/**
+ * \brief Make a key pair in OpenSSL library form.
+ *
+ * \param[in] kind      The algorithm to sign with.
+ * \param[out] key      The key pair. This must be freed.
+ */
+static teep_error_code_t openssl_generate_key(
+    teep_signature_kind_t kind,
+    _Out_ struct t_cose_key* key)
+{
+    int ossl_key_type;
+    switch (kind) {
+    case TEEP_SIGNATURE_ES256:
+        ossl_key_type = EVP_PKEY_EC;
+        break;
+    case TEEP_SIGNATURE_EDDSA:
+        ossl_key_type = EVP_PKEY_ED25519;
+        break;
+    default:
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(ossl_key_type, NULL);
+    if (ctx == NULL) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    EVP_PKEY* pkey = nullptr;
+    bool ok = (EVP_PKEY_keygen_init(ctx) > 0) &&
+              (ossl_key_type != EVP_PKEY_EC || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) == 1) &&
+              (EVP_PKEY_keygen(ctx, &pkey) == 1);
+    EVP_PKEY_CTX_free(ctx);
+    if (!ok) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    key->key.ptr = pkey;
+    return TEEP_ERR_SUCCESS;
+}
+
+static teep_error_code_t openssl_save_key(
+    _In_ const struct t_cose_key* key,
+    _In_z_ const char* private_file_name,
+    _In_z_ const char* public_file_name)
+{
+    EVP_PKEY* pkey = (EVP_PKEY*)key->key.ptr;
+
+    // Write key pair with private key, for future use by the TAM.
+    FILE* fp = fopen(private_file_name, "wb");
+    if (fp == nullptr) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    int succeeded = PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL);
+    fclose(fp);
+    if (!succeeded) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    // Write public key for use by TEEP Agents.
+    fp = fopen(public_file_name, "wb");
+    if (fp == nullptr) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    succeeded = PEM_write_PUBKEY(fp, pkey);
+    fclose(fp);
+    if (!succeeded) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    return TEEP_ERR_SUCCESS;
+}
+
+static void openssl_free_key(_Inout_ struct t_cose_key* key)
+{
+    TeepKeyHandle::Release(key);
+    EVP_PKEY_free((EVP_PKEY*)key->key.ptr);
+    key->key.ptr = nullptr;
+}
+
+static teep_error_code_t openssl_get_key_id(
+    teep_signature_kind_t kind,
+    _In_ const struct t_cose_key* key,
+    _Inout_ UsefulBuf* key_id)
+{
+    if (key_id->len < TEEP_SHA256_LENGTH) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    TEEP_UNUSED(kind);
+    std::string keyId;
+    if (!TeepKeyHandle::GetKeyId(key, keyId)) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    memcpy(key_id->ptr, keyId.data(), keyId.size());
+    key_id->len = keyId.size();
+    return TEEP_ERR_SUCCESS;
+}
+
+static teep_error_code_t openssl_sha256(
+    _In_reads_(segment_count) const UsefulBufC* segments,
+    size_t segment_count,
+    _Out_writes_(TEEP_SHA256_LENGTH) uint8_t* hash)
+{
+    thread_local std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> context_holder(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    EVP_MD_CTX* context = context_holder.get();
+    if (context == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    bool ok = EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+    for (size_t i = 0; i < segment_count; i++) {
+        ok = ok && EVP_DigestUpdate(context, segments[i].ptr, segments[i].len);
+    }
+    unsigned int hash_length;
+    ok = ok && EVP_DigestFinal_ex(context, hash, &hash_length);
+    return (ok && hash_length == TEEP_SHA256_LENGTH) ? TEEP_ERR_SUCCESS : TEEP_ERR_TEMPORARY_ERROR;
+}
+
+static teep_error_code_t openssl_sign(
+    teep_signature_kind_t kind,
+    _In_ const struct t_cose_key* key,
+    _In_reads_(data_length) const uint8_t* data,
+    size_t data_length,
+    _Out_writes_(TEEP_SIGNATURE_LENGTH) uint8_t* signature)
+{
+    TeepKeyHandle handle(key);
+    if (!handle.IsValid()) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    switch (kind) {
+    case TEEP_SIGNATURE_ES256: return handle.SignHash(data, data_length, signature);
+    case TEEP_SIGNATURE_EDDSA: return handle.SignMessage(data, data_length, signature);
+    default: return TEEP_ERR_PERMANENT_ERROR;
+    }
+}
+
+static teep_error_code_t openssl_verify(
+    teep_signature_kind_t kind,
+    _In_ const struct t_cose_key* key,
+    _In_reads_(data_length) const uint8_t* data,
+    size_t data_length,
+    _In_reads_(TEEP_SIGNATURE_LENGTH) const uint8_t* signature)
+{
+    TeepKeyHandle handle(key);
+    if (!handle.IsValid()) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    switch (kind) {
+    case TEEP_SIGNATURE_ES256: return handle.VerifyHash(data, data_length, signature);
+    case TEEP_SIGNATURE_EDDSA: return handle.VerifyMessage(data, data_length, signature);
+    default: return TEEP_ERR_PERMANENT_ERROR;
+    }
+}
+
+static teep_error_code_t openssl_verify_eddsa_batch(
+    _In_reads_(count) const teep_eddsa_batch_entry_t* entries,
+    size_t count)
+{
+    thread_local std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> context_holder(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    thread_local TeepEd25519BatchVerifier verifier;
+    EVP_MD_CTX* context = context_holder.get();
+    if (context == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    // OpenSSL has no batch verification, so it only supplies the public
+    // keys and the SHA-512 hashes of R || A || M.
+    verifier.Clear();
+    for (size_t i = 0; i < count; i++) {
+        const teep_eddsa_batch_entry_t* entry = &entries[i];
+        EVP_PKEY* pkey = (EVP_PKEY*)entry->key->key.ptr;
+        uint8_t public_key[TEEP_ED25519_PUBLIC_KEY_LENGTH];
+        size_t public_key_length = sizeof(public_key);
+        if (EVP_PKEY_id(pkey) != EVP_PKEY_ED25519 ||
+            EVP_PKEY_get_raw_public_key(pkey, public_key, &public_key_length) != 1 ||
+            public_key_length != sizeof(public_key)) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+
+        uint8_t hash[TEEP_ED25519_HASH_LENGTH];
+        unsigned int hash_length;
+        bool ok = EVP_DigestInit_ex(context, EVP_sha512(), nullptr) &&
+                  EVP_DigestUpdate(context, entry->signature, 32) &&
+                  EVP_DigestUpdate(context, public_key, sizeof(public_key));
+        for (size_t j = 0; j < entry->segment_count; j++) {
+            ok = ok && EVP_DigestUpdate(context, entry->segments[j].ptr, entry->segments[j].len);
+        }
+        ok = ok && EVP_DigestFinal_ex(context, hash, &hash_length);
+        if (!ok || hash_length != sizeof(hash)) {
+            return TEEP_ERR_TEMPORARY_ERROR;
+        }
+        if (!verifier.Add(public_key, entry->signature, hash)) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+    }
+    return verifier.Verify() ? TEEP_ERR_SUCCESS : TEEP_ERR_PERMANENT_ERROR;
+}
+
+static teep_error_code_t openssl_random(
+    _Out_writes_(length) void* buffer,
+    size_t length)
+{
+    if (length > INT_MAX) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    return (RAND_bytes((unsigned char*)buffer, (int)length) == 1) ? TEEP_ERR_SUCCESS : TEEP_ERR_TEMPORARY_ERROR;
+}
+
+// Set up a per-thread AES-128-GCM context for one operation.
+static EVP_CIPHER_CTX* get_aead_context(
+    int encrypt,
+    _In_reads_(TEEP_AEAD_KEY_LENGTH) const uint8_t* key,
+    _In_reads_(TEEP_AEAD_NONCE_LENGTH) const uint8_t* nonce)
+{
+    thread_local std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> context_holder(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+    EVP_CIPHER_CTX* context = context_holder.get();
+    if (context == nullptr) {
+        return nullptr;
+    }
+
+    // The default GCM nonce length is the 12 bytes used here.
+    if (!EVP_CipherInit_ex(context, EVP_aes_128_gcm(), nullptr, key, nonce, encrypt)) {
+        return nullptr;
+    }
+    return context;
+}
+
+static teep_error_code_t openssl_aead_seal(
+    _In_reads_(TEEP_AEAD_KEY_LENGTH) const uint8_t* key,
+    _In_reads_(TEEP_AEAD_NONCE_LENGTH) const uint8_t* nonce,
+    UsefulBufC aad,
+    UsefulBufC plaintext,
+    _Out_writes_(plaintext.len) uint8_t* ciphertext,
+    _Out_writes_(TEEP_AEAD_TAG_LENGTH) uint8_t* tag)
+{
+    if (aad.len > INT_MAX || plaintext.len > INT_MAX) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    EVP_CIPHER_CTX* context = get_aead_context(1, key, nonce);
+    if (context == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    int length;
+    bool ok = (aad.len == 0 || EVP_EncryptUpdate(context, nullptr, &length, (const unsigned char*)aad.ptr, (int)aad.len)) &&
+              (plaintext.len == 0 || EVP_EncryptUpdate(context, ciphertext, &length, (const unsigned char*)plaintext.ptr, (int)plaintext.len)) &&
+              EVP_EncryptFinal_ex(context, ciphertext + plaintext.len, &length) &&
+              EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_GET_TAG, TEEP_AEAD_TAG_LENGTH, tag);
+    return (ok) ? TEEP_ERR_SUCCESS : TEEP_ERR_TEMPORARY_ERROR;
+}
+
+static teep_error_code_t openssl_aead_open(
+    _In_reads_(TEEP_AEAD_KEY_LENGTH) const uint8_t* key,
+    _In_reads_(TEEP_AEAD_NONCE_LENGTH) const uint8_t* nonce,
+    UsefulBufC aad,
+    UsefulBufC ciphertext,
+    _In_reads_(TEEP_AEAD_TAG_LENGTH) const uint8_t* tag,
+    _Out_writes_(ciphertext.len) uint8_t* plaintext)
+{
+    if (aad.len > INT_MAX || ciphertext.len > INT_MAX) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    EVP_CIPHER_CTX* context = get_aead_context(0, key, nonce);
+    if (context == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    int length;
+    if (!(aad.len == 0 || EVP_DecryptUpdate(context, nullptr, &length, (const unsigned char*)aad.ptr, (int)aad.len)) ||
+        !(ciphertext.len == 0 || EVP_DecryptUpdate(context, plaintext, &length, (const unsigned char*)ciphertext.ptr, (int)ciphertext.len)) ||
+        !EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_SET_TAG, TEEP_AEAD_TAG_LENGTH, (void*)tag)) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    // Finalizing checks the tag.
+    return (EVP_DecryptFinal_ex(context, plaintext + ciphertext.len, &length) > 0) ? TEEP_ERR_SUCCESS : TEEP_ERR_PERMANENT_ERROR;
+}
+
+static teep_error_code_t openssl_hmac_sha256(
+    _In_reads_(key_length) const uint8_t* key,
+    size_t key_length,
+    _In_reads_(segment_count) const UsefulBufC* segments,
+    size_t segment_count,
+    _Out_writes_(TEEP_HMAC_SHA256_LENGTH) uint8_t* mac)
+{
+    if (key_length > INT_MAX) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    thread_local std::unique_ptr<HMAC_CTX, decltype(&HMAC_CTX_free)> context_holder(HMAC_CTX_new(), HMAC_CTX_free);
+    HMAC_CTX* context = context_holder.get();
+    if (context == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    bool ok = HMAC_Init_ex(context, key, (int)key_length, EVP_sha256(), nullptr);
+    for (size_t i = 0; i < segment_count; i++) {
+        ok = ok && HMAC_Update(context, (const unsigned char*)segments[i].ptr, segments[i].len);
+    }
+    unsigned int mac_length;
+    ok = ok && HMAC_Final(context, mac, &mac_length);
+    return (ok && mac_length == TEEP_HMAC_SHA256_LENGTH) ? TEEP_ERR_SUCCESS : TEEP_ERR_TEMPORARY_ERROR;
+}
+
+static teep_error_code_t openssl_generate_agreement_key(
+    _Out_ struct t_cose_key* key,
+    _Inout_ UsefulBuf* public_key)
+{
+    // Unlike a signing key, an agreement key is used once, so there is
+    // nothing to precompute.
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (ctx == NULL) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    EVP_PKEY* pkey = nullptr;
+    bool ok = (EVP_PKEY_keygen_init(ctx) > 0) &&
+              (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) == 1) &&
+              (EVP_PKEY_keygen(ctx, &pkey) == 1);
+    EVP_PKEY_CTX_free(ctx);
+    if (!ok) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    int length = i2d_PUBKEY(pkey, nullptr);
+    if (length <= 0 || (size_t)length > public_key->len) {
+        EVP_PKEY_free(pkey);
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    unsigned char* p = (unsigned char*)public_key->ptr;
+    public_key->len = i2d_PUBKEY(pkey, &p);
+    key->key.ptr = pkey;
+    return TEEP_ERR_SUCCESS;
+}
+
+static teep_error_code_t openssl_agree(
+    _In_ const struct t_cose_key* key,
+    UsefulBufC peer_public_key,
+    _Out_writes_(TEEP_ECDH_SECRET_LENGTH) uint8_t* secret)
+{
+    const unsigned char* p = (const unsigned char*)peer_public_key.ptr;
+    EVP_PKEY* peer = d2i_PUBKEY(nullptr, &p, (long)peer_public_key.len);
+    if (peer == nullptr) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    // Decoding checks that the point is on its curve, and setting the
+    // peer checks that the curve matches our own.
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new((EVP_PKEY*)key->key.ptr, nullptr);
+    size_t secret_length = TEEP_ECDH_SECRET_LENGTH;
+    bool ok = (ctx != nullptr) &&
+              (EVP_PKEY_derive_init(ctx) == 1) &&
+              (EVP_PKEY_derive_set_peer(ctx, peer) == 1) &&
+              (EVP_PKEY_derive(ctx, secret, &secret_length) == 1) &&
+              (secret_length == TEEP_ECDH_SECRET_LENGTH);
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    return (ok) ? TEEP_ERR_SUCCESS : TEEP_ERR_PERMANENT_ERROR;
+}
+
+const teep_crypto_provider_t teep_openssl_crypto_provider = {
+    "OpenSSL",
+    openssl_load_private_key,
+    openssl_load_public_key,
+    openssl_import_public_key,
+    openssl_generate_key,
+    openssl_save_key,
+    openssl_free_key,
+    openssl_get_key_id,
+    openssl_sha256,
+    openssl_sign,
+    openssl_verify,
+    openssl_random,
+    openssl_aead_seal,
+    openssl_aead_open,
+    openssl_hmac_sha256,
+    openssl_generate_agreement_key,
+    openssl_agree,
+    openssl_verify_eddsa_batch,
+};
+
+void teep_set_es256_precomputation(int enabled)
+{
+    TeepEcdsaNoncePool::SetEnabled(enabled != 0);
+}
+
+void teep_precompute_signing_key(_In_ const struct t_cose_key* key_pair)
+{
+    TeepKeyHandle::Precompute(key_pair);
+}
@@ -0,0 +1,128 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <string.h>
+#include "OutboundMessage.h"
+
+TeepOutboundMessage::TeepOutboundMessage()
+{
+    _blockUsed = 0;
+    _length = 0;
+}
+
+TeepOutboundMessage::TeepOutboundMessage(TeepOutboundMessage&& other) noexcept
+    : _segments(std::move(other._segments)),
+      _owners(std::move(other._owners)),
+      _blocks(std::move(other._blocks)),
+      _blockUsed(other._blockUsed),
+      _length(other._length)
+{
+    other.Clear();
+}
+
+TeepOutboundMessage& TeepOutboundMessage::operator=(TeepOutboundMessage&& other) noexcept
+{
+    if (this != &other) {
+        _segments = std::move(other._segments);
+        _owners = std::move(other._owners);
+        _blocks = std::move(other._blocks);
+        _blockUsed = other._blockUsed;
+        _length = other._length;
+        other.Clear();
+    }
+    return *this;
+}
+
+void TeepOutboundMessage::Clear(void)
+{
+    _segments.clear();
+    _owners.clear();
+    _blocks.clear();
+    _blockUsed = 0;
+    _length = 0;
+}
+
+// Add a segment, merging it with the previous one if they are adjacent.
+void TeepOutboundMessage::AppendSegment(UsefulBufC bytes)
+{
+    if (bytes.len == 0) {
+        return;
+    }
+    _length += bytes.len;
+    if (!_segments.empty()) {
+        UsefulBufC& last = _segments.back();
+        if ((const uint8_t*)last.ptr + last.len == (const uint8_t*)bytes.ptr) {
+            last.len += bytes.len;
+            return;
+        }
+    }
+    _segments.push_back(bytes);
+}
+
+void TeepOutboundMessage::AppendReference(UsefulBufC bytes, _In_ const std::shared_ptr<const void>& owner)
+{
+    if (owner && (_owners.empty() || _owners.back() != owner)) {
+        _owners.push_back(owner);
+    }
+    AppendSegment(bytes);
+}
+
+void TeepOutboundMessage::AppendCopy(UsefulBufC bytes)
+{
+    const uint8_t* source = (const uint8_t*)bytes.ptr;
+    size_t remaining = bytes.len;
+    while (remaining > 0) {
+        if (_blocks.empty() || _blockUsed == TEEP_OUTBOUND_MESSAGE_BLOCK_SIZE) {
+            _blocks.emplace_back(new uint8_t[TEEP_OUTBOUND_MESSAGE_BLOCK_SIZE]);
+            _blockUsed = 0;
+        }
+        size_t count = TEEP_OUTBOUND_MESSAGE_BLOCK_SIZE - _blockUsed;
+        if (count > remaining) {
+            count = remaining;
+        }
+        uint8_t* destination = _blocks.back().get() + _blockUsed;
+        memcpy(destination, source, count);
+        _blockUsed += count;
+        AppendSegment({ destination, count });
+        source += count;
+        remaining -= count;
+    }
+}
+
+void TeepOutboundMessage::Append(_Inout_ TeepOutboundMessage&& other)
+{
+    for (std::shared_ptr<const void>& owner : other._owners) {
+        _owners.push_back(std::move(owner));
+    }
+    for (std::unique_ptr<uint8_t[]>& block : other._blocks) {
+        _blocks.push_back(std::move(block));
+    }
+
+    // New copies go into a fresh block, since the last block moved from
+    // the other message may be partly used by its segments.
+    _blockUsed = TEEP_OUTBOUND_MESSAGE_BLOCK_SIZE;
+
+    for (const UsefulBufC& segment : other._segments) {
+        AppendSegment(segment);
+    }
+    other.Clear();
+}
+
+void TeepOutboundMessage::AppendShared(_In_ const std::shared_ptr<const TeepOutboundMessage>& other)
+{
+    if (!other) {
+        return;
+    }
+    _owners.push_back(other);
+    for (const UsefulBufC& segment : other->_segments) {
+        AppendSegment(segment);
+    }
+}
+
+void TeepOutboundMessage::Flatten(_Out_ std::vector<uint8_t>& buffer) const
+{
+    buffer.clear();
+    buffer.reserve(_length);
+    for (const UsefulBufC& segment : _segments) {
+        buffer.insert(buffer.end(), (const uint8_t*)segment.ptr, (const uint8_t*)segment.ptr + segment.len);
+    }
+}
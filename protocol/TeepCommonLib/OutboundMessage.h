@@ -0,0 +1,58 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <memory>
+#include <vector>
+#include "qcbor/UsefulBuf.h"
+#include "teep_sal.h"
+
+#define TEEP_OUTBOUND_MESSAGE_BLOCK_SIZE 4096
+
+// An outbound message held as a list of segments, so that large payloads
+// such as manifests can go from where they are stored to the socket
+// without being copied.  Each segment either points into storage kept
+// alive by a reference-counted owner, or into small blocks owned by the
+// message itself.  Messages are move-only: ownership passes from the
+// composer to the transport, while the underlying storage may be shared
+// with caches and the manifest repository.
+class TeepOutboundMessage
+{
+public:
+    TeepOutboundMessage();
+    TeepOutboundMessage(TeepOutboundMessage&& other) noexcept;
+    TeepOutboundMessage& operator=(TeepOutboundMessage&& other) noexcept;
+    TeepOutboundMessage(const TeepOutboundMessage&) = delete;
+    TeepOutboundMessage& operator=(const TeepOutboundMessage&) = delete;
+
+    // Reference bytes in place.  The owner keeps them alive for as long
+    // as the message, or any message built from it, needs them.
+    void AppendReference(UsefulBufC bytes, _In_ const std::shared_ptr<const void>& owner);
+
+    // Copy a few bytes, such as protocol framing, into the message.
+    void AppendCopy(UsefulBufC bytes);
+
+    // Move all segments of another message onto the end of this one.
+    void Append(_Inout_ TeepOutboundMessage&& other);
+
+    // Reference all segments of a shared message, such as a cached one.
+    void AppendShared(_In_ const std::shared_ptr<const TeepOutboundMessage>& other);
+
+    void Clear(void);
+
+    size_t GetLength(void) const { return _length; }
+    bool IsEmpty(void) const { return _length == 0; }
+    const std::vector<UsefulBufC>& GetSegments(void) const { return _segments; }
+
+    // Copy the segments into one contiguous buffer, for consumers that
+    // cannot gather.
+    void Flatten(_Out_ std::vector<uint8_t>& buffer) const;
+
+private:
+    void AppendSegment(UsefulBufC bytes);
+
+    std::vector<UsefulBufC> _segments;
+    std::vector<std::shared_ptr<const void>> _owners;
+    std::vector<std::unique_ptr<uint8_t[]>> _blocks;
+    size_t _blockUsed; // Bytes used in the last block.
+    size_t _length;
+};
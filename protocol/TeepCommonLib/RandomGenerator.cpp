@@ -0,0 +1,185 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <atomic>
+#include <mutex>
+#include <string.h>
+#if !defined(OE_BUILD_ENCLAVE) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+#include "CryptoProvider.h"
+#include "RandomGenerator.h"
+
+static inline uint32_t RotateLeft(uint32_t value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+static inline uint32_t LoadLittleEndian32(_In_reads_(4) const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void StoreLittleEndian32(_Out_writes_(4) uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = RotateLeft(d, 16); \
+    c += d; b ^= c; b = RotateLeft(b, 12); \
+    a += b; d ^= a; d = RotateLeft(d, 8);  \
+    c += d; b ^= c; b = RotateLeft(b, 7);
+
+// Incremented in a child process after fork(), which has a copy of every
+// generator's state and must not repeat the parent's output.  Checking a
+// counter is cheaper than calling getpid() on every request.  Enclaves and
+// Windows processes cannot fork.
+static std::atomic<unsigned int> g_ForkGeneration{ 0 };
+
+#if !defined(OE_BUILD_ENCLAVE) && !defined(_WIN32)
+static void OnForkChild(void)
+{
+    g_ForkGeneration++;
+}
+#endif
+
+// Clear memory in a way the compiler will not optimize away.
+static void SecureZero(_Out_writes_(length) void* buffer, size_t length)
+{
+    volatile uint8_t* p = (volatile uint8_t*)buffer;
+    while (length-- > 0) {
+        *p++ = 0;
+    }
+}
+
+void TeepRandomGenerator::Block(
+    _In_reads_(TEEP_CHACHA20_KEY_LENGTH) const uint8_t* key,
+    uint32_t counter,
+    _In_reads_(TEEP_CHACHA20_NONCE_LENGTH) const uint8_t* nonce,
+    _Out_writes_(TEEP_CHACHA20_BLOCK_LENGTH) uint8_t* block)
+{
+    // RFC 8439 section 2.3.
+    uint32_t input[16];
+    input[0] = 0x61707865;
+    input[1] = 0x3320646e;
+    input[2] = 0x79622d32;
+    input[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) {
+        input[4 + i] = LoadLittleEndian32(key + 4 * i);
+    }
+    input[12] = counter;
+    for (int i = 0; i < 3; i++) {
+        input[13 + i] = LoadLittleEndian32(nonce + 4 * i);
+    }
+
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+    for (int round = 0; round < 10; round++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        StoreLittleEndian32(block + 4 * i, x[i] + input[i]);
+    }
+    SecureZero(x, sizeof(x));
+    SecureZero(input, sizeof(input));
+}
+
+TeepRandomGenerator::TeepRandomGenerator()
+    : _position(TEEP_RANDOM_BUFFER_SIZE), _outputSinceReseed(0), _seeded(false), _forkGeneration(0)
+{
+    memset(_key, 0, sizeof(_key));
+    memset(_buffer, 0, sizeof(_buffer));
+}
+
+TeepRandomGenerator::~TeepRandomGenerator()
+{
+    SecureZero(_key, sizeof(_key));
+    SecureZero(_buffer, sizeof(_buffer));
+}
+
+TeepRandomGenerator& TeepRandomGenerator::GetForThread(void)
+{
+#if !defined(OE_BUILD_ENCLAVE) && !defined(_WIN32)
+    static std::once_flag registered;
+    std::call_once(registered, [] { (void)pthread_atfork(nullptr, nullptr, OnForkChild); });
+#endif
+    thread_local TeepRandomGenerator generator;
+    return generator;
+}
+
+teep_error_code_t TeepRandomGenerator::Reseed(void)
+{
+    uint8_t seed[TEEP_CHACHA20_KEY_LENGTH];
+    teep_error_code_t result = teep_get_crypto_provider()->random(seed, sizeof(seed));
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    for (size_t i = 0; i < sizeof(_key); i++) {
+        _key[i] ^= seed[i];
+    }
+    SecureZero(seed, sizeof(seed));
+
+    // Drop anything generated from the old key.
+    SecureZero(_buffer, sizeof(_buffer));
+    _position = TEEP_RANDOM_BUFFER_SIZE;
+    _outputSinceReseed = 0;
+    _seeded = true;
+    _forkGeneration = g_ForkGeneration;
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TeepRandomGenerator::Refill(void)
+{
+    // A zero nonce is safe, since the key changes on every refill.
+    static const uint8_t nonce[TEEP_CHACHA20_NONCE_LENGTH] = { 0 };
+    for (uint32_t i = 0; i < TEEP_RANDOM_BUFFER_SIZE / TEEP_CHACHA20_BLOCK_LENGTH; i++) {
+        Block(_key, i, nonce, _buffer + i * TEEP_CHACHA20_BLOCK_LENGTH);
+    }
+
+    // Replace the key with the start of the output.
+    memcpy(_key, _buffer, sizeof(_key));
+    SecureZero(_buffer, sizeof(_key));
+    _position = sizeof(_key);
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TeepRandomGenerator::Generate(_Out_writes_(length) void* buffer, size_t length)
+{
+    if (!_seeded || _outputSinceReseed >= TEEP_RANDOM_RESEED_INTERVAL || _forkGeneration != g_ForkGeneration) {
+        teep_error_code_t result = Reseed();
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+    }
+
+    uint8_t* out = (uint8_t*)buffer;
+    while (length > 0) {
+        if (_position == TEEP_RANDOM_BUFFER_SIZE) {
+            teep_error_code_t result = Refill();
+            if (result != TEEP_ERR_SUCCESS) {
+                return result;
+            }
+        }
+        size_t count = TEEP_RANDOM_BUFFER_SIZE - _position;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(out, _buffer + _position, count);
+        SecureZero(_buffer + _position, count);
+        _position += count;
+        _outputSinceReseed += count;
+        out += count;
+        length -= count;
+    }
+    return TEEP_ERR_SUCCESS;
+}
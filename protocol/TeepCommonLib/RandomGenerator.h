@@ -0,0 +1,62 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+#define TEEP_CHACHA20_KEY_LENGTH 32
+#define TEEP_CHACHA20_NONCE_LENGTH 12
+#define TEEP_CHACHA20_BLOCK_LENGTH 64
+
+// Bytes of output generated at once.  The first TEEP_CHACHA20_KEY_LENGTH
+// bytes become the next key, and the rest are handed out.
+#define TEEP_RANDOM_BUFFER_SIZE 1024
+
+// Output after which fresh entropy is mixed into the key.
+#define TEEP_RANDOM_RESEED_INTERVAL (1024 * 1024)
+
+// A ChaCha20 generator (RFC 8439) owned by one thread.  It is seeded from
+// the crypto provider's generator, which takes its entropy from the OS,
+// and serves bytes from a buffer, so most requests are a memcpy.  Each
+// refill replaces the key with part of its own output and bytes are wiped
+// from the buffer once handed out, so a later compromise of the state
+// does not reveal earlier output.
+//
+// TEEP mostly asks for 16- and 32-byte tokens, challenges and nonces, for
+// which this is seven to ten times faster than a call to the provider's
+// generator (OpenSSL's RAND_bytes), though no faster for a few hundred
+// bytes.  Run TeepBenchmark "random" to compare.
+class TeepRandomGenerator
+{
+public:
+    ~TeepRandomGenerator();
+
+    // Get the calling thread's generator.
+    static TeepRandomGenerator& GetForThread(void);
+
+    teep_error_code_t Generate(_Out_writes_(length) void* buffer, size_t length);
+
+    // Compute one ChaCha20 block.
+    static void Block(
+        _In_reads_(TEEP_CHACHA20_KEY_LENGTH) const uint8_t* key,
+        uint32_t counter,
+        _In_reads_(TEEP_CHACHA20_NONCE_LENGTH) const uint8_t* nonce,
+        _Out_writes_(TEEP_CHACHA20_BLOCK_LENGTH) uint8_t* block);
+
+private:
+    TeepRandomGenerator();
+    TeepRandomGenerator(const TeepRandomGenerator&) = delete;
+    TeepRandomGenerator& operator=(const TeepRandomGenerator&) = delete;
+
+    // Mix fresh entropy into the key.
+    teep_error_code_t Reseed(void);
+    teep_error_code_t Refill(void);
+
+    uint8_t _key[TEEP_CHACHA20_KEY_LENGTH];
+    uint8_t _buffer[TEEP_RANDOM_BUFFER_SIZE];
+    size_t _position; // Next unused byte in _buffer.
+    size_t _outputSinceReseed;
+    bool _seeded;
+    unsigned int _forkGeneration; // To reseed in a child after fork().
+};
@@ -0,0 +1,128 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <atomic>
+#include <string.h>
+#include "CryptoProvider.h"
+#include "SessionKey.h"
+
+// 0 disables session mode.
+static std::atomic<uint32_t> g_SessionKeyLifetime{ 0 };
+
+void teep_set_session_key_lifetime(uint32_t seconds)
+{
+    g_SessionKeyLifetime = seconds;
+}
+
+uint32_t teep_get_session_key_lifetime(void)
+{
+    return g_SessionKeyLifetime;
+}
+
+// Clear memory in a way the compiler will not optimize away.
+static void SecureZero(_Out_writes_(length) void* buffer, size_t length)
+{
+    volatile uint8_t* p = (volatile uint8_t*)buffer;
+    while (length-- > 0) {
+        *p++ = 0;
+    }
+}
+
+// HKDF-Expand (RFC 5869 section 2.3) for output no longer than one hash.
+static teep_error_code_t HkdfExpand(
+    _In_reads_(TEEP_HMAC_SHA256_LENGTH) const uint8_t* prk,
+    _In_z_ const char* info,
+    _Out_writes_(TEEP_HMAC_SHA256_LENGTH) uint8_t* output)
+{
+    static const uint8_t counter = 1;
+    UsefulBufC segments[] = { { info, strlen(info) }, { &counter, sizeof(counter) } };
+    return teep_get_crypto_provider()->hmac_sha256(prk, TEEP_HMAC_SHA256_LENGTH, segments, 2, output);
+}
+
+TeepSessionKey::TeepSessionKey()
+{
+    memset(_key, 0, sizeof(_key));
+    memset(_keyId, 0, sizeof(_keyId));
+}
+
+TeepSessionKey::~TeepSessionKey()
+{
+    SecureZero(_key, sizeof(_key));
+}
+
+teep_error_code_t TeepSessionKey::GenerateAgreementKey(
+    _Out_ struct t_cose_key* agreementKey,
+    _Out_ std::vector<uint8_t>& publicShare)
+{
+    publicShare.resize(TEEP_MAX_AGREEMENT_PUBLIC_KEY_LENGTH);
+    UsefulBuf share = { publicShare.data(), publicShare.size() };
+    teep_error_code_t result = teep_get_crypto_provider()->generate_agreement_key(agreementKey, &share);
+    if (result != TEEP_ERR_SUCCESS) {
+        publicShare.clear();
+        return result;
+    }
+    publicShare.resize(share.len);
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TeepSessionKey::Derive(
+    _In_ const struct t_cose_key* agreementKey,
+    UsefulBufC peerShare,
+    UsefulBufC queryResponse,
+    _Out_ std::shared_ptr<const TeepSessionKey>& sessionKey)
+{
+    sessionKey.reset();
+    uint32_t lifetime = teep_get_session_key_lifetime();
+    if (lifetime == 0) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    const teep_crypto_provider_t* provider = teep_get_crypto_provider();
+    uint8_t secret[TEEP_ECDH_SECRET_LENGTH];
+    teep_error_code_t result = provider->agree(agreementKey, peerShare, secret);
+    if (result != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("Session key agreement failed\n");
+        return result;
+    }
+
+    // HKDF-Extract.
+    uint8_t prk[TEEP_HMAC_SHA256_LENGTH];
+    UsefulBufC ikm = { secret, sizeof(secret) };
+    result = provider->hmac_sha256((const uint8_t*)queryResponse.ptr, queryResponse.len, &ikm, 1, prk);
+    SecureZero(secret, sizeof(secret));
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+
+    std::shared_ptr<TeepSessionKey> key(new TeepSessionKey());
+    uint8_t keyId[TEEP_HMAC_SHA256_LENGTH];
+    result = HkdfExpand(prk, "TEEP session key", key->_key);
+    if (result == TEEP_ERR_SUCCESS) {
+        result = HkdfExpand(prk, "TEEP session key ID", keyId);
+    }
+    SecureZero(prk, sizeof(prk));
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    memcpy(key->_keyId, keyId, sizeof(key->_keyId));
+
+    // Stop sending a tenth of the lifetime before expiry, up to a limit.
+    uint32_t margin = lifetime / 10;
+    if (margin > TEEP_SESSION_KEY_MAX_SEND_MARGIN_SECONDS) {
+        margin = TEEP_SESSION_KEY_MAX_SEND_MARGIN_SECONDS;
+    }
+    auto now = std::chrono::steady_clock::now();
+    key->_expiry = now + std::chrono::seconds(lifetime);
+    key->_sendExpiry = key->_expiry - std::chrono::seconds(margin);
+    sessionKey = key;
+    return TEEP_ERR_SUCCESS;
+}
+
+bool TeepSessionKey::IsExpired(void) const
+{
+    return std::chrono::steady_clock::now() >= _expiry;
+}
+
+bool TeepSessionKey::CanSend(void) const
+{
+    return std::chrono::steady_clock::now() < _sendExpiry;
+}
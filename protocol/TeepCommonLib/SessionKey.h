@@ -0,0 +1,65 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "common.h"
+
+#define TEEP_SESSION_KEY_LENGTH 32   // HMAC 256/256.
+#define TEEP_SESSION_KEY_ID_LENGTH 8
+
+// Longest time before expiry that a key stops being used to send, so
+// that a message sent under it does not arrive after it has expired.
+#define TEEP_SESSION_KEY_MAX_SEND_MARGIN_SECONDS 30
+
+// A symmetric key that the TAM and a TEEP Agent share in session mode.
+// After a signed and attested QueryRequest and QueryResponse exchange,
+// in which each side sends an ECDH public key share, both sides derive
+// the same key, and later messages within its lifetime are protected
+// with COSE_Mac0 (HMAC 256/256) rather than signed.
+class TeepSessionKey
+{
+public:
+    ~TeepSessionKey();
+
+    // Generate an ephemeral agreement key, and get the public key share
+    // to send to the peer.  The key must be freed with free_key.
+    static teep_error_code_t GenerateAgreementKey(
+        _Out_ struct t_cose_key* agreementKey,
+        _Out_ std::vector<uint8_t>& publicShare);
+
+    // Derive a session key with HKDF-SHA256 (RFC 5869) from the ECDH
+    // secret of our agreement key and the peer's public key share.  The
+    // salt is the QueryResponse payload, which carries the agent's share
+    // and its attestation evidence and is signed by the agent, so the
+    // key is bound to the attested exchange.  The key expires after the
+    // lifetime set with teep_set_session_key_lifetime.
+    static teep_error_code_t Derive(
+        _In_ const struct t_cose_key* agreementKey,
+        UsefulBufC peerShare,
+        UsefulBufC queryResponse,
+        _Out_ std::shared_ptr<const TeepSessionKey>& sessionKey);
+
+    UsefulBufC GetKey(void) const { return { _key, sizeof(_key) }; }
+
+    // The COSE key ID (kid) in the messages protected with the key, which
+    // both sides derive along with the key.
+    UsefulBufC GetKeyId(void) const { return { _keyId, sizeof(_keyId) }; }
+
+    // Whether a message received now may be accepted under the key.
+    bool IsExpired(void) const;
+
+    // Whether a message may still be sent under the key.
+    bool CanSend(void) const;
+
+private:
+    TeepSessionKey();
+    TeepSessionKey(const TeepSessionKey&) = delete;
+    TeepSessionKey& operator=(const TeepSessionKey&) = delete;
+
+    uint8_t _key[TEEP_SESSION_KEY_LENGTH];
+    uint8_t _keyId[TEEP_SESSION_KEY_ID_LENGTH];
+    std::chrono::steady_clock::time_point _expiry;
+    std::chrono::steady_clock::time_point _sendExpiry;
+};
@@ -4,10 +4,16 @@
 // This file contains trusted code in common between the TAM and TEEP Agent.
 #include <stdio.h>
 #include <string.h>
+#include <vector>
 #include "t_cose/t_cose_common.h"
 #include "t_cose/t_cose_sign1_sign.h"
 #include "t_cose/t_cose_sign1_verify.h"
+#include "qcbor/qcbor_decode.h"
+#include "qcbor/qcbor_encode.h"
 #include "common.h"
+#include "CryptoProvider.h"
+#include "RandomGenerator.h"
+#include "SessionKey.h"
 extern "C" {
 #ifdef TEEP_USE_TEE
 #define _countof(x) OE_COUNTOF(x)
@@ -39,216 +45,563 @@ void report_type_error(std::ostream& s, const char* id, int expected_type, int a
     s << "Invalid " << id << " type " << get_cbor_type_name(actual_type) << ", expected " << get_cbor_type_name(expected_type) << std::endl;
 }
 
-static teep_error_code_t _save_signing_key_pair(
-    _In_ const struct t_cose_key* key_pair,
+#ifndef TEEP_DEFAULT_CRYPTO_PROVIDER
+#define TEEP_DEFAULT_CRYPTO_PROVIDER teep_openssl_crypto_provider
+#endif
+
+static const teep_crypto_provider_t* g_crypto_provider = &TEEP_DEFAULT_CRYPTO_PROVIDER;
+
+const teep_crypto_provider_t* teep_get_crypto_provider(void)
+{
+    return g_crypto_provider;
+}
+
+void teep_set_crypto_provider(_In_opt_ const teep_crypto_provider_t* provider)
+{
+    g_crypto_provider = (provider != nullptr) ? provider : &TEEP_DEFAULT_CRYPTO_PROVIDER;
+}
+
+teep_error_code_t teep_load_signing_key_pair(
+    _Out_ struct t_cose_key* key_pair,
     _In_z_ const char* private_file_name,
+    _In_z_ const char* public_file_name,
+    teep_signature_kind_t signature_kind)
+{
+    const teep_crypto_provider_t* provider = teep_get_crypto_provider();
+    if (provider->load_private_key(private_file_name, key_pair) == TEEP_ERR_PERMANENT_ERROR) {
+        TeepLogMessage("Creating new key in %s\n", public_file_name);
+        teep_error_code_t result = provider->generate_key(signature_kind, key_pair);
+        if (result != TEEP_ERR_SUCCESS) {
+            return TEEP_ERR_TEMPORARY_ERROR;
+        }
+
+        result = provider->save_key(key_pair, private_file_name, public_file_name);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+    }
+
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t teep_get_verifying_key_pair(
+    _Out_ struct t_cose_key* key_pair,
     _In_z_ const char* public_file_name)
 {
-    EVP_PKEY* pkey = (EVP_PKEY*)key_pair->key.ptr;
+    return teep_get_crypto_provider()->load_public_key(public_file_name, key_pair);
+}
 
-    // Write key pair with private key, for future use by the TAM.
-    FILE* fp = fopen(private_file_name, "wb");
-    if (fp == nullptr) {
+teep_error_code_t TeepInitialize(_In_z_ const char* signing_private_key_pair_filename, _In_z_ const char* signing_public_key_filename, teep_signature_kind_t signature_kind)
+{
+    struct t_cose_key key_pair;
+    return teep_load_signing_key_pair(&key_pair, signing_private_key_pair_filename, signing_public_key_filename, signature_kind);
+}
+
+teep_error_code_t
+teep_compute_key_id(teep_signature_kind_t signature_kind, _In_ const struct t_cose_key* key_pair, _Inout_ UsefulBuf* key_id)
+{
+    return teep_get_crypto_provider()->get_key_id(signature_kind, key_pair, key_id);
+}
+
+#ifndef COSE_HEADER_PARAM_ALG
+#define COSE_HEADER_PARAM_ALG 1 // RFC 9052 section 3.1
+#endif
+#ifndef COSE_HEADER_PARAM_KID
+#define COSE_HEADER_PARAM_KID 4 // RFC 9052 section 3.1
+#endif
+
+// Skip over the contents of an item that has already been read,
+// if it is an array or map.
+static QCBORError skip_nested_items(_Inout_ QCBORDecodeContext* context, _In_ const QCBORItem* item)
+{
+    QCBORItem next = *item;
+    while (next.uNextNestLevel > item->uNestingLevel) {
+        QCBORError err = QCBORDecode_GetNext(context, &next);
+        if (err != QCBOR_SUCCESS) {
+            return err;
+        }
+    }
+    return QCBOR_SUCCESS;
+}
+
+// Find the kid (label 4) in a COSE header map that has already been
+// opened, consuming the rest of the map.
+static QCBORError get_key_id_from_header_map(
+    _Inout_ QCBORDecodeContext* context,
+    _In_ const QCBORItem* map,
+    _Inout_ std::vector<UsefulBufC>& key_ids)
+{
+    for (uint16_t i = 0; i < map->val.uCount; i++) {
+        QCBORItem item;
+        QCBORError err = QCBORDecode_GetNext(context, &item);
+        if (err != QCBOR_SUCCESS) {
+            return err;
+        }
+        if (item.uLabelType == QCBOR_TYPE_INT64 &&
+            item.label.int64 == COSE_HEADER_PARAM_KID &&
+            item.uDataType == QCBOR_TYPE_BYTE_STRING) {
+            key_ids.push_back(item.val.string);
+        }
+        err = skip_nested_items(context, &item);
+        if (err != QCBOR_SUCCESS) {
+            return err;
+        }
+    }
+    return QCBOR_SUCCESS;
+}
+
+// Read the protected and unprotected headers at the current position.
+static QCBORError get_key_ids_from_headers(
+    _Inout_ QCBORDecodeContext* context,
+    _Inout_ std::vector<UsefulBufC>& key_ids)
+{
+    // Protected headers are a byte string wrapping a map.
+    QCBORItem item;
+    QCBORError err = QCBORDecode_GetNext(context, &item);
+    if (err != QCBOR_SUCCESS) {
+        return err;
+    }
+    if (item.uDataType != QCBOR_TYPE_BYTE_STRING) {
+        return QCBOR_ERR_UNEXPECTED_TYPE;
+    }
+    if (item.val.string.len > 0) {
+        QCBORDecodeContext protected_context;
+        QCBORDecode_Init(&protected_context, item.val.string, QCBOR_DECODE_MODE_NORMAL);
+        QCBORItem map;
+        err = QCBORDecode_GetNext(&protected_context, &map);
+        if (err != QCBOR_SUCCESS) {
+            return err;
+        }
+        if (map.uDataType != QCBOR_TYPE_MAP) {
+            return QCBOR_ERR_UNEXPECTED_TYPE;
+        }
+        err = get_key_id_from_header_map(&protected_context, &map, key_ids);
+        if (err != QCBOR_SUCCESS) {
+            return err;
+        }
+    }
+
+    // Unprotected headers are a map.
+    err = QCBORDecode_GetNext(context, &item);
+    if (err != QCBOR_SUCCESS) {
+        return err;
+    }
+    if (item.uDataType != QCBOR_TYPE_MAP) {
+        return QCBOR_ERR_UNEXPECTED_TYPE;
+    }
+    return get_key_id_from_header_map(context, &item, key_ids);
+}
+
+teep_error_code_t
+teep_get_cose_key_ids(
+    _In_ const UsefulBufC* signed_cose,
+    _Out_ std::vector<UsefulBufC>& key_ids)
+{
+    key_ids.clear();
+
+    // COSE_Sign1 and COSE_Sign are both [protected, unprotected, payload, x],
+    // where x is the signature for COSE_Sign1 and an array of
+    // [protected, unprotected, signature] for COSE_Sign.
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, *signed_cose, QCBOR_DECODE_MODE_NORMAL);
+    QCBORItem item;
+    QCBORError err = QCBORDecode_GetNext(&context, &item);
+    if (err != QCBOR_SUCCESS || item.uDataType != QCBOR_TYPE_ARRAY || item.val.uCount != 4) {
         return TEEP_ERR_PERMANENT_ERROR;
     }
-    int succeeded = PEM_write_PrivateKey(fp, (EVP_PKEY*)key_pair->key.ptr,
-        NULL, NULL, 0, NULL, NULL);
-    fclose(fp);
-    if (!succeeded) {
+
+    err = get_key_ids_from_headers(&context, key_ids);
+    if (err != QCBOR_SUCCESS) {
         return TEEP_ERR_PERMANENT_ERROR;
     }
 
-    // Write public key for use by TEEP Agents.
-    fp = fopen(public_file_name, "wb");
-    if (fp == nullptr) {
+    // Skip the payload.
+    err = QCBORDecode_GetNext(&context, &item);
+    if (err != QCBOR_SUCCESS) {
         return TEEP_ERR_PERMANENT_ERROR;
     }
-    succeeded = PEM_write_PUBKEY(fp, pkey);
-    fclose(fp);
-    if (!succeeded) {
+
+    err = QCBORDecode_GetNext(&context, &item);
+    if (err != QCBOR_SUCCESS) {
         return TEEP_ERR_PERMANENT_ERROR;
     }
+    if (item.uDataType == QCBOR_TYPE_ARRAY) {
+        // COSE_Sign: get the key ID of each signature.
+        uint16_t signature_count = item.val.uCount;
+        for (uint16_t i = 0; i < signature_count; i++) {
+            QCBORItem signature;
+            err = QCBORDecode_GetNext(&context, &signature);
+            if (err != QCBOR_SUCCESS || signature.uDataType != QCBOR_TYPE_ARRAY || signature.val.uCount != 3) {
+                return TEEP_ERR_PERMANENT_ERROR;
+            }
+            err = get_key_ids_from_headers(&context, key_ids);
+            if (err != QCBOR_SUCCESS) {
+                return TEEP_ERR_PERMANENT_ERROR;
+            }
+            err = QCBORDecode_GetNext(&context, &item);
+            if (err != QCBOR_SUCCESS) {
+                return TEEP_ERR_PERMANENT_ERROR;
+            }
+        }
+    }
 
     return TEEP_ERR_SUCCESS;
 }
 
-static teep_error_code_t _load_signing_key_pair(
-    _Out_ struct t_cose_key* key_pair,
-    _In_z_ const char* file_name)
+teep_error_code_t
+teep_add_verification_key(
+    _Inout_ teep_key_index_t& key_index,
+    teep_signature_kind_t signature_kind,
+    _In_ const struct t_cose_key* key)
 {
-    FILE* fp = fopen(file_name, "rb");
-    if (fp == nullptr) {
-        return TEEP_ERR_PERMANENT_ERROR;
-    }
-    key_pair->key.ptr = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
-    fclose(fp);
-    if (key_pair->key.ptr == nullptr) {
-        return TEEP_ERR_PERMANENT_ERROR;
+    UsefulBuf_MAKE_STACK_UB(key_id, TEEP_SHA256_LENGTH);
+    teep_error_code_t result = teep_compute_key_id(signature_kind, key, &key_id);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
     }
-
+    key_index[std::string((const char*)key_id.ptr, key_id.len)] = { signature_kind, *key };
     return TEEP_ERR_SUCCESS;
 }
 
-/**
- * \brief Make a key pair in OpenSSL library form.
- *
- * \param[in] cose_algorithm_id  The algorithm to sign with, for example
- *                               \ref T_COSE_ALGORITHM_ES256.
- * \param[out] key_pair          The key pair. This must be freed.
- *
- * The key made here is fixed and just useful for testing.
- */
-static enum t_cose_err_t _make_ossl_key_pair(
-    int32_t cose_algorithm_id,
-    _Out_ struct t_cose_key* key_pair)
-{
-    enum t_cose_err_t return_value;
-    int ossl_result;
-    int ossl_key_type;
-    int ossl_curve_nid;
-    EVP_PKEY* pkey = NULL;
-    EVP_PKEY_CTX* ctx;
-
-    switch (cose_algorithm_id) {
-    case T_COSE_ALGORITHM_ES256:
-        ossl_key_type = EVP_PKEY_EC;
-        ossl_curve_nid = NID_X9_62_prime256v1;
-        break;
-
-    case T_COSE_ALGORITHM_ES384:
-        ossl_key_type = EVP_PKEY_EC;
-        ossl_curve_nid = NID_secp384r1;
-        break;
-
-    case T_COSE_ALGORITHM_ES512:
-        ossl_key_type = EVP_PKEY_EC;
-        ossl_curve_nid = NID_secp521r1;
-        break;
-
-    case T_COSE_ALGORITHM_EDDSA:
-        ossl_key_type = EVP_PKEY_ED25519;
-        break;
-
-    default:
-        return T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
-    }
-
-    ctx = EVP_PKEY_CTX_new_id(ossl_key_type, NULL);
-    if (ctx == NULL) {
-        return_value = T_COSE_ERR_INSUFFICIENT_MEMORY;
-        goto Done;
-    }
-
-    if (EVP_PKEY_keygen_init(ctx) <= 0) {
-        return_value = T_COSE_ERR_FAIL;
-        goto Done;
-    }
-
-    if (ossl_key_type == EVP_PKEY_EC) {
-        ossl_result = EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, ossl_curve_nid);
-        if (ossl_result != 1) {
-            return_value = T_COSE_ERR_FAIL;
-            goto Done;
+teep_error_code_t
+teep_verify_cbor_message_by_key_id(
+    _In_ const teep_key_index_t& key_index,
+    _In_ const UsefulBufC* signed_cose,
+    _Out_ UsefulBufC* encoded,
+    _Out_opt_ std::string* key_id)
+{
+    std::vector<UsefulBufC> key_ids;
+    teep_error_code_t result = teep_get_cose_key_ids(signed_cose, key_ids);
+    if (result != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("Could not parse COSE headers\n");
+        return result;
+    }
+
+    for (const UsefulBufC& kid : key_ids) {
+        auto it = key_index.find(std::string((const char*)kid.ptr, kid.len));
+        if (it == key_index.end()) {
+            continue;
         }
+
+        // Verify only against the key the sender named.
+        result = teep_verify_cbor_message(it->second.kind, &it->second.key, signed_cose, encoded);
+        if (result == TEEP_ERR_SUCCESS && key_id != nullptr) {
+            *key_id = it->first;
+        }
+        return result;
+    }
+
+    TeepLogMessage("No trusted key matches the key ID of the message\n");
+    return TEEP_ERR_PERMANENT_ERROR;
+}
+
+size_t teep_get_cbor_head_size(uint64_t argument)
+{
+    if (argument < 24) {
+        return 1;
+    } else if (argument <= UINT8_MAX) {
+        return 2;
+    } else if (argument <= UINT16_MAX) {
+        return 3;
+    } else if (argument <= UINT32_MAX) {
+        return 5;
+    } else {
+        return 9;
     }
+}
 
-    pkey = EVP_PKEY_new();
+// Upper bound on how much a COSE Sig_structure adds to its payload:
+// the context string, protected headers, and external AAD.
+#define MAX_SIG_STRUCTURE_OVERHEAD 64
 
-    ossl_result = EVP_PKEY_keygen(ctx, &pkey);
+// Largest auxiliary buffer kept for reuse by a thread.
+#define MAX_POOLED_AUXILIARY_BUFFER_SIZE (64 * 1024)
 
-    if (ossl_result != 1) {
-        return_value = T_COSE_ERR_FAIL;
-        goto Done;
+// Auxiliary space big enough to serialize a Sig_structure into, which
+// EdDSA signs and verifies directly.  The size is bounded from
+// the payload (or whole message) length, so no sizing pass is needed.
+// Each thread keeps one buffer for reuse, so steady-state signing and
+// verification do not allocate; a rare larger message gets its own
+// buffer, freed afterwards, so that it does not pin memory.
+class auxiliary_buffer
+{
+public:
+    // No space, for algorithms that do not use any.
+    auxiliary_buffer() : buffer(NULLUsefulBuf)
+    {
+    }
+
+    explicit auxiliary_buffer(size_t payload_length)
+    {
+        allocate(payload_length);
+    }
+
+    void allocate(size_t payload_length)
+    {
+        thread_local std::vector<uint8_t> pooled;
+        size_t length = teep_get_cbor_head_size(payload_length) + payload_length + MAX_SIG_STRUCTURE_OVERHEAD;
+        std::vector<uint8_t>* storage = (length <= MAX_POOLED_AUXILIARY_BUFFER_SIZE) ? &pooled : &_large;
+        if (storage->size() < length) {
+            storage->resize(length);
+        }
+        buffer = { storage->data(), storage->size() };
     }
 
-    key_pair->key.ptr = pkey;
-    return_value = T_COSE_SUCCESS;
+    struct q_useful_buf buffer;
 
-Done:
-    return return_value;
+private:
+    std::vector<uint8_t> _large;
+};
+
+// The protected headers of ES256 and EdDSA COSE_Sign1 messages: {1: -7}
+// and {1: -8}.
+static const uint8_t es256_protected_headers[] = { 0xA1, 0x01, 0x26 };
+static const uint8_t eddsa_protected_headers[] = { 0xA1, 0x01, 0x27 };
+
+// Largest COSE_Sign1 envelope, which is everything but the payload bytes.
+#define MAX_SIGN1_ENVELOPE_SIZE 128
+
+// Encode the part of a COSE_Sign1 Sig_structure, or of a COSE_Mac0
+// MAC_structure, that comes before the payload bytes.  The two differ
+// only in their context string.
+static QCBORError encode_to_be_authenticated_head(
+    _In_z_ const char* context_string,
+    UsefulBufC protected_headers,
+    size_t payload_length,
+    UsefulBuf buffer,
+    _Out_ UsefulBufC* head)
+{
+    QCBOREncodeContext context;
+    QCBOREncode_Init(&context, buffer);
+    QCBOREncode_OpenArray(&context);
+    QCBOREncode_AddSZString(&context, context_string);
+    QCBOREncode_AddBytes(&context, protected_headers);
+    QCBOREncode_AddBytes(&context, UsefulBuf_FROM_SZ_LITERAL("")); // No externally supplied AAD.
+    QCBOREncode_AddBytesLenOnly(&context, { nullptr, payload_length });
+    QCBOREncode_CloseArray(&context);
+    return QCBOREncode_Finish(&context, head);
 }
 
-static int get_cose_algorithm(teep_signature_kind_t signature_kind)
+static QCBORError encode_sig_structure_head(
+    UsefulBufC protected_headers,
+    size_t payload_length,
+    UsefulBuf buffer,
+    _Out_ UsefulBufC* head)
+{
+    return encode_to_be_authenticated_head("Signature1", protected_headers, payload_length, buffer, head);
+}
+
+static UsefulBufC get_protected_headers(teep_signature_kind_t signature_kind)
 {
     switch (signature_kind) {
-    case TEEP_SIGNATURE_ES256: return T_COSE_ALGORITHM_ES256;
-    case TEEP_SIGNATURE_EDDSA: return T_COSE_ALGORITHM_EDDSA;
-    default: return TEEP_ERR_PERMANENT_ERROR;
+    case TEEP_SIGNATURE_ES256: return { es256_protected_headers, sizeof(es256_protected_headers) };
+    case TEEP_SIGNATURE_EDDSA: return { eddsa_protected_headers, sizeof(eddsa_protected_headers) };
+    default: return NULLUsefulBufC;
     }
 }
 
-teep_error_code_t teep_load_signing_key_pair(
-    _Out_ struct t_cose_key* key_pair,
-    _In_z_ const char* private_file_name,
-    _In_z_ const char* public_file_name,
-    teep_signature_kind_t signature_kind)
+// Hash the Sig_structure (RFC 9052 section 4.4) of an ES256 COSE_Sign1
+// message.  The payload is its last item, so only the part before the
+// payload bytes is encoded and the payload segments are then hashed
+// where they are.
+static teep_error_code_t hash_es256_sig_structure(
+    _In_reads_(segment_count) const UsefulBufC* segments,
+    size_t segment_count,
+    size_t payload_length,
+    _Out_writes_(TEEP_SHA256_LENGTH) uint8_t* hash)
 {
-    int cose_algorithm = get_cose_algorithm(signature_kind);
+    UsefulBuf_MAKE_STACK_UB(sig_structure_buffer, MAX_SIG_STRUCTURE_OVERHEAD);
+    UsefulBufC sig_structure_head;
+    if (encode_sig_structure_head(get_protected_headers(TEEP_SIGNATURE_ES256), payload_length, sig_structure_buffer, &sig_structure_head) != QCBOR_SUCCESS) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
 
-    if (_load_signing_key_pair(key_pair, private_file_name) == TEEP_ERR_PERMANENT_ERROR) {
-        TeepLogMessage("Creating new key in %s\n", public_file_name);
-        enum t_cose_err_t return_value = _make_ossl_key_pair(cose_algorithm, key_pair);
-        if (return_value != T_COSE_SUCCESS) {
-            return TEEP_ERR_TEMPORARY_ERROR;
-        }
+    // Hash the head and the payload segments as one list.
+    thread_local std::vector<UsefulBufC> all_segments;
+    all_segments.assign(1, sig_structure_head);
+    all_segments.insert(all_segments.end(), segments, segments + segment_count);
+    return teep_get_crypto_provider()->sha256(all_segments.data(), all_segments.size(), hash);
+}
 
-        teep_error_code_t result = _save_signing_key_pair(key_pair, private_file_name, public_file_name);
-        if (result != TEEP_ERR_SUCCESS) {
-            return result;
-        }
+// Build the Sig_structure of an EdDSA COSE_Sign1 message in an auxiliary
+// buffer, since EdDSA signs the whole Sig_structure rather than a hash
+// of it.
+static teep_error_code_t build_eddsa_sig_structure(
+    _In_reads_(segment_count) const UsefulBufC* segments,
+    size_t segment_count,
+    size_t payload_length,
+    _Inout_ auxiliary_buffer& auxiliary,
+    _Out_ UsefulBufC* sig_structure)
+{
+    UsefulBufC head;
+    if (encode_sig_structure_head(get_protected_headers(TEEP_SIGNATURE_EDDSA), payload_length, auxiliary.buffer, &head) != QCBOR_SUCCESS) {
+        return TEEP_ERR_PERMANENT_ERROR;
     }
-
+    uint8_t* out = (uint8_t*)auxiliary.buffer.ptr + head.len;
+    for (size_t i = 0; i < segment_count; i++) {
+        memcpy(out, segments[i].ptr, segments[i].len);
+        out += segments[i].len;
+    }
+    *sig_structure = { auxiliary.buffer.ptr, head.len + payload_length };
     return TEEP_ERR_SUCCESS;
 }
 
-teep_error_code_t teep_get_verifying_key_pair(
-    _Out_ struct t_cose_key* key_pair,
-    _In_z_ const char* public_file_name)
+// Sign a payload held as segments with ES256 or EdDSA, and encode the
+// COSE_Sign1 envelope, which is the message without the payload bytes,
+// into envelope_buffer.  The payload bytes belong at head_length.
+static teep_error_code_t sign1_segments(
+    teep_signature_kind_t signature_kind,
+    _In_ const struct t_cose_key* key_pair,
+    _In_reads_(segment_count) const UsefulBufC* segments,
+    size_t segment_count,
+    size_t payload_length,
+    UsefulBuf envelope_buffer,
+    _Out_ UsefulBufC* envelope,
+    _Out_ size_t* head_length)
 {
-    FILE* fp = fopen(public_file_name, "rb");
-    if (fp == nullptr) {
+    const teep_crypto_provider_t* provider = teep_get_crypto_provider();
+    UsefulBufC protected_headers = get_protected_headers(signature_kind);
+    if (protected_headers.ptr == nullptr) {
         return TEEP_ERR_PERMANENT_ERROR;
     }
-    key_pair->key.ptr = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
-    fclose(fp);
-    if (key_pair->key.ptr == nullptr) {
+    UsefulBuf_MAKE_STACK_UB(key_id, TEEP_SHA256_LENGTH);
+    teep_error_code_t result = provider->get_key_id(signature_kind, key_pair, &key_id);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+
+    uint8_t signature[TEEP_SIGNATURE_LENGTH];
+    if (signature_kind == TEEP_SIGNATURE_ES256) {
+        uint8_t hash[TEEP_SHA256_LENGTH];
+        result = hash_es256_sig_structure(segments, segment_count, payload_length, hash);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+        result = provider->sign(signature_kind, key_pair, hash, sizeof(hash), signature);
+    } else {
+        auxiliary_buffer auxiliary(payload_length);
+        UsefulBufC sig_structure;
+        result = build_eddsa_sig_structure(segments, segment_count, payload_length, auxiliary, &sig_structure);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+        result = provider->sign(signature_kind, key_pair, (const uint8_t*)sig_structure.ptr, sig_structure.len, signature);
+    }
+    if (result != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("%s signing failed\n", (signature_kind == TEEP_SIGNATURE_ES256) ? "ES256" : "EdDSA");
+        return result;
+    }
+
+    // Encode the COSE_Sign1 message the same way, leaving out the payload
+    // bytes.
+    QCBOREncodeContext context;
+    QCBOREncode_Init(&context, envelope_buffer);
+    QCBOREncode_AddTag(&context, CBOR_TAG_COSE_SIGN1);
+    QCBOREncode_OpenArray(&context);
+    {
+        QCBOREncode_AddBytes(&context, protected_headers);
+        QCBOREncode_OpenMap(&context);
+        QCBOREncode_AddBytesToMapN(&context, COSE_HEADER_PARAM_KID, UsefulBuf_Const(key_id));
+        QCBOREncode_CloseMap(&context);
+        QCBOREncode_AddBytesLenOnly(&context, { nullptr, payload_length });
+        QCBOREncode_AddBytes(&context, { signature, sizeof(signature) });
+    }
+    QCBOREncode_CloseArray(&context);
+    if (QCBOREncode_Finish(&context, envelope) != QCBOR_SUCCESS) {
         return TEEP_ERR_PERMANENT_ERROR;
     }
+    *head_length = envelope->len - (teep_get_cbor_head_size(sizeof(signature)) + sizeof(signature));
     return TEEP_ERR_SUCCESS;
 }
 
-teep_error_code_t TeepInitialize(_In_z_ const char* signing_private_key_pair_filename, _In_z_ const char* signing_public_key_filename, teep_signature_kind_t signature_kind)
+// Decode a COSE_Sign1 or COSE_Mac0 message with the given protected
+// headers and a signature or tag of the given length.  Returns false for
+// any other message, which is left for t_cose.
+static bool decode_sign1(
+    _In_ const UsefulBufC* signed_cose,
+    UsefulBufC protected_headers,
+    size_t signature_length,
+    _Out_ UsefulBufC* payload,
+    _Out_ const uint8_t** signature)
 {
-    struct t_cose_key key_pair;
-    return teep_load_signing_key_pair(&key_pair, signing_private_key_pair_filename, signing_public_key_filename, signature_kind);
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, *signed_cose, QCBOR_DECODE_MODE_NORMAL);
+    QCBORItem item;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS ||
+        item.uDataType != QCBOR_TYPE_ARRAY || item.val.uCount != 4) {
+        return false;
+    }
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS ||
+        item.uDataType != QCBOR_TYPE_BYTE_STRING ||
+        UsefulBuf_Compare(item.val.string, protected_headers) != 0) {
+        return false;
+    }
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS ||
+        item.uDataType != QCBOR_TYPE_MAP ||
+        skip_nested_items(&context, &item) != QCBOR_SUCCESS) {
+        return false;
+    }
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS ||
+        item.uDataType != QCBOR_TYPE_BYTE_STRING) {
+        return false;
+    }
+    *payload = item.val.string;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS ||
+        item.uDataType != QCBOR_TYPE_BYTE_STRING ||
+        item.val.string.len != signature_length ||
+        QCBORDecode_Finish(&context) != QCBOR_SUCCESS) {
+        return false;
+    }
+    *signature = (const uint8_t*)item.val.string.ptr;
+    return true;
 }
 
-teep_error_code_t
-teep_compute_key_id(teep_signature_kind_t signature_kind, _In_ const struct t_cose_key* key_pair, _Out_ UsefulBuf* key_id)
+// Verify an ES256 COSE_Sign1 message in a single pass.  Any other kind of message is left for t_cose, with *handled
+// set to false.
+static teep_error_code_t verify_es256_sign1(
+    _In_ const struct t_cose_key* key_pair,
+    _In_ const UsefulBufC* signed_cose,
+    _Out_ UsefulBufC* encoded,
+    _Out_ bool* handled)
 {
-#if 1
-    // TODO: this is not correct or secure, switch to the other code path once we
-    // can get the public key from a t_cose_key key pair.
-    *(teep_signature_kind_t*)key_id->ptr = signature_kind;
-    key_id->len = sizeof(signature_kind);
-    return TEEP_ERR_SUCCESS;
-#else
-    // Get the public key.
-    if (signature_kind == TEEP_SIGNATURE_ES256) {
+    UsefulBufC payload;
+    const uint8_t* signature;
+    *handled = decode_sign1(signed_cose, get_protected_headers(TEEP_SIGNATURE_ES256), TEEP_SIGNATURE_LENGTH, &payload, &signature);
+    if (!*handled) {
+        return TEEP_ERR_SUCCESS;
     }
-    else {
+
+    uint8_t hash[TEEP_SHA256_LENGTH];
+    teep_error_code_t result = hash_es256_sig_structure(&payload, 1, payload.len, hash);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    result = teep_get_crypto_provider()->verify(TEEP_SIGNATURE_ES256, key_pair, hash, sizeof(hash), signature);
+    if (result != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("ES256 signature verification failed\n");
+        return result;
     }
+    *encoded = payload;
+    return TEEP_ERR_SUCCESS;
+}
 
-    // Compute SHA-256 hash.
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, public_key.key.buffer.ptr, public_key.key.buffer.len);
-    SHA256_Final(hash, &sha256);
+size_t teep_get_sign1_message_size(size_t payload_length)
+{
+    return 1 +                                 // COSE_Sign1 tag.
+        1 +                                    // Array head.
+        1 + 3 +                                // Protected header with alg.
+        1 + 1 + 2 + TEEP_SHA256_LENGTH +       // Unprotected header with kid.
+        teep_get_cbor_head_size(payload_length) + payload_length +
+        2 + 64;                                // ES256 or EdDSA signature.
+}
 
-    *key_id = UsefulBuf_FROM_BYTE_ARRAY_LITERAL(hash);
-    return TEEP_ERR_PERMANENT_ERROR;
-#endif
+static teep_error_code_t get_sign_error(enum t_cose_err_t return_value)
+{
+    switch (return_value) {
+    case T_COSE_SUCCESS: return TEEP_ERR_SUCCESS;
+    case T_COSE_ERR_TOO_SMALL: return TEEP_ERR_TEMPORARY_ERROR;
+    default: return TEEP_ERR_PERMANENT_ERROR;
+    }
 }
 
 teep_error_code_t
@@ -259,61 +612,21 @@ teep_sign1_cbor_message(
     teep_signature_kind_t signature_kind,
     _Out_ UsefulBufC* signed_message)
 {
-    // Initialize for signing.
-    struct t_cose_sign1_sign_ctx sign_ctx;
-    t_cose_sign1_sign_init(&sign_ctx, 0, get_cose_algorithm(signature_kind));
-    UsefulBuf_MAKE_STACK_UB(key_id, SHA256_DIGEST_LENGTH);
-    teep_error_code_t result = teep_compute_key_id(signature_kind, key_pair, &key_id);
+    UsefulBuf_MAKE_STACK_UB(envelope_buffer, MAX_SIGN1_ENVELOPE_SIZE);
+    UsefulBufC envelope;
+    size_t head_length;
+    teep_error_code_t result = sign1_segments(signature_kind, key_pair, unsigned_message, 1, unsigned_message->len, envelope_buffer, &envelope, &head_length);
     if (result != TEEP_ERR_SUCCESS) {
         return result;
     }
-    t_cose_sign1_set_signing_key(&sign_ctx, *key_pair, UsefulBuf_Const(key_id));
-
-    // Compute the size of the output and auxiliary buffers.
-    struct q_useful_buf null_buff { NULL, SIZE_MAX };
-    struct q_useful_buf_c signed_cose;
-    enum t_cose_err_t return_value = t_cose_sign1_sign(&sign_ctx,
-        *unsigned_message,
-        null_buff,
-        &signed_cose);
-
-    // Allocate buffers of the right size.
-    if (signed_cose.len > signed_message_buffer.len) {
+    if (envelope.len + unsigned_message->len > signed_message_buffer.len) {
         return TEEP_ERR_TEMPORARY_ERROR;
     }
-    struct q_useful_buf auxiliary_buffer = {};
-    auxiliary_buffer.len = t_cose_sign1_sign_auxiliary_buffer_size(&sign_ctx);
-    if (auxiliary_buffer.len > 0) {
-        auxiliary_buffer.ptr = malloc(auxiliary_buffer.len);
-        if (auxiliary_buffer.ptr == NULL) {
-            return TEEP_ERR_TEMPORARY_ERROR;
-        }
-    }
-
-    // Sign.
-    t_cose_sign1_sign_set_auxiliary_buffer(&sign_ctx, auxiliary_buffer);
-    return_value = t_cose_sign1_sign(
-        &sign_ctx,
-        *unsigned_message,
-        /* Non-const pointer and length of the
-         * buffer where the completed output is
-         * written to. The length here is that
-         * of the whole buffer.
-         */
-        signed_message_buffer,
-        /* Const pointer and actual length of
-         * the completed, signed and encoded
-         * COSE_Sign1 message. This points
-         * into the output buffer and has the
-         * lifetime of the output buffer.
-         */
-        signed_message);
-    free(auxiliary_buffer.ptr);
-    if (return_value != T_COSE_SUCCESS) {
-        TeepLogMessage("COSE Sign1 failed with error %d\n", return_value);
-        return TEEP_ERR_PERMANENT_ERROR;
-    }
-
+    uint8_t* out = (uint8_t*)signed_message_buffer.ptr;
+    memcpy(out, envelope.ptr, head_length);
+    memcpy(out + head_length, unsigned_message->ptr, unsigned_message->len);
+    memcpy(out + head_length + unsigned_message->len, (const uint8_t*)envelope.ptr + head_length, envelope.len - head_length);
+    *signed_message = { out, envelope.len + unsigned_message->len };
     return TEEP_ERR_SUCCESS;
 }
 
@@ -331,50 +644,27 @@ teep_sign_cbor_message(
 
     struct t_cose_signature_sign_eddsa eddsa_signer;
     struct t_cose_signature_sign_main es256_signer;
-    UsefulBuf_MAKE_STACK_UB(eddsa_key_id, SHA256_DIGEST_LENGTH);
-    UsefulBuf_MAKE_STACK_UB(es256_key_id, SHA256_DIGEST_LENGTH);
+    std::string eddsa_key_id;
+    std::string es256_key_id;
+    auxiliary_buffer auxiliary(unsigned_message->len);
     for (const auto& [kind, key_pair] : key_pairs) {
+        UsefulBuf_MAKE_STACK_UB(key_id, TEEP_SHA256_LENGTH);
+        teep_error_code_t result = teep_get_crypto_provider()->get_key_id(kind, &key_pair, &key_id);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
         int32_t algorithm_id = (kind == TEEP_SIGNATURE_ES256) ? T_COSE_ALGORITHM_ES256 : T_COSE_ALGORITHM_EDDSA;
         if (kind == TEEP_SIGNATURE_ES256) {
             t_cose_signature_sign_main_init(&es256_signer, algorithm_id);
-            teep_error_code_t result = teep_compute_key_id(kind, &key_pair, &es256_key_id);
-            if (result != TEEP_ERR_SUCCESS) {
-                return result;
-            }
-            t_cose_signature_sign_main_set_signing_key(&es256_signer, key_pair, UsefulBuf_Const(es256_key_id));
+            es256_key_id.assign((const char*)key_id.ptr, key_id.len);
+            t_cose_signature_sign_main_set_signing_key(&es256_signer, key_pair, { es256_key_id.data(), es256_key_id.size() });
             t_cose_sign_add_signer(&sign_ctx, t_cose_signature_sign_from_main(&es256_signer));
         } else {
             t_cose_signature_sign_eddsa_init(&eddsa_signer);
-            teep_error_code_t result = teep_compute_key_id(kind, &key_pair, &eddsa_key_id);
-            if (result != TEEP_ERR_SUCCESS) {
-                return result;
-            }
-            t_cose_signature_sign_eddsa_set_signing_key(&eddsa_signer, key_pair, UsefulBuf_Const(eddsa_key_id));
+            eddsa_key_id.assign((const char*)key_id.ptr, key_id.len);
+            t_cose_signature_sign_eddsa_set_signing_key(&eddsa_signer, key_pair, { eddsa_key_id.data(), eddsa_key_id.size() });
             t_cose_sign_add_signer(&sign_ctx, t_cose_signature_sign_from_eddsa(&eddsa_signer));
-
-            // Compute the size of the output and auxiliary buffers.
-            struct q_useful_buf null_buff { NULL, SIZE_MAX };
-            struct q_useful_buf_c signed_cose;
-            enum t_cose_err_t return_value = t_cose_sign_sign(&sign_ctx,
-                NULL_Q_USEFUL_BUF_C, // No externally supplied AAD.
-                *unsigned_message,
-                null_buff,
-                &signed_cose);
-
-            // Allocate buffers of the right size.
-            if (signed_cose.len > signed_message_buffer.len) {
-                return TEEP_ERR_TEMPORARY_ERROR;
-            }
-            struct q_useful_buf auxiliary_buffer = {};
-            auxiliary_buffer.len = t_cose_signature_sign_eddsa_auxiliary_buffer_size(&eddsa_signer);
-            if (auxiliary_buffer.len > 0) {
-                auxiliary_buffer.ptr = malloc(auxiliary_buffer.len);
-                if (auxiliary_buffer.ptr == NULL) {
-                    return TEEP_ERR_TEMPORARY_ERROR;
-                }
-            }
-
-            t_cose_signature_sign_eddsa_set_auxiliary_buffer(&eddsa_signer, auxiliary_buffer);
+            t_cose_signature_sign_eddsa_set_auxiliary_buffer(&eddsa_signer, auxiliary.buffer);
         }
     }
 
@@ -397,61 +687,193 @@ teep_sign_cbor_message(
         signed_message);
     if (return_value != T_COSE_SUCCESS) {
         TeepLogMessage("COSE Sign failed with error %d\n", return_value);
+    }
+    return get_sign_error(return_value);
+}
+
+teep_error_code_t
+teep_sign1_outbound_message(
+    _In_ const struct t_cose_key* key_pair,
+    teep_signature_kind_t signature_kind,
+    _Inout_ TeepOutboundMessage&& payload,
+    _Out_ TeepOutboundMessage& signed_message)
+{
+    signed_message.Clear();
+
+    auto envelope = std::make_shared<std::vector<uint8_t>>(MAX_SIGN1_ENVELOPE_SIZE);
+    const std::vector<UsefulBufC>& segments = payload.GetSegments();
+    UsefulBufC encoded;
+    size_t head_length;
+    teep_error_code_t result = sign1_segments(signature_kind, key_pair, segments.data(), segments.size(), payload.GetLength(), { envelope->data(), envelope->size() }, &encoded, &head_length);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+
+    // Splice the payload segments in before the signature.
+    signed_message.AppendReference({ encoded.ptr, head_length }, envelope);
+    signed_message.Append(std::move(payload));
+    signed_message.AppendReference({ (const uint8_t*)encoded.ptr + head_length, encoded.len - head_length }, envelope);
+    return TEEP_ERR_SUCCESS;
+}
+
+// The protected headers of a COSE_Mac0 message with HMAC 256/256: {1: 5}.
+static const uint8_t hmac256_protected_headers[] = { 0xA1, 0x01, 0x05 };
+
+// Largest COSE_Mac0 envelope, which is everything but the payload bytes.
+#define MAX_MAC0_ENVELOPE_SIZE 64
+
+// Compute the tag of a COSE_Mac0 message over a payload held as segments.
+static teep_error_code_t compute_mac0_tag(
+    _In_ const TeepSessionKey& session_key,
+    _In_reads_(segment_count) const UsefulBufC* segments,
+    size_t segment_count,
+    size_t payload_length,
+    _Out_writes_(TEEP_HMAC_SHA256_LENGTH) uint8_t* tag)
+{
+    UsefulBuf_MAKE_STACK_UB(mac_structure_buffer, MAX_SIG_STRUCTURE_OVERHEAD);
+    UsefulBufC mac_structure_head;
+    UsefulBufC protected_headers = { hmac256_protected_headers, sizeof(hmac256_protected_headers) };
+    if (encode_to_be_authenticated_head("MAC0", protected_headers, payload_length, mac_structure_buffer, &mac_structure_head) != QCBOR_SUCCESS) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    thread_local std::vector<UsefulBufC> all_segments;
+    all_segments.assign(1, mac_structure_head);
+    all_segments.insert(all_segments.end(), segments, segments + segment_count);
+    UsefulBufC key = session_key.GetKey();
+    return teep_get_crypto_provider()->hmac_sha256((const uint8_t*)key.ptr, key.len, all_segments.data(), all_segments.size(), tag);
+}
+
+bool teep_is_mac0_message(_In_ const UsefulBufC* message)
+{
+    // Tag 17 encodes as the single byte 0xD1.
+    return (message->len > 0) && (((const uint8_t*)message->ptr)[0] == 0xD1);
+}
+
+teep_error_code_t
+teep_mac0_outbound_message(
+    _In_ const TeepSessionKey& session_key,
+    _Inout_ TeepOutboundMessage&& payload,
+    _Out_ TeepOutboundMessage& maced_message)
+{
+    maced_message.Clear();
+    if (session_key.IsExpired()) {
         return TEEP_ERR_PERMANENT_ERROR;
     }
 
+    uint8_t tag[TEEP_HMAC_SHA256_LENGTH];
+    const std::vector<UsefulBufC>& segments = payload.GetSegments();
+    teep_error_code_t result = compute_mac0_tag(session_key, segments.data(), segments.size(), payload.GetLength(), tag);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+
+    auto envelope = std::make_shared<std::vector<uint8_t>>(MAX_MAC0_ENVELOPE_SIZE);
+    QCBOREncodeContext context;
+    QCBOREncode_Init(&context, { envelope->data(), envelope->size() });
+    QCBOREncode_AddTag(&context, CBOR_TAG_COSE_MAC0);
+    QCBOREncode_OpenArray(&context);
+    {
+        QCBOREncode_AddBytes(&context, { hmac256_protected_headers, sizeof(hmac256_protected_headers) });
+        QCBOREncode_OpenMap(&context);
+        QCBOREncode_AddBytesToMapN(&context, COSE_HEADER_PARAM_KID, session_key.GetKeyId());
+        QCBOREncode_CloseMap(&context);
+        QCBOREncode_AddBytesLenOnly(&context, { nullptr, payload.GetLength() });
+        QCBOREncode_AddBytes(&context, { tag, sizeof(tag) });
+    }
+    QCBOREncode_CloseArray(&context);
+    UsefulBufC encoded;
+    if (QCBOREncode_Finish(&context, &encoded) != QCBOR_SUCCESS) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    size_t head_length = encoded.len - (teep_get_cbor_head_size(sizeof(tag)) + sizeof(tag));
+
+    // Splice the payload segments in before the tag.
+    maced_message.AppendReference({ encoded.ptr, head_length }, envelope);
+    maced_message.Append(std::move(payload));
+    maced_message.AppendReference({ (const uint8_t*)encoded.ptr + head_length, encoded.len - head_length }, envelope);
     return TEEP_ERR_SUCCESS;
 }
 
 teep_error_code_t
-teep_verify_cbor_message_sign1(
-    _In_ const struct t_cose_key* key_pair,
-    _In_ const UsefulBufC* signed_cose,
+teep_verify_mac0_message(
+    _In_ const TeepSessionKey& session_key,
+    _In_ const UsefulBufC* maced_cose,
     _Out_ UsefulBufC* encoded)
 {
-    struct t_cose_sign1_verify_ctx verify_ctx;
+    *encoded = NULLUsefulBufC;
+    if (session_key.IsExpired()) {
+        TeepLogMessage("Session key has expired\n");
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
 
-    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_DECODE_ONLY);
-    UsefulBufC payload = {};
-    t_cose_err_t return_value = t_cose_sign1_verify(&verify_ctx, *signed_cose, &payload, nullptr);
-    if (return_value != T_COSE_SUCCESS) {
-        TeepLogMessage("First t_cose_sign1_verify failed with error %d\n", return_value);
+    UsefulBufC payload;
+    const uint8_t* received_tag;
+    if (!decode_sign1(maced_cose, { hmac256_protected_headers, sizeof(hmac256_protected_headers) }, TEEP_HMAC_SHA256_LENGTH, &payload, &received_tag)) {
+        TeepLogMessage("Could not parse COSE_Mac0 message\n");
         return TEEP_ERR_PERMANENT_ERROR;
     }
 
-    // Allocate an auxiliary buffer of the right size.
-    struct q_useful_buf auxiliary_buffer = {};
-    auxiliary_buffer.len = t_cose_sign1_verify_auxiliary_buffer_size(&verify_ctx);
-    if (auxiliary_buffer.len > 0) {
-        auxiliary_buffer.ptr = malloc(auxiliary_buffer.len);
-        if (auxiliary_buffer.ptr == NULL) {
-            TeepLogMessage("teep_verify_cbor_message could not allocate %d bytes\n", auxiliary_buffer.len);
-            return TEEP_ERR_TEMPORARY_ERROR;
-        }
+    // The message must name the session key it was MACed with.
+    std::vector<UsefulBufC> key_ids;
+    if (teep_get_cose_key_ids(maced_cose, key_ids) != TEEP_ERR_SUCCESS ||
+        key_ids.size() != 1 ||
+        UsefulBuf_Compare(key_ids[0], session_key.GetKeyId()) != 0) {
+        TeepLogMessage("COSE_Mac0 message does not name the session key\n");
+        return TEEP_ERR_PERMANENT_ERROR;
     }
 
-    t_cose_sign1_verify_init(&verify_ctx, 0);
+    uint8_t tag[TEEP_HMAC_SHA256_LENGTH];
+    teep_error_code_t result = compute_mac0_tag(session_key, &payload, 1, payload.len, tag);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
 
+    // Compare in constant time.
+    uint8_t difference = 0;
+    for (size_t i = 0; i < sizeof(tag); i++) {
+        difference |= tag[i] ^ received_tag[i];
+    }
+    if (difference != 0) {
+        TeepLogMessage("COSE_Mac0 verification failed\n");
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    *encoded = payload;
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t
+teep_verify_cbor_message_sign1(
+    _In_ const struct t_cose_key* key_pair,
+    _In_ const UsefulBufC* signed_cose,
+    _Out_ UsefulBufC* encoded)
+{
+    struct t_cose_sign1_verify_ctx verify_ctx;
+
+    // Only EdDSA uses auxiliary space, so look at the protected headers
+    // to see whether the message is EdDSA before providing any.
+    auxiliary_buffer auxiliary;
+    UsefulBufC payload;
+    const uint8_t* signature;
+    if (decode_sign1(signed_cose, get_protected_headers(TEEP_SIGNATURE_EDDSA), TEEP_SIGNATURE_LENGTH, &payload, &signature)) {
+        auxiliary.allocate(payload.len);
+    }
+    t_cose_sign1_verify_init(&verify_ctx, 0);
     t_cose_sign1_set_verification_key(&verify_ctx, *key_pair);
-    t_cose_sign1_verify_set_auxiliary_buffer(&verify_ctx, auxiliary_buffer);
+    t_cose_sign1_verify_set_auxiliary_buffer(&verify_ctx, auxiliary.buffer);
 
-    return_value = t_cose_sign1_verify(&verify_ctx,
+    t_cose_err_t return_value = t_cose_sign1_verify(&verify_ctx,
         *signed_cose,        /* COSE to verify */
         encoded,             /* Payload from signed_cose */
         nullptr);            /* Don't return parameters */
-    free(auxiliary_buffer.ptr);
     if (return_value != T_COSE_SUCCESS) {
-        TeepLogMessage("Second t_cose_sign1_verify failed with error %d\n", return_value);
+        TeepLogMessage("t_cose_sign1_verify failed with error %d\n", return_value);
         return TEEP_ERR_PERMANENT_ERROR;
     }
 
     return TEEP_ERR_SUCCESS;
 }
 
-// TODO: Define this once https://github.com/laurencelundblade/t_cose/issues/252
-// is fixed.
-#undef COMPUTE_AUXILIARY_BUFFER_SIZE
-
 teep_error_code_t
 teep_verify_cbor_message_sign(
     teep_signature_kind_t signature_kind,
@@ -461,72 +883,79 @@ teep_verify_cbor_message_sign(
 {
     struct t_cose_sign_verify_ctx verify_ctx;
 
-    UsefulBuf_MAKE_STACK_UB(key_id, SHA256_DIGEST_LENGTH);
-    teep_error_code_t result = teep_compute_key_id(signature_kind, key_pair, &key_id);
+    UsefulBuf_MAKE_STACK_UB(key_id_buffer, TEEP_SHA256_LENGTH);
+    teep_error_code_t result = teep_get_crypto_provider()->get_key_id(signature_kind, key_pair, &key_id_buffer);
     if (result != TEEP_ERR_SUCCESS) {
         return result;
     }
+    UsefulBufC key_id = UsefulBuf_Const(key_id_buffer);
 
-    // Initialize verifiers.
-#ifndef COMPUTE_AUXILIARY_BUFFER_SIZE
+    // Initialize verifiers.  EdDSA verifies the whole Sig_structure, so it
+    // needs auxiliary space, which the message length bounds.
     t_cose_sign_verify_init(&verify_ctx, 0);
-#else
-    t_cose_sign_verify_init(&verify_ctx, T_COSE_OPT_DECODE_ONLY);
-#endif
     struct t_cose_signature_verify_main es256_verifier;
     struct t_cose_signature_verify_eddsa eddsa_verifier;
+    auxiliary_buffer auxiliary;
     if (signature_kind == TEEP_SIGNATURE_ES256) {
         // ES256 verifier.
         t_cose_signature_verify_main_init(&es256_verifier);
-        t_cose_signature_verify_main_set_key(&es256_verifier, *key_pair, UsefulBuf_Const(key_id));
+        t_cose_signature_verify_main_set_key(&es256_verifier, *key_pair, key_id);
         t_cose_sign_add_verifier(&verify_ctx, t_cose_signature_verify_from_main(&es256_verifier));
     } else {
         // EdDSA verifier.
         t_cose_signature_verify_eddsa_init(&eddsa_verifier, 0);
-        t_cose_signature_verify_eddsa_set_key(&eddsa_verifier, *key_pair, UsefulBuf_Const(key_id));
+        t_cose_signature_verify_eddsa_set_key(&eddsa_verifier, *key_pair, key_id);
+        auxiliary.allocate(signed_cose->len);
+        t_cose_signature_verify_eddsa_set_auxiliary_buffer(&eddsa_verifier, auxiliary.buffer);
         t_cose_sign_add_verifier(&verify_ctx, t_cose_signature_verify_from_eddsa(&eddsa_verifier));
     }
 
-    t_cose_err_t return_value;
-    struct q_useful_buf auxiliary_buffer = {};
-#ifdef COMPUTE_AUXILIARY_BUFFER_SIZE
-    // Compute the auxiliary buffer size needed.
-    UsefulBufC payload = {};
-    return_value = t_cose_sign_verify(&verify_ctx, *signed_cose, NULL_Q_USEFUL_BUF_C, &payload, nullptr);
-    if (return_value != T_COSE_SUCCESS) {
-        TeepLogMessage("First t_cose_sign1_verify failed with error %d\n", return_value);
-        return TEEP_ERR_PERMANENT_ERROR;
-    }
-    t_cose_sign_verify_init(&verify_ctx, 0);
-
-    // Allocate an auxiliary buffer of the right size
-    auxiliary_buffer.len = t_cose_signature_verify_eddsa_auxiliary_buffer_size(&eddsa_verifier);
-#else
-    auxiliary_buffer.len = 1024;
-#endif
-    if (auxiliary_buffer.len > 0) {
-        auxiliary_buffer.ptr = malloc(auxiliary_buffer.len);
-        if (auxiliary_buffer.ptr == NULL) {
-            TeepLogMessage("teep_verify_cbor_message could not allocate %d bytes\n", auxiliary_buffer.len);
-            return TEEP_ERR_TEMPORARY_ERROR;
-        }
-    }
-    t_cose_signature_verify_eddsa_set_auxiliary_buffer(&eddsa_verifier, auxiliary_buffer);
-
-    // Do the actual verification.
-    return_value = t_cose_sign_verify(&verify_ctx,
+    // Verify in a single pass.
+    t_cose_err_t return_value = t_cose_sign_verify(&verify_ctx,
         *signed_cose,        /* COSE to verify */
         NULL_Q_USEFUL_BUF_C, /* No AAD */
         encoded,             /* Payload from signed_cose */
         nullptr);            /* Don't return parameters */
     if (return_value != T_COSE_SUCCESS) {
-        TeepLogMessage("Second t_cose_sign_verify failed with error %d\n", return_value);
+        TeepLogMessage("t_cose_sign_verify failed with error %d\n", return_value);
         return TEEP_ERR_PERMANENT_ERROR;
     }
 
     return TEEP_ERR_SUCCESS;
 }
 
+// Verify an EdDSA COSE_Sign1 message.  EdDSA signs the whole
+// Sig_structure rather than a hash of it, so it is built in the
+// auxiliary buffer.  Any other kind of message is left for t_cose,
+// with *handled set to false.
+static teep_error_code_t verify_eddsa_sign1(
+    _In_ const struct t_cose_key* key_pair,
+    _In_ const UsefulBufC* signed_cose,
+    _Out_ UsefulBufC* encoded,
+    _Out_ bool* handled)
+{
+    UsefulBufC payload;
+    const uint8_t* signature;
+    *handled = decode_sign1(signed_cose, get_protected_headers(TEEP_SIGNATURE_EDDSA), TEEP_SIGNATURE_LENGTH, &payload, &signature);
+    if (!*handled) {
+        return TEEP_ERR_SUCCESS;
+    }
+
+    auxiliary_buffer auxiliary(payload.len);
+    UsefulBufC sig_structure;
+    teep_error_code_t result = build_eddsa_sig_structure(&payload, 1, payload.len, auxiliary, &sig_structure);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    result = teep_get_crypto_provider()->verify(TEEP_SIGNATURE_EDDSA, key_pair, (const uint8_t*)sig_structure.ptr, sig_structure.len, signature);
+    if (result != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("EdDSA signature verification failed\n");
+        return result;
+    }
+    *encoded = payload;
+    return TEEP_ERR_SUCCESS;
+}
+
 teep_error_code_t
 teep_verify_cbor_message(
     teep_signature_kind_t signature_kind,
@@ -540,9 +969,84 @@ teep_verify_cbor_message(
         return TEEP_ERR_SUCCESS;
     }
 #endif
+    bool handled = false;
+    teep_error_code_t result = TEEP_ERR_SUCCESS;
+    if (signature_kind == TEEP_SIGNATURE_ES256) {
+        result = verify_es256_sign1(key_pair, signed_cose, encoded, &handled);
+    } else if (signature_kind == TEEP_SIGNATURE_EDDSA) {
+        result = verify_eddsa_sign1(key_pair, signed_cose, encoded, &handled);
+    }
+    if (handled) {
+        return result;
+    }
     return teep_verify_cbor_message_sign(signature_kind, key_pair, signed_cose, encoded);
 }
 
+size_t
+teep_verify_cbor_messages(
+    _Inout_updates_(count) teep_verification_t* verifications,
+    size_t count)
+{
+    // An EdDSA COSE_Sign1 message, whose Sig_structure is checked as the
+    // head encoded here followed by the payload where it is.
+    struct batched_message {
+        size_t index;
+        UsefulBufC payload;
+        const uint8_t* signature;
+        uint8_t head[MAX_SIG_STRUCTURE_OVERHEAD];
+        size_t head_length;
+        UsefulBufC segments[2];
+    };
+    thread_local std::vector<batched_message> batched;
+    thread_local std::vector<teep_eddsa_batch_entry_t> entries;
+    batched.clear();
+    entries.clear();
+
+    const teep_crypto_provider_t* provider = teep_get_crypto_provider();
+    for (size_t i = 0; i < count; i++) {
+        teep_verification_t* verification = &verifications[i];
+        verification->encoded = NULLUsefulBufC;
+        UsefulBufC payload;
+        const uint8_t* signature;
+        UsefulBufC head;
+        batched_message message;
+        if (provider->verify_eddsa_batch == nullptr ||
+            verification->signature_kind != TEEP_SIGNATURE_EDDSA ||
+            !decode_sign1(&verification->signed_cose, get_protected_headers(TEEP_SIGNATURE_EDDSA), TEEP_SIGNATURE_LENGTH, &payload, &signature) ||
+            encode_sig_structure_head(get_protected_headers(TEEP_SIGNATURE_EDDSA), payload.len, { message.head, sizeof(message.head) }, &head) != QCBOR_SUCCESS) {
+            verification->result = teep_verify_cbor_message(verification->signature_kind, verification->key_pair, &verification->signed_cose, &verification->encoded);
+            continue;
+        }
+        message.index = i;
+        message.payload = payload;
+        message.signature = signature;
+        message.head_length = head.len;
+        batched.push_back(message);
+    }
+
+    // A batch of one costs about as much as verifying alone.
+    if (batched.size() > 1) {
+        for (batched_message& message : batched) {
+            message.segments[0] = { message.head, message.head_length };
+            message.segments[1] = message.payload;
+            entries.push_back({ verifications[message.index].key_pair, message.segments, 2, message.signature });
+        }
+        if (provider->verify_eddsa_batch(entries.data(), entries.size()) == TEEP_ERR_SUCCESS) {
+            for (const batched_message& message : batched) {
+                verifications[message.index].encoded = message.payload;
+                verifications[message.index].result = TEEP_ERR_SUCCESS;
+            }
+            return batched.size();
+        }
+    }
+
+    for (const batched_message& message : batched) {
+        teep_verification_t* verification = &verifications[message.index];
+        verification->result = teep_verify_cbor_message(verification->signature_kind, verification->key_pair, &verification->signed_cose, &verification->encoded);
+    }
+    return 0;
+}
+
 #ifdef TEEP_USE_CERTIFICATES // Currently unused.
 _Ret_writes_bytes_maybenull_(*pCertificateSize)
 const unsigned char* GetDerCertificate(
@@ -603,20 +1107,12 @@ void HexPrintBuffer(_In_opt_z_ const char* label, const void* buffer, size_t len
 }
 
 #ifndef TEEP_USE_TEE
-#include <random>
 teep_error_code_t teep_random(
     _Out_writes_(length) void* buffer,
     size_t length)
 {
-    std::random_device rd;  // non-deterministic generator
-    std::mt19937 gen(rd()); // to seed mersenne twister.
-                            // replace the call to rd() with a
-                            // constant value to get repeatable
-                            // results.
-    for (size_t i = 0; i < length; i++) {
-        ((uint8_t*)buffer)[i] = gen() % 256;
-    }
-    return TEEP_ERR_SUCCESS;
+    // Each thread has its own generator, so no lock is needed.
+    return TeepRandomGenerator::GetForThread().Generate(buffer, length);
 }
 #endif
 
@@ -9,22 +9,13 @@
 
 #define UUID_LENGTH 16 // Size in bytes of a UUID (RFC 4122)
 
+#include "teep_sal.h"
+
 #ifdef OE_BUILD_ENCLAVE
 #include <openenclave/enclave.h>
 typedef oe_uuid_t teep_uuid_t;
 #define TEEP_UUID_SIZE sizeof(oe_uuid_t)
 #define TEEP_ASSERT(x) oe_assert(x)
-#define _In_
-#define _In_opt_z_
-#define _In_reads_(x)
-#define _In_z_
-#define _Inout_
-#define _Out_
-#define _Out_writes_(x)
-#define _Out_writes_opt_z_(x)
-#define _Ret_writes_bytes_(x)
-#define _Ret_writes_bytes_maybenull_(x)
-#define _Return_type_success_(x)
 #define strcpy_s(dest, dest_sz, src) strcpy(dest, src)
 #define sprintf_s(dest, sz, ...) sprintf(dest, __VA_ARGS__)
 #define _strdup strdup
@@ -72,6 +63,22 @@ teep_sign1_cbor_message(
     teep_signature_kind_t signature_kind,
     _Out_ UsefulBufC* signed_message);
 
+// Turn background precomputation of ES256 signing nonces on or off.  It
+// is off by default, since it runs a background thread, and the TAM turns
+// it on for its own signing keys.
+void teep_set_es256_precomputation(int enabled);
+
+// Set up precomputation for a key pair the caller signs with often, such
+// as the TAM's own signing keys.  Call it once the key is loaded.
+void teep_precompute_signing_key(_In_ const struct t_cose_key* key_pair);
+
+// Set the lifetime of session keys.  In session mode, the TAM and TEEP
+// Agent agree on a symmetric key during a signed and attested exchange,
+// and protect later messages with COSE_Mac0 until the key expires, after
+// which they go back to signing.  0, the default, disables session mode.
+void teep_set_session_key_lifetime(uint32_t seconds);
+uint32_t teep_get_session_key_lifetime(void);
+
 #ifdef __cplusplus
 #include <map>
 teep_error_code_t
@@ -90,6 +97,119 @@ teep_verify_cbor_message(
     _In_ const UsefulBufC* signed_cose,
     _Out_ UsefulBufC* encoded);
 
+// A message to verify as part of a batch.
+typedef struct {
+    teep_signature_kind_t signature_kind;
+    const struct t_cose_key* key_pair;
+    UsefulBufC signed_cose;
+    UsefulBufC encoded;       // Set on success.
+    teep_error_code_t result; // Result for this message alone.
+} teep_verification_t;
+
+// Verify a batch of messages, such as a burst of QueryResponses from many
+// agents, with the result for each that teep_verify_cbor_message would
+// give.  EdDSA COSE_Sign1 messages are checked together with the crypto
+// provider's batch verification, if it has one, and if the batch fails,
+// each is verified alone to find the bad ones.  Any other message is
+// verified alone.  Returns how many messages passed as a batch.
+size_t
+teep_verify_cbor_messages(
+    _Inout_updates_(count) teep_verification_t* verifications,
+    size_t count);
+
+// Compute the COSE key ID (kid) of a key, which is the SHA-256 hash of
+// its DER-encoded public key.  key_id must have room for 32 bytes.
+teep_error_code_t
+teep_compute_key_id(
+    teep_signature_kind_t signature_kind,
+    _In_ const struct t_cose_key* key_pair,
+    _Inout_ UsefulBuf* key_id);
+
+#ifdef __cplusplus
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "t_cose/t_cose_common.h"
+
+// A trusted verification key.
+typedef struct {
+    teep_signature_kind_t kind;
+    struct t_cose_key key;
+} teep_verification_key_t;
+
+// Trusted verification keys indexed by COSE key ID.
+typedef std::unordered_map<std::string, teep_verification_key_t> teep_key_index_t;
+
+// Get the key IDs from the headers of a COSE_Sign1 message, or of each
+// signature in a COSE_Sign message.  The key IDs point into signed_cose.
+teep_error_code_t
+teep_get_cose_key_ids(
+    _In_ const UsefulBufC* signed_cose,
+    _Out_ std::vector<UsefulBufC>& key_ids);
+
+// Add a trusted key to a key index under its key ID.
+teep_error_code_t
+teep_add_verification_key(
+    _Inout_ teep_key_index_t& key_index,
+    teep_signature_kind_t signature_kind,
+    _In_ const struct t_cose_key* key);
+
+// Verify a message using the trusted key named by its key ID, so that
+// only one signature verification is done however many keys are trusted.
+// On success, the key ID that was used is optionally returned.
+teep_error_code_t
+teep_verify_cbor_message_by_key_id(
+    _In_ const teep_key_index_t& key_index,
+    _In_ const UsefulBufC* signed_cose,
+    _Out_ UsefulBufC* encoded,
+    _Out_opt_ std::string* key_id);
+
+#include "OutboundMessage.h"
+
+// Maximum size of a COSE envelope and its signatures around a payload.
+#define TEEP_MAX_COSE_OVERHEAD 1024
+
+// Get the size of a CBOR head with a given argument (RFC 8949 section 3).
+size_t teep_get_cbor_head_size(uint64_t argument);
+
+// Get the exact size of a COSE_Sign1 message with a given payload length,
+// as signed with either ES256 or EdDSA.
+size_t teep_get_sign1_message_size(size_t payload_length);
+
+// Sign a payload held as segments into a COSE_Sign1 message, which
+// references the segments in place.  For ES256 the segments are fed into
+// an incremental SHA-256 hash.  EdDSA signs the whole Sig_structure
+// rather than a hash of it, so for EdDSA the payload is gathered into a
+// reused per-thread buffer to be signed.
+teep_error_code_t
+teep_sign1_outbound_message(
+    _In_ const struct t_cose_key* key_pair,
+    teep_signature_kind_t signature_kind,
+    _Inout_ TeepOutboundMessage&& payload,
+    _Out_ TeepOutboundMessage& signed_message);
+
+class TeepSessionKey;
+
+// Check whether a message is a COSE_Mac0 message, as sent in session mode.
+bool teep_is_mac0_message(_In_ const UsefulBufC* message);
+
+// Protect a payload held as segments with COSE_Mac0 (HMAC 256/256) under
+// a session key, referencing the segments in place.
+teep_error_code_t
+teep_mac0_outbound_message(
+    _In_ const TeepSessionKey& session_key,
+    _Inout_ TeepOutboundMessage&& payload,
+    _Out_ TeepOutboundMessage& maced_message);
+
+// Verify a COSE_Mac0 message, which fails if its kid does not name the
+// session key, or once the session key expires.
+teep_error_code_t
+teep_verify_mac0_message(
+    _In_ const TeepSessionKey& session_key,
+    _In_ const UsefulBufC* maced_cose,
+    _Out_ UsefulBufC* encoded);
+#endif
+
 #ifdef __cplusplus
 #include <iostream>
 #include <ostream>
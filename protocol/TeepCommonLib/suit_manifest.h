@@ -28,4 +28,19 @@ typedef enum {
     SUIT_COMMON_LABEL_SEQUENCE = 4,
 } suit_common_label_t;
 
+typedef enum {
+    SUIT_DIRECTIVE_SET_COMPONENT_INDEX = 12,
+    SUIT_DIRECTIVE_SET_PARAMETERS = 19,
+    SUIT_DIRECTIVE_OVERRIDE_PARAMETERS = 20,
+} suit_directive_t;
+
+typedef enum {
+    SUIT_PARAMETER_VENDOR_IDENTIFIER = 1,
+    SUIT_PARAMETER_CLASS_IDENTIFIER = 2,
+    SUIT_PARAMETER_IMAGE_DIGEST = 3,
+    SUIT_PARAMETER_IMAGE_SIZE = 14,
+} suit_parameter_t;
+
+#define SUIT_ALGORITHM_ID_SHA256 -16
+
 #define SUIT_MANIFEST_VERSION_VALUE 1
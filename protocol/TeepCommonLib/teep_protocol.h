@@ -57,6 +57,10 @@ typedef enum {
     TEEP_LABEL_TOKEN = 20,
     TEEP_LABEL_SUPPORTED_FRESHNESS_MECHANISMS = 21,
     TEEP_LABEL_ERR_CODE = 23,
+
+    // Private use: an ECDH public key share for session mode, in a
+    // QueryRequest from the TAM or a QueryResponse from the TEEP Agent.
+    TEEP_LABEL_SESSION_KEY_SHARE = -65537,
 } teep_label_t;
 
 typedef enum {
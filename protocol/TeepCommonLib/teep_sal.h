@@ -0,0 +1,27 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+
+// SAL annotations are only understood by the Microsoft compiler, whose
+// headers define them.  Define them away for enclave and Linux builds.
+#if defined(OE_BUILD_ENCLAVE) || !defined(_MSC_VER)
+#define _In_
+#define _In_opt_
+#define _In_opt_z_
+#define _In_reads_(x)
+#define _In_reads_opt_(x)
+#define _In_z_
+#define _Inout_
+#define _Inout_updates_(x)
+#define _Out_
+#define _Out_opt_
+#define _Out_writes_(x)
+#define _Out_writes_opt_z_(x)
+#define _Outptr_
+#define _Outptr_opt_result_nullonfailure_
+#define _Ret_maybenull_
+#define _Ret_writes_bytes_(x)
+#define _Ret_writes_bytes_maybenull_(x)
+#define _Return_type_success_(x)
+#define _Success_(x)
+#endif
@@ -0,0 +1,195 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+//
+// Work-stealing thread pool.  Each worker owns a deque: work queued from a
+// worker goes onto that worker's own deque, and work queued from any other
+// thread (e.g., a transport thread) is spread round-robin.  A worker takes
+// from the back of its own deque and, when that is empty, steals from the
+// front of the others, so no single queue lock is shared by every worker.
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include "common.h"
+#include "TamWorkerPool.h"
+
+struct TamWorkItem
+{
+    TamWorkItemCallback Callback;
+    void* Context;
+};
+
+struct TamWorkerQueue
+{
+    std::mutex Lock;
+    std::deque<TamWorkItem> Items;
+};
+
+// The pool lock guards starting and stopping the pool against threads
+// queueing work.  Queueing takes it shared, so queueing threads never
+// contend with each other on it, and the queues are only created or freed
+// with it held exclusively.
+static std::shared_mutex g_PoolLock;
+static std::vector<std::unique_ptr<TamWorkerQueue>> g_WorkerQueues;
+static std::vector<std::thread> g_WorkerThreads;
+static std::atomic<unsigned int> g_NextQueue{ 0 };
+static std::atomic<bool> g_PoolRunning{ false };
+
+// Idle workers sleep on this until there is pending work.  The idle lock
+// is only taken when a worker has nothing to do, or to wake one up.
+static std::mutex g_IdleLock;
+static std::condition_variable g_WorkAvailable;
+static std::atomic<size_t> g_PendingCount{ 0 };
+static std::atomic<size_t> g_IdleWorkers{ 0 };
+static std::atomic<bool> g_Stopping{ false };
+
+// Index of the current thread's queue, or -1 if not a worker thread.
+static thread_local int t_WorkerIndex = -1;
+
+static bool TryPopLocal(size_t index, _Out_ TamWorkItem* item)
+{
+    TamWorkerQueue& queue = *g_WorkerQueues[index];
+    std::lock_guard<std::mutex> lock(queue.Lock);
+    if (queue.Items.empty()) {
+        return false;
+    }
+    *item = queue.Items.back();
+    queue.Items.pop_back();
+    return true;
+}
+
+static bool TrySteal(size_t thief, _Out_ TamWorkItem* item)
+{
+    size_t count = g_WorkerQueues.size();
+    for (size_t i = 1; i < count; i++) {
+        TamWorkerQueue& victim = *g_WorkerQueues[(thief + i) % count];
+        std::unique_lock<std::mutex> lock(victim.Lock, std::try_to_lock);
+        if (!lock.owns_lock() || victim.Items.empty()) {
+            continue;
+        }
+        *item = victim.Items.front();
+        victim.Items.pop_front();
+        return true;
+    }
+    return false;
+}
+
+static void TamWorkerThread(size_t index)
+{
+    t_WorkerIndex = (int)index;
+
+    for (;;) {
+        TamWorkItem item;
+        if (TryPopLocal(index, &item) || TrySteal(index, &item)) {
+            g_PendingCount--;
+            item.Callback(item.Context);
+            continue;
+        }
+
+        if (g_PendingCount > 0) {
+            // Work is pending but another worker's lock was busy; try again
+            // after giving that worker a chance to make progress.
+            std::this_thread::yield();
+            continue;
+        }
+        if (g_Stopping) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(g_IdleLock);
+        g_IdleWorkers++;
+        g_WorkAvailable.wait(lock, [] { return g_Stopping || g_PendingCount > 0; });
+        g_IdleWorkers--;
+    }
+}
+
+int TamStartWorkerPool(int workerCount)
+{
+    std::unique_lock<std::shared_mutex> poolLock(g_PoolLock);
+    if (g_PoolRunning || !g_WorkerThreads.empty()) {
+        return EALREADY;
+    }
+    if (workerCount <= 0) {
+        workerCount = (int)std::thread::hardware_concurrency();
+        if (workerCount <= 0) {
+            workerCount = 1;
+        }
+    }
+
+    g_Stopping = false;
+    g_PendingCount = 0;
+    for (int i = 0; i < workerCount; i++) {
+        g_WorkerQueues.push_back(std::make_unique<TamWorkerQueue>());
+    }
+    for (int i = 0; i < workerCount; i++) {
+        g_WorkerThreads.emplace_back(TamWorkerThread, (size_t)i);
+    }
+    g_PoolRunning = true;
+    return 0;
+}
+
+void TamStopWorkerPool(void)
+{
+    {
+        // Once this is released, only workers can queue more work, and
+        // anything queued by another thread beforehand will be drained.
+        std::unique_lock<std::shared_mutex> poolLock(g_PoolLock);
+        if (!g_PoolRunning) {
+            return;
+        }
+        g_PoolRunning = false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(g_IdleLock);
+        g_Stopping = true;
+    }
+    g_WorkAvailable.notify_all();
+
+    for (std::thread& thread : g_WorkerThreads) {
+        thread.join();
+    }
+
+    std::unique_lock<std::shared_mutex> poolLock(g_PoolLock);
+    g_WorkerThreads.clear();
+    g_WorkerQueues.clear();
+}
+
+int TamIsWorkerPoolRunning(void)
+{
+    return g_PoolRunning ? 1 : 0;
+}
+
+int TamQueueWorkItem(_In_ TamWorkItemCallback callback, _In_opt_ void* context)
+{
+    std::shared_lock<std::shared_mutex> poolLock(g_PoolLock);
+
+    // Workers may still queue follow-on work while the pool drains.
+    if (!g_PoolRunning && t_WorkerIndex < 0) {
+        return ENOTCONN;
+    }
+
+    // Count the item before it can be popped, so the count never drops
+    // below zero.  A worker that sees the count before the item is pushed
+    // just tries again.
+    g_PendingCount++;
+    size_t index = (t_WorkerIndex >= 0) ? (size_t)t_WorkerIndex : (g_NextQueue++ % g_WorkerQueues.size());
+    {
+        TamWorkerQueue& queue = *g_WorkerQueues[index];
+        std::lock_guard<std::mutex> lock(queue.Lock);
+        queue.Items.push_back({ callback, context });
+    }
+
+    if (g_IdleWorkers > 0) {
+        // Taking the lock ensures a worker that just found no pending work
+        // is either waiting already or will see the new count.
+        { std::lock_guard<std::mutex> lock(g_IdleLock); }
+        g_WorkAvailable.notify_one();
+    }
+    return 0;
+}
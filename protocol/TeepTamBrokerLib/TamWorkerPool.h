@@ -0,0 +1,30 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+
+// The TAM worker pool runs TEEP message processing (decoding, signature
+// verification, Update composition and signing) on a set of CPU worker
+// threads, so that transport threads only have to do I/O.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef void (*TamWorkItemCallback)(_In_opt_ void* context);
+
+    // Start the worker pool.  A workerCount of 0 means one worker per core.
+    int TamStartWorkerPool(int workerCount);
+
+    // Stop the worker pool, after running any work items already queued.
+    void TamStopWorkerPool(void);
+
+    // Returns non-zero if the worker pool is running.
+    int TamIsWorkerPoolRunning(void);
+
+    // Queue a work item to be run on some worker thread.  Returns 0 on
+    // success, or an error if the pool is not running.
+    int TamQueueWorkItem(_In_ TamWorkItemCallback callback, _In_opt_ void* context);
+
+#ifdef __cplusplus
+};
+#endif
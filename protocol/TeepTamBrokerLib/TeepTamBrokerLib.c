@@ -1,6 +1,12 @@
 // Copyright (c) TEEP contributors
 // SPDX-License-Identifier: MIT
+#ifdef _WIN32
 #include <direct.h>
+#else
+#include <sys/stat.h>
+#define _mkdir(dir) mkdir(dir, 0755)
+#define sprintf_s(dest, sz, ...) snprintf(dest, sz, __VA_ARGS__)
+#endif
 #include <stdio.h>
 #include <string.h>
 #include "TeepTamBrokerLib.h"
@@ -11,8 +17,16 @@
 #endif
 #ifndef TEEP_USE_TEE
 #include "TeepTamLib.h"
+#include "TamConfigurationWatcher.h"
 #endif
 
+static int g_WatchConfiguration = 0;
+
+void SetTamBrokerConfigurationWatch(int watch)
+{
+    g_WatchConfiguration = watch;
+}
+
 int TamBrokerProcess(_In_z_ const wchar_t* tamUri)
 {
     int err;
@@ -68,7 +82,17 @@ int StartTamBroker(_In_z_ const char* dataDirectory, int simulatedTee)
         return result;
     }
 
-    return TamInitializeKeys(dataDirectory);
+    result = TamInitializeKeys(dataDirectory);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+
+    // Pick up manifest and key changes without a restart.  The watcher
+    // logs why if it cannot start, and the TAM carries on without it.
+    if (g_WatchConfiguration) {
+        (void)TamStartConfigurationWatcher(dataDirectory);
+    }
+    return 0;
 #endif
 }
 
@@ -76,5 +100,17 @@ void StopTamBroker(void)
 {
 #ifdef TEEP_USE_TEE
     StopTamTABroker();
+#else
+    TamStopConfigurationWatcher();
+#endif
+}
+
+int CompileTamManifests(_In_z_ const char* dataDirectory)
+{
+#ifdef TEEP_USE_TEE
+    printf("Compiling manifests is not supported with a TEE\n");
+    return TEEP_ERR_PERMANENT_ERROR;
+#else
+    return TamCompileManifests(dataDirectory);
 #endif
 }
\ No newline at end of file
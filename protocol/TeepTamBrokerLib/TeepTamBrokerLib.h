@@ -3,7 +3,7 @@
 #pragma once
 
 // Other prototypes are the same as in the TEE.
-#include "..\TeepTamLib\TeepTamLib.h"
+#include "../TeepTamLib/TeepTamLib.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,8 +11,17 @@ extern "C" {
 
     int TamBrokerProcess(_In_z_ const wchar_t* tamUri);
     int StartTamBroker(_In_z_ const char* manifestDirectory, int simulated_tee);
+
+    // Whether StartTamBroker also watches the data directory and applies
+    // configuration changes without a restart.  Off by default.
+    void SetTamBrokerConfigurationWatch(int watch);
     void StopTamBroker(void);
 
+    // Compile the manifest files under a data directory into the manifest
+    // pack that StartTamBroker loads, e.g. after changing them while no
+    // TAM was watching the directory.
+    int CompileTamManifests(_In_z_ const char* dataDirectory);
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,462 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <algorithm>
+#include <filesystem>
+#include <stdio.h>
+#include <string.h>
+#include "t_cose/t_cose_common.h"
+#include "AgentKeyStore.h"
+#include "CryptoProvider.h"
+#include "MappedFile.h"
+#include "TeepTamLib.h"
+using namespace std;
+#ifdef TEEP_USE_TEE
+using namespace std::__fs;
+#endif
+
+AgentKey::AgentKey(teep_signature_kind_t kind, struct t_cose_key key)
+{
+    Kind = kind;
+    Key = key;
+}
+
+AgentKey::~AgentKey()
+{
+    teep_get_crypto_provider()->free_key(&Key);
+}
+
+// A read-only view of a pack file.
+class AgentKeyPack
+{
+public:
+    AgentKeyPack();
+
+    teep_error_code_t Open(_In_z_ const char* filename);
+    const AgentKeyPackRecord* Find(_In_reads_(TAM_AGENT_KEY_ID_LENGTH) const uint8_t* keyId) const;
+    UsefulBufC GetDer(_In_ const AgentKeyPackRecord* record) const;
+    size_t GetRecordCount() const { return _recordCount; }
+    const AgentKeyPackRecord* GetRecord(size_t index) const { return &_records[index]; }
+
+private:
+    MappedFile _file;
+    const AgentKeyPackRecord* _records;
+    size_t _recordCount;
+};
+
+AgentKeyPack::AgentKeyPack()
+{
+    _records = nullptr;
+    _recordCount = 0;
+}
+
+teep_error_code_t AgentKeyPack::Open(_In_z_ const char* filename)
+{
+    teep_error_code_t result = _file.Open(filename, sizeof(AgentKeyPackHeader));
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    const uint8_t* data = _file.GetData();
+    size_t size = _file.GetSize();
+
+    // Validate the header.  Records are validated as they are used, so that
+    // opening a large pack does not touch every page.
+    const AgentKeyPackHeader* header = (const AgentKeyPackHeader*)data;
+    if (memcmp(header->Magic, TAM_AGENT_KEY_PACK_MAGIC, sizeof(header->Magic)) != 0) {
+        TeepLogMessage("%s is not an agent key pack\n", filename);
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    if (header->RecordCount > (size - sizeof(*header)) / sizeof(AgentKeyPackRecord)) {
+        TeepLogMessage("Agent key pack %s is truncated\n", filename);
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    _records = (const AgentKeyPackRecord*)(header + 1);
+    _recordCount = (size_t)header->RecordCount;
+    return TEEP_ERR_SUCCESS;
+}
+
+const AgentKeyPackRecord* AgentKeyPack::Find(_In_reads_(TAM_AGENT_KEY_ID_LENGTH) const uint8_t* keyId) const
+{
+    const AgentKeyPackRecord* end = _records + _recordCount;
+    const AgentKeyPackRecord* record = std::lower_bound(_records, end, keyId,
+        [](const AgentKeyPackRecord& left, const uint8_t* right) {
+            return memcmp(left.KeyId, right, TAM_AGENT_KEY_ID_LENGTH) < 0;
+        });
+    if (record == end || memcmp(record->KeyId, keyId, TAM_AGENT_KEY_ID_LENGTH) != 0) {
+        return nullptr;
+    }
+    return record;
+}
+
+UsefulBufC AgentKeyPack::GetDer(_In_ const AgentKeyPackRecord* record) const
+{
+    size_t size = _file.GetSize();
+    if (record->Offset > size || record->Length > size - record->Offset) {
+        return NULLUsefulBufC;
+    }
+    return { _file.GetData() + record->Offset, record->Length };
+}
+
+// A key to be written to a pack file.
+struct AgentKeyPackEntry
+{
+    std::string KeyId;
+    teep_signature_kind_t Kind;
+    UsefulBufC Der;
+};
+
+static teep_error_code_t WritePackEntries(_In_z_ const char* filename, _Inout_ std::vector<AgentKeyPackEntry>& entries)
+{
+    std::stable_sort(entries.begin(), entries.end(),
+        [](const AgentKeyPackEntry& left, const AgentKeyPackEntry& right) { return left.KeyId < right.KeyId; });
+    entries.erase(std::unique(entries.begin(), entries.end(),
+        [](const AgentKeyPackEntry& left, const AgentKeyPackEntry& right) { return left.KeyId == right.KeyId; }),
+        entries.end());
+
+    FILE* fp = fopen(filename, "wb");
+    if (fp == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    AgentKeyPackHeader header = {};
+    memcpy(header.Magic, TAM_AGENT_KEY_PACK_MAGIC, sizeof(header.Magic));
+    header.RecordCount = entries.size();
+    bool ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+
+    uint64_t offset = sizeof(header) + entries.size() * sizeof(AgentKeyPackRecord);
+    for (const AgentKeyPackEntry& entry : entries) {
+        AgentKeyPackRecord record = {};
+        memcpy(record.KeyId, entry.KeyId.data(), TAM_AGENT_KEY_ID_LENGTH);
+        record.Kind = entry.Kind;
+        record.Length = (uint32_t)entry.Der.len;
+        record.Offset = offset;
+        offset += entry.Der.len;
+        ok = ok && (fwrite(&record, sizeof(record), 1, fp) == 1);
+    }
+    for (const AgentKeyPackEntry& entry : entries) {
+        ok = ok && (entry.Der.len == 0 || fwrite(entry.Der.ptr, 1, entry.Der.len, fp) == entry.Der.len);
+    }
+
+    if (fclose(fp) != 0 || !ok) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+static teep_error_code_t ComputeKeyId(teep_signature_kind_t kind, UsefulBufC der, _Out_ std::string& keyId)
+{
+    const teep_crypto_provider_t* provider = teep_get_crypto_provider();
+    struct t_cose_key key = {};
+    teep_error_code_t result = provider->import_public_key(der, &key);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    UsefulBuf_MAKE_STACK_UB(keyIdBuffer, TAM_AGENT_KEY_ID_LENGTH);
+    result = provider->get_key_id(kind, &key, &keyIdBuffer);
+    provider->free_key(&key);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    keyId.assign((const char*)keyIdBuffer.ptr, keyIdBuffer.len);
+    return TEEP_ERR_SUCCESS;
+}
+
+AgentKeyStore::AgentKeyStore()
+{
+    _cacheCapacity = TAM_DEFAULT_AGENT_KEY_CACHE_CAPACITY;
+    _packGeneration = 0;
+    _generation = 0;
+}
+
+AgentKeyStore::~AgentKeyStore()
+{
+}
+
+teep_error_code_t AgentKeyStore::Open(_In_z_ const char* filename)
+{
+    uint64_t packGeneration;
+    if (!FindLatestPackGeneration(filename, &packGeneration)) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (_pack && _packFilename == filename && _packGeneration == packGeneration) {
+            // E.g., a change notification for a pack we saved ourselves.
+            return TEEP_ERR_SUCCESS;
+        }
+    }
+
+    auto pack = std::make_shared<AgentKeyPack>();
+    teep_error_code_t result = pack->Open(GetPackGenerationFilename(filename, packGeneration).c_str());
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+
+    std::lock_guard<std::mutex> lock(_lock);
+    _pack = pack;
+    _packFilename = filename;
+    _packGeneration = packGeneration;
+    _overlay.clear();
+    _cache.clear();
+    _lru.clear();
+    _generation++;
+    return TEEP_ERR_SUCCESS;
+}
+
+void AgentKeyStore::Close()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    _pack.reset();
+    _packFilename.clear();
+    _packGeneration = 0;
+    _overlay.clear();
+    _cache.clear();
+    _lru.clear();
+    _generation++;
+}
+
+void AgentKeyStore::Evict(_In_ const std::string& keyId)
+{
+    auto it = _cache.find(keyId);
+    if (it != _cache.end()) {
+        _lru.erase(it->second);
+        _cache.erase(it);
+    }
+}
+
+std::shared_ptr<const AgentKey> AgentKeyStore::Find(UsefulBufC keyId)
+{
+    if (keyId.len != TAM_AGENT_KEY_ID_LENGTH) {
+        return nullptr;
+    }
+    std::string id((const char*)keyId.ptr, keyId.len);
+
+    std::shared_ptr<AgentKeyPack> pack; // Keeps the DER mapped while we parse it.
+    std::vector<uint8_t> overlayDer;
+    UsefulBufC der;
+    teep_signature_kind_t kind;
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        auto cached = _cache.find(id);
+        if (cached != _cache.end()) {
+            _lru.splice(_lru.begin(), _lru, cached->second);
+            return cached->second->second;
+        }
+
+        auto added = _overlay.find(id);
+        if (added != _overlay.end()) {
+            if (added->second.Revoked) {
+                return nullptr;
+            }
+            kind = added->second.Kind;
+            overlayDer = added->second.Der;
+            der = { overlayDer.data(), overlayDer.size() };
+        } else {
+            if (!_pack) {
+                return nullptr;
+            }
+            const AgentKeyPackRecord* record = _pack->Find((const uint8_t*)keyId.ptr);
+            if (record == nullptr || record->Kind == TEEP_SIGNATURE_NONE) {
+                return nullptr;
+            }
+            kind = (teep_signature_kind_t)record->Kind;
+            der = _pack->GetDer(record);
+            pack = _pack;
+        }
+        generation = _generation;
+    }
+
+    // Parse outside the lock, since this is the expensive part.
+    struct t_cose_key key = {};
+    if (teep_get_crypto_provider()->import_public_key(der, &key) != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("Could not parse agent key\n");
+        return nullptr;
+    }
+    auto agentKey = std::make_shared<const AgentKey>(kind, key);
+
+    std::lock_guard<std::mutex> lock(_lock);
+    if (generation != _generation) {
+        // The trusted keys changed while we were parsing, so don't cache
+        // a key that might have just been revoked.
+        return agentKey;
+    }
+    auto cached = _cache.find(id);
+    if (cached != _cache.end()) {
+        // Another thread parsed the same key first.
+        return cached->second->second;
+    }
+    _lru.emplace_front(id, agentKey);
+    _cache[id] = _lru.begin();
+    while (_cache.size() > _cacheCapacity) {
+        _cache.erase(_lru.back().first);
+        _lru.pop_back();
+    }
+    return agentKey;
+}
+
+teep_error_code_t AgentKeyStore::Add(teep_signature_kind_t kind, UsefulBufC der)
+{
+    if (kind == TEEP_SIGNATURE_NONE) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    std::string keyId;
+    teep_error_code_t result = ComputeKeyId(kind, der, keyId);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+
+    std::lock_guard<std::mutex> lock(_lock);
+    OverlayEntry& entry = _overlay[keyId];
+    entry.Revoked = false;
+    entry.Kind = kind;
+    entry.Der.assign((const uint8_t*)der.ptr, (const uint8_t*)der.ptr + der.len);
+    Evict(keyId);
+    _generation++;
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t AgentKeyStore::Revoke(UsefulBufC keyId)
+{
+    if (keyId.len != TAM_AGENT_KEY_ID_LENGTH) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    std::string id((const char*)keyId.ptr, keyId.len);
+
+    std::lock_guard<std::mutex> lock(_lock);
+    OverlayEntry& entry = _overlay[id];
+    entry.Revoked = true;
+    entry.Der.clear();
+    Evict(id);
+    _generation++;
+    return TEEP_ERR_SUCCESS;
+}
+
+bool AgentKeyStore::IsRevoked(UsefulBufC keyId)
+{
+    if (keyId.len != TAM_AGENT_KEY_ID_LENGTH) {
+        return false;
+    }
+    std::string id((const char*)keyId.ptr, keyId.len);
+
+    std::lock_guard<std::mutex> lock(_lock);
+    auto entry = _overlay.find(id);
+    if (entry != _overlay.end()) {
+        return entry->second.Revoked;
+    }
+    if (!_pack) {
+        return false;
+    }
+    const AgentKeyPackRecord* record = _pack->Find((const uint8_t*)keyId.ptr);
+    return (record != nullptr && record->Kind == TEEP_SIGNATURE_NONE);
+}
+
+teep_error_code_t AgentKeyStore::Save(_In_z_ const char* filename)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    std::vector<AgentKeyPackEntry> entries;
+    if (_pack) {
+        entries.reserve(_pack->GetRecordCount() + _overlay.size());
+        for (size_t i = 0; i < _pack->GetRecordCount(); i++) {
+            const AgentKeyPackRecord* record = _pack->GetRecord(i);
+            std::string keyId((const char*)record->KeyId, TAM_AGENT_KEY_ID_LENGTH);
+            if (_overlay.find(keyId) != _overlay.end()) {
+                continue;
+            }
+            if (record->Kind == TEEP_SIGNATURE_NONE) {
+                entries.push_back({ keyId, TEEP_SIGNATURE_NONE, NULLUsefulBufC });
+                continue;
+            }
+            UsefulBufC der = _pack->GetDer(record);
+            if (UsefulBuf_IsNULLC(der)) {
+                continue;
+            }
+            entries.push_back({ keyId, (teep_signature_kind_t)record->Kind, der });
+        }
+    }
+    for (const auto& [keyId, entry] : _overlay) {
+        if (entry.Revoked) {
+            entries.push_back({ keyId, TEEP_SIGNATURE_NONE, NULLUsefulBufC });
+        } else {
+            entries.push_back({ keyId, entry.Kind, { entry.Der.data(), entry.Der.size() } });
+        }
+    }
+
+    // The current pack may be mapped, so write the next generation rather
+    // than replacing it.  Write it under a temporary name first, so a crash
+    // never leaves a partial pack as the newest generation.
+    uint64_t packGeneration = 0;
+    FindLatestPackGeneration(filename, &packGeneration);
+    if (_pack && _packFilename == filename && _packGeneration > packGeneration) {
+        packGeneration = _packGeneration;
+    }
+    packGeneration++;
+    std::string packFilename = GetPackGenerationFilename(filename, packGeneration);
+    std::string temporaryFilename = packFilename + ".tmp";
+    teep_error_code_t result = WritePackEntries(temporaryFilename.c_str(), entries);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    std::error_code error;
+    filesystem::rename(temporaryFilename, packFilename, error);
+    if (error) {
+        filesystem::remove(temporaryFilename, error);
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    // Switch only once the new pack is mapped.  Readers still holding the
+    // old pack keep their mapping after its file is deleted.
+    auto pack = std::make_shared<AgentKeyPack>();
+    result = pack->Open(packFilename.c_str());
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    _pack = pack;
+    _packFilename = filename;
+    _packGeneration = packGeneration;
+    _overlay.clear();
+    _generation++;
+    RemoveOlderPackGenerations(filename, packGeneration);
+    return TEEP_ERR_SUCCESS;
+}
+
+void AgentKeyStore::SetCacheCapacity(size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    _cacheCapacity = capacity;
+    while (_cache.size() > _cacheCapacity) {
+        _cache.erase(_lru.back().first);
+        _lru.pop_back();
+    }
+}
+
+size_t AgentKeyStore::GetCachedKeyCount()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    return _cache.size();
+}
+
+teep_error_code_t AgentKeyStore::WritePack(
+    _In_z_ const char* filename,
+    _In_ const std::vector<std::pair<teep_signature_kind_t, UsefulBufC>>& keys)
+{
+    std::vector<AgentKeyPackEntry> entries;
+    entries.reserve(keys.size());
+    for (const auto& [kind, der] : keys) {
+        AgentKeyPackEntry entry;
+        teep_error_code_t result = ComputeKeyId(kind, der, entry.KeyId);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+        entry.Kind = kind;
+        entry.Der = der;
+        entries.push_back(entry);
+    }
+    return WritePackEntries(filename, entries);
+}
+
+AgentKeyStore& TamGetAgentKeyStore()
+{
+    static AgentKeyStore store;
+    return store;
+}
@@ -0,0 +1,125 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "common.h"
+
+#define TAM_AGENT_KEY_PACK_FILENAME "agent-keys.pack"
+#define TAM_AGENT_KEY_ID_LENGTH 32 // SHA-256 of the DER SubjectPublicKeyInfo.
+#define TAM_DEFAULT_AGENT_KEY_CACHE_CAPACITY 4096
+
+// On-disk layout of an agent key pack, in little-endian byte order:
+//
+//     AgentKeyPackHeader
+//     AgentKeyPackRecord[RecordCount], sorted by KeyId
+//     DER SubjectPublicKeyInfo blobs referenced by the records
+//
+// A record with Kind TEEP_SIGNATURE_NONE and no DER marks a revoked key,
+// so that a revocation survives a restart even for a key the TAM loads
+// from elsewhere, such as a key file.
+//
+// The file is memory-mapped and searched in place, so opening a pack costs
+// the same whether it holds ten keys or ten million.  A pack is never
+// replaced in place; see GetPackGenerationFilename.
+#define TAM_AGENT_KEY_PACK_MAGIC "TKP1"
+
+typedef struct {
+    char Magic[4];
+    uint32_t Reserved;
+    uint64_t RecordCount;
+} AgentKeyPackHeader;
+
+typedef struct {
+    uint8_t KeyId[TAM_AGENT_KEY_ID_LENGTH];
+    uint32_t Kind; // teep_signature_kind_t
+    uint32_t Length;
+    uint64_t Offset; // From the start of the file.
+} AgentKeyPackRecord;
+
+// A parsed agent public key.  Keys are shared with callers so that eviction
+// from the cache never frees a key that is still verifying a message.
+class AgentKey
+{
+public:
+    AgentKey(teep_signature_kind_t kind, struct t_cose_key key);
+    ~AgentKey();
+
+    teep_signature_kind_t Kind;
+    struct t_cose_key Key;
+};
+
+class AgentKeyPack;
+
+// Holds the public keys of all TEEP Agents the TAM trusts.  Keys come from
+// a read-only pack file plus an in-memory overlay of keys added or revoked
+// since the pack was written.  Keys are only parsed when first used, and at
+// most a bounded number of parsed keys are kept.
+class AgentKeyStore
+{
+public:
+    AgentKeyStore();
+    ~AgentKeyStore();
+
+    // Map the newest generation of a pack file, replacing any previous pack
+    // and discarding the overlay.  Does nothing if that generation is
+    // already the one mapped.
+    teep_error_code_t Open(_In_z_ const char* filename);
+
+    // Unmap the pack and forget all keys.
+    void Close();
+
+    // Get the key with a given key ID, or nullptr if it is unknown or revoked.
+    std::shared_ptr<const AgentKey> Find(UsefulBufC keyId);
+
+    // Trust a DER SubjectPublicKeyInfo.  Takes effect immediately.
+    teep_error_code_t Add(teep_signature_kind_t kind, UsefulBufC der);
+
+    // Stop trusting a key, whether it is in this store or not.  Takes
+    // effect immediately.
+    teep_error_code_t Revoke(UsefulBufC keyId);
+
+    // Returns true if a key has been revoked.  Keys the TAM loads from
+    // elsewhere, such as key files, must be checked with this too.
+    bool IsRevoked(UsefulBufC keyId);
+
+    // Write the pack and overlay to the next generation of a pack file,
+    // switch to it once it is mapped, and delete older generations.
+    teep_error_code_t Save(_In_z_ const char* filename);
+
+    void SetCacheCapacity(size_t capacity);
+    size_t GetCachedKeyCount();
+
+    // Write a pack file containing the given keys.
+    static teep_error_code_t WritePack(
+        _In_z_ const char* filename,
+        _In_ const std::vector<std::pair<teep_signature_kind_t, UsefulBufC>>& keys);
+
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<const AgentKey>>> LruList;
+
+    struct OverlayEntry
+    {
+        bool Revoked;
+        teep_signature_kind_t Kind;
+        std::vector<uint8_t> Der;
+    };
+
+    void Evict(_In_ const std::string& keyId);
+
+    std::mutex _lock;
+    std::shared_ptr<AgentKeyPack> _pack;
+    std::string _packFilename; // Generation 0 name of the pack.
+    uint64_t _packGeneration;
+    std::unordered_map<std::string, OverlayEntry> _overlay;
+    LruList _lru; // Most recently used first.
+    std::unordered_map<std::string, LruList::iterator> _cache;
+    size_t _cacheCapacity;
+    uint64_t _generation; // Bumped whenever the set of trusted keys changes.
+};
+
+AgentKeyStore& TamGetAgentKeyStore();
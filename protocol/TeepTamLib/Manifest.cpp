@@ -2,85 +2,270 @@
 // SPDX-License-Identifier: MIT
 #include "UsefulBuf.h"
 #include "Manifest.h"
+#include "ManifestRepository.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <atomic>
 #include <string.h>
 #include <stdlib.h>
 #include <dirent.h>
 
-Manifest* Manifest::g_FirstManifest = nullptr;
-
 Manifest::Manifest(
-    teep_uuid_t component_id,
-    _In_reads_(manifest_size) const char* manifest,
-    size_t manifest_size,
-    int is_required)
+    teep_component_handle_t component_handle,
+    UsefulBufC manifest,
+    _In_ const std::shared_ptr<const void>& owner,
+    int is_required,
+    _In_ const ManifestMetadata& metadata)
 {
-    this->ManifestContents.len  = 0;
-    this->ManifestContents.ptr = nullptr;
-    this->_component_id = component_id;
+    this->ManifestContents = manifest;
+    this->_component_handle = component_handle;
+    this->_component_id = TeepComponentIdTable::GetEncoded(component_handle);
     this->IsRequired = is_required;
-    this->Next = nullptr;
+    this->Metadata = metadata;
+    this->_contents = owner;
+}
+
+Manifest::~Manifest()
+{
+    // The contents are freed when the last reference to them goes away.
+    TeepComponentIdTable::Release(this->_component_handle);
+}
 
-    void* buffer = malloc(manifest_size);
+std::shared_ptr<const Manifest> Manifest::Create(
+    UsefulBufC component_id,
+    _In_reads_(manifest_content_size) const char* manifest_content,
+    size_t manifest_content_size,
+    int is_required)
+{
+    UsefulBufC contents = NULLUsefulBufC;
+    std::shared_ptr<const void> owner;
+    void* buffer = malloc(manifest_content_size);
     if (buffer != nullptr) {
-        this->ManifestContents.ptr = buffer;
-        memcpy(buffer, manifest, manifest_size);
-        this->ManifestContents.len = manifest_size;
+        owner = std::shared_ptr<const void>(buffer, free);
+        memcpy(buffer, manifest_content, manifest_content_size);
+        contents = { buffer, manifest_content_size };
     }
+    return Create(component_id, contents, owner, is_required);
+}
+
+std::shared_ptr<const Manifest> Manifest::Create(
+    UsefulBufC component_id,
+    UsefulBufC manifest_content,
+    _In_ const std::shared_ptr<const void>& owner,
+    int is_required)
+{
+    // Contents that are not a SUIT envelope are still served, with no
+    // metadata.
+    ManifestMetadata metadata;
+    (void)TamDecodeManifestMetadata(manifest_content, &metadata);
+    return Create(component_id, manifest_content, owner, is_required, metadata);
+}
+
+std::shared_ptr<const Manifest> Manifest::Create(
+    UsefulBufC component_id,
+    UsefulBufC manifest_content,
+    _In_ const std::shared_ptr<const void>& owner,
+    int is_required,
+    _In_ const ManifestMetadata& metadata)
+{
+    // The manifest holds the reference that interning adds.
+    teep_component_handle_t handle = TeepComponentIdTable::Intern(component_id);
+    return std::shared_ptr<const Manifest>(new Manifest(handle, manifest_content, owner, is_required, metadata));
+}
+
+std::shared_ptr<const Manifest> Manifest::Create(
+    _In_ const teep_uuid_t& component_id,
+    _In_reads_(manifest_content_size) const char* manifest_content,
+    size_t manifest_content_size,
+    int is_required)
+{
+    std::string encoded;
+    UsefulBufC element = { component_id.b, sizeof(component_id.b) };
+    (void)TeepEncodeComponentId(&element, 1, encoded);
+    return Create({ encoded.data(), encoded.size() }, manifest_content, manifest_content_size, is_required);
 }
 
-_Ret_maybenull_
-Manifest* Manifest::First(void)
+std::shared_ptr<const Manifest> Manifest::Create(
+    _In_ const teep_uuid_t& component_id,
+    UsefulBufC manifest_content,
+    _In_ const std::shared_ptr<const void>& owner,
+    int is_required,
+    _In_ const ManifestMetadata& metadata)
 {
-    return g_FirstManifest;
+    teep_component_handle_t handle = TeepComponentIdTable::Intern(component_id);
+    return std::shared_ptr<const Manifest>(new Manifest(handle, manifest_content, owner, is_required, metadata));
 }
 
 void Manifest::AddManifest(
-    teep_uuid_t component_id,
+    UsefulBufC component_id,
     _In_reads_(manifest_content_size) const char* manifest_content,
     size_t manifest_content_size,
     int is_required)
 {
-    Manifest* manifest = new Manifest(component_id, manifest_content, manifest_content_size, is_required);
-    manifest->Next = g_FirstManifest;
-    g_FirstManifest = manifest;
+    std::shared_ptr<const Manifest> manifest = Create(component_id, manifest_content, manifest_content_size, is_required);
+    ManifestRepository::Update([&](ManifestRepositoryBuilder& builder) {
+        builder.Add(manifest);
+        return TEEP_ERR_SUCCESS;
+    });
 }
 
-bool Manifest::HasComponentId(_In_ const UsefulBufC* component_id)
+void Manifest::AddManifest(
+    _In_ const teep_uuid_t& component_id,
+    _In_reads_(manifest_content_size) const char* manifest_content,
+    size_t manifest_content_size,
+    int is_required)
 {
-    if (sizeof(_component_id) != component_id->len) {
-        return false;
-    }
-    if (memcmp(&_component_id, component_id->ptr, component_id->len) != 0) {
-        return false;
+    std::shared_ptr<const Manifest> manifest = Create(component_id, manifest_content, manifest_content_size, is_required);
+    ManifestRepository::Update([&](ManifestRepositoryBuilder& builder) {
+        builder.Add(manifest);
+        return TEEP_ERR_SUCCESS;
+    });
+}
+
+void Manifest::ClearManifests(void)
+{
+    ManifestRepository::Update([](ManifestRepositoryBuilder& builder) {
+        builder.Clear();
+        return TEEP_ERR_SUCCESS;
+    });
+}
+
+bool Manifest::CompareComponentIds(_In_ const Manifest* left, _In_ const Manifest* right)
+{
+    return TeepCompareComponentIds(left->_component_id, right->_component_id) < 0;
+}
+
+bool Manifest::HasComponentId(UsefulBufC component_id) const
+{
+    return TeepCompareComponentIds(_component_id, component_id) == 0;
+}
+
+ManifestPack::ManifestPack() : _records(nullptr), _recordCount(0)
+{
+}
+
+ManifestPack::~ManifestPack()
+{
+    for (teep_component_handle_t handle : _handles) {
+        TeepComponentIdTable::Release(handle);
     }
-    return true;
 }
 
-_Ret_maybenull_
-Manifest* Manifest::FindManifest(_In_ const UsefulBufC* component_id)
+teep_error_code_t ManifestPack::Open(_In_z_ const char* filename, _Out_ std::shared_ptr<const ManifestPack>& pack)
 {
-    for (Manifest* manifest = g_FirstManifest; manifest != nullptr; manifest = manifest->Next) {
-        if (manifest->HasComponentId(component_id)) {
-            return manifest;
+    pack.reset();
+    auto file = std::make_shared<MappedFile>();
+    teep_error_code_t result = file->Open(filename, sizeof(ManifestPackHeader));
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    const uint8_t* data = file->GetData();
+    size_t size = file->GetSize();
+    const ManifestPackHeader* header = (const ManifestPackHeader*)data;
+    if (memcmp(header->Magic, TAM_MANIFEST_PACK_MAGIC, sizeof(header->Magic)) != 0) {
+        TeepLogMessage("%s is not a manifest pack\n", filename);
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    if (header->RecordCount > (size - sizeof(*header)) / sizeof(ManifestPackRecord)) {
+        TeepLogMessage("Manifest pack %s is truncated\n", filename);
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    const ManifestPackRecord* records = (const ManifestPackRecord*)(header + 1);
+    size_t recordCount = (size_t)header->RecordCount;
+
+    // Check every record.  This touches only the records and component
+    // IDs, not the manifests they point to.
+    std::vector<UsefulBufC> componentIds(recordCount);
+    UsefulBufC previousComponentId = NULLUsefulBufC;
+    for (size_t i = 0; i < recordCount; i++) {
+        const ManifestPackRecord& record = records[i];
+        if (record.Offset > size || record.Length > size - record.Offset ||
+            record.ComponentIdOffset > size || record.ComponentIdLength > size - record.ComponentIdOffset) {
+            TeepLogMessage("Manifest pack %s is truncated\n", filename);
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        UsefulBufC componentId = { data + record.ComponentIdOffset, record.ComponentIdLength };
+        if (componentId.len == 0 ||
+            (i > 0 && TeepCompareComponentIds(previousComponentId, componentId) >= 0)) {
+            TeepLogMessage("Manifest pack %s is not sorted\n", filename);
+            return TEEP_ERR_PERMANENT_ERROR;
         }
+        previousComponentId = componentId;
+        componentIds[i] = componentId;
     }
-    return nullptr;
+
+    // Intern the component IDs, so that IDs reported by devices find
+    // their records by handle.
+    std::shared_ptr<ManifestPack> opened(new ManifestPack());
+    opened->_file = file;
+    opened->_records = records;
+    opened->_recordCount = recordCount;
+    opened->_handles.resize(recordCount);
+    TeepComponentIdTable::Intern(componentIds.data(), recordCount, opened->_handles.data());
+    opened->_manifests.resize(recordCount);
+    pack = opened;
+    return TEEP_ERR_SUCCESS;
 }
 
-void Manifest::ClearManifests(void)
+UsefulBufC ManifestPack::GetComponentId(size_t index) const
+{
+    const ManifestPackRecord& record = _records[index];
+    return { _file->GetData() + record.ComponentIdOffset, record.ComponentIdLength };
+}
+
+UsefulBufC ManifestPack::GetContents(size_t index) const
 {
-    while (g_FirstManifest != nullptr) {
-        Manifest* manifest = g_FirstManifest;
-        g_FirstManifest = manifest->Next;
-        delete manifest;
+    const ManifestPackRecord& record = _records[index];
+    return { _file->GetData() + record.Offset, record.Length };
+}
+
+const Manifest* ManifestPack::GetManifest(size_t index) const
+{
+    std::shared_ptr<const Manifest> manifest = std::atomic_load(&_manifests[index]);
+    if (manifest) {
+        return manifest.get();
+    }
+
+    // Another thread may create the same manifest meanwhile, in which case
+    // the first one stored wins.  The manifest shares the mapping.
+    const ManifestPackRecord& record = _records[index];
+    ManifestMetadata metadata;
+    metadata.SequenceNumber = record.SequenceNumber;
+    metadata.PayloadSize = record.PayloadSize;
+    memcpy(metadata.PayloadDigest, record.PayloadDigest, sizeof(metadata.PayloadDigest));
+    std::shared_ptr<const void> owner = _file;
+    std::shared_ptr<const Manifest> created = Manifest::Create(GetComponentId(index), GetContents(index), owner, record.IsRequired != 0, metadata);
+    if (std::atomic_compare_exchange_strong(&_manifests[index], &manifest, created)) {
+        return created.get();
     }
+    return manifest.get();
+}
+
+teep_error_code_t Manifest::LoadPack(_In_z_ const char* filename)
+{
+    std::shared_ptr<const ManifestPack> pack;
+    teep_error_code_t result = ManifestPack::Open(filename, pack);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    return ManifestRepository::Update([&](ManifestRepositoryBuilder& builder) {
+        builder.SetPack(pack);
+        return TEEP_ERR_SUCCESS;
+    });
+}
+
+teep_error_code_t Manifest::WritePack(_In_z_ const char* filename)
+{
+    return ManifestRepository::GetCurrent()->WritePack(filename);
 }
 
-static teep_error_code_t ConfigureManifest(
+teep_error_code_t TamLoadManifestFile(
     _In_z_ const char* directory_name,
     _In_z_ const char* filename,
-    int is_required)
+    int is_required,
+    _Out_ std::shared_ptr<const Manifest>& manifest_object)
 {
+    manifest_object.reset();
     FILE* fp = NULL;
     char* manifest = NULL;
     size_t fullpathname_length = strlen(directory_name) + strlen(filename) + 2;
@@ -113,20 +298,25 @@ static teep_error_code_t ConfigureManifest(
             break;
         }
 
-        teep_uuid_t component_id;
-        result = GetUuidFromFilename(filename, &component_id);
-        if (result == TEEP_ERR_SUCCESS) {
+        std::string component_id;
+        result = TeepGetComponentIdFromManifestFilename(filename, component_id);
+        if (result != TEEP_ERR_SUCCESS) {
+            TeepLogMessage("Manifest file name %s is not a component ID\n", filename);
+        } else {
+            // The manifest takes the buffer rather than a copy of it.
+            UsefulBufC contents = { manifest, manifest_size };
             if (manifest_size > 2 && manifest[0] == 0xd8 && manifest[1] == 0x6b) {
-                Manifest::AddManifest(component_id, manifest + 2, manifest_size - 2, is_required);
-            }
-            else {
-                Manifest::AddManifest(component_id, manifest, manifest_size, is_required);
+                contents = { manifest + 2, manifest_size - 2 };
             }
+            manifest_object = Manifest::Create({ component_id.data(), component_id.size() }, contents, std::shared_ptr<const void>(manifest, free), is_required);
+            manifest = NULL;
         }
     } while (0);
 
     free(manifest);
-    fclose(fp);
+    if (fp != NULL) {
+        fclose(fp);
+    }
     free(fullpathname);
     return result;
 }
@@ -138,6 +328,7 @@ static teep_error_code_t ConfigureManifest(
  * (decrypting the contents inside the TEE).
  */
 teep_error_code_t TamConfigureManifests(
+    _Inout_ ManifestRepositoryBuilder& builder,
     _In_z_ const char* directory_name,
     int is_required)
 {
@@ -157,11 +348,72 @@ teep_error_code_t TamConfigureManifests(
             strcmp(filename + filename_length - 5, ".cbor") != 0) {
             continue;
         }
-        result = ConfigureManifest(directory_name, filename, is_required);
+        std::shared_ptr<const Manifest> manifest;
+        result = TamLoadManifestFile(directory_name, filename, is_required, manifest);
         if (result != TEEP_ERR_SUCCESS) {
             break;
         }
+        builder.Add(manifest);
     }
     closedir(dir);
     return result;
 }
+
+// Write a repository snapshot as the next generation of the manifest pack
+// under a data directory.  A running TAM may have the current pack mapped,
+// so it is never replaced in place.
+static teep_error_code_t WriteNextManifestPack(
+    _In_z_ const char* dataDirectory,
+    _In_ const ManifestRepository& repository,
+    _Out_ std::string& filename)
+{
+    filename.clear();
+    std::string packPath = std::string(dataDirectory) + "/" TAM_MANIFEST_PACK_FILENAME;
+    uint64_t generation = 0;
+    if (FindLatestPackGeneration(packPath.c_str(), &generation)) {
+        generation++;
+    }
+    std::string packFilename = GetPackGenerationFilename(packPath.c_str(), generation);
+    teep_error_code_t result = repository.WritePack(packFilename.c_str());
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    RemoveOlderPackGenerations(packPath.c_str(), generation);
+    filename = packFilename;
+    return TEEP_ERR_SUCCESS;
+}
+
+bool TamFindManifestPack(_In_z_ const char* dataDirectory, _Out_ std::string& filename)
+{
+    filename.clear();
+    std::string packPath = std::string(dataDirectory) + "/" TAM_MANIFEST_PACK_FILENAME;
+    uint64_t generation;
+    if (!FindLatestPackGeneration(packPath.c_str(), &generation)) {
+        return false;
+    }
+    filename = GetPackGenerationFilename(packPath.c_str(), generation);
+    return true;
+}
+
+teep_error_code_t TamCompileManifestPack(_In_z_ const char* dataDirectory, _Out_ std::string& filename)
+{
+    filename.clear();
+    ManifestRepositoryBuilder builder(nullptr);
+    std::string requiredManifestPath = std::string(dataDirectory) + "/manifests/required";
+    teep_error_code_t result = TamConfigureManifests(builder, requiredManifestPath.c_str(), true);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    std::string optionalManifestPath = std::string(dataDirectory) + "/manifests/optional";
+    result = TamConfigureManifests(builder, optionalManifestPath.c_str(), false);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    return WriteNextManifestPack(dataDirectory, *builder.Build(), filename);
+}
+
+teep_error_code_t TamSaveManifestPack(_In_z_ const char* dataDirectory)
+{
+    std::string filename;
+    return WriteNextManifestPack(dataDirectory, *ManifestRepository::GetCurrent(), filename);
+}
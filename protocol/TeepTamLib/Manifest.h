@@ -1,39 +1,223 @@
 // Copyright (c) TEEP contributors
 // SPDX-License-Identifier: MIT
 #pragma once
+#include <memory>
+#include <string>
+#include <vector>
 #include "qcbor/UsefulBuf.h"
 #include "common.h"
+#include "ComponentIdTable.h"
+#include "ManifestMetadata.h"
 
+#define TAM_MANIFEST_PACK_FILENAME "manifests.pack"
+
+// On-disk layout of a manifest pack, in little-endian byte order:
+//
+//     ManifestPackHeader
+//     ManifestPackRecord[RecordCount], sorted by component ID
+//     Component IDs and manifest bytes referenced by the records
+//
+// The pack is authoritative: a TAM that has one maps it at startup and
+// serves manifests straight from the mapping, without listing or reading
+// any manifest file, and the pages are shared by every TAM process using
+// the same pack.  The records carry the decoded SUIT metadata too, so
+// loading a pack decodes no envelopes either.  The pack is compiled from
+// the manifest files when there is none, by TamCompileManifestPack(), and
+// the configuration watcher writes a new one each time it applies
+// changes, so a change made while no watcher is running is only seen
+// once the pack is compiled again.
+#define TAM_MANIFEST_PACK_MAGIC "TMP5"
+
+typedef struct {
+    char Magic[4];
+    uint32_t Reserved;
+    uint64_t RecordCount;
+} ManifestPackHeader;
+
+// Records are sorted by TeepCompareComponentIds() of their component IDs,
+// which are kept in canonical form.
+typedef struct {
+    uint64_t ComponentIdOffset; // From the start of the file.
+    uint32_t ComponentIdLength;
+    uint32_t IsRequired;
+    uint64_t Offset; // From the start of the file.
+    uint32_t Length;
+    uint32_t Reserved;
+    uint64_t SequenceNumber;
+    uint64_t PayloadSize;
+    uint8_t PayloadDigest[TAM_SUIT_DIGEST_LENGTH];
+} ManifestPackRecord;
+
+class ManifestRepositoryBuilder;
+
+// A manifest in the repository.  Manifests never change once created, so
+// they can be shared by any number of repository snapshots (see
+// ManifestRepository.h).  The SUIT envelope is decoded once, when the
+// manifest is created.  A manifest is keyed by its component ID, in
+// canonical form (see ComponentIdTable.h), which may have any number of
+// elements.
 class Manifest
 {
 public:
+    // Create a manifest holding a copy of the given contents.
+    static std::shared_ptr<const Manifest> Create(
+        UsefulBufC component_id,
+        _In_reads_(manifest_content_size) const char* manifest_content,
+        size_t manifest_content_size,
+        int is_required);
+
+    // Same, but takes a reference to contents kept alive by owner instead
+    // of copying them.
+    static std::shared_ptr<const Manifest> Create(
+        UsefulBufC component_id,
+        UsefulBufC manifest_content,
+        _In_ const std::shared_ptr<const void>& owner,
+        int is_required);
+
+    // Same, but with metadata already decoded, e.g. from a manifest pack.
+    static std::shared_ptr<const Manifest> Create(
+        UsefulBufC component_id,
+        UsefulBufC manifest_content,
+        _In_ const std::shared_ptr<const void>& owner,
+        int is_required,
+        _In_ const ManifestMetadata& metadata);
+
+    // Same as the above, for a component ID that is a single UUID.
+    static std::shared_ptr<const Manifest> Create(
+        _In_ const teep_uuid_t& component_id,
+        _In_reads_(manifest_content_size) const char* manifest_content,
+        size_t manifest_content_size,
+        int is_required);
+    static std::shared_ptr<const Manifest> Create(
+        _In_ const teep_uuid_t& component_id,
+        UsefulBufC manifest_content,
+        _In_ const std::shared_ptr<const void>& owner,
+        int is_required,
+        _In_ const ManifestMetadata& metadata);
+
+    // Publish a repository snapshot with one manifest added or replaced.
+    // Each call rebuilds the repository, so use
+    // ManifestRepository::Update() to make many changes at once.
     static void AddManifest(
-        teep_uuid_t component_id,
+        UsefulBufC component_id,
         _In_reads_(manifest_content_size) const char* manifest_content,
         size_t manifest_content_size,
         int is_required);
-    static _Ret_maybenull_ Manifest* FindManifest(_In_ const UsefulBufC* component_id);
-    static _Ret_maybenull_ Manifest* First(void);
+    static void AddManifest(
+        _In_ const teep_uuid_t& component_id,
+        _In_reads_(manifest_content_size) const char* manifest_content,
+        size_t manifest_content_size,
+        int is_required);
+
+    // Publish an empty repository snapshot.
     static void ClearManifests(void);
 
-    bool HasComponentId(_In_ const UsefulBufC* component_id);
-    Manifest* Next;
+    // Replace the repository with the contents of a manifest pack (see
+    // ManifestPack).  On failure the repository is left unchanged.
+    static teep_error_code_t LoadPack(_In_z_ const char* filename);
+
+    // Write the current repository snapshot to a manifest pack.
+    static teep_error_code_t WritePack(_In_z_ const char* filename);
+
+    static bool CompareComponentIds(_In_ const Manifest* left, _In_ const Manifest* right);
+
+    ~Manifest();
+
+    // Check for a component ID in canonical form.
+    bool HasComponentId(UsefulBufC component_id) const;
+
+    // The component ID in canonical form, which stays valid as long as the
+    // manifest does.
+    UsefulBufC ComponentId(void) const { return _component_id; }
+    teep_component_handle_t ComponentHandle(void) const { return _component_handle; }
     int IsRequired;
     UsefulBufC ManifestContents;
+    ManifestMetadata Metadata;
+
+    // Keeps ManifestContents alive, so outbound messages can reference
+    // them in place even if the manifest is removed from the repository.
+    const std::shared_ptr<const void>& ContentsOwner(void) const { return _contents; }
 
 private:
+    Manifest(const Manifest&) = delete;
+    Manifest& operator=(const Manifest&) = delete;
+
     Manifest(
-        teep_uuid_t component_id,
-        _In_reads_(manifest_size) const char* manifest,
-        size_t manifest_size,
-        int is_required);
+        teep_component_handle_t component_handle,
+        UsefulBufC manifest,
+        _In_ const std::shared_ptr<const void>& owner,
+        int is_required,
+        _In_ const ManifestMetadata& metadata);
+
+    UsefulBufC _component_id; // Points into the component ID table.
+    teep_component_handle_t _component_handle;
+    std::shared_ptr<const void> _contents;
+};
 
-    teep_uuid_t _component_id;
+class MappedFile;
 
-    static Manifest* g_FirstManifest;
+// A mapped manifest pack.  Opening one reads only its records and
+// component IDs, so a repository snapshot can be served straight from the
+// records, and the Manifest object for a record is only created the first
+// time something needs it, e.g. to send it.  The pack holds a reference to
+// the component ID of every record, so their handles stay valid as long as
+// the pack does.
+class ManifestPack
+{
+public:
+    ~ManifestPack();
+
+    // Map a pack and check its records.
+    static teep_error_code_t Open(_In_z_ const char* filename, _Out_ std::shared_ptr<const ManifestPack>& pack);
+
+    size_t Count(void) const { return _recordCount; }
+    const ManifestPackRecord& GetRecord(size_t index) const { return _records[index]; }
+    teep_component_handle_t GetComponentHandle(size_t index) const { return _handles[index]; }
+    UsefulBufC GetComponentId(size_t index) const;
+    UsefulBufC GetContents(size_t index) const;
+
+    // Get the manifest for a record, creating it on first use.  It lives
+    // as long as the pack does.
+    const Manifest* GetManifest(size_t index) const;
+
+private:
+    ManifestPack();
+    ManifestPack(const ManifestPack&) = delete;
+    ManifestPack& operator=(const ManifestPack&) = delete;
+
+    std::shared_ptr<const MappedFile> _file; // Also keeps the contents of created manifests alive.
+    const ManifestPackRecord* _records;
+    size_t _recordCount;
+    std::vector<teep_component_handle_t> _handles; // Indexed by record.
+    mutable std::vector<std::shared_ptr<const Manifest>> _manifests; // Indexed by record; nullptr until created.
 };
 
+// Read one manifest file, whose name is its component ID (see
+// TeepGetManifestFilename()).
+teep_error_code_t TamLoadManifestFile(
+    _In_z_ const char* directory_name,
+    _In_z_ const char* filename,
+    int is_required,
+    _Out_ std::shared_ptr<const Manifest>& manifest);
+
+// Add the manifests in a directory to a repository being built.
 teep_error_code_t TamConfigureManifests(
+    _Inout_ ManifestRepositoryBuilder& builder,
     _In_z_ const char* directory_name,
     int is_required);
 
+// Load the manifests under a data directory and compile them into the
+// next generation of the manifest pack there (see MappedFile.h), which
+// TamLoadConfiguration then maps instead.  On success, filename is the
+// pack written.
+teep_error_code_t TamCompileManifestPack(_In_z_ const char* dataDirectory, _Out_ std::string& filename);
+
+// Write the current repository snapshot as the next generation of the
+// manifest pack under a data directory, so that a TAM started later sees
+// the changes applied to it since it was loaded.
+teep_error_code_t TamSaveManifestPack(_In_z_ const char* dataDirectory);
+
+// Find the latest generation of the manifest pack under a data directory,
+// returning false if there is none.  The pack is authoritative, so no
+// manifest file is listed or checked against it.
+bool TamFindManifestPack(_In_z_ const char* dataDirectory, _Out_ std::string& filename);
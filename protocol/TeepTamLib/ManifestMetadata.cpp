@@ -0,0 +1,232 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <string.h>
+#include "ManifestMetadata.h"
+extern "C" {
+#include "suit_manifest.h"
+};
+#include "qcbor/qcbor_decode.h"
+
+// Skip over the contents of an item that has already been read,
+// if it is an array or map.
+static QCBORError SkipNestedItems(_Inout_ QCBORDecodeContext* context, _In_ const QCBORItem* item)
+{
+    QCBORItem next = *item;
+    while (next.uNextNestLevel > item->uNestingLevel) {
+        QCBORError err = QCBORDecode_GetNext(context, &next);
+        if (err != QCBOR_SUCCESS) {
+            return err;
+        }
+    }
+    return QCBOR_SUCCESS;
+}
+
+static bool GetUnsigned(_In_ const QCBORItem* item, _Out_ uint64_t* value)
+{
+    if (item->uDataType == QCBOR_TYPE_UINT64) {
+        *value = item->val.uint64;
+        return true;
+    }
+    if (item->uDataType == QCBOR_TYPE_INT64 && item->val.int64 >= 0) {
+        *value = (uint64_t)item->val.int64;
+        return true;
+    }
+    return false;
+}
+
+// Decode a bstr-wrapped SUIT_Digest, keeping it only if it is SHA-256.
+static void DecodeSuitDigest(UsefulBufC encoded, _Inout_ ManifestMetadata* metadata)
+{
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, encoded, QCBOR_DECODE_MODE_NORMAL);
+
+    QCBORItem item;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS ||
+        item.uDataType != QCBOR_TYPE_ARRAY || item.val.uCount < 2) {
+        return;
+    }
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS ||
+        item.uDataType != QCBOR_TYPE_INT64 || item.val.int64 != SUIT_ALGORITHM_ID_SHA256) {
+        return;
+    }
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS ||
+        item.uDataType != QCBOR_TYPE_BYTE_STRING || item.val.string.len != TAM_SUIT_DIGEST_LENGTH) {
+        return;
+    }
+    memcpy(metadata->PayloadDigest, item.val.string.ptr, TAM_SUIT_DIGEST_LENGTH);
+}
+
+// Decode a SUIT_Parameters map that has already been opened, consuming
+// the rest of the map.
+static QCBORError DecodeSuitParameters(
+    _Inout_ QCBORDecodeContext* context,
+    _In_ const QCBORItem* map,
+    _Inout_ ManifestMetadata* metadata)
+{
+    for (uint16_t i = 0; i < map->val.uCount; i++) {
+        QCBORItem item;
+        QCBORError err = QCBORDecode_GetNext(context, &item);
+        if (err != QCBOR_SUCCESS) {
+            return err;
+        }
+        if (item.uLabelType == QCBOR_TYPE_INT64) {
+            switch (item.label.int64) {
+            case SUIT_PARAMETER_IMAGE_DIGEST:
+                if (item.uDataType == QCBOR_TYPE_BYTE_STRING) {
+                    DecodeSuitDigest(item.val.string, metadata);
+                }
+                break;
+            case SUIT_PARAMETER_IMAGE_SIZE:
+                GetUnsigned(&item, &metadata->PayloadSize);
+                break;
+            }
+        }
+        err = SkipNestedItems(context, &item);
+        if (err != QCBOR_SUCCESS) {
+            return err;
+        }
+    }
+    return QCBOR_SUCCESS;
+}
+
+// Decode a bstr-wrapped SUIT_Command_Sequence, which alternates command
+// IDs and their arguments, looking for the parameters of component 0.
+static teep_error_code_t DecodeSuitCommandSequence(UsefulBufC encoded, _Inout_ ManifestMetadata* metadata)
+{
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, encoded, QCBOR_DECODE_MODE_NORMAL);
+
+    QCBORItem item;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS || item.uDataType != QCBOR_TYPE_ARRAY) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    uint16_t count = item.val.uCount;
+
+    uint64_t componentIndex = 0;
+    for (uint16_t i = 0; i + 1 < count; i += 2) {
+        QCBORItem command;
+        QCBORItem argument;
+        if (QCBORDecode_GetNext(&context, &command) != QCBOR_SUCCESS ||
+            QCBORDecode_GetNext(&context, &argument) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        QCBORError err = QCBOR_SUCCESS;
+        if (command.uDataType != QCBOR_TYPE_INT64) {
+            err = SkipNestedItems(&context, &argument);
+        } else if (command.val.int64 == SUIT_DIRECTIVE_SET_COMPONENT_INDEX) {
+            // An index of true, or a list of indices, includes component 0.
+            if (!GetUnsigned(&argument, &componentIndex)) {
+                componentIndex = 0;
+            }
+            err = SkipNestedItems(&context, &argument);
+        } else if ((command.val.int64 == SUIT_DIRECTIVE_SET_PARAMETERS ||
+                    command.val.int64 == SUIT_DIRECTIVE_OVERRIDE_PARAMETERS) &&
+                   argument.uDataType == QCBOR_TYPE_MAP && componentIndex == 0) {
+            err = DecodeSuitParameters(&context, &argument, metadata);
+        } else {
+            err = SkipNestedItems(&context, &argument);
+        }
+        if (err != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+// Decode a bstr-wrapped SUIT_Common.
+static teep_error_code_t DecodeSuitCommon(UsefulBufC encoded, _Inout_ ManifestMetadata* metadata)
+{
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, encoded, QCBOR_DECODE_MODE_NORMAL);
+
+    QCBORItem item;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS || item.uDataType != QCBOR_TYPE_MAP) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    uint16_t entryCount = item.val.uCount;
+    for (uint16_t entryIndex = 0; entryIndex < entryCount; entryIndex++) {
+        if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        if (item.uLabelType == QCBOR_TYPE_INT64 &&
+            item.label.int64 == SUIT_COMMON_LABEL_SEQUENCE &&
+            item.uDataType == QCBOR_TYPE_BYTE_STRING) {
+            return DecodeSuitCommandSequence(item.val.string, metadata);
+        }
+        if (SkipNestedItems(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+// Decode a bstr-wrapped SUIT_Manifest.
+static teep_error_code_t DecodeSuitManifest(UsefulBufC encoded, _Inout_ ManifestMetadata* metadata)
+{
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, encoded, QCBOR_DECODE_MODE_NORMAL);
+
+    QCBORItem item;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS || item.uDataType != QCBOR_TYPE_MAP) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    uint16_t entryCount = item.val.uCount;
+    for (uint16_t entryIndex = 0; entryIndex < entryCount; entryIndex++) {
+        if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        if (item.uLabelType == QCBOR_TYPE_INT64) {
+            switch (item.label.int64) {
+            case SUIT_MANIFEST_LABEL_SEQUENCE_NUMBER:
+                if (!GetUnsigned(&item, &metadata->SequenceNumber)) {
+                    return TEEP_ERR_PERMANENT_ERROR;
+                }
+                break;
+            case SUIT_MANIFEST_LABEL_COMMON:
+                if (item.uDataType != QCBOR_TYPE_BYTE_STRING ||
+                    DecodeSuitCommon(item.val.string, metadata) != TEEP_ERR_SUCCESS) {
+                    return TEEP_ERR_PERMANENT_ERROR;
+                }
+                break;
+            }
+        }
+        if (SkipNestedItems(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TamDecodeManifestMetadata(UsefulBufC envelope, _Out_ ManifestMetadata* metadata)
+{
+    memset(metadata, 0, sizeof(*metadata));
+
+    QCBORDecodeContext context;
+    QCBORDecode_Init(&context, envelope, QCBOR_DECODE_MODE_NORMAL);
+
+    QCBORItem item;
+    if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS || item.uDataType != QCBOR_TYPE_MAP) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    uint16_t entryCount = item.val.uCount;
+    for (uint16_t entryIndex = 0; entryIndex < entryCount; entryIndex++) {
+        if (QCBORDecode_GetNext(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        if (item.uLabelType == QCBOR_TYPE_INT64 &&
+            item.label.int64 == SUIT_ENVELOPE_LABEL_MANIFEST &&
+            item.uDataType == QCBOR_TYPE_BYTE_STRING) {
+            teep_error_code_t result = DecodeSuitManifest(item.val.string, metadata);
+            if (result != TEEP_ERR_SUCCESS) {
+                memset(metadata, 0, sizeof(*metadata));
+            }
+            return result;
+        }
+        if (SkipNestedItems(&context, &item) != QCBOR_SUCCESS) {
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+    }
+
+    // No manifest.
+    return TEEP_ERR_PERMANENT_ERROR;
+}
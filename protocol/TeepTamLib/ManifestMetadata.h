@@ -0,0 +1,25 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <stdint.h>
+#include "qcbor/UsefulBuf.h"
+#include "common.h"
+
+#define TAM_SUIT_DIGEST_LENGTH 32 // SHA-256.
+
+// The fields of a SUIT envelope that TAM policy needs, decoded once when
+// a manifest is loaded so that nothing has to decode the envelope again.
+typedef struct {
+    // suit-manifest-sequence-number.
+    uint64_t SequenceNumber;
+
+    // suit-parameter-image-size and suit-parameter-image-digest of the
+    // first component, or zero if the manifest does not give them.  Only
+    // SHA-256 digests are kept.
+    uint64_t PayloadSize;
+    uint8_t PayloadDigest[TAM_SUIT_DIGEST_LENGTH];
+} ManifestMetadata;
+
+// Decode the metadata of a SUIT_Envelope.  Fields the envelope does not
+// contain are left zero.
+teep_error_code_t TamDecodeManifestMetadata(UsefulBufC envelope, _Out_ ManifestMetadata* metadata);
@@ -0,0 +1,299 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <string.h>
+#include "ManifestRepository.h"
+using namespace std;
+#ifdef TEEP_USE_TEE
+using namespace std::__fs;
+#endif
+
+// The epoch of the empty repository a TAM starts with is 0.
+static std::atomic<uint64_t> g_LastRepositoryEpoch{ 0 };
+
+// Readers load the current snapshot without taking g_RepositoryUpdateLock;
+// only writers serialize on it.
+static std::shared_ptr<const ManifestRepository> g_CurrentRepository;
+static std::mutex g_RepositoryUpdateLock;
+
+ManifestRepository::ManifestRepository() : _epoch(0)
+{
+}
+
+ManifestRepository::~ManifestRepository()
+{
+}
+
+std::shared_ptr<const ManifestRepository> ManifestRepository::GetCurrent(void)
+{
+    std::shared_ptr<const ManifestRepository> current = std::atomic_load(&g_CurrentRepository);
+    if (current) {
+        return current;
+    }
+
+    // Nothing has been published yet.
+    std::lock_guard<std::mutex> lock(g_RepositoryUpdateLock);
+    current = std::atomic_load(&g_CurrentRepository);
+    if (!current) {
+        current = std::shared_ptr<const ManifestRepository>(new ManifestRepository());
+        std::atomic_store(&g_CurrentRepository, current);
+    }
+    return current;
+}
+
+teep_error_code_t ManifestRepository::Update(
+    _In_ const std::function<teep_error_code_t(ManifestRepositoryBuilder&)>& change)
+{
+    std::lock_guard<std::mutex> lock(g_RepositoryUpdateLock);
+    ManifestRepositoryBuilder builder(std::atomic_load(&g_CurrentRepository));
+    teep_error_code_t result = change(builder);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+
+    // Sessions still holding the old snapshot keep it alive until they
+    // finish with it.
+    std::atomic_store(&g_CurrentRepository, builder.Build());
+    return TEEP_ERR_SUCCESS;
+}
+
+_Ret_maybenull_
+const Manifest* ManifestRepository::Find(UsefulBufC component_id) const
+{
+    size_t row = FindRow(TeepComponentIdTable::Find(component_id));
+    return (row == TAM_NO_MANIFEST_ROW) ? nullptr : GetManifest(row);
+}
+
+_Ret_maybenull_
+const Manifest* ManifestRepository::Find(_In_ const teep_uuid_t& component_id) const
+{
+    size_t row = FindRow(TeepComponentIdTable::Find(component_id));
+    return (row == TAM_NO_MANIFEST_ROW) ? nullptr : GetManifest(row);
+}
+
+const Manifest* ManifestRepository::GetManifest(size_t row) const
+{
+    const Row& entry = _rows[row];
+    return (entry.Added) ? entry.Added.get() : _pack->GetManifest(entry.PackRecord);
+}
+
+UsefulBufC ManifestRepository::GetComponentId(size_t row) const
+{
+    const Row& entry = _rows[row];
+    return (entry.Added) ? entry.Added->ComponentId() : _pack->GetComponentId(entry.PackRecord);
+}
+
+UsefulBufC ManifestRepository::GetContents(size_t row) const
+{
+    const Row& entry = _rows[row];
+    return (entry.Added) ? entry.Added->ManifestContents : _pack->GetContents(entry.PackRecord);
+}
+
+teep_error_code_t ManifestRepository::WritePack(_In_z_ const char* filename) const
+{
+    std::string temporaryFilename = std::string(filename) + ".tmp";
+    FILE* fp = fopen(temporaryFilename.c_str(), "wb");
+    if (fp == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    ManifestPackHeader header = {};
+    memcpy(header.Magic, TAM_MANIFEST_PACK_MAGIC, sizeof(header.Magic));
+    header.RecordCount = _rows.size();
+    bool ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+
+    // The component IDs follow the records, and the manifests follow them.
+    // The metadata comes from the table, so no manifest is created.
+    uint64_t componentIdOffset = sizeof(header) + _rows.size() * sizeof(ManifestPackRecord);
+    uint64_t offset = componentIdOffset;
+    for (size_t row = 0; row < _rows.size(); row++) {
+        offset += GetComponentId(row).len;
+    }
+    for (size_t row = 0; row < _rows.size(); row++) {
+        UsefulBufC componentId = GetComponentId(row);
+        UsefulBufC contents = GetContents(row);
+        ManifestPackRecord record = {};
+        record.ComponentIdOffset = componentIdOffset;
+        record.ComponentIdLength = (uint32_t)componentId.len;
+        componentIdOffset += componentId.len;
+        record.IsRequired = _metadata.IsRequired[row];
+        record.Length = (uint32_t)contents.len;
+        record.Offset = offset;
+        record.SequenceNumber = _metadata.SequenceNumbers[row];
+        record.PayloadSize = _metadata.PayloadSizes[row];
+        memcpy(record.PayloadDigest, _metadata.PayloadDigests[row].data(), sizeof(record.PayloadDigest));
+        offset += contents.len;
+        ok = ok && (fwrite(&record, sizeof(record), 1, fp) == 1);
+    }
+    for (size_t row = 0; row < _rows.size(); row++) {
+        UsefulBufC componentId = GetComponentId(row);
+        ok = ok && (componentId.len == 0 || fwrite(componentId.ptr, 1, componentId.len, fp) == componentId.len);
+    }
+    for (size_t row = 0; row < _rows.size(); row++) {
+        UsefulBufC contents = GetContents(row);
+        ok = ok && (contents.len == 0 || fwrite(contents.ptr, 1, contents.len, fp) == contents.len);
+    }
+
+    if (fclose(fp) != 0 || !ok) {
+        remove(temporaryFilename.c_str());
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    std::error_code error;
+    filesystem::rename(temporaryFilename, filename, error);
+    if (error) {
+        remove(temporaryFilename.c_str());
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+ManifestRepositoryBuilder::ManifestRepositoryBuilder(_In_ const std::shared_ptr<const ManifestRepository>& base)
+    : _base(base)
+{
+}
+
+void ManifestRepositoryBuilder::Clear(void)
+{
+    _base.reset();
+    _pack.reset();
+    _changes.clear();
+}
+
+void ManifestRepositoryBuilder::SetPack(_In_ const std::shared_ptr<const ManifestPack>& pack)
+{
+    Clear();
+    _pack = pack;
+}
+
+void ManifestRepositoryBuilder::Add(_In_ const std::shared_ptr<const Manifest>& manifest)
+{
+    _changes.push_back({ manifest->ComponentId(), manifest });
+}
+
+void ManifestRepositoryBuilder::Remove(UsefulBufC component_id)
+{
+    // Manifests hold a reference to their component IDs, so an ID that is
+    // not in the table has no manifest to remove.  One that is stays in
+    // the table while the base snapshot is alive.
+    teep_component_handle_t handle = TeepComponentIdTable::Find(component_id);
+    if (handle != TEEP_NO_COMPONENT_HANDLE) {
+        _changes.push_back({ TeepComponentIdTable::GetEncoded(handle), nullptr });
+    }
+}
+
+std::shared_ptr<const ManifestRepository> ManifestRepositoryBuilder::Build(void)
+{
+    // Sort the changes by component ID, keeping only the last change to
+    // each component.
+    auto compare = [](const Change& left, const Change& right) {
+        return TeepCompareComponentIds(left.ComponentId, right.ComponentId) < 0;
+    };
+    if (!std::is_sorted(_changes.begin(), _changes.end(), compare)) {
+        std::stable_sort(_changes.begin(), _changes.end(), compare);
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < _changes.size(); i++) {
+        if (i + 1 < _changes.size() && TeepCompareComponentIds(_changes[i].ComponentId, _changes[i + 1].ComponentId) == 0) {
+            continue;
+        }
+        _changes[kept++] = std::move(_changes[i]);
+    }
+    _changes.resize(kept);
+
+    // Merge the changes into the base rows, which are either the records
+    // of a pack or the rows of the base snapshot.  Unchanged rows are
+    // shared with the base, and pack records stay records.
+    std::shared_ptr<ManifestRepository> repository(new ManifestRepository());
+    const ManifestRepository* base = (_pack) ? nullptr : _base.get();
+    repository->_pack = (_pack) ? _pack : ((base != nullptr) ? base->_pack : nullptr);
+    const ManifestPack* pack = repository->_pack.get();
+    size_t baseCount = (_pack) ? _pack->Count() : ((base != nullptr) ? base->_rows.size() : 0);
+    auto getBaseComponentId = [&](size_t index) {
+        return (base != nullptr) ? base->GetComponentId(index) : pack->GetComponentId(index);
+    };
+    repository->_rows.reserve(baseCount + _changes.size());
+    size_t index = 0;
+    auto change = _changes.begin();
+    while (index < baseCount || change != _changes.end()) {
+        int order;
+        if (change == _changes.end()) {
+            order = -1;
+        } else if (index == baseCount) {
+            order = 1;
+        } else {
+            order = TeepCompareComponentIds(getBaseComponentId(index), change->ComponentId);
+        }
+
+        if (order < 0) {
+            if (base != nullptr) {
+                repository->_rows.push_back(base->_rows[index]);
+            } else {
+                repository->_rows.push_back({ nullptr, (uint32_t)index });
+            }
+            ++index;
+            continue;
+        }
+        if (order == 0) {
+            ++index;
+        }
+        if (change->Value) {
+            repository->_rows.push_back({ change->Value, 0 });
+        }
+        ++change;
+    }
+    _changes.clear();
+
+    // Fill in the metadata table, from the records of pack rows and from
+    // the metadata each added manifest decoded when it was created.
+    size_t count = repository->_rows.size();
+    ManifestMetadataTable& metadata = repository->_metadata;
+    metadata.ComponentHandles.resize(count);
+    metadata.SequenceNumbers.resize(count);
+    metadata.EncodedSizes.resize(count);
+    metadata.PayloadSizes.resize(count);
+    metadata.PayloadDigests.resize(count);
+    metadata.IsRequired.resize(count);
+    for (size_t row = 0; row < count; row++) {
+        const ManifestRepository::Row& entry = repository->_rows[row];
+        if (entry.Added) {
+            const Manifest* manifest = entry.Added.get();
+            metadata.ComponentHandles[row] = manifest->ComponentHandle();
+            metadata.SequenceNumbers[row] = manifest->Metadata.SequenceNumber;
+            metadata.EncodedSizes[row] = manifest->ManifestContents.len;
+            metadata.PayloadSizes[row] = manifest->Metadata.PayloadSize;
+            memcpy(metadata.PayloadDigests[row].data(), manifest->Metadata.PayloadDigest, TAM_SUIT_DIGEST_LENGTH);
+            metadata.IsRequired[row] = (manifest->IsRequired) ? 1 : 0;
+        } else {
+            const ManifestPackRecord& record = pack->GetRecord(entry.PackRecord);
+            metadata.ComponentHandles[row] = pack->GetComponentHandle(entry.PackRecord);
+            metadata.SequenceNumbers[row] = record.SequenceNumber;
+            metadata.EncodedSizes[row] = record.Length;
+            metadata.PayloadSizes[row] = record.PayloadSize;
+            memcpy(metadata.PayloadDigests[row].data(), record.PayloadDigest, TAM_SUIT_DIGEST_LENGTH);
+            metadata.IsRequired[row] = (record.IsRequired != 0) ? 1 : 0;
+        }
+    }
+    teep_component_handle_t maxHandle = 0;
+    for (teep_component_handle_t handle : metadata.ComponentHandles) {
+        if (handle != TEEP_NO_COMPONENT_HANDLE) {
+            maxHandle = std::max(maxHandle, handle);
+        }
+    }
+    repository->_rowsByHandle.assign((count > 0) ? (size_t)maxHandle + 1 : 0, UINT32_MAX);
+    for (size_t row = 0; row < count; row++) {
+        teep_component_handle_t handle = metadata.ComponentHandles[row];
+        if (handle != TEEP_NO_COMPONENT_HANDLE) {
+            repository->_rowsByHandle[handle] = (uint32_t)row;
+        }
+        if (metadata.IsRequired[row]) {
+            repository->_requiredRows.push_back((uint32_t)row);
+        } else {
+            repository->_optionalRows.push_back((uint32_t)row);
+        }
+    }
+    repository->_epoch = ++g_LastRepositoryEpoch;
+    return repository;
+}
@@ -0,0 +1,156 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <array>
+#include <functional>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+#include "Manifest.h"
+
+class ManifestRepositoryBuilder;
+
+#define TAM_NO_MANIFEST_ROW SIZE_MAX
+
+// The decoded metadata of every manifest in a snapshot, one row per
+// manifest in component ID order, stored as a structure of arrays.  Policy
+// and planning code scans only the columns it needs, which stay compact
+// and hot in cache, and reaches a Manifest object only to send it.
+struct ManifestMetadataTable
+{
+    std::vector<teep_component_handle_t> ComponentHandles;
+    std::vector<uint64_t> SequenceNumbers;
+    std::vector<size_t> EncodedSizes;
+    std::vector<uint64_t> PayloadSizes;
+    std::vector<std::array<uint8_t, TAM_SUIT_DIGEST_LENGTH>> PayloadDigests;
+    std::vector<uint8_t> IsRequired;
+
+    size_t RowCount(void) const { return ComponentHandles.size(); }
+};
+
+// An immutable snapshot of the manifest repository.  Manifests are kept in
+// component ID order next to a metadata table with a row per manifest,
+// plus an array from interned component handle to row, so a lookup is a
+// single array access regardless of repository size.  Manifests and packs
+// hold a reference to their component IDs, so the handles in a snapshot
+// are not reused while it is alive.  Released handles are reused, so the
+// array is bounded by the number of IDs in use.
+//
+// A snapshot loaded from a manifest pack serves its rows straight from the
+// pack's records, and a Manifest object is only created for a row when
+// GetManifest() or Find() first needs it.  Rows added or replaced since
+// the pack was loaded hold their Manifest objects.
+//
+// Changes never modify a snapshot.  Instead a new snapshot is built and
+// published in place of the old one, so readers take no lock, and a
+// session that holds a snapshot keeps seeing the same policy until it
+// finishes, however the repository changes meanwhile.
+class ManifestRepository
+{
+public:
+    ~ManifestRepository();
+
+    // Get the current snapshot.  Never returns nullptr.
+    static std::shared_ptr<const ManifestRepository> GetCurrent(void);
+
+    // Apply changes to the current snapshot and publish the result.
+    // Updates are serialized so that none loses another's changes, but
+    // readers are never blocked.  If change fails, nothing is published.
+    static teep_error_code_t Update(
+        _In_ const std::function<teep_error_code_t(ManifestRepositoryBuilder&)>& change);
+
+    // Find the manifest for a component ID in canonical form.
+    _Ret_maybenull_ const Manifest* Find(UsefulBufC component_id) const;
+    _Ret_maybenull_ const Manifest* Find(_In_ const teep_uuid_t& component_id) const;
+    size_t Count(void) const { return _rows.size(); }
+
+    // Get the metadata table row of a component, or TAM_NO_MANIFEST_ROW.
+    size_t FindRow(teep_component_handle_t handle) const
+    {
+        return (handle < _rowsByHandle.size() && _rowsByHandle[handle] != UINT32_MAX) ?
+            _rowsByHandle[handle] : TAM_NO_MANIFEST_ROW;
+    }
+    const ManifestMetadataTable& Metadata(void) const { return _metadata; }
+
+    // Rows of required and of optional manifests, in component ID order.
+    const std::vector<uint32_t>& RequiredRows(void) const { return _requiredRows; }
+    const std::vector<uint32_t>& OptionalRows(void) const { return _optionalRows; }
+
+    // Get the manifest in a row, creating it if it is still only a pack
+    // record.  It lives as long as the snapshot does.
+    const Manifest* GetManifest(size_t row) const;
+
+    // Unique to each snapshot, so anything computed from a snapshot can be
+    // cached under its epoch.
+    uint64_t GetEpoch(void) const { return _epoch; }
+
+    // Write the snapshot to a manifest pack.  Rows that are still pack
+    // records are copied from the pack without creating their manifests.
+    // The pack is written to a temporary file and renamed, so a crash
+    // never leaves a partial pack.  A pack that a TAM may have mapped must
+    // not be overwritten, so write a new generation instead (see
+    // MappedFile.h).
+    teep_error_code_t WritePack(_In_z_ const char* filename) const;
+
+private:
+    friend class ManifestRepositoryBuilder;
+
+    // A record of the snapshot's pack, or a manifest added since.
+    struct Row
+    {
+        std::shared_ptr<const Manifest> Added; // nullptr for a pack record.
+        uint32_t PackRecord;
+    };
+
+    ManifestRepository();
+    ManifestRepository(const ManifestRepository&) = delete;
+    ManifestRepository& operator=(const ManifestRepository&) = delete;
+
+    UsefulBufC GetComponentId(size_t row) const;
+    UsefulBufC GetContents(size_t row) const;
+
+    std::shared_ptr<const ManifestPack> _pack; // nullptr if no row is from a pack.
+    std::vector<Row> _rows; // Sorted by component ID.
+    ManifestMetadataTable _metadata;
+    std::vector<uint32_t> _requiredRows;
+    std::vector<uint32_t> _optionalRows;
+    std::vector<uint32_t> _rowsByHandle; // UINT32_MAX for no row.
+    uint64_t _epoch;
+};
+
+// Builds a new snapshot from a base snapshot plus a set of changes.  Only
+// the changed entries are touched: every other manifest is shared with the
+// base snapshot rather than copied or re-read.
+class ManifestRepositoryBuilder
+{
+public:
+    explicit ManifestRepositoryBuilder(_In_ const std::shared_ptr<const ManifestRepository>& base);
+
+    // Start from an empty repository instead of the base snapshot.
+    void Clear(void);
+
+    // Start from the records of a manifest pack instead of the base
+    // snapshot.
+    void SetPack(_In_ const std::shared_ptr<const ManifestPack>& pack);
+
+    // Add or replace the manifest for a component.  If there are several
+    // changes to the same component, the last one wins.
+    void Add(_In_ const std::shared_ptr<const Manifest>& manifest);
+
+    // Remove the manifest for a component ID in canonical form, if there
+    // is one.
+    void Remove(UsefulBufC component_id);
+
+    std::shared_ptr<const ManifestRepository> Build(void);
+
+private:
+    struct Change
+    {
+        UsefulBufC ComponentId; // Points into the component ID table.
+        std::shared_ptr<const Manifest> Value; // nullptr to remove.
+    };
+
+    std::shared_ptr<const ManifestRepository> _base;
+    std::shared_ptr<const ManifestPack> _pack; // Replaces _base if set.
+    std::vector<Change> _changes;
+};
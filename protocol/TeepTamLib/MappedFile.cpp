@@ -0,0 +1,211 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <ctype.h>
+#include <filesystem>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#if defined(OE_BUILD_ENCLAVE)
+// No file mapping inside an enclave.
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "MappedFile.h"
+using namespace std;
+#ifdef TEEP_USE_TEE
+using namespace std::__fs;
+#endif
+
+MappedFile::MappedFile()
+{
+    _data = nullptr;
+    _size = 0;
+#if !defined(OE_BUILD_ENCLAVE) && defined(_WIN32)
+    _file = INVALID_HANDLE_VALUE;
+    _mapping = nullptr;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#if defined(OE_BUILD_ENCLAVE)
+    // _buffer frees itself.
+#elif defined(_WIN32)
+    if (_data != nullptr) {
+        UnmapViewOfFile(_data);
+    }
+    if (_mapping != nullptr) {
+        CloseHandle(_mapping);
+    }
+    if (_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(_file);
+    }
+#else
+    if (_data != nullptr) {
+        munmap((void*)_data, _size);
+    }
+#endif
+}
+
+teep_error_code_t MappedFile::Open(_In_z_ const char* filename, size_t minimumSize)
+{
+#if defined(OE_BUILD_ENCLAVE)
+    FILE* fp = fopen(filename, "rb");
+    if (fp == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    uint8_t chunk[4096];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        _buffer.insert(_buffer.end(), chunk, chunk + count);
+    }
+    fclose(fp);
+    _data = _buffer.data();
+    _size = _buffer.size();
+#elif defined(_WIN32)
+    _file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (_file == INVALID_HANDLE_VALUE) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(_file, &fileSize)) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    _size = (size_t)fileSize.QuadPart;
+    if (_size < minimumSize || _size == 0) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (_mapping == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    _data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (_data == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+#else
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    _size = (size_t)st.st_size;
+    if (_size < minimumSize || _size == 0) {
+        close(fd);
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    void* data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    _data = (const uint8_t*)data;
+#endif
+
+    if (_size < minimumSize) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+std::string GetPackGenerationFilename(_In_z_ const char* filename, uint64_t generation)
+{
+    if (generation == 0) {
+        return filename;
+    }
+    filesystem::path path(filename);
+    filesystem::path leaf = path.stem();
+    leaf += "." + std::to_string(generation);
+    leaf += path.extension();
+    return path.replace_filename(leaf).string();
+}
+
+// Parse the generation out of a file name without a directory.
+static bool ParsePackGeneration(
+    _In_ const filesystem::path& packLeafName,
+    _In_ const std::string& leafName,
+    _Out_ uint64_t* generation)
+{
+    *generation = 0;
+    if (leafName == packLeafName.string()) {
+        return true;
+    }
+    std::string prefix = packLeafName.stem().string() + ".";
+    std::string suffix = packLeafName.extension().string();
+    if (leafName.size() <= prefix.size() + suffix.size() ||
+        leafName.compare(0, prefix.size(), prefix) != 0 ||
+        leafName.compare(leafName.size() - suffix.size(), suffix.size(), suffix) != 0) {
+        return false;
+    }
+    std::string digits = leafName.substr(prefix.size(), leafName.size() - prefix.size() - suffix.size());
+    if (digits.size() > 19) {
+        return false;
+    }
+    for (char c : digits) {
+        if (!isdigit((unsigned char)c)) {
+            return false;
+        }
+    }
+    *generation = strtoull(digits.c_str(), nullptr, 10);
+    return (*generation > 0);
+}
+
+bool IsPackGenerationFilename(_In_z_ const char* packLeafName, _In_z_ const char* leafName)
+{
+    uint64_t generation;
+    return ParsePackGeneration(filesystem::path(packLeafName), leafName, &generation);
+}
+
+// Call a function for each generation of a pack file that exists.
+template <typename Function>
+static void ForEachPackGeneration(_In_z_ const char* filename, Function function)
+{
+    filesystem::path path(filename);
+    filesystem::path directory = path.has_parent_path() ? path.parent_path() : filesystem::path(".");
+    filesystem::path packLeafName = path.filename();
+
+    std::error_code error;
+    for (filesystem::directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+        uint64_t generation;
+        if (ParsePackGeneration(packLeafName, it->path().filename().string(), &generation)) {
+            function(it->path(), generation);
+        }
+    }
+}
+
+bool FindLatestPackGeneration(_In_z_ const char* filename, _Out_ uint64_t* generation)
+{
+    bool found = false;
+    *generation = 0;
+    ForEachPackGeneration(filename, [&](const filesystem::path&, uint64_t candidate) {
+        if (!found || candidate > *generation) {
+            *generation = candidate;
+        }
+        found = true;
+    });
+    return found;
+}
+
+void RemoveOlderPackGenerations(_In_z_ const char* filename, uint64_t generation)
+{
+    std::vector<filesystem::path> older;
+    ForEachPackGeneration(filename, [&](const filesystem::path& path, uint64_t candidate) {
+        if (candidate < generation) {
+            older.push_back(path);
+        }
+    });
+    for (const filesystem::path& path : older) {
+        std::error_code error;
+        filesystem::remove(path, error);
+    }
+}
@@ -0,0 +1,60 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "common.h"
+
+// A read-only view of a whole file.  The file is memory-mapped, so pages
+// are only read when touched and are shared by every process mapping the
+// same file.  Inside an enclave, where files cannot be mapped, it is read
+// into memory instead.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // Map a file.  Fails with TEEP_ERR_PERMANENT_ERROR if it is shorter
+    // than minimumSize.
+    teep_error_code_t Open(_In_z_ const char* filename, size_t minimumSize);
+
+    const uint8_t* GetData() const { return _data; }
+    size_t GetSize() const { return _size; }
+
+private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* _data;
+    size_t _size;
+#if defined(OE_BUILD_ENCLAVE)
+    std::vector<uint8_t> _buffer;
+#elif defined(_WIN32)
+    void* _file; // HANDLE
+    void* _mapping; // HANDLE
+#endif
+};
+
+// A pack file that a running TAM may have mapped is never rewritten or
+// replaced in place: on Windows a mapped file cannot be replaced, and
+// elsewhere readers of the old mapping would not see the change.  Instead
+// each new version is written to a file whose name carries a generation
+// number, such as "agent-keys.3.pack" for "agent-keys.pack", and the one
+// with the highest generation is current.  The unnumbered name is
+// generation 0.
+std::string GetPackGenerationFilename(_In_z_ const char* filename, uint64_t generation);
+
+// Find the highest generation of a pack file that exists.  Returns false
+// if there is none.
+bool FindLatestPackGeneration(_In_z_ const char* filename, _Out_ uint64_t* generation);
+
+// Returns true if a file name without a directory is some generation of
+// the pack with the given file name without a directory.
+bool IsPackGenerationFilename(_In_z_ const char* packLeafName, _In_z_ const char* leafName);
+
+// Delete the generations of a pack older than the given one.  A reader
+// that still has one mapped keeps its view until it closes it.
+void RemoveOlderPackGenerations(_In_z_ const char* filename, uint64_t generation);
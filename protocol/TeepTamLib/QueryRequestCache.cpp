@@ -0,0 +1,185 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string.h>
+#include <tuple>
+#include "QueryRequestCache.h"
+#include "TamKeys.h"
+
+// Freshness mechanisms offered in every QueryRequest, as a bitmask of
+// (1 << teep_freshness_mechanism_t).
+#define TAM_SUPPORTED_FRESHNESS_MECHANISMS (1 << TEEP_FRESHNESS_MECHANISM_NONCE)
+
+struct QueryRequestCacheKey
+{
+    int MinVersion;
+    int MaxVersion;
+    bool HaveVersions;
+    uint32_t FreshnessMechanisms;
+    size_t ChallengeLength;
+    teep_signature_kind_t SignatureKind;
+    uint64_t KeyGeneration;
+    uint64_t AgreementKeyGeneration; // 0 if no agreement key is offered.
+
+    bool operator<(const QueryRequestCacheKey& other) const
+    {
+        return std::tie(MinVersion, MaxVersion, HaveVersions, FreshnessMechanisms, ChallengeLength, SignatureKind, KeyGeneration, AgreementKeyGeneration) <
+            std::tie(other.MinVersion, other.MaxVersion, other.HaveVersions, other.FreshnessMechanisms, other.ChallengeLength, other.SignatureKind, other.KeyGeneration, other.AgreementKeyGeneration);
+    }
+};
+
+struct QueryRequestCacheEntry
+{
+    // The signed message, if there is no challenge.
+    std::shared_ptr<const std::vector<uint8_t>> SignedMessage;
+
+    // The unsigned template and offset of its challenge slot, if there is
+    // a challenge.
+    std::vector<uint8_t> Template;
+    size_t ChallengeOffset;
+};
+
+static std::mutex g_QueryRequestCacheLock;
+static std::map<QueryRequestCacheKey, QueryRequestCacheEntry> g_QueryRequestCache;
+static size_t g_ChallengeLength = 0;
+
+void TamSetQueryRequestChallengeLength(size_t challengeLength)
+{
+    std::lock_guard<std::mutex> lock(g_QueryRequestCacheLock);
+    g_ChallengeLength = challengeLength;
+}
+
+void TamInvalidateQueryRequestCache(void)
+{
+    std::lock_guard<std::mutex> lock(g_QueryRequestCacheLock);
+    g_QueryRequestCache.clear();
+}
+
+static teep_error_code_t SignQueryRequest(
+    _In_ const UsefulBufC* unsignedMessage,
+    teep_signature_kind_t signatureKind,
+    _Out_ std::shared_ptr<const std::vector<uint8_t>>& signedMessage)
+{
+    auto buffer = std::make_shared<std::vector<uint8_t>>(unsignedMessage->len + TEEP_MAX_COSE_OVERHEAD);
+    UsefulBuf signedMessageBuffer = { buffer->data(), buffer->size() };
+    UsefulBufC signedMessageC;
+    teep_error_code_t result = TamSignMessage(unsignedMessage, signedMessageBuffer, signatureKind, &signedMessageC);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    buffer->resize(signedMessageC.len);
+    signedMessage = buffer;
+    return TEEP_ERR_SUCCESS;
+}
+
+// Encode a QueryRequest, locating the challenge slot if there is one.
+static teep_error_code_t BuildQueryRequestCacheEntry(
+    std::optional<int> minVersion,
+    std::optional<int> maxVersion,
+    size_t challengeLength,
+    UsefulBufC sessionKeyShare,
+    teep_signature_kind_t signatureKind,
+    _Out_ QueryRequestCacheEntry& entry)
+{
+    Q_USEFUL_BUF_MAKE_STACK_UB(encoded, 4096);
+    UsefulBufC encodedC = UsefulBuf_Const(encoded);
+    teep_error_code_t result = TamComposeQueryRequestTemplate(minVersion, maxVersion, challengeLength, sessionKeyShare, &encodedC);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    if (encodedC.len == 0) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    if (challengeLength == 0) {
+        return SignQueryRequest(&encodedC, signatureKind, entry.SignedMessage);
+    }
+
+    // The challenge is encoded as a zero-filled byte string.  The only
+    // other byte string in a QueryRequest is the session key share, a
+    // DER-encoded public key, which starts with a SEQUENCE tag rather than
+    // zeros, so the slot is the only match for its head followed by that
+    // many zeros.
+    std::vector<uint8_t> slot;
+    if (challengeLength < 24) {
+        slot.push_back((uint8_t)(0x40 + challengeLength));
+    } else if (challengeLength < 256) {
+        slot.push_back(0x58);
+        slot.push_back((uint8_t)challengeLength);
+    } else {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    slot.resize(slot.size() + challengeLength, 0);
+
+    const uint8_t* begin = (const uint8_t*)encodedC.ptr;
+    const uint8_t* end = begin + encodedC.len;
+    const uint8_t* found = std::search(begin, end, slot.begin(), slot.end());
+    if (found == end) {
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    entry.Template.assign(begin, end);
+    entry.ChallengeOffset = (found - begin) + (slot.size() - challengeLength);
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TamGetQueryRequest(
+    std::optional<int> minVersion,
+    std::optional<int> maxVersion,
+    teep_signature_kind_t signatureKind,
+    _Inout_ TamSession* session,
+    _Out_ std::shared_ptr<const std::vector<uint8_t>>& signedMessage)
+{
+    QueryRequestCacheKey key;
+    key.MinVersion = minVersion.value_or(0);
+    key.MaxVersion = maxVersion.value_or(0);
+    key.HaveVersions = maxVersion.has_value();
+    key.FreshnessMechanisms = TAM_SUPPORTED_FRESHNESS_MECHANISMS;
+    key.KeyGeneration = TamGetSigningKeyGeneration();
+
+    // In session mode, offer the TAM's agreement key share.
+    session->AgreementKey = TamGetAgreementKey();
+    key.AgreementKeyGeneration = (session->AgreementKey) ? session->AgreementKey->Generation : 0;
+    UsefulBufC sessionKeyShare = NULLUsefulBufC;
+    if (session->AgreementKey) {
+        sessionKeyShare = { session->AgreementKey->PublicShare.data(), session->AgreementKey->PublicShare.size() };
+    }
+    key.SignatureKind = signatureKind;
+
+    std::vector<uint8_t> challengeTemplate;
+    size_t challengeOffset;
+    {
+        std::lock_guard<std::mutex> lock(g_QueryRequestCacheLock);
+        key.ChallengeLength = g_ChallengeLength;
+
+        auto it = g_QueryRequestCache.find(key);
+        if (it == g_QueryRequestCache.end()) {
+            // Build it while holding the lock, so a reconnect storm
+            // signs only once.
+            QueryRequestCacheEntry entry;
+            teep_error_code_t result = BuildQueryRequestCacheEntry(minVersion, maxVersion, key.ChallengeLength, sessionKeyShare, key.SignatureKind, entry);
+            if (result != TEEP_ERR_SUCCESS) {
+                return result;
+            }
+            it = g_QueryRequestCache.emplace(key, std::move(entry)).first;
+        }
+
+        if (key.ChallengeLength == 0) {
+            signedMessage = it->second.SignedMessage;
+            return TEEP_ERR_SUCCESS;
+        }
+        challengeTemplate = it->second.Template;
+        challengeOffset = it->second.ChallengeOffset;
+    }
+
+    // Patch a fresh challenge into the template and sign the result.
+    teep_error_code_t result = teep_random(challengeTemplate.data() + challengeOffset, key.ChallengeLength);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    session->Challenge.assign(challengeTemplate.begin() + challengeOffset, challengeTemplate.begin() + challengeOffset + key.ChallengeLength);
+
+    UsefulBufC unsignedMessage = { challengeTemplate.data(), challengeTemplate.size() };
+    return SignQueryRequest(&unsignedMessage, signatureKind, signedMessage);
+}
@@ -0,0 +1,44 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <memory>
+#include <optional>
+#include <vector>
+#include "common.h"
+#include "TamSession.h"
+
+// Implemented in TeepTamMessageHandler.cpp.
+teep_error_code_t TamComposeQueryRequestTemplate(
+    std::optional<int> minVersion,
+    std::optional<int> maxVersion,
+    size_t challengeLength,
+    UsefulBufC sessionKeyShare,
+    _Out_ UsefulBufC* bufferToSend);
+
+teep_error_code_t TamSignMessage(
+    _In_ const UsefulBufC* unsignedMessage,
+    _Inout_ UsefulBuf signedMessageBuffer,
+    teep_signature_kind_t signatureKind,
+    _Out_ UsefulBufC* signedMessage);
+
+// Get a signed QueryRequest to send on a new connection.  Without challenge
+// freshness the QueryRequest is identical for every connection, so it is
+// encoded and signed once per (versions, freshness mechanisms, signature
+// kind, signing key generation) and then served from the cache.  With a
+// challenge, the cached unsigned template has a slot that is patched with
+// a fresh challenge, which is also saved in the session, before signing.
+// In session mode the QueryRequest also offers the TAM's agreement key
+// share, which is saved in the session.  A QueryRequest is always signed,
+// since it goes out before the device has identified itself.
+teep_error_code_t TamGetQueryRequest(
+    std::optional<int> minVersion,
+    std::optional<int> maxVersion,
+    teep_signature_kind_t signatureKind,
+    _Inout_ TamSession* session,
+    _Out_ std::shared_ptr<const std::vector<uint8_t>>& signedMessage);
+
+// Set the challenge length to use in QueryRequests, or 0 for none.
+void TamSetQueryRequestChallengeLength(size_t challengeLength);
+
+// Discard all cached QueryRequests.  Called whenever signing keys change.
+void TamInvalidateQueryRequestCache(void);
@@ -3,21 +3,43 @@
 #include "qcbor/UsefulBuf.h"
 #include "RequestedComponentInfo.h"
 
-RequestedComponentInfo::RequestedComponentInfo(_In_ const UsefulBufC* componentId)
+RequestedComponentInfo::RequestedComponentInfo(UsefulBufC encodedComponentId)
 {
-    if (componentId != nullptr) {
-        this->ComponentId = *componentId;
-    } else {
-        this->ComponentId.len = 0;
-        this->ComponentId.ptr = nullptr;
+    SetComponentId(encodedComponentId);
+    this->ManifestSequenceNumber = 0;
+    this->HaveManifestSequenceNumber = false;
+    this->HaveBinary = false;
+    this->Next = nullptr;
+}
+
+RequestedComponentInfo::RequestedComponentInfo(_In_ const teep_uuid_t& componentId)
+{
+    UsefulBufC element = { componentId.b, sizeof(componentId.b) };
+    std::string encoded;
+    if (TeepEncodeComponentId(&element, 1, encoded) != TEEP_ERR_SUCCESS) {
+        encoded.clear();
     }
+    SetComponentId({ encoded.data(), encoded.size() });
     this->ManifestSequenceNumber = 0;
+    this->HaveManifestSequenceNumber = false;
     this->HaveBinary = false;
     this->Next = nullptr;
 }
 
+void RequestedComponentInfo::SetComponentId(UsefulBufC encodedComponentId)
+{
+    this->ComponentHandle = TeepComponentIdTable::Acquire(encodedComponentId);
+    if (this->ComponentHandle != TEEP_NO_COMPONENT_HANDLE) {
+        this->ComponentId = TeepComponentIdTable::GetEncoded(this->ComponentHandle);
+    } else {
+        _unknownComponentId.assign((const char*)encodedComponentId.ptr, encodedComponentId.len);
+        this->ComponentId = { _unknownComponentId.data(), _unknownComponentId.size() };
+    }
+}
+
 RequestedComponentInfo::~RequestedComponentInfo()
 {
+    TeepComponentIdTable::Release(this->ComponentHandle);
     if (this->Next != nullptr) {
         delete this->Next;
     }
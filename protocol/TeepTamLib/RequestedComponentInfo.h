@@ -1,15 +1,42 @@
 // Copyright (c) TEEP contributors
 // SPDX-License-Identifier: MIT
 #pragma once
+#include <string>
+#include "ComponentIdTable.h"
+
 class RequestedComponentInfo
 {
 public:
-    RequestedComponentInfo(_In_ const UsefulBufC* componentId);
+    // Takes a component ID in canonical form, as from TeepParseComponentId().
+    // Component IDs are only looked up in the component ID table, never
+    // added, since they come from the device.  A reference is held on an
+    // ID that is found, so its handle cannot be reused meanwhile.
+    RequestedComponentInfo(UsefulBufC encodedComponentId);
+
+    // Same, for a component ID that is a single UUID.
+    RequestedComponentInfo(_In_ const teep_uuid_t& componentId);
+
     ~RequestedComponentInfo();
 
     RequestedComponentInfo* Next;
+
+    // TEEP_NO_COMPONENT_HANDLE if the ID is not in the table, in which
+    // case the TAM has no manifest for it.
+    teep_component_handle_t ComponentHandle;
+
+    // The canonical encoding of the SUIT_Component_Identifier, shared with
+    // the component ID table if it has a handle.
     UsefulBufC ComponentId;
+
     uint64_t ManifestSequenceNumber;
+    bool HaveManifestSequenceNumber; // False if the device did not report one.
     bool HaveBinary;
-};
 
+private:
+    RequestedComponentInfo(const RequestedComponentInfo&) = delete;
+    RequestedComponentInfo& operator=(const RequestedComponentInfo&) = delete;
+
+    void SetComponentId(UsefulBufC encodedComponentId);
+
+    std::string _unknownComponentId; // Holds ComponentId if there is no handle.
+};
@@ -0,0 +1,495 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string.h>
+#include <thread>
+#if defined(OE_BUILD_ENCLAVE)
+// No watcher inside an enclave.
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#include "ManifestRepository.h"
+#include "TamConfigurationWatcher.h"
+#include "TamKeys.h"
+#include "TeepTamLib.h"
+using namespace std;
+#ifdef TEEP_USE_TEE
+using namespace std::__fs;
+#endif
+
+static bool IsManifestFilename(_In_ const std::string& filename)
+{
+    return (filename.size() >= 6 && filename.compare(filename.size() - 5, 5, ".cbor") == 0);
+}
+
+teep_error_code_t TamApplyConfigurationChanges(
+    _In_z_ const char* dataDirectory,
+    _In_ const std::vector<TamConfigurationChange>& changes,
+    _Out_opt_ std::vector<TamConfigurationChange>* failedChanges)
+{
+    if (failedChanges != nullptr) {
+        failedChanges->clear();
+    }
+    std::string requiredManifestPath = std::string(dataDirectory) + "/manifests/required";
+    std::string optionalManifestPath = std::string(dataDirectory) + "/manifests/optional";
+    std::string trustedKeysPath = std::string(dataDirectory) + "/trusted";
+
+    std::set<std::string> manifestFiles;
+    std::vector<std::string> keyFiles;
+    for (const TamConfigurationChange& change : changes) {
+        if (change.Directory == TAM_TRUSTED_KEYS_DIRECTORY) {
+            keyFiles.push_back(change.Filename);
+        } else if (IsManifestFilename(change.Filename)) {
+            manifestFiles.insert(change.Filename);
+        }
+    }
+
+    teep_error_code_t result = TEEP_ERR_SUCCESS;
+    if (!manifestFiles.empty()) {
+        result = ManifestRepository::Update([&](ManifestRepositoryBuilder& builder) {
+            for (const std::string& filename : manifestFiles) {
+                std::string component_id;
+                if (TeepGetComponentIdFromManifestFilename(filename.c_str(), component_id) != TEEP_ERR_SUCCESS) {
+                    continue;
+                }
+
+                // A manifest moved between directories shows up as a removal
+                // from one and an addition to the other, so look in both.  As
+                // in TamLoadConfiguration, an optional manifest wins.
+                std::shared_ptr<const Manifest> manifest;
+                teep_error_code_t loaded = TEEP_ERR_SUCCESS;
+                tam_configuration_directory_t directory = TAM_REQUIRED_MANIFESTS_DIRECTORY;
+                if (filesystem::exists(optionalManifestPath + "/" + filename)) {
+                    directory = TAM_OPTIONAL_MANIFESTS_DIRECTORY;
+                    loaded = TamLoadManifestFile(optionalManifestPath.c_str(), filename.c_str(), false, manifest);
+                } else if (filesystem::exists(requiredManifestPath + "/" + filename)) {
+                    loaded = TamLoadManifestFile(requiredManifestPath.c_str(), filename.c_str(), true, manifest);
+                }
+
+                // A file removed after the check above is removed from the
+                // repository by the change that reports its removal.
+                if (loaded != TEEP_ERR_SUCCESS) {
+                    TeepLogMessage("TAM could not reload manifest %s\n", filename.c_str());
+                    if (failedChanges != nullptr) {
+                        failedChanges->push_back({ directory, filename });
+                    }
+                    continue;
+                }
+                if (manifest) {
+                    builder.Add(manifest);
+                    TeepLogMessage("TAM loaded manifest %s\n", filename.c_str());
+                } else {
+                    builder.Remove({ component_id.data(), component_id.size() });
+                    TeepLogMessage("TAM removed manifest %s\n", filename.c_str());
+                }
+            }
+            return TEEP_ERR_SUCCESS;
+        });
+
+        // The pack is authoritative at startup, so save the new snapshot
+        // as the next one.  Rows still served from the old pack are copied
+        // from its mapping.
+        if (result == TEEP_ERR_SUCCESS) {
+            result = TamSaveManifestPack(dataDirectory);
+            if (result != TEEP_ERR_SUCCESS) {
+                TeepLogMessage("TAM could not save the manifest pack, error %d\n", result);
+            }
+        }
+    }
+
+    if (!keyFiles.empty()) {
+        std::vector<std::string> failedKeyFiles;
+        teep_error_code_t keyResult = TamReloadAgentKeyFiles(trustedKeysPath.c_str(), keyFiles, &failedKeyFiles);
+        if (result == TEEP_ERR_SUCCESS) {
+            result = keyResult;
+        }
+        if (failedChanges != nullptr) {
+            for (const std::string& filename : failedKeyFiles) {
+                failedChanges->push_back({ TAM_TRUSTED_KEYS_DIRECTORY, filename });
+            }
+        }
+    }
+    return result;
+}
+
+#if !defined(OE_BUILD_ENCLAVE) && (defined(_WIN32) || defined(__linux__))
+
+struct TamWatchedDirectory
+{
+    tam_configuration_directory_t Kind;
+    std::string Path;
+};
+
+static std::vector<TamWatchedDirectory> GetWatchedDirectories(_In_ const std::string& dataDirectory)
+{
+    return {
+        { TAM_REQUIRED_MANIFESTS_DIRECTORY, dataDirectory + "/manifests/required" },
+        { TAM_OPTIONAL_MANIFESTS_DIRECTORY, dataDirectory + "/manifests/optional" },
+        { TAM_TRUSTED_KEYS_DIRECTORY, dataDirectory + "/trusted" },
+    };
+}
+
+typedef std::pair<tam_configuration_directory_t, std::string> TamConfigurationFile;
+
+// Changes noticed but not yet applied.
+struct TamConfigurationBatch
+{
+    std::vector<TamConfigurationChange> Changes;
+
+    // When the oldest change in the batch was noticed.
+    std::chrono::steady_clock::time_point FirstChangeTime;
+
+    // How many times in a row each file has failed to load without
+    // being changed again.
+    std::map<TamConfigurationFile, int> FailureCounts;
+};
+
+static void AddChange(_Inout_ TamConfigurationBatch& batch, _In_ const TamConfigurationChange& change)
+{
+    if (batch.Changes.empty()) {
+        batch.FirstChangeTime = std::chrono::steady_clock::now();
+    }
+    batch.Changes.push_back(change);
+}
+
+// Get how long to wait for more changes before applying a batch, in
+// milliseconds, or -1 to wait for the next change.  Each change restarts
+// the batch delay, but a steady stream of changes cannot hold back a batch
+// longer than TAM_CONFIGURATION_MAX_BATCH_DELAY_MS.
+static int GetBatchTimeout(_In_ const TamConfigurationBatch& batch)
+{
+    if (batch.Changes.empty()) {
+        return -1;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - batch.FirstChangeTime).count();
+    auto remaining = std::max<long long>(TAM_CONFIGURATION_MAX_BATCH_DELAY_MS - elapsed, 0);
+    return (int)std::min<long long>(remaining, TAM_CONFIGURATION_BATCH_DELAY_MS);
+}
+
+// Apply and clear a batch of changes.  A failure is only logged, since a
+// later change may fix whatever was wrong.  A file that could not be
+// loaded may still be being written, since on Windows a change is reported
+// at each write rather than once the file is closed, so it is tried again
+// in the next batch until it loads or has failed
+// TAM_CONFIGURATION_MAX_ATTEMPTS times without being changed again.
+static void ApplyBatch(_In_ const std::string& dataDirectory, _Inout_ TamConfigurationBatch& batch)
+{
+    if (batch.Changes.empty()) {
+        return;
+    }
+    std::vector<TamConfigurationChange> failedChanges;
+    teep_error_code_t result = TamApplyConfigurationChanges(dataDirectory.c_str(), batch.Changes, &failedChanges);
+    if (result != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("TAM could not apply configuration changes, error %d\n", result);
+    }
+    batch.Changes.clear();
+
+    std::map<TamConfigurationFile, int> failureCounts;
+    for (const TamConfigurationChange& change : failedChanges) {
+        TamConfigurationFile file(change.Directory, change.Filename);
+        int count = batch.FailureCounts[file] + 1;
+        if (count >= TAM_CONFIGURATION_MAX_ATTEMPTS) {
+            TeepLogMessage("TAM skipped %s after %d attempts\n", change.Filename.c_str(), count);
+            continue;
+        }
+        failureCounts[file] = count;
+        AddChange(batch, change);
+    }
+    batch.FailureCounts = std::move(failureCounts);
+}
+
+// Add a change reported by the operating system.  A file that changes
+// again gets a fresh set of attempts.
+static void AddNoticedChange(_Inout_ TamConfigurationBatch& batch, tam_configuration_directory_t kind, _In_ const std::string& filename)
+{
+    batch.FailureCounts.erase(TamConfigurationFile(kind, filename));
+    AddChange(batch, { kind, filename });
+}
+
+// Reload everything, when changes were lost because too many happened at
+// once.  The manifest pack may be missing the lost changes too, so it is
+// compiled again from the manifest files.
+static void ReloadConfiguration(_In_ const std::string& dataDirectory, _Inout_ TamConfigurationBatch& batch)
+{
+    TeepLogMessage("TAM missed configuration changes, reloading %s\n", dataDirectory.c_str());
+    batch.Changes.clear();
+    batch.FailureCounts.clear();
+    std::string packFilename;
+    teep_error_code_t result = TamCompileManifestPack(dataDirectory.c_str(), packFilename);
+    if (result == TEEP_ERR_SUCCESS) {
+        result = Manifest::LoadPack(packFilename.c_str());
+    }
+    if (result != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("TAM could not reload manifests, error %d\n", result);
+    }
+    TamConfigureAgentKeys((dataDirectory + "/trusted").c_str());
+}
+
+static std::mutex g_WatcherLock;
+static std::thread g_WatcherThread;
+
+#endif
+
+#if defined(OE_BUILD_ENCLAVE) || !(defined(_WIN32) || defined(__linux__))
+
+teep_error_code_t TamStartConfigurationWatcher(_In_z_ const char* dataDirectory)
+{
+    TeepLogMessage("TAM cannot watch %s for configuration changes on this platform\n", dataDirectory);
+    return TEEP_ERR_PERMANENT_ERROR;
+}
+
+void TamStopConfigurationWatcher(void)
+{
+}
+
+#elif defined(_WIN32)
+
+struct TamDirectoryWatch
+{
+    tam_configuration_directory_t Kind;
+    HANDLE Directory;
+    OVERLAPPED Overlapped;
+    DWORD Buffer[4096]; // FILE_NOTIFY_INFORMATION records must be DWORD-aligned.
+};
+
+static HANDLE g_WatcherStopEvent = nullptr;
+
+static bool ReadDirectoryChanges(_Inout_ TamDirectoryWatch& watch)
+{
+    return ReadDirectoryChangesW(watch.Directory, watch.Buffer, sizeof(watch.Buffer), FALSE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE, nullptr, &watch.Overlapped, nullptr) != 0;
+}
+
+static void WatchConfiguration(
+    std::string dataDirectory,
+    std::vector<std::unique_ptr<TamDirectoryWatch>> watches,
+    HANDLE stopEvent)
+{
+    std::vector<HANDLE> events = { stopEvent };
+    for (const auto& watch : watches) {
+        events.push_back(watch->Overlapped.hEvent);
+    }
+
+    TamConfigurationBatch batch;
+    for (;;) {
+        int batchTimeout = GetBatchTimeout(batch);
+        if (batchTimeout == 0) {
+            ApplyBatch(dataDirectory, batch);
+            continue;
+        }
+        DWORD timeout = (batchTimeout < 0) ? INFINITE : (DWORD)batchTimeout;
+        DWORD wait = WaitForMultipleObjects((DWORD)events.size(), events.data(), FALSE, timeout);
+        if (wait == WAIT_TIMEOUT) {
+            ApplyBatch(dataDirectory, batch);
+            continue;
+        }
+        if (wait == WAIT_OBJECT_0 || wait >= WAIT_OBJECT_0 + events.size()) {
+            break;
+        }
+
+        TamDirectoryWatch& watch = *watches[wait - WAIT_OBJECT_0 - 1];
+        DWORD length;
+        if (!GetOverlappedResult(watch.Directory, &watch.Overlapped, &length, FALSE) || length == 0) {
+            // The buffer overflowed.
+            ReloadConfiguration(dataDirectory, batch);
+        } else {
+            const uint8_t* p = (const uint8_t*)watch.Buffer;
+            for (;;) {
+                const FILE_NOTIFY_INFORMATION* information = (const FILE_NOTIFY_INFORMATION*)p;
+                int wideLength = (int)(information->FileNameLength / sizeof(WCHAR));
+                int size = WideCharToMultiByte(CP_UTF8, 0, information->FileName, wideLength, nullptr, 0, nullptr, nullptr);
+                std::string filename(size, '\0');
+                WideCharToMultiByte(CP_UTF8, 0, information->FileName, wideLength, &filename[0], size, nullptr, nullptr);
+                AddNoticedChange(batch, watch.Kind, filename);
+                if (information->NextEntryOffset == 0) {
+                    break;
+                }
+                p += information->NextEntryOffset;
+            }
+        }
+        if (!ReadDirectoryChanges(watch)) {
+            TeepLogMessage("TAM stopped watching configuration, error %lu\n", GetLastError());
+            break;
+        }
+    }
+
+    for (const auto& watch : watches) {
+        CancelIoEx(watch->Directory, &watch->Overlapped);
+        DWORD length;
+        GetOverlappedResult(watch->Directory, &watch->Overlapped, &length, TRUE);
+        CloseHandle(watch->Overlapped.hEvent);
+        CloseHandle(watch->Directory);
+    }
+}
+
+teep_error_code_t TamStartConfigurationWatcher(_In_z_ const char* dataDirectory)
+{
+    TamStopConfigurationWatcher();
+    std::lock_guard<std::mutex> lock(g_WatcherLock);
+
+    std::vector<std::unique_ptr<TamDirectoryWatch>> watches;
+    for (const TamWatchedDirectory& directory : GetWatchedDirectories(dataDirectory)) {
+        HANDLE handle = CreateFileA(directory.Path.c_str(), FILE_LIST_DIRECTORY,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) {
+            // Nothing to watch in a directory that does not exist.
+            continue;
+        }
+        auto watch = std::make_unique<TamDirectoryWatch>();
+        watch->Kind = directory.Kind;
+        watch->Directory = handle;
+        memset(&watch->Overlapped, 0, sizeof(watch->Overlapped));
+        watch->Overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (watch->Overlapped.hEvent == nullptr || !ReadDirectoryChanges(*watch)) {
+            if (watch->Overlapped.hEvent != nullptr) {
+                CloseHandle(watch->Overlapped.hEvent);
+            }
+            CloseHandle(handle);
+            continue;
+        }
+        watches.push_back(std::move(watch));
+    }
+
+    g_WatcherStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (g_WatcherStopEvent == nullptr) {
+        for (const auto& watch : watches) {
+            CancelIoEx(watch->Directory, &watch->Overlapped);
+            CloseHandle(watch->Overlapped.hEvent);
+            CloseHandle(watch->Directory);
+        }
+        TeepLogMessage("TAM is not watching %s for configuration changes, error %lu\n", dataDirectory, GetLastError());
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    g_WatcherThread = std::thread(WatchConfiguration, std::string(dataDirectory), std::move(watches), g_WatcherStopEvent);
+    return TEEP_ERR_SUCCESS;
+}
+
+void TamStopConfigurationWatcher(void)
+{
+    std::lock_guard<std::mutex> lock(g_WatcherLock);
+    if (!g_WatcherThread.joinable()) {
+        return;
+    }
+    SetEvent(g_WatcherStopEvent);
+    g_WatcherThread.join();
+    CloseHandle(g_WatcherStopEvent);
+    g_WatcherStopEvent = nullptr;
+}
+
+#else // __linux__
+
+static int g_WatcherStopPipe[2] = { -1, -1 };
+
+static void WatchConfiguration(
+    std::string dataDirectory,
+    int inotifyFd,
+    std::map<int, tam_configuration_directory_t> watches,
+    int stopFd)
+{
+    alignas(struct inotify_event) char buffer[16 * 1024];
+    TamConfigurationBatch batch;
+    for (;;) {
+        int timeout = GetBatchTimeout(batch);
+        if (timeout == 0) {
+            ApplyBatch(dataDirectory, batch);
+            continue;
+        }
+        struct pollfd fds[2] = { { inotifyFd, POLLIN, 0 }, { stopFd, POLLIN, 0 } };
+        int count = poll(fds, 2, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            TeepLogMessage("TAM stopped watching configuration, error %d\n", errno);
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        if (count == 0) {
+            ApplyBatch(dataDirectory, batch);
+            continue;
+        }
+
+        ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            continue;
+        }
+        for (const char* p = buffer; p < buffer + length; ) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            p += sizeof(*event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                ReloadConfiguration(dataDirectory, batch);
+                continue;
+            }
+            auto watch = watches.find(event->wd);
+            if (watch == watches.end() || event->len == 0) {
+                continue;
+            }
+            AddNoticedChange(batch, watch->second, event->name);
+        }
+    }
+    close(inotifyFd);
+}
+
+teep_error_code_t TamStartConfigurationWatcher(_In_z_ const char* dataDirectory)
+{
+    TamStopConfigurationWatcher();
+    std::lock_guard<std::mutex> lock(g_WatcherLock);
+
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0) {
+        TeepLogMessage("TAM is not watching %s for configuration changes, error %d\n", dataDirectory, errno);
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    // Files are picked up once they have been written and closed, or
+    // renamed into place, never while half written.
+    std::map<int, tam_configuration_directory_t> watches;
+    for (const TamWatchedDirectory& directory : GetWatchedDirectories(dataDirectory)) {
+        int wd = inotify_add_watch(inotifyFd, directory.Path.c_str(),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR);
+        if (wd >= 0) {
+            watches[wd] = directory.Kind;
+        }
+    }
+
+    if (pipe2(g_WatcherStopPipe, O_CLOEXEC) != 0) {
+        TeepLogMessage("TAM is not watching %s for configuration changes, error %d\n", dataDirectory, errno);
+        close(inotifyFd);
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    g_WatcherThread = std::thread(WatchConfiguration, std::string(dataDirectory), inotifyFd, std::move(watches), g_WatcherStopPipe[0]);
+    return TEEP_ERR_SUCCESS;
+}
+
+void TamStopConfigurationWatcher(void)
+{
+    std::lock_guard<std::mutex> lock(g_WatcherLock);
+    if (!g_WatcherThread.joinable()) {
+        return;
+    }
+    char stop = 0;
+    (void)!write(g_WatcherStopPipe[1], &stop, sizeof(stop));
+    g_WatcherThread.join();
+    close(g_WatcherStopPipe[0]);
+    close(g_WatcherStopPipe[1]);
+    g_WatcherStopPipe[0] = -1;
+    g_WatcherStopPipe[1] = -1;
+}
+
+#endif
@@ -0,0 +1,68 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include "common.h"
+
+// The configuration watcher applies changes under a TAM data directory as
+// they happen, without pausing traffic: manifests added to, changed in, or
+// removed from manifests/required and manifests/optional, and TEEP Agent
+// keys in trusted.  Each batch of changes re-reads only the files that
+// changed and publishes a single new manifest repository snapshot, so
+// exchanges already in progress finish on the snapshot they started with
+// and new ones see the new policy.  The snapshot is also saved as the next
+// manifest pack, which a TAM loads at startup without reading the files.
+//
+// Changes are noticed with inotify on Linux and ReadDirectoryChangesW on
+// Windows.  There is no watcher inside an enclave.
+
+// Wait this long after a change for any others that go with it, so that,
+// e.g., copying in a directory of manifests publishes one snapshot.
+#define TAM_CONFIGURATION_BATCH_DELAY_MS 50
+
+// Apply a batch at most this long after its first change, even if changes
+// keep coming.
+#define TAM_CONFIGURATION_MAX_BATCH_DELAY_MS 1000
+
+// Give up on a file that still cannot be loaded after this many batches
+// without it changing again.
+#define TAM_CONFIGURATION_MAX_ATTEMPTS 10
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Start watching a data directory, replacing any previous watch.  A
+    // failure is also logged.
+    teep_error_code_t TamStartConfigurationWatcher(_In_z_ const char* dataDirectory);
+
+    // Stop watching.  Changes not yet applied are dropped.
+    void TamStopConfigurationWatcher(void);
+
+#ifdef __cplusplus
+};
+
+#include <string>
+#include <vector>
+
+typedef enum {
+    TAM_REQUIRED_MANIFESTS_DIRECTORY,
+    TAM_OPTIONAL_MANIFESTS_DIRECTORY,
+    TAM_TRUSTED_KEYS_DIRECTORY,
+} tam_configuration_directory_t;
+
+// A file under a data directory that was added, changed, or removed.
+typedef struct {
+    tam_configuration_directory_t Directory;
+    std::string Filename;
+} TamConfigurationChange;
+
+// Apply a batch of changes, as the watcher does, and save the resulting
+// snapshot as the next manifest pack.  Whether each file was added,
+// changed, or removed is determined from what is now on disk.  A file that
+// cannot be loaded is skipped and, if failedChanges is not null, added to
+// it, and the rest of the batch is still applied.
+teep_error_code_t TamApplyConfigurationChanges(
+    _In_z_ const char* dataDirectory,
+    _In_ const std::vector<TamConfigurationChange>& changes,
+    _Out_opt_ std::vector<TamConfigurationChange>* failedChanges = nullptr);
+#endif
@@ -1,11 +1,19 @@
 // Copyright (c) TEEP contributors
 // SPDX-License-Identifier: MIT
+#include <atomic>
 #include <dirent.h>
 #include <filesystem>
+#include <mutex>
 #include <vector>
 #include "t_cose/t_cose_key.h"
 #include "TeepTamLib.h"
 #include "TamKeys.h"
+#include "AgentKeyStore.h"
+#include "CryptoProvider.h"
+#include "MappedFile.h"
+#include "QueryRequestCache.h"
+#include "SessionKey.h"
+#include "UpdateCache.h"
 using namespace std;
 #ifdef TEEP_USE_TEE
 using namespace std::__fs;
@@ -18,6 +26,12 @@ using namespace std::__fs;
 #define TAM_EDDSA_SIGNING_PRIVATE_KEY_PAIR_FILENAME "tam-eddsa-private-key-pair.pem"
 
 std::map<teep_signature_kind_t, struct t_cose_key> g_tam_signing_key_pairs;
+static std::atomic<uint64_t> g_tam_signing_key_generation{ 0 };
+
+uint64_t TamGetSigningKeyGeneration(void)
+{
+    return g_tam_signing_key_generation;
+}
 
 teep_error_code_t TamGetSigningKeyPairs(_Out_ std::map<teep_signature_kind_t, struct t_cose_key>& key_pairs)
 {
@@ -25,7 +39,114 @@ teep_error_code_t TamGetSigningKeyPairs(_Out_ std::map<teep_signature_kind_t, st
     return TEEP_ERR_SUCCESS;
 }
 
-map<teep_signature_kind_t, struct t_cose_key> g_agent_key_pairs;
+static std::mutex g_tam_agreement_key_lock;
+static std::shared_ptr<const TamAgreementKey> g_tam_agreement_key;
+static uint64_t g_tam_agreement_key_generation = 0;
+
+TamAgreementKey::TamAgreementKey() : Generation(0)
+{
+    Key.key.ptr = nullptr;
+}
+
+TamAgreementKey::~TamAgreementKey()
+{
+    if (Key.key.ptr != nullptr) {
+        teep_get_crypto_provider()->free_key(&Key);
+    }
+}
+
+std::shared_ptr<const TamAgreementKey> TamGetAgreementKey(void)
+{
+    uint32_t lifetime = teep_get_session_key_lifetime();
+    if (lifetime == 0) {
+        return nullptr;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    std::shared_ptr<const TamAgreementKey> current;
+    bool replaced = false;
+    {
+        std::lock_guard<std::mutex> lock(g_tam_agreement_key_lock);
+        if (!g_tam_agreement_key || now >= g_tam_agreement_key->Expiry) {
+            auto key = std::make_shared<TamAgreementKey>();
+            if (TeepSessionKey::GenerateAgreementKey(&key->Key, key->PublicShare) != TEEP_ERR_SUCCESS) {
+                // Carry on without session mode.
+                return nullptr;
+            }
+            key->Generation = ++g_tam_agreement_key_generation;
+            key->Expiry = now + std::chrono::seconds(lifetime);
+            g_tam_agreement_key = key;
+            replaced = true;
+        }
+        current = g_tam_agreement_key;
+    }
+
+    // QueryRequests offering the old share are stale.
+    if (replaced) {
+        TamInvalidateQueryRequestCache();
+    }
+    return current;
+}
+
+// Writers serialize on g_agent_key_files_update_lock, but readers just load
+// the current set.
+static std::mutex g_agent_key_files_update_lock;
+static std::shared_ptr<const TamAgentKeyFiles> g_agent_key_files;
+
+static bool IsAgentKeyFilename(_In_z_ const char* filename)
+{
+    size_t filename_length = strlen(filename);
+    return (filename_length >= 5 && strcmp(filename + filename_length - 4, ".pem") == 0);
+}
+
+static teep_error_code_t LoadAgentKeyFile(
+    _In_z_ const char* directory_name,
+    _In_z_ const char* filename,
+    _Out_ std::shared_ptr<const AgentKey>& agent_key)
+{
+    string keyfile = string(directory_name) + "/" + filename;
+
+    // Load public key from file.
+    struct t_cose_key key_pair;
+    teep_error_code_t result = teep_get_verifying_key_pair(&key_pair, keyfile.c_str());
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    teep_signature_kind_t kind = (strstr(filename, "es256") != nullptr) ? TEEP_SIGNATURE_ES256 : TEEP_SIGNATURE_EDDSA;
+    agent_key = std::make_shared<const AgentKey>(kind, key_pair);
+
+    TeepLogMessage("TAM loaded TEEP agent key from %s\n", keyfile.c_str());
+    return TEEP_ERR_SUCCESS;
+}
+
+// Index a set of key files by key ID and make it the current set.
+static teep_error_code_t PublishAgentKeyFiles(_In_ const std::shared_ptr<TamAgentKeyFiles>& keys)
+{
+    for (const auto& file : keys->Files) {
+        teep_error_code_t result = teep_add_verification_key(keys->Index, file.second->Kind, &file.second->Key);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+    }
+    std::atomic_store(&g_agent_key_files, std::shared_ptr<const TamAgentKeyFiles>(keys));
+    return TEEP_ERR_SUCCESS;
+}
+
+// Keys for large numbers of devices live in a pack file instead.
+static teep_error_code_t OpenAgentKeyPack(_In_z_ const char* directory_name)
+{
+    string packfile = string(directory_name) + "/" + TAM_AGENT_KEY_PACK_FILENAME;
+    uint64_t generation;
+    if (!FindLatestPackGeneration(packfile.c_str(), &generation)) {
+        TamGetAgentKeyStore().Close();
+        return TEEP_ERR_SUCCESS;
+    }
+    teep_error_code_t result = TamGetAgentKeyStore().Open(packfile.c_str());
+    if (result == TEEP_ERR_SUCCESS) {
+        TeepLogMessage("TAM loaded TEEP agent keys from %s\n", packfile.c_str());
+    }
+    return result;
+}
 
 /* TODO: This is just a placeholder for a real implementation.
  * Currently we provide untrusted keys into the TAM.
@@ -35,9 +156,10 @@ map<teep_signature_kind_t, struct t_cose_key> g_agent_key_pairs;
  */
 teep_error_code_t TamConfigureAgentKeys(_In_z_ const char* directory_name)
 {
-    g_agent_key_pairs.clear();
+    std::lock_guard<std::mutex> lock(g_agent_key_files_update_lock);
+    auto keys = std::make_shared<TamAgentKeyFiles>();
 
-    teep_error_code_t result = TEEP_ERR_SUCCESS;
+    teep_error_code_t load_result = TEEP_ERR_SUCCESS;
     DIR* dir = opendir(directory_name);
     if (dir == NULL) {
         return TEEP_ERR_TEMPORARY_ERROR;
@@ -47,35 +169,98 @@ teep_error_code_t TamConfigureAgentKeys(_In_z_ const char* directory_name)
         if (dirent == NULL) {
             break;
         }
-
-        // Compose path to file.
-        char* filename = dirent->d_name;
-        size_t filename_length = strlen(filename);
-        if (filename_length < 5 ||
-            strcmp(filename + filename_length - 4, ".pem") != 0) {
+        if (!IsAgentKeyFilename(dirent->d_name)) {
+            continue;
+        }
+        std::shared_ptr<const AgentKey> agent_key;
+        teep_error_code_t result = LoadAgentKeyFile(directory_name, dirent->d_name, agent_key);
+        if (result != TEEP_ERR_SUCCESS) {
+            TeepLogMessage("TAM skipped TEEP agent key %s/%s, error %d\n", directory_name, dirent->d_name, result);
+            if (load_result == TEEP_ERR_SUCCESS) {
+                load_result = result;
+            }
             continue;
         }
-        string keyfile = string(directory_name) + "/" + filename;
+        keys->Files[dirent->d_name] = agent_key;
+    }
+    closedir(dir);
+
+    teep_error_code_t result = PublishAgentKeyFiles(keys);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    result = OpenAgentKeyPack(directory_name);
+    return (result != TEEP_ERR_SUCCESS) ? result : load_result;
+}
+
+teep_error_code_t TamReloadAgentKeyFiles(
+    _In_z_ const char* directory_name,
+    _In_ const std::vector<std::string>& filenames,
+    _Out_opt_ std::vector<std::string>* failed_filenames)
+{
+    std::lock_guard<std::mutex> lock(g_agent_key_files_update_lock);
+    if (failed_filenames != nullptr) {
+        failed_filenames->clear();
+    }
 
-        // Load public key from file.
-        struct t_cose_key key_pair;
-        result = teep_get_verifying_key_pair(&key_pair, keyfile.c_str());
+    // Keys in files that did not change are shared with the current set.
+    auto keys = std::make_shared<TamAgentKeyFiles>();
+    keys->Files = TamGetTeepAgentKeyFiles()->Files;
+    bool keyFilesChanged = false;
+    bool packChanged = false;
+    teep_error_code_t load_result = TEEP_ERR_SUCCESS;
+    for (const std::string& filename : filenames) {
+        if (IsPackGenerationFilename(TAM_AGENT_KEY_PACK_FILENAME, filename.c_str())) {
+            packChanged = true;
+            continue;
+        }
+        if (!IsAgentKeyFilename(filename.c_str())) {
+            continue;
+        }
+        keyFilesChanged = true;
+        keys->Files.erase(filename);
+        if (!filesystem::exists(string(directory_name) + "/" + filename)) {
+            TeepLogMessage("TAM removed TEEP agent key %s\n", filename.c_str());
+            continue;
+        }
+        std::shared_ptr<const AgentKey> agent_key;
+        teep_error_code_t result = LoadAgentKeyFile(directory_name, filename.c_str(), agent_key);
         if (result != TEEP_ERR_SUCCESS) {
-            break;
+            TeepLogMessage("TAM skipped TEEP agent key %s/%s, error %d\n", directory_name, filename.c_str(), result);
+            if (failed_filenames != nullptr) {
+                failed_filenames->push_back(filename);
+            }
+            if (load_result == TEEP_ERR_SUCCESS) {
+                load_result = result;
+            }
+            continue;
         }
-        teep_signature_kind_t kind = (strstr(filename, "es256") != nullptr) ? TEEP_SIGNATURE_ES256 : TEEP_SIGNATURE_EDDSA;
-        g_agent_key_pairs[kind] = key_pair;
+        keys->Files[filename] = agent_key;
+    }
 
-        TeepLogMessage("TAM loaded TEEP agent key from %s\n", keyfile.c_str());
+    if (keyFilesChanged) {
+        teep_error_code_t result = PublishAgentKeyFiles(keys);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
     }
-    closedir(dir);
-    return result;
+    if (packChanged) {
+        teep_error_code_t result = OpenAgentKeyPack(directory_name);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+    }
+    return load_result;
 }
 
-/* Get the TEEP Agents' public keys to verify an incoming message against. */
-map<teep_signature_kind_t, struct t_cose_key> TamGetTeepAgentKeys()
+/* Get the TEEP Agents' public keys loaded from individual key files.
+ * Keys in the agent key pack are found with TamGetAgentKeyStore().
+ */
+std::shared_ptr<const TamAgentKeyFiles> TamGetTeepAgentKeyFiles(void)
 {
-    return g_agent_key_pairs;
+    static const std::shared_ptr<const TamAgentKeyFiles> empty = std::make_shared<TamAgentKeyFiles>();
+    std::shared_ptr<const TamAgentKeyFiles> keys = std::atomic_load(&g_agent_key_files);
+    return (keys) ? keys : empty;
 }
 
 filesystem::path g_data_directory;
@@ -125,6 +310,7 @@ _InitializeKey(teep_signature_kind_t signatureKind)
     if (result != TEEP_ERR_SUCCESS) {
         return result;
     }
+    teep_precompute_signing_key(&key_pair);
     g_tam_signing_key_pairs[signatureKind] = key_pair;
     return TEEP_ERR_SUCCESS;
 }
@@ -133,6 +319,15 @@ teep_error_code_t TamInitializeKeys(_In_z_ const char* dataDirectory)
 {
     g_data_directory = dataDirectory;
 
+    // Anything signed with the old keys is now stale.
+    g_tam_signing_key_generation++;
+    TamInvalidateQueryRequestCache();
+    TamInvalidateUpdateCache();
+
+    // The TAM signs far more than it verifies, so have its ES256 nonces
+    // computed ahead of time.
+    teep_set_es256_precomputation(1);
+
     teep_error_code_t result = _InitializeKey(TEEP_SIGNATURE_ES256);
     if (result != TEEP_ERR_SUCCESS) {
         return result;
@@ -1,12 +1,62 @@
 // Copyright (c) TEEP contributors
 // SPDX-License-Identifier: MIT
 #pragma once
+#include <chrono>
 #include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
+class AgentKey;
+
+// TEEP Agent keys loaded from individual key files.  The set is replaced
+// as a whole whenever a key file changes, so a message being verified
+// keeps the keys it started with.
+struct TamAgentKeyFiles
+{
+    // The keys by filename.  These own the keys in Index.
+    std::map<std::string, std::shared_ptr<const AgentKey>> Files;
+
+    // The same keys by COSE key ID.
+    teep_key_index_t Index;
+};
+
+// Load every key file in a directory.  A file that cannot be loaded is
+// logged and skipped, and the error is returned once the rest are in use.
 teep_error_code_t TamConfigureAgentKeys(_In_z_ const char* directory_name);
 
-std::map<teep_signature_kind_t, struct t_cose_key> TamGetTeepAgentKeys();
+// Reload only the named files in a key directory, whether they were added,
+// changed, or removed.  The agent key pack is reopened if it is one of them.
+// As with TamConfigureAgentKeys, a file that cannot be loaded is skipped,
+// leaving no key for it, and is added to failed_filenames if not null.
+teep_error_code_t TamReloadAgentKeyFiles(
+    _In_z_ const char* directory_name,
+    _In_ const std::vector<std::string>& filenames,
+    _Out_opt_ std::vector<std::string>* failed_filenames = nullptr);
+
+std::shared_ptr<const TamAgentKeyFiles> TamGetTeepAgentKeyFiles(void);
 
 teep_error_code_t TamGetSigningKeyPairs(_Out_ std::map<teep_signature_kind_t, struct t_cose_key>& key_pairs);
 
+// Returns a counter that changes whenever the TAM signing keys are reloaded.
+uint64_t TamGetSigningKeyGeneration(void);
+
+// An ECDH key whose public share the TAM offers in QueryRequests in
+// session mode.  One key serves all sessions, so that QueryRequests stay
+// cacheable, and it is replaced once it is older than the session key
+// lifetime.
+struct TamAgreementKey
+{
+    TamAgreementKey();
+    ~TamAgreementKey();
+
+    struct t_cose_key Key;
+    std::vector<uint8_t> PublicShare;
+    uint64_t Generation;
+    std::chrono::steady_clock::time_point Expiry;
+};
+
+// Get the current agreement key, or nullptr if session mode is off.
+std::shared_ptr<const TamAgreementKey> TamGetAgreementKey(void);
+
 void TamKeyPublicKey(teep_signature_kind_t kind, _Out_writes_opt_z_(256) char* publicKeyFilename);
\ No newline at end of file
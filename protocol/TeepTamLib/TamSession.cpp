@@ -0,0 +1,166 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <mutex>
+#include <unordered_map>
+#include "TamSession.h"
+#include "TeepTamLib.h"
+
+#define TAM_SESSION_SHARD_COUNT 64 // Must be a power of 2.
+
+TamSession::TamSession()
+{
+    MessagesReceived = 0;
+    LastMessageType = TEEP_MESSAGE_QUERY_REQUEST;
+    AgentKeyKind = TEEP_SIGNATURE_NONE;
+    SignatureKind = TEEP_SIGNATURE_BOTH;
+    MacExchange = false;
+    DeviceIdentified = false;
+}
+
+TamDevice::TamDevice()
+{
+    AgentKeyKind = TEEP_SIGNATURE_NONE;
+    SignatureKind = TEEP_SIGNATURE_BOTH;
+}
+
+const TeepSessionKey* TamGetSendingSessionKey(_In_ const TamSession& session)
+{
+    if (!session.MacExchange || !session.SessionKey || !session.SessionKey->CanSend()) {
+        return nullptr;
+    }
+    return session.SessionKey.get();
+}
+
+teep_signature_kind_t TamGetUpdateSignatureKind(_In_ const TamSession& session)
+{
+    if (session.SignatureKind != TEEP_SIGNATURE_BOTH) {
+        return session.SignatureKind;
+    }
+    return (session.AgentKeyKind != TEEP_SIGNATURE_NONE) ? session.AgentKeyKind : TEEP_SIGNATURE_ES256;
+}
+
+struct TamSessionShard
+{
+    std::mutex Lock;
+    std::unordered_map<void*, std::shared_ptr<TamSession>> Sessions;
+};
+
+static TamSessionShard g_SessionShards[TAM_SESSION_SHARD_COUNT];
+
+static TamSessionShard& GetSessionShard(_In_opt_ void* sessionHandle)
+{
+    // Session handles are heap or static addresses, so the low bits carry
+    // little entropy; mix them before selecting a shard.
+    uint64_t value = (uint64_t)(uintptr_t)sessionHandle;
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    return g_SessionShards[value & (TAM_SESSION_SHARD_COUNT - 1)];
+}
+
+std::shared_ptr<TamSession> TamGetSession(_In_opt_ void* sessionHandle)
+{
+    TamSessionShard& shard = GetSessionShard(sessionHandle);
+    std::lock_guard<std::mutex> lock(shard.Lock);
+    std::shared_ptr<TamSession>& session = shard.Sessions[sessionHandle];
+    if (!session) {
+        session = std::make_shared<TamSession>();
+    }
+    return session;
+}
+
+void TamResetSession(_In_opt_ void* sessionHandle)
+{
+    TamSessionShard& shard = GetSessionShard(sessionHandle);
+    std::lock_guard<std::mutex> lock(shard.Lock);
+    shard.Sessions.erase(sessionHandle);
+}
+
+void TamCloseSession(_In_ void* sessionHandle)
+{
+    TamResetSession(sessionHandle);
+}
+
+struct TamDeviceShard
+{
+    std::mutex Lock;
+    std::unordered_map<std::string, TamDevice> Devices;
+};
+
+static TamDeviceShard g_DeviceShards[TAM_SESSION_SHARD_COUNT];
+
+// Agent key ID of the device each session key was agreed with, by session
+// key ID.  Only updated while holding the lock of that device's shard.
+static std::mutex g_SessionKeyDevicesLock;
+static std::unordered_map<std::string, std::string> g_SessionKeyDevices;
+
+static std::string GetSessionKeyId(_In_ const TeepSessionKey& sessionKey)
+{
+    UsefulBufC keyId = sessionKey.GetKeyId();
+    return std::string((const char*)keyId.ptr, keyId.len);
+}
+
+static TamDeviceShard& GetDeviceShard(_In_ const std::string& agentKeyId)
+{
+    // Key IDs are hashes of the public key, so any bits will do.
+    return g_DeviceShards[std::hash<std::string>()(agentKeyId) & (TAM_SESSION_SHARD_COUNT - 1)];
+}
+
+bool TamGetDevice(_In_ const std::string& agentKeyId, _Out_ TamDevice& device)
+{
+    TamDeviceShard& shard = GetDeviceShard(agentKeyId);
+    std::lock_guard<std::mutex> lock(shard.Lock);
+    auto it = shard.Devices.find(agentKeyId);
+    if (it == shard.Devices.end()) {
+        device = TamDevice();
+        return false;
+    }
+    device = it->second;
+    return true;
+}
+
+bool TamFindDeviceBySessionKeyId(UsefulBufC sessionKeyId, _Out_ std::string& agentKeyId, _Out_ TamDevice& device)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_SessionKeyDevicesLock);
+        auto it = g_SessionKeyDevices.find(std::string((const char*)sessionKeyId.ptr, sessionKeyId.len));
+        if (it == g_SessionKeyDevices.end()) {
+            agentKeyId.clear();
+            device = TamDevice();
+            return false;
+        }
+        agentKeyId = it->second;
+    }
+
+    // The device may have agreed on a new key since.
+    return TamGetDevice(agentKeyId, device) &&
+        device.SessionKey &&
+        UsefulBuf_Compare(device.SessionKey->GetKeyId(), sessionKeyId) == 0;
+}
+
+void TamSetDevice(_In_ const std::string& agentKeyId, _In_ const TamDevice& device)
+{
+    TamDeviceShard& shard = GetDeviceShard(agentKeyId);
+    std::lock_guard<std::mutex> lock(shard.Lock);
+    TamDevice& entry = shard.Devices[agentKeyId];
+    if (entry.SessionKey != device.SessionKey) {
+        std::lock_guard<std::mutex> sessionKeyLock(g_SessionKeyDevicesLock);
+        if (entry.SessionKey) {
+            g_SessionKeyDevices.erase(GetSessionKeyId(*entry.SessionKey));
+        }
+        if (device.SessionKey) {
+            g_SessionKeyDevices[GetSessionKeyId(*device.SessionKey)] = agentKeyId;
+        }
+    }
+    entry = device;
+}
+
+void TamClearDevices()
+{
+    for (TamDeviceShard& shard : g_DeviceShards) {
+        std::lock_guard<std::mutex> lock(shard.Lock);
+        shard.Devices.clear();
+    }
+    std::lock_guard<std::mutex> lock(g_SessionKeyDevicesLock);
+    g_SessionKeyDevices.clear();
+}
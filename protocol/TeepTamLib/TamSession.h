@@ -0,0 +1,105 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "SessionKey.h"
+
+class ManifestRepository;
+struct TamAgreementKey;
+
+// Per-session TAM state.  A transport never delivers two messages for the
+// same session at once, so fields are only touched by the thread that is
+// currently handling that session and need no lock of their own.
+class TamSession
+{
+public:
+    TamSession();
+
+    uint64_t MessagesReceived;
+    teep_message_type_t LastMessageType;
+
+    // COSE key ID and kind of the agent key that signed the last message.
+    // Empty until a message in this exchange identifies the device.
+    std::string AgentKeyId;
+    teep_signature_kind_t AgentKeyKind;
+
+    // Cipher suite negotiated with the identified device, or
+    // TEEP_SIGNATURE_BOTH if the device is not yet known or none has been
+    // negotiated with it.
+    teep_signature_kind_t SignatureKind;
+
+    // Challenge sent in the QueryRequest, if any.
+    std::vector<uint8_t> Challenge;
+
+    // In session mode, the agreement key offered in the QueryRequest, and
+    // the session key of the identified device.
+    std::shared_ptr<const TamAgreementKey> AgreementKey;
+    std::shared_ptr<const TeepSessionKey> SessionKey;
+
+    // Whether the device answered the QueryRequest with a QueryResponse
+    // MACed with its session key, proving it holds the key, so that the
+    // rest of the exchange is protected the same way.
+    bool MacExchange;
+
+    // Whether a QueryResponse in this exchange has identified the device,
+    // by its signature or by a MAC with a session key agreed with it.
+    // Until one has, no other MACed message is accepted.
+    bool DeviceIdentified;
+
+    // Manifest repository snapshot that was current when the exchange
+    // started, so the exchange finishes on the policy it started with.
+    std::shared_ptr<const ManifestRepository> Repository;
+};
+
+// Get the state for a session, creating it if it does not yet exist.
+// Sessions live in a table sharded by session handle so that workers
+// handling different sessions do not contend on a global lock.
+std::shared_ptr<TamSession> TamGetSession(_In_opt_ void* sessionHandle);
+
+// Discard any state for a session, so the next lookup starts fresh.
+void TamResetSession(_In_opt_ void* sessionHandle);
+
+// TAM state kept per device across sessions.  A transport session is not a
+// device: one may carry exchanges with several devices in turn, and a device
+// may reconnect on a new one.  So this state is keyed by the COSE key ID of
+// the agent key, and is only looked up once a message has been verified.
+struct TamDevice
+{
+    TamDevice();
+
+    teep_signature_kind_t AgentKeyKind;
+
+    // Cipher suite last negotiated with the device, or TEEP_SIGNATURE_BOTH
+    // if none has been.
+    teep_signature_kind_t SignatureKind;
+
+    // In session mode, the session key last agreed with the device.  Its
+    // key ID also identifies the device, to verify a QueryResponse MACed
+    // with it.
+    std::shared_ptr<const TeepSessionKey> SessionKey;
+};
+
+// Get a copy of the state for a device.  Returns false if nothing is known
+// about it yet.
+bool TamGetDevice(_In_ const std::string& agentKeyId, _Out_ TamDevice& device);
+
+// Find the device that a session key was agreed with, by the key ID in a
+// COSE_Mac0 message.  Returns false if no device has that session key.
+bool TamFindDeviceBySessionKeyId(UsefulBufC sessionKeyId, _Out_ std::string& agentKeyId, _Out_ TamDevice& device);
+
+// Replace the state for a device.
+void TamSetDevice(_In_ const std::string& agentKeyId, _In_ const TamDevice& device);
+
+// Forget all devices.
+void TamClearDevices();
+
+// Get the single signature kind to use for an Update in a session: the
+// negotiated one, else the kind of the agent's key, else ES256.
+teep_signature_kind_t TamGetUpdateSignatureKind(_In_ const TamSession& session);
+
+// Get the session key to protect an outbound message with, or nullptr if
+// the message is to be signed.
+const TeepSessionKey* TamGetSendingSessionKey(_In_ const TamSession& session);
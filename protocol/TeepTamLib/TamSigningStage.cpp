@@ -0,0 +1,287 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "TamSigningStage.h"
+#include "TeepTamLib.h"
+#include "UpdateCache.h"
+
+// A request being processed by TamProcessTeepMessageAsync.  The request
+// itself and each signing job it queues hold a reference, and whichever
+// releases the last one completes the request.
+class TamPendingRequest
+{
+public:
+    TamPendingRequest(_In_ TamRequestCompletionCallback callback, _In_opt_ void* context)
+        : _callback(callback), _context(context), _references(1), _result(TEEP_ERR_SUCCESS) {}
+
+    void AddReference(void) { _references++; }
+
+    // Release a reference, keeping the first error seen.
+    void Release(teep_error_code_t result)
+    {
+        if (result != TEEP_ERR_SUCCESS) {
+            teep_error_code_t expected = TEEP_ERR_SUCCESS;
+            _result.compare_exchange_strong(expected, result);
+        }
+        if (--_references > 0) {
+            return;
+        }
+        TamRequestCompletionCallback callback = _callback;
+        void* context = _context;
+        teep_error_code_t finalResult = _result;
+        delete this;
+        callback(context, finalResult);
+    }
+
+private:
+    TamRequestCompletionCallback _callback;
+    void* _context;
+    std::atomic<int> _references;
+    std::atomic<teep_error_code_t> _result;
+};
+
+struct TamSigningJob
+{
+    void* SessionHandle;
+    std::string MediaType;
+    TeepOutboundMessage UnsignedMessage;
+    teep_signature_kind_t SignatureKind;
+    TamSignedMessageCallback OnSigned;
+    TamPendingRequest* Request;
+};
+
+// A session's jobs, which are signed and queued one at a time, in order.
+typedef std::deque<std::unique_ptr<TamSigningJob>> TamSessionJobs;
+
+static std::mutex g_SigningLock;
+static std::condition_variable g_SigningJobAvailable;
+static std::unordered_map<void*, TamSessionJobs> g_SessionJobs; // Sessions with jobs waiting or being signed.
+static std::deque<void*> g_ReadySessions;                        // Sessions whose next job can be taken.
+static size_t g_SigningQueueDepth = 0;                           // Jobs waiting in g_SessionJobs.
+static std::vector<std::thread> g_SigningThreads;
+static size_t g_SigningQueueCapacity = TAM_DEFAULT_SIGNING_QUEUE_CAPACITY;
+static size_t g_MaxSigningQueueDepth = 0;
+static bool g_SigningStageRunning = false;
+static bool g_SigningStageStopping = false;
+static std::atomic<uint64_t> g_JobsQueued{ 0 };
+static std::atomic<uint64_t> g_JobsSignedInline{ 0 };
+
+// The request being processed by TamProcessTeepMessageAsync on this
+// thread, if any.
+static thread_local TamPendingRequest* t_CurrentRequest = nullptr;
+
+static teep_error_code_t SignAndQueue(
+    _In_ void* sessionHandle,
+    _In_z_ const char* mediaType,
+    _Inout_ TeepOutboundMessage&& unsignedMessage,
+    teep_signature_kind_t signatureKind,
+    _In_ const TamSignedMessageCallback& onSigned)
+{
+    TeepOutboundMessage signedMessage;
+    if (signatureKind == TEEP_SIGNATURE_NONE) {
+        signedMessage = std::move(unsignedMessage);
+    } else {
+        teep_error_code_t result = TamSignOutboundMessage(std::move(unsignedMessage), signatureKind, signedMessage);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+    }
+    if (onSigned) {
+        auto shared = std::make_shared<const TeepOutboundMessage>(std::move(signedMessage));
+        onSigned(shared);
+        signedMessage.AppendShared(shared);
+    }
+    return TamQueueOutboundTeepMessage(sessionHandle, mediaType, std::move(signedMessage));
+}
+
+static void TamSigningThread(void)
+{
+    for (;;) {
+        std::unique_ptr<TamSigningJob> job;
+        {
+            std::unique_lock<std::mutex> lock(g_SigningLock);
+            g_SigningJobAvailable.wait(lock, [] { return g_SigningStageStopping || !g_ReadySessions.empty(); });
+            if (g_ReadySessions.empty()) {
+                return;
+            }
+            TamSessionJobs& jobs = g_SessionJobs[g_ReadySessions.front()];
+            g_ReadySessions.pop_front();
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            g_SigningQueueDepth--;
+        }
+
+        teep_error_code_t result = SignAndQueue(job->SessionHandle, job->MediaType.c_str(), std::move(job->UnsignedMessage), job->SignatureKind, job->OnSigned);
+        TamPendingRequest* request = job->Request;
+        void* sessionHandle = job->SessionHandle;
+        job.reset();
+
+        // Only now can the session's next job be taken, so that no other
+        // thread queues it first.
+        {
+            std::lock_guard<std::mutex> lock(g_SigningLock);
+            auto it = g_SessionJobs.find(sessionHandle);
+            if (it->second.empty()) {
+                g_SessionJobs.erase(it);
+            } else {
+                g_ReadySessions.push_back(sessionHandle);
+                g_SigningJobAvailable.notify_one();
+            }
+        }
+        if (request != nullptr) {
+            request->Release(result);
+        }
+    }
+}
+
+int TamStartSigningStage(int workerCount, size_t queueCapacity)
+{
+    std::lock_guard<std::mutex> lock(g_SigningLock);
+    if (g_SigningStageRunning) {
+        return EALREADY;
+    }
+    if (workerCount <= 0) {
+        workerCount = (int)std::thread::hardware_concurrency();
+        if (workerCount <= 0) {
+            workerCount = 1;
+        }
+    }
+
+    g_SigningQueueCapacity = (queueCapacity > 0) ? queueCapacity : TAM_DEFAULT_SIGNING_QUEUE_CAPACITY;
+    g_MaxSigningQueueDepth = 0;
+    g_SigningStageStopping = false;
+    for (int i = 0; i < workerCount; i++) {
+        g_SigningThreads.emplace_back(TamSigningThread);
+    }
+    g_SigningStageRunning = true;
+    return 0;
+}
+
+void TamStopSigningStage(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_SigningLock);
+        if (!g_SigningStageRunning) {
+            return;
+        }
+        g_SigningStageRunning = false;
+        g_SigningStageStopping = true;
+    }
+    g_SigningJobAvailable.notify_all();
+
+    for (std::thread& thread : g_SigningThreads) {
+        thread.join();
+    }
+    g_SigningThreads.clear();
+}
+
+int TamIsSigningStageSaturated(void)
+{
+    std::lock_guard<std::mutex> lock(g_SigningLock);
+    return (g_SigningStageRunning && g_SigningQueueDepth >= g_SigningQueueCapacity) ? 1 : 0;
+}
+
+void TamGetSigningStageStatistics(_Out_ TamSigningStageStatistics* statistics)
+{
+    std::lock_guard<std::mutex> lock(g_SigningLock);
+    statistics->QueueDepth = g_SigningQueueDepth;
+    statistics->MaxQueueDepth = g_MaxSigningQueueDepth;
+    statistics->QueueCapacity = g_SigningQueueCapacity;
+    statistics->JobsQueued = g_JobsQueued;
+    statistics->JobsSignedInline = g_JobsSignedInline;
+}
+
+teep_error_code_t TamSignAndQueueOutboundMessage(
+    _In_ void* sessionHandle,
+    _In_z_ const char* mediaType,
+    _Inout_ TeepOutboundMessage&& unsignedMessage,
+    teep_signature_kind_t signatureKind,
+    _In_ const TamSignedMessageCallback& onSigned)
+{
+    TamPendingRequest* request = t_CurrentRequest;
+    {
+        std::lock_guard<std::mutex> lock(g_SigningLock);
+
+        // Once any of a session's messages are on the stage, the rest must
+        // follow them there, even past the queue capacity, or they would
+        // be sent first.  A request only sends a few messages, so this
+        // cannot grow the queue by much.  The stage takes the session's
+        // jobs until there are none left, even while stopping.
+        auto jobs = g_SessionJobs.find(sessionHandle);
+        bool mustQueue = (jobs != g_SessionJobs.end());
+        bool canQueue = (request != nullptr && signatureKind != TEEP_SIGNATURE_NONE &&
+                         g_SigningStageRunning && g_SigningQueueDepth < g_SigningQueueCapacity);
+        if (mustQueue || canQueue) {
+            if (request != nullptr) {
+                request->AddReference();
+            }
+            if (jobs == g_SessionJobs.end()) {
+                jobs = g_SessionJobs.emplace(sessionHandle, TamSessionJobs()).first;
+                g_ReadySessions.push_back(sessionHandle);
+            }
+            jobs->second.emplace_back(new TamSigningJob{ sessionHandle, mediaType, std::move(unsignedMessage), signatureKind, onSigned, request });
+            g_SigningQueueDepth++;
+            if (g_SigningQueueDepth > g_MaxSigningQueueDepth) {
+                g_MaxSigningQueueDepth = g_SigningQueueDepth;
+            }
+            g_JobsQueued++;
+            g_SigningJobAvailable.notify_one();
+            return TEEP_ERR_SUCCESS;
+        }
+    }
+
+    // Either the caller cannot complete later or the stage is full, so
+    // sign here, which also slows down whoever is producing the work.
+    if (signatureKind != TEEP_SIGNATURE_NONE) {
+        g_JobsSignedInline++;
+    }
+    return SignAndQueue(sessionHandle, mediaType, std::move(unsignedMessage), signatureKind, onSigned);
+}
+
+void TamProcessRequestAsync(
+    _In_ const TamRequestFunction& work,
+    _In_ TamRequestCompletionCallback callback,
+    _In_opt_ void* context)
+{
+    TamContinueRequest(new TamPendingRequest(callback, context), work);
+}
+
+TamPendingRequest* TamHoldCurrentRequest(void)
+{
+    TamPendingRequest* request = t_CurrentRequest;
+    if (request != nullptr) {
+        request->AddReference();
+    }
+    return request;
+}
+
+void TamContinueRequest(_In_ TamPendingRequest* request, _In_ const TamRequestFunction& work)
+{
+    TamPendingRequest* previousRequest = t_CurrentRequest;
+    t_CurrentRequest = request;
+    teep_error_code_t result = work();
+    t_CurrentRequest = previousRequest;
+    request->Release(result);
+}
+
+void TamProcessTeepMessageAsync(
+    _In_ void* sessionHandle,
+    _In_z_ const char* mediaType,
+    _In_reads_(messageLength) const char* message,
+    size_t messageLength,
+    _In_ TamRequestCompletionCallback callback,
+    _In_opt_ void* context)
+{
+    TamProcessRequestAsync(
+        [=]() { return TamProcessTeepMessage(sessionHandle, mediaType, message, messageLength); },
+        callback,
+        context);
+}
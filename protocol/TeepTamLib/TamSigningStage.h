@@ -0,0 +1,104 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+// The signing stage signs outbound messages on its own pool of crypto
+// threads, so a thread that has parsed a request can take the next one
+// instead of waiting on ECDSA or EdDSA.  Signing jobs wait in a bounded
+// queue.  When the queue is full, the caller signs inline instead, and
+// TamIsSigningStageSaturated tells the transport to hold new requests
+// back until the queue drains.
+
+#define TAM_DEFAULT_SIGNING_QUEUE_CAPACITY 256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Called once a request passed to TamProcessTeepMessageAsync is
+    // complete, with all of its outbound messages queued.
+    typedef void (*TamRequestCompletionCallback)(_In_opt_ void* context, teep_error_code_t result);
+
+    // Start the signing stage.  A workerCount of 0 means one worker per core.
+    int TamStartSigningStage(int workerCount, size_t queueCapacity);
+
+    // Stop the signing stage, after signing any jobs already queued.
+    void TamStopSigningStage(void);
+
+    // Returns non-zero if the signing queue is full.
+    int TamIsSigningStageSaturated(void);
+
+    typedef struct {
+        size_t QueueDepth;         // Jobs waiting for a signing worker.
+        size_t MaxQueueDepth;      // High-water mark of QueueDepth.
+        size_t QueueCapacity;
+        uint64_t JobsQueued;       // Jobs handed to a signing worker.
+        uint64_t JobsSignedInline; // Jobs signed by the caller instead.
+    } TamSigningStageStatistics;
+
+    void TamGetSigningStageStatistics(_Out_ TamSigningStageStatistics* statistics);
+
+    // Process a TEEP message like TamProcessTeepMessage, but let any
+    // signing finish on the signing stage, and any batched signature
+    // verification on the verification stage.  The callback is called
+    // exactly once, either before this returns or later on a signing or
+    // verification thread.
+    void TamProcessTeepMessageAsync(
+        _In_ void* sessionHandle,
+        _In_z_ const char* mediaType,
+        _In_reads_(messageLength) const char* message,
+        size_t messageLength,
+        _In_ TamRequestCompletionCallback callback,
+        _In_opt_ void* context);
+
+#ifdef __cplusplus
+};
+
+#include <functional>
+#include <memory>
+#include "OutboundMessage.h"
+
+typedef std::function<void(const std::shared_ptr<const TeepOutboundMessage>& signedMessage)> TamSignedMessageCallback;
+
+typedef std::function<teep_error_code_t(void)> TamRequestFunction;
+
+// Run work as a request, the way TamProcessTeepMessageAsync runs the
+// processing of a TEEP message.
+void TamProcessRequestAsync(
+    _In_ const TamRequestFunction& work,
+    _In_ TamRequestCompletionCallback callback,
+    _In_opt_ void* context);
+
+class TamPendingRequest;
+
+// Take a reference to the request being processed on this thread, so that
+// it does not complete until the reference is passed to
+// TamContinueRequest.  Returns nullptr outside of a request.
+TamPendingRequest* TamHoldCurrentRequest(void);
+
+// Run more work as part of a held request, such as on another stage's
+// thread, so that messages it queues go to the signing stage, and then
+// drop the reference with the result of the work.
+void TamContinueRequest(_In_ TamPendingRequest* request, _In_ const TamRequestFunction& work);
+
+// Sign a message and queue it on a session.  Within a request started by
+// TamProcessTeepMessageAsync, this returns as soon as the job is queued if
+// the signing queue has room; otherwise it signs inline.
+//
+// A session's messages are queued in the order given.  Once one of them
+// is on the signing stage, later ones wait behind it there rather than
+// being signed inline.  So every message the TAM sends goes through here,
+// with TEEP_SIGNATURE_NONE for a message to be queued as it is, such as
+// one that is already MACed.
+//
+// onSigned, if set, is given the signed message before it is queued.
+teep_error_code_t TamSignAndQueueOutboundMessage(
+    _In_ void* sessionHandle,
+    _In_z_ const char* mediaType,
+    _Inout_ TeepOutboundMessage&& unsignedMessage,
+    teep_signature_kind_t signatureKind,
+    _In_ const TamSignedMessageCallback& onSigned = nullptr);
+#endif
@@ -0,0 +1,188 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "TamSigningStage.h"
+#include "TamVerificationStage.h"
+
+struct TamVerificationJob
+{
+    teep_signature_kind_t SignatureKind;
+    std::shared_ptr<const struct t_cose_key> Key;
+    UsefulBufC SignedCose;
+    TamVerifiedMessageCallback OnVerified;
+    TamPendingRequest* Request;
+    std::chrono::steady_clock::time_point Queued;
+};
+
+static std::mutex g_VerificationLock;
+static std::condition_variable g_VerificationJobAvailable; // For a worker to start collecting a batch.
+static std::condition_variable g_VerificationBatchFull;    // For the worker collecting a batch.
+static std::deque<std::unique_ptr<TamVerificationJob>> g_VerificationQueue;
+static std::vector<std::thread> g_VerificationThreads;
+static size_t g_VerificationBatchSize = TAM_DEFAULT_VERIFICATION_BATCH_SIZE;
+static std::chrono::microseconds g_VerificationWindow(TAM_DEFAULT_VERIFICATION_WINDOW_MICROSECONDS);
+static bool g_VerificationStageRunning = false;
+static bool g_VerificationStageStopping = false;
+static bool g_CollectingBatch = false; // Only one worker waits for the queue to fill at a time.
+static size_t g_MaxVerificationBatchSize = 0;
+static uint64_t g_VerificationBatches = 0;
+static uint64_t g_MessagesQueued = 0;
+static std::atomic<uint64_t> g_MessagesBatched{ 0 };
+static std::atomic<uint64_t> g_VerificationBatchesFailed{ 0 };
+static std::atomic<uint64_t> g_MessagesVerifiedInline{ 0 };
+
+static void TamVerificationThread(void)
+{
+    std::vector<std::unique_ptr<TamVerificationJob>> jobs;
+    std::vector<teep_verification_t> verifications;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(g_VerificationLock);
+            g_VerificationJobAvailable.wait(lock, [] {
+                return g_VerificationStageStopping || (!g_CollectingBatch && !g_VerificationQueue.empty());
+            });
+            if (g_VerificationQueue.empty()) {
+                return;
+            }
+
+            // Wait for a full batch, but no longer than the window since
+            // the oldest message arrived.
+            g_CollectingBatch = true;
+            g_VerificationBatchFull.wait_until(lock, g_VerificationQueue.front()->Queued + g_VerificationWindow, [] {
+                return g_VerificationStageStopping || g_VerificationQueue.size() >= g_VerificationBatchSize;
+            });
+            g_CollectingBatch = false;
+
+            size_t count = std::min(g_VerificationQueue.size(), g_VerificationBatchSize);
+            for (size_t i = 0; i < count; i++) {
+                jobs.push_back(std::move(g_VerificationQueue.front()));
+                g_VerificationQueue.pop_front();
+            }
+            g_VerificationBatches++;
+            g_MaxVerificationBatchSize = std::max(g_MaxVerificationBatchSize, count);
+            if (!g_VerificationQueue.empty()) {
+                g_VerificationJobAvailable.notify_one();
+            }
+        }
+
+        verifications.resize(jobs.size());
+        for (size_t i = 0; i < jobs.size(); i++) {
+            verifications[i].signature_kind = jobs[i]->SignatureKind;
+            verifications[i].key_pair = jobs[i]->Key.get();
+            verifications[i].signed_cose = jobs[i]->SignedCose;
+        }
+        size_t batched = teep_verify_cbor_messages(verifications.data(), verifications.size());
+        g_MessagesBatched += batched;
+        if (batched == 0 && jobs.size() > 1) {
+            g_VerificationBatchesFailed++;
+        }
+
+        // Finish handling each message as part of its request.
+        for (size_t i = 0; i < jobs.size(); i++) {
+            const TamVerificationJob& job = *jobs[i];
+            const teep_verification_t& verification = verifications[i];
+            TamContinueRequest(job.Request, [&] {
+                return job.OnVerified(verification.result, verification.encoded);
+            });
+        }
+        jobs.clear();
+    }
+}
+
+int TamStartVerificationStage(int workerCount, size_t batchSize, uint32_t windowMicroseconds)
+{
+    std::lock_guard<std::mutex> lock(g_VerificationLock);
+    if (g_VerificationStageRunning) {
+        return EALREADY;
+    }
+    if (workerCount <= 0) {
+        workerCount = (int)std::thread::hardware_concurrency();
+        if (workerCount <= 0) {
+            workerCount = 1;
+        }
+    }
+
+    g_VerificationBatchSize = (batchSize > 0) ? batchSize : TAM_DEFAULT_VERIFICATION_BATCH_SIZE;
+    g_VerificationWindow = std::chrono::microseconds(windowMicroseconds);
+    g_MaxVerificationBatchSize = 0;
+    g_VerificationStageStopping = false;
+    for (int i = 0; i < workerCount; i++) {
+        g_VerificationThreads.emplace_back(TamVerificationThread);
+    }
+    g_VerificationStageRunning = true;
+    return 0;
+}
+
+void TamStopVerificationStage(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_VerificationLock);
+        if (!g_VerificationStageRunning) {
+            return;
+        }
+        g_VerificationStageRunning = false;
+        g_VerificationStageStopping = true;
+    }
+    g_VerificationJobAvailable.notify_all();
+    g_VerificationBatchFull.notify_all();
+
+    for (std::thread& thread : g_VerificationThreads) {
+        thread.join();
+    }
+    g_VerificationThreads.clear();
+}
+
+void TamGetVerificationStageStatistics(_Out_ TamVerificationStageStatistics* statistics)
+{
+    std::lock_guard<std::mutex> lock(g_VerificationLock);
+    statistics->Batches = g_VerificationBatches;
+    statistics->MessagesQueued = g_MessagesQueued;
+    statistics->MessagesBatched = g_MessagesBatched;
+    statistics->BatchesFailed = g_VerificationBatchesFailed;
+    statistics->MessagesVerifiedInline = g_MessagesVerifiedInline;
+    statistics->MaxBatchSize = g_MaxVerificationBatchSize;
+}
+
+teep_error_code_t TamVerifyInboundMessage(
+    teep_signature_kind_t signatureKind,
+    _In_ const std::shared_ptr<const struct t_cose_key>& key,
+    UsefulBufC signedCose,
+    _In_ const TamVerifiedMessageCallback& onVerified)
+{
+    if (signatureKind == TEEP_SIGNATURE_EDDSA) {
+        std::lock_guard<std::mutex> lock(g_VerificationLock);
+        if (g_VerificationStageRunning &&
+            g_VerificationQueue.size() < g_VerificationBatchSize * TAM_VERIFICATION_QUEUE_BATCHES) {
+            TamPendingRequest* request = TamHoldCurrentRequest();
+            if (request != nullptr) {
+                std::unique_ptr<TamVerificationJob> job(new TamVerificationJob());
+                job->SignatureKind = signatureKind;
+                job->Key = key;
+                job->SignedCose = signedCose;
+                job->OnVerified = onVerified;
+                job->Request = request;
+                job->Queued = std::chrono::steady_clock::now();
+                g_VerificationQueue.push_back(std::move(job));
+                g_MessagesQueued++;
+                g_VerificationJobAvailable.notify_one();
+                if (g_VerificationQueue.size() >= g_VerificationBatchSize) {
+                    g_VerificationBatchFull.notify_one();
+                }
+                return TEEP_ERR_SUCCESS;
+            }
+        }
+        g_MessagesVerifiedInline++;
+    }
+
+    UsefulBufC encoded = NULLUsefulBufC;
+    teep_error_code_t result = teep_verify_cbor_message(signatureKind, key.get(), &signedCose, &encoded);
+    return onVerified(result, encoded);
+}
@@ -0,0 +1,72 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+// The verification stage checks the signatures of inbound EdDSA-signed
+// messages on its own pool of crypto threads, in batches, which cost much
+// less per signature than verifying each message alone.  A thread that
+// has parsed a request hands its message over and takes the next request.
+// A verification thread waits until it has a full batch or until the
+// window since the first message in it has passed, so a burst of messages
+// from many agents is verified together while a lone message is delayed
+// by at most the window.  If a batch fails, its messages are verified
+// alone so that only the bad ones are rejected.
+//
+// Messages signed otherwise, messages outside a request started by
+// TamProcessTeepMessageAsync, and messages that would overfill the queue
+// are verified inline.
+
+#define TAM_DEFAULT_VERIFICATION_BATCH_SIZE 64
+#define TAM_DEFAULT_VERIFICATION_WINDOW_MICROSECONDS 1000
+
+// How many batches can wait for a verification worker.
+#define TAM_VERIFICATION_QUEUE_BATCHES 4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Start the verification stage.  A workerCount of 0 means one worker
+    // per core.
+    int TamStartVerificationStage(int workerCount, size_t batchSize, uint32_t windowMicroseconds);
+
+    // Stop the verification stage, after verifying any messages already
+    // queued.
+    void TamStopVerificationStage(void);
+
+    typedef struct {
+        uint64_t Batches;                // Batches taken by a verification worker.
+        uint64_t MessagesQueued;         // Messages handed to a verification worker.
+        uint64_t MessagesBatched;        // Messages that passed as part of a batch.
+        uint64_t BatchesFailed;          // Batches whose messages were then verified alone.
+        uint64_t MessagesVerifiedInline; // EdDSA messages verified by the caller instead.
+        size_t MaxBatchSize;             // High-water mark of the batch size.
+    } TamVerificationStageStatistics;
+
+    void TamGetVerificationStageStatistics(_Out_ TamVerificationStageStatistics* statistics);
+
+#ifdef __cplusplus
+};
+
+#include <functional>
+#include <memory>
+
+// Called with the result of verifying a message and, on success, its
+// payload.
+typedef std::function<teep_error_code_t(teep_error_code_t result, UsefulBufC encoded)> TamVerifiedMessageCallback;
+
+// Verify a signed message and pass the result to onVerified.  Within a
+// request started by TamProcessTeepMessageAsync, an EdDSA-signed message
+// is queued for the verification stage if it is running and has room, and
+// onVerified runs later on a verification thread as part of the request;
+// otherwise this verifies the message inline and returns what onVerified
+// returns.  The message must stay valid until the request completes.
+teep_error_code_t TamVerifyInboundMessage(
+    teep_signature_kind_t signatureKind,
+    _In_ const std::shared_ptr<const struct t_cose_key>& key,
+    UsefulBufC signedCose,
+    _In_ const TamVerifiedMessageCallback& onVerified);
+#endif
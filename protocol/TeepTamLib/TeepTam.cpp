@@ -8,6 +8,7 @@
 #include "TeepTamLib.h"
 #include "TamKeys.h"
 #include "Manifest.h"
+#include "ManifestRepository.h"
 
 #define TRUE 1
 #define FALSE 0
@@ -19,22 +20,47 @@ void StopTamTABroker(void);
 
 teep_error_code_t TamLoadConfiguration(_In_z_ const char* dataDirectory)
 {
-    Manifest::ClearManifests();
-    std::string requiredManifestPath = std::string(dataDirectory) + "/manifests/required";
-    teep_error_code_t result = TamConfigureManifests(
-        requiredManifestPath.c_str(),
-        true);
-    if (result != TEEP_ERR_SUCCESS) {
-        return result;
+    // The manifest pack is authoritative, so map it without listing or
+    // reading any manifest file.  It is only compiled here if there is
+    // none yet or it cannot be loaded.
+    std::string packFilename;
+    if (TamFindManifestPack(dataDirectory, packFilename)) {
+        if (Manifest::LoadPack(packFilename.c_str()) == TEEP_ERR_SUCCESS) {
+            return TEEP_ERR_SUCCESS;
+        }
+        TeepLogMessage("Could not load %s, compiling a new manifest pack\n", packFilename.c_str());
+    }
+    if (TamCompileManifestPack(dataDirectory, packFilename) == TEEP_ERR_SUCCESS) {
+        if (Manifest::LoadPack(packFilename.c_str()) == TEEP_ERR_SUCCESS) {
+            return TEEP_ERR_SUCCESS;
+        }
+        TeepLogMessage("Could not load %s, reading manifest files instead\n", packFilename.c_str());
+    } else {
+        TeepLogMessage("Could not compile a manifest pack, reading manifest files instead\n");
     }
 
+    // Read both directories into one snapshot, so that a failure part way
+    // through leaves the repository unchanged.
+    std::string requiredManifestPath = std::string(dataDirectory) + "/manifests/required";
     std::string optionalManifestPath = std::string(dataDirectory) + "/manifests/optional";
-    result = TamConfigureManifests(
-        optionalManifestPath.c_str(),
-        false);
-    if (result != TEEP_ERR_SUCCESS) {
-        return result;
-    }
+    return ManifestRepository::Update([&](ManifestRepositoryBuilder& builder) {
+        builder.Clear();
+        teep_error_code_t result = TamConfigureManifests(
+            builder,
+            requiredManifestPath.c_str(),
+            true);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+        return TamConfigureManifests(
+            builder,
+            optionalManifestPath.c_str(),
+            false);
+    });
+}
 
-    return TEEP_ERR_SUCCESS;
+teep_error_code_t TamCompileManifests(_In_z_ const char* dataDirectory)
+{
+    std::string packFilename;
+    return TamCompileManifestPack(dataDirectory, packFilename);
 }
\ No newline at end of file
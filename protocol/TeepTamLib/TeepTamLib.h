@@ -8,6 +8,12 @@ extern "C" {
 #endif
 
     teep_error_code_t TamLoadConfiguration(_In_z_ const char* dataDirectory);
+
+    // Compile the manifest files under a data directory into a new
+    // manifest pack, which TamLoadConfiguration loads from then on.  Run
+    // this after changing the files while no configuration watcher is
+    // running.
+    teep_error_code_t TamCompileManifests(_In_z_ const char* dataDirectory);
     teep_error_code_t TamInitializeKeys(_In_z_ const char* dataDirectory);
     void TamGetPublicKey(teep_signature_kind_t kind, _Out_writes_opt_z_(256) char* publicKeyFilename);
 
@@ -18,6 +24,10 @@ extern "C" {
         size_t messageLength);
     teep_error_code_t TamProcessConnect(_In_ void* sessionHandle, _In_z_ const char* acceptMediaType);
 
+    // Called by the transport when a session ends, so per-session state
+    // can be released.
+    void TamCloseSession(_In_ void* sessionHandle);
+
     teep_error_code_t TamQueueOutboundTeepMessage(
         _In_ void* sessionHandle,
         _In_z_ const char* mediaType,
@@ -26,4 +36,13 @@ extern "C" {
 
 #ifdef __cplusplus
 };
+
+#include "OutboundMessage.h"
+
+// Queue a message held as segments.  Transports that can gather send the
+// segments as they are; others flatten them first.
+teep_error_code_t TamQueueOutboundTeepMessage(
+    _In_ void* sessionHandle,
+    _In_z_ const char* mediaType,
+    _Inout_ TeepOutboundMessage&& message);
 #endif
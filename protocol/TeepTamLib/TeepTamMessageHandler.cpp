@@ -7,24 +7,37 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include "AgentKeyStore.h"
 #include "common.h"
 #include "Manifest.h"
+#include "ManifestRepository.h"
 #include "openssl/x509.h"
 #include "openssl/evp.h"
 #include "qcbor/qcbor_decode.h"
 #include "qcbor/qcbor_encode.h"
+#include "QueryRequestCache.h"
 #include "RequestedComponentInfo.h"
 #include "t_cose/q_useful_buf.h"
 #include "t_cose/t_cose_common.h"
 #include "t_cose/t_cose_sign1_sign.h"
 #include "TamKeys.h"
+#include "TamSession.h"
+#include "TamSigningStage.h"
+#include "TamVerificationStage.h"
 #include "TeepTamEcallHandler.h"
 #include "TeepTamLib.h"
-
-/* Compose a raw QueryRequest message to be signed. */
-teep_error_code_t TamComposeQueryRequest(
+#include "UpdateCache.h"
+#include "UpdatePlan.h"
+
+/* Compose a raw QueryRequest message to be signed, with a zero-filled
+ * challenge of the given length if challengeLength is non-zero, and a
+ * session key share if one is given.
+ */
+teep_error_code_t TamComposeQueryRequestTemplate(
     std::optional<int> minVersion,
     std::optional<int> maxVersion,
+    size_t challengeLength,
+    UsefulBufC sessionKeyShare,
     _Out_ UsefulBufC* bufferToSend)
 {
     QCBOREncodeContext context;
@@ -49,6 +62,10 @@ teep_error_code_t TamComposeQueryRequest(
             QCBOREncode_CloseArray(&context);
 
             // Add challenge if needed.
+            if (challengeLength > 0) {
+                std::vector<uint8_t> challenge(challengeLength, 0);
+                QCBOREncode_AddBytesToMapN(&context, TEEP_LABEL_CHALLENGE, UsefulBufC{ challenge.data(), challenge.size() });
+            }
 
             // Add versions if needed.
             if (maxVersion) {
@@ -60,6 +77,11 @@ teep_error_code_t TamComposeQueryRequest(
                 }
                 QCBOREncode_CloseArray(&context);
             }
+
+            // Add session key share if in session mode.
+            if (sessionKeyShare.len > 0) {
+                QCBOREncode_AddBytesToMapN(&context, TEEP_LABEL_SESSION_KEY_SHARE, sessionKeyShare);
+            }
         }
         QCBOREncode_CloseMap(&context);
 
@@ -124,6 +146,15 @@ teep_error_code_t TamComposeQueryRequest(
     return (err == QCBOR_SUCCESS) ? TEEP_ERR_SUCCESS : TEEP_ERR_PERMANENT_ERROR;
 }
 
+/* Compose a raw QueryRequest message to be signed. */
+teep_error_code_t TamComposeQueryRequest(
+    std::optional<int> minVersion,
+    std::optional<int> maxVersion,
+    _Out_ UsefulBufC* bufferToSend)
+{
+    return TamComposeQueryRequestTemplate(minVersion, maxVersion, 0, NULLUsefulBufC, bufferToSend);
+}
+
 teep_error_code_t
 TamSignMessage(
     _In_ const UsefulBufC* unsignedMessage,
@@ -144,37 +175,82 @@ TamSignMessage(
     }
 }
 
+teep_error_code_t
+TamSignOutboundMessage(
+    _Inout_ TeepOutboundMessage&& unsignedMessage,
+    teep_signature_kind_t signatureKind,
+    _Out_ TeepOutboundMessage& signedMessage)
+{
+    signedMessage.Clear();
+
+    const char* label = "Sending CBOR message: ";
+    for (const UsefulBufC& segment : unsignedMessage.GetSegments()) {
+        HexPrintBuffer(label, segment.ptr, segment.len);
+        label = nullptr;
+    }
+
+    std::map<teep_signature_kind_t, struct t_cose_key> key_pairs;
+    teep_error_code_t err = TamGetSigningKeyPairs(key_pairs);
+    if (err != TEEP_ERR_SUCCESS) {
+        return err;
+    }
+
+    if (signatureKind != TEEP_SIGNATURE_BOTH) {
+        return teep_sign1_outbound_message(&key_pairs[signatureKind], signatureKind, std::move(unsignedMessage), signedMessage);
+    }
+
+    // A COSE_Sign message includes an EdDSA signature, which needs the
+    // payload in one piece.
+    std::vector<uint8_t> payload;
+    unsignedMessage.Flatten(payload);
+    unsignedMessage.Clear();
+    UsefulBufC payloadC = { payload.data(), payload.size() };
+    auto buffer = std::make_shared<std::vector<uint8_t>>(payload.size() + TEEP_MAX_COSE_OVERHEAD);
+    UsefulBuf signedMessageBuffer = { buffer->data(), buffer->size() };
+    UsefulBufC signedMessageC;
+    err = teep_sign_cbor_message(key_pairs, &payloadC, signedMessageBuffer, signatureKind, &signedMessageC);
+    if (err != TEEP_ERR_SUCCESS) {
+        return err;
+    }
+    buffer->resize(signedMessageC.len);
+    signedMessage.AppendReference({ buffer->data(), buffer->size() }, buffer);
+    return TEEP_ERR_SUCCESS;
+}
+
+// Protect a message with a session key and queue it.  A MAC is cheap
+// enough to compute here rather than on the signing stage.
+static teep_error_code_t
+TamMacAndQueueOutboundMessage(
+    _In_ void* sessionHandle,
+    _In_z_ const char* mediaType,
+    _Inout_ TeepOutboundMessage&& unsignedMessage,
+    _In_ const TeepSessionKey& sessionKey)
+{
+    TeepOutboundMessage macedMessage;
+    teep_error_code_t err = teep_mac0_outbound_message(sessionKey, std::move(unsignedMessage), macedMessage);
+    if (err != TEEP_ERR_SUCCESS) {
+        return err;
+    }
+    return TamSignAndQueueOutboundMessage(sessionHandle, mediaType, std::move(macedMessage), TEEP_SIGNATURE_NONE);
+}
+
 static teep_error_code_t
 TamSendMessage(
     _In_ void* sessionHandle,
     _In_z_ const char* mediaType,
-    _In_ const UsefulBufC* unsignedMessage,
+    _Inout_ TeepOutboundMessage&& unsignedMessage,
     teep_signature_kind_t signatureKind)
 {
-    UsefulBufC signedMessage;
-    const char* output_buffer;
-    size_t output_buffer_length;
-
-#ifdef TEEP_USE_COSE
-    if (signatureKind != TEEP_SIGNATURE_NONE) {
-        const size_t max_cose_message_size = 3000;
-        Q_USEFUL_BUF_MAKE_STACK_UB(signed_cose_buffer, max_cose_message_size);
-        teep_error_code_t error = TamSignMessage(unsignedMessage, signed_cose_buffer, signatureKind, &signedMessage);
-        if (error != TEEP_ERR_SUCCESS) {
-            return error;
-        }
-
-        output_buffer = (const char*)signedMessage.ptr;
-        output_buffer_length = signedMessage.len;
-    } else {
-#endif
-        output_buffer = (const char*)unsignedMessage->ptr;
-        output_buffer_length = unsignedMessage->len;
 #ifdef TEEP_USE_COSE
+    const TeepSessionKey* sessionKey = TamGetSendingSessionKey(*TamGetSession(sessionHandle));
+    if (sessionKey != nullptr) {
+        return TamMacAndQueueOutboundMessage(sessionHandle, mediaType, std::move(unsignedMessage), *sessionKey);
     }
+#else
+    signatureKind = TEEP_SIGNATURE_NONE;
 #endif
 
-    return TamQueueOutboundTeepMessage(sessionHandle, mediaType, output_buffer, output_buffer_length);
+    return TamSignAndQueueOutboundMessage(sessionHandle, mediaType, std::move(unsignedMessage), signatureKind);
 }
 
 /* Handle a new incoming connection from a device. */
@@ -184,24 +260,31 @@ static teep_error_code_t TamProcessTeepConnect(
 {
     TeepLogMessage("Received client connection\n");
 
-    teep_error_code_t teep_error = TEEP_ERR_SUCCESS;
-    Q_USEFUL_BUF_MAKE_STACK_UB(encoded, 4096);
-    UsefulBufC encodedC = UsefulBuf_Const(encoded);
-
-    teep_error = TamComposeQueryRequest({}, {}, &encodedC);
+    // A connect starts a new TEEP session.  The device has not identified
+    // itself yet, and the transport session may have carried exchanges
+    // with other devices, so nothing is carried over: the QueryRequest
+    // carries one signature of each kind, and is never MACed.  In session
+    // mode, a device that still holds a session key proves it by MACing
+    // its QueryResponse, and the rest of the exchange is then MACed too.
+    TamResetSession(sessionHandle);
+    std::shared_ptr<TamSession> session = TamGetSession(sessionHandle);
+
+    // The whole exchange uses the manifest repository as it is now, even
+    // if it is reloaded before the exchange finishes.
+    session->Repository = ManifestRepository::GetCurrent();
+
+    // The QueryRequest is usually identical for every connection, so it
+    // is normally served from a cache instead of being signed again.
+    std::shared_ptr<const std::vector<uint8_t>> signedMessage;
+    teep_error_code_t teep_error = TamGetQueryRequest({}, {}, session->SignatureKind, session.get(), signedMessage);
     if (teep_error != TEEP_ERR_SUCCESS) {
         return teep_error;
     }
 
-    if (encoded.len == 0) {
-        return TEEP_ERR_PERMANENT_ERROR;
-    }
-
-    HexPrintBuffer("Sending CBOR message: ", encodedC.ptr, encodedC.len);
-
     TeepLogMessage("Sending QueryRequest...\n");
-    teep_error = TamSendMessage(sessionHandle, mediaType, &encodedC, TEEP_SIGNATURE_BOTH);
-    return teep_error;
+    TeepOutboundMessage message;
+    message.AppendReference({ signedMessage->data(), signedMessage->size() }, signedMessage);
+    return TamSignAndQueueOutboundMessage(sessionHandle, mediaType, std::move(message), TEEP_SIGNATURE_NONE);
 }
 
 teep_error_code_t TamProcessConnect(_In_ void* sessionHandle, _In_z_ const char* acceptMediaType)
@@ -213,40 +296,20 @@ teep_error_code_t TamProcessConnect(_In_ void* sessionHandle, _In_z_ const char*
     }
 }
 
-static void AddComponentId(QCBOREncodeContext* context, const RequestedComponentInfo* tc)
-{
-    QCBOREncode_OpenArray(context);
-    {
-        // Currently we only support component IDs with one element.
-        // TODO: relax this.
-        QCBOREncode_AddBytes(context, tc->ComponentId);
-    }
-    QCBOREncode_CloseArray(context);
-}
-
-/* Compose a raw Update message to be signed. */
-static teep_error_code_t TamComposeUpdate(
-    _Out_ UsefulBufC* encoded,
-    _In_opt_ const RequestedComponentInfo* currentComponentList,
-    _In_opt_ const RequestedComponentInfo* requestedComponentList,
-    _In_opt_ const RequestedComponentInfo* unneededComponentList,
+/* Encode an Update message, leaving out the manifest bytes.  With a
+ * NULL buffer pointer this just computes the encoded size.
+ */
+static QCBORError TamEncodeUpdateFraming(
+    UsefulBuf buffer,
+    _In_opt_ const UpdatePlan* plan,
     _In_ teep_error_code_t errorCode,
     _In_ const std::string& errorMessage,
-    _Out_ int* count) // Returns non-zero if we actually have something to update.
+    _Out_ int* count,
+    _Out_ UsefulBufC* encoded)
 {
     *count = 0;
-    *encoded = NULLUsefulBufC;
-
-    size_t maxBufferLength = 4096;
-    char* rawBuffer = (char*)malloc(maxBufferLength);
-    if (rawBuffer == nullptr) {
-        return TEEP_ERR_TEMPORARY_ERROR; /* Error */
-    }
-    encoded->ptr = rawBuffer;
-    encoded->len = maxBufferLength;
 
     QCBOREncodeContext context;
-    UsefulBuf buffer = UsefulBuf_Unconst(*encoded);
     QCBOREncode_Init(&context, buffer);
 
     QCBOREncode_OpenArray(&context);
@@ -262,68 +325,18 @@ static teep_error_code_t TamComposeUpdate(
             UsefulBuf_MAKE_STACK_UB(token, 8);
             teep_error_code_t result = teep_random(token.ptr, token.len);
             if (result != TEEP_ERR_SUCCESS) {
-                return result;
+                return QCBOR_ERR_UNSUPPORTED;
             }
             QCBOREncode_AddBytesToMapN(&context, TEEP_LABEL_TOKEN, UsefulBuf_Const(token));
 #endif
 
             QCBOREncode_OpenArrayInMapN(&context, TEEP_LABEL_UNNEEDED_MANIFEST_LIST);
-            {
-                // List any installed components that are not in the required or optional list.
-                for (const RequestedComponentInfo* rci = currentComponentList; rci != nullptr; rci = rci->Next) {
-                    Manifest* manifest = Manifest::FindManifest(&rci->ComponentId);
-                    if (manifest != nullptr) {
-                        continue;
-                    }
-
-                    AddComponentId(&context, rci);
-                    (*count)++;
-                }
-
-                // List any additional optional components that are reported as unneeded.
-                for (const RequestedComponentInfo* rci = unneededComponentList; rci != nullptr; rci = rci->Next) {
-                    Manifest* manifest = Manifest::FindManifest(&rci->ComponentId);
-                    if ((manifest == nullptr) || manifest->IsRequired) {
-                        continue;
-                    }
-
-                    // The component is allowed but optional, so ok to delete on request.
-                    AddComponentId(&context, rci);
-                    (*count)++;
-                }
-
-            }
-            QCBOREncode_CloseArray(&context);
-
-            QCBOREncode_OpenArrayInMapN(&context, TEEP_LABEL_MANIFEST_LIST);
-            {
-                // Any SUIT manifest for any required components that aren't reported to be present.
-                for (Manifest* manifest = Manifest::First(); manifest != nullptr; manifest = manifest->Next) {
-                    bool found = false;
-                    if (!manifest->IsRequired) {
-                        continue;
-                    }
-                    for (const RequestedComponentInfo* cci = currentComponentList; cci != nullptr; cci = cci->Next) {
-                        if (manifest->HasComponentId(&cci->ComponentId)) {
-                            found = true;
-                            break;
-                        }
-                    }
-                    if (!found) {
-                        QCBOREncode_AddBytes(&context, manifest->ManifestContents);
-                        (*count)++;
-                    }
-                }
-
-                // Add SUIT manifest for any optional components that were requested.
-                for (const RequestedComponentInfo* rci = requestedComponentList; rci != nullptr; rci = rci->Next) {
-                    Manifest* manifest = Manifest::FindManifest(&rci->ComponentId);
-                    if ((manifest == nullptr) || manifest->IsRequired) {
-                        continue;
-                    }
-
-                    // The component is allowed and optional, so ok to install on request.
-                    QCBOREncode_AddBytes(&context, manifest->ManifestContents);
+            if (plan != nullptr) {
+                // List any installed components that are not in the required or optional
+                // list, plus any optional components that are reported as unneeded.
+                for (UsefulBufC componentId : plan->Uninstall) {
+                    // Component IDs are held already encoded.
+                    QCBOREncode_AddEncoded(&context, componentId);
                     (*count)++;
                 }
             }
@@ -338,67 +351,128 @@ static teep_error_code_t TamComposeUpdate(
             if (!errorMessage.empty()) {
                 QCBOREncode_AddTextToMapN(&context, TEEP_LABEL_ERR_MSG, UsefulBuf_FromSZ(errorMessage.c_str()));
             }
+
+            // The manifest list goes last, with only the head of each manifest
+            // encoded here, so the encoding ends with those heads and the
+            // manifests can be spliced in after them.
+            QCBOREncode_OpenArrayInMapN(&context, TEEP_LABEL_MANIFEST_LIST);
+            if (plan != nullptr) {
+                // Any SUIT manifest for any required components that aren't reported to be present,
+                // plus any optional components that were requested.
+                for (const Manifest* manifest : plan->Install) {
+                    QCBOREncode_AddBytesLenOnly(&context, manifest->ManifestContents);
+                    (*count)++;
+                }
+            }
+            QCBOREncode_CloseArray(&context);
         }
         QCBOREncode_CloseMap(&context);
     }
     QCBOREncode_CloseArray(&context);
 
-    QCBORError err = QCBOREncode_Finish(&context, encoded);
-    return (err == QCBOR_SUCCESS) ? TEEP_ERR_SUCCESS : TEEP_ERR_TEMPORARY_ERROR;
+    return QCBOREncode_Finish(&context, encoded);
 }
 
-static teep_error_code_t ParseComponentId(
-    _Inout_ QCBORDecodeContext* context,
-    _In_ const QCBORItem* item,
-    _Outptr_ RequestedComponentInfo** currentRci,
-    _Inout_ std::ostringstream& errorMessage)
+/* Compose a raw Update message to be signed.  Manifests are referenced
+ * in place from the repository rather than copied into the message, and
+ * the rest is encoded into a buffer of exactly the right size, so there
+ * is no limit on the size of an Update.
+ */
+teep_error_code_t TamComposeUpdate(
+    _Out_ TeepOutboundMessage& update,
+    _In_opt_ const UpdatePlan* plan,
+    _In_ teep_error_code_t errorCode,
+    _In_ const std::string& errorMessage,
+    _Out_ int* count) // Returns non-zero if we actually have something to update.
 {
-    if (item->uDataType != QCBOR_TYPE_ARRAY) {
-        REPORT_TYPE_ERROR(errorMessage, "component-id", QCBOR_TYPE_ARRAY, *item);
-        return TEEP_ERR_PERMANENT_ERROR;
+    *count = 0;
+    update.Clear();
+
+    // Compute the size, then encode.
+    UsefulBufC encoded;
+    QCBORError err = TamEncodeUpdateFraming(SizeCalculateUsefulBuf, plan, errorCode, errorMessage, count, &encoded);
+    if (err != QCBOR_SUCCESS) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    auto framing = std::make_shared<std::vector<uint8_t>>(encoded.len);
+    err = TamEncodeUpdateFraming({ framing->data(), framing->size() }, plan, errorCode, errorMessage, count, &encoded);
+    if (err != QCBOR_SUCCESS) {
+        return TEEP_ERR_TEMPORARY_ERROR;
     }
 
-    // Get array size.
-    uint16_t componentIdEntryCount = item->val.uCount;
-    if (componentIdEntryCount != 1) {
-        // TODO: support more general component ids.
-        return TEEP_ERR_PERMANENT_ERROR;
+    size_t headsLength = 0;
+    if (plan != nullptr) {
+        for (const Manifest* manifest : plan->Install) {
+            headsLength += teep_get_cbor_head_size(manifest->ManifestContents.len);
+        }
     }
+    const uint8_t* next = (const uint8_t*)encoded.ptr;
+    size_t framingLength = encoded.len - headsLength;
+    update.AppendReference({ next, framingLength }, framing);
+    next += framingLength;
+    if (plan != nullptr) {
+        for (const Manifest* manifest : plan->Install) {
+            size_t headLength = teep_get_cbor_head_size(manifest->ManifestContents.len);
+            update.AppendReference({ next, headLength }, framing);
+            next += headLength;
+            update.AppendReference(manifest->ManifestContents, manifest->ContentsOwner());
+        }
+    }
+    return TEEP_ERR_SUCCESS;
+}
 
-    // Read bstr from component id array.
-    QCBORItem bstrItem;
-    QCBORDecode_GetNext(context, &bstrItem);
+// QCBOR decodes unsigned integers that fit in an int64_t as INT64, so
+// accept either type.
+static bool GetUnsignedValue(_In_ const QCBORItem* item, _Out_ uint64_t* value)
+{
+    if (item->uDataType == QCBOR_TYPE_UINT64) {
+        *value = item->val.uint64;
+        return true;
+    }
+    if (item->uDataType == QCBOR_TYPE_INT64 && item->val.int64 >= 0) {
+        *value = (uint64_t)item->val.int64;
+        return true;
+    }
+    *value = 0;
+    return false;
+}
 
-    if (bstrItem.uDataType != QCBOR_TYPE_BYTE_STRING) {
-        REPORT_TYPE_ERROR(errorMessage, "component-id", QCBOR_TYPE_BYTE_STRING, bstrItem);
-        return TEEP_ERR_PERMANENT_ERROR;
+// Parse a component ID into a new RequestedComponentInfo.  encoded is
+// scratch space that can be reused across calls.
+static teep_error_code_t ParseComponentId(
+    _Inout_ QCBORDecodeContext* context,
+    _In_ const QCBORItem* item,
+    _Inout_ std::string& encoded,
+    _Outptr_ RequestedComponentInfo** currentRci,
+    _Inout_ std::ostringstream& errorMessage)
+{
+    teep_error_code_t result = TeepParseComponentId(context, item, encoded, errorMessage);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
     }
 
-    *currentRci = new RequestedComponentInfo(&bstrItem.val.string);
+    *currentRci = new RequestedComponentInfo(UsefulBufC{ encoded.data(), encoded.size() });
     return TEEP_ERR_SUCCESS;
 }
 
 static teep_error_code_t TamSendErrorUpdateMessage(_In_ void* sessionHandle, teep_error_code_t errorCode, _In_ const std::string& errorMessage)
 {
     // Compose an Update message.
-    UsefulBufC update;
+    TeepOutboundMessage update;
     int count;
-    teep_error_code_t err = TamComposeUpdate(&update, nullptr, nullptr, nullptr, errorCode, errorMessage.c_str(), &count);
+    teep_error_code_t err = TamComposeUpdate(update, nullptr, errorCode, errorMessage.c_str(), &count);
     if (err != 0) {
         return err;
     }
     if (count > 0) {
-        if (update.len == 0) {
+        if (update.IsEmpty()) {
             return TEEP_ERR_TEMPORARY_ERROR;
         }
 
-        HexPrintBuffer("Sending CBOR message: ", update.ptr, update.len);
-
         TeepLogMessage("Sending Update message...\n");
 
-        // TODO(#114): get correct signature kind from session
-        err = TamSendMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, &update, TEEP_SIGNATURE_ES256);
-        free((void*)update.ptr);
+        teep_signature_kind_t signatureKind = TamGetUpdateSignatureKind(*TamGetSession(sessionHandle));
+        err = TamSendMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, std::move(update), signatureKind);
         if (err != TEEP_ERR_SUCCESS) {
             return err;
         }
@@ -408,6 +482,7 @@ static teep_error_code_t TamSendErrorUpdateMessage(_In_ void* sessionHandle, tee
 
 static teep_error_code_t TamHandleQueryResponse(
     _In_ void* sessionHandle,
+    UsefulBufC queryResponse,
     _Inout_ QCBORDecodeContext* context)
 {
     TeepLogMessage("TamHandleQueryResponse\n");
@@ -415,6 +490,12 @@ static teep_error_code_t TamHandleQueryResponse(
     QCBORItem item;
     std::ostringstream errorMessage;
     std::string attestationPayloadFormat;
+    std::shared_ptr<TamSession> session = TamGetSession(sessionHandle);
+
+    // Without a selected-cipher-suite, the suite is the one negotiated
+    // with the device before, else the one the agent signed with.
+    teep_signature_kind_t selectedKind = (session->SignatureKind != TEEP_SIGNATURE_BOTH) ? session->SignatureKind : session->AgentKeyKind;
+    UsefulBufC sessionKeyShare = NULLUsefulBufC;
 
     // Parse the options map.
     QCBORDecode_GetNext(context, &item);
@@ -422,9 +503,10 @@ static teep_error_code_t TamHandleQueryResponse(
         REPORT_TYPE_ERROR(errorMessage, "options", QCBOR_TYPE_MAP, item);
         return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, errorMessage.str());
     }
-    RequestedComponentInfo currentComponentList(nullptr);
-    RequestedComponentInfo requestedComponentList(nullptr);
-    RequestedComponentInfo unneededComponentList(nullptr);
+    RequestedComponentInfo currentComponentList(NULLUsefulBufC);
+    RequestedComponentInfo requestedComponentList(NULLUsefulBufC);
+    RequestedComponentInfo unneededComponentList(NULLUsefulBufC);
+    std::string componentId; // Scratch space for parsing component IDs.
     uint16_t mapEntryCount = item.val.uCount;
     for (int mapEntryIndex = 0; mapEntryIndex < mapEntryCount; mapEntryIndex++) {
         QCBORDecode_GetNext(context, &item);
@@ -486,7 +568,11 @@ static teep_error_code_t TamHandleQueryResponse(
                 REPORT_TYPE_ERROR(errorMessage, "cose algorithm", QCBOR_TYPE_INT64, item);
                 return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, errorMessage.str());
             }
-            if (item.val.int64 != T_COSE_ALGORITHM_ES256) {
+            if (item.val.int64 == T_COSE_ALGORITHM_ES256) {
+                selectedKind = TEEP_SIGNATURE_ES256;
+            } else if (item.val.int64 == T_COSE_ALGORITHM_EDDSA) {
+                selectedKind = TEEP_SIGNATURE_EDDSA;
+            } else {
                 errorMessage << "Unrecognized COSE algorithm " << item.val.uint64 << std::endl;
                 TeepLogMessage(errorMessage.str().c_str());
                 return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, errorMessage.str());
@@ -519,7 +605,7 @@ static teep_error_code_t TamHandleQueryResponse(
                             // Duplicate.
                             return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, "Duplicate requested component");
                         }
-                        teep_error_code_t errorCode = ParseComponentId(context, &item, &currentRci, errorMessage);
+                        teep_error_code_t errorCode = ParseComponentId(context, &item, componentId, &currentRci, errorMessage);
                         if (errorCode != TEEP_ERR_SUCCESS) {
                             return TamSendErrorUpdateMessage(sessionHandle, errorCode, errorMessage.str());
                         }
@@ -528,25 +614,32 @@ static teep_error_code_t TamHandleQueryResponse(
                         break;
                     }
                     case TEEP_LABEL_TC_MANIFEST_SEQUENCE_NUMBER:
-                        if (item.uDataType != QCBOR_TYPE_UINT64) {
+                    {
+                        uint64_t sequenceNumber;
+                        if (!GetUnsignedValue(&item, &sequenceNumber)) {
                             REPORT_TYPE_ERROR(errorMessage, "tc-manifest-sequence-number", QCBOR_TYPE_UINT64, item);
                             return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, errorMessage.str());
                         }
                         if (currentRci == nullptr) {
                             return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, "No current component");
                         }
-                        currentRci->ManifestSequenceNumber = item.val.uint64;
+                        currentRci->ManifestSequenceNumber = sequenceNumber;
+                        currentRci->HaveManifestSequenceNumber = true;
                         break;
+                    }
                     case TEEP_LABEL_HAVE_BINARY:
-                        if (item.uDataType != QCBOR_TYPE_UINT64) {
+                    {
+                        uint64_t haveBinary;
+                        if (!GetUnsignedValue(&item, &haveBinary)) {
                             REPORT_TYPE_ERROR(errorMessage, "have-binary", QCBOR_TYPE_UINT64, item);
                             return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, errorMessage.str());
                         }
                         if (currentRci == nullptr) {
                             return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, "No current component");
                         }
-                        currentRci->HaveBinary = (item.val.uint64 != 0);
+                        currentRci->HaveBinary = (haveBinary != 0);
                         break;
+                    }
                     default:
                         errorMessage << "Unrecognized option label " << label << std::endl;
                         TeepLogMessage(errorMessage.str().c_str());
@@ -567,7 +660,7 @@ static teep_error_code_t TamHandleQueryResponse(
                 QCBORDecode_GetNext(context, &item);
 
                 RequestedComponentInfo* currentUci = nullptr;
-                teep_error_code_t errorCode = ParseComponentId(context, &item, &currentUci, errorMessage);
+                teep_error_code_t errorCode = ParseComponentId(context, &item, componentId, &currentUci, errorMessage);
                 if (errorCode != TEEP_ERR_SUCCESS) {
                     return TamSendErrorUpdateMessage(sessionHandle, errorCode, errorMessage.str());
                 }
@@ -582,7 +675,6 @@ static teep_error_code_t TamHandleQueryResponse(
                 REPORT_TYPE_ERROR(errorMessage, "tc-list", QCBOR_TYPE_ARRAY, item);
                 return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, errorMessage.str());
             }
-            RequestedComponentInfo* currentRci = nullptr;
             uint16_t arrayEntryCount = item.val.uCount;
             for (int arrayEntryIndex = 0; arrayEntryIndex < arrayEntryCount; arrayEntryIndex++) {
                 QCBORDecode_GetNext(context, &item);
@@ -591,6 +683,7 @@ static teep_error_code_t TamHandleQueryResponse(
                     return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, errorMessage.str());
                 }
                 uint16_t tcInfoParameterCount = item.val.uCount;
+                RequestedComponentInfo* currentRci = nullptr;
                 for (int tcInfoParameterIndex = 0; tcInfoParameterIndex < tcInfoParameterCount; tcInfoParameterIndex++) {
                     QCBORDecode_GetNext(context, &item);
                     teep_label_t label = (teep_label_t)item.label.int64;
@@ -601,7 +694,7 @@ static teep_error_code_t TamHandleQueryResponse(
                             // Duplicate.
                             return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, "Duplicate component");
                         }
-                        teep_error_code_t errorCode = ParseComponentId(context, &item, &currentRci, errorMessage);
+                        teep_error_code_t errorCode = ParseComponentId(context, &item, componentId, &currentRci, errorMessage);
                         if (errorCode != TEEP_ERR_SUCCESS) {
                             return TamSendErrorUpdateMessage(sessionHandle, errorCode, errorMessage.str());
                         }
@@ -610,15 +703,19 @@ static teep_error_code_t TamHandleQueryResponse(
                         break;
                     }
                     case TEEP_LABEL_TC_MANIFEST_SEQUENCE_NUMBER:
-                        if (item.uDataType != QCBOR_TYPE_UINT64) {
+                    {
+                        uint64_t sequenceNumber;
+                        if (!GetUnsignedValue(&item, &sequenceNumber)) {
                             REPORT_TYPE_ERROR(errorMessage, "tc-manifest-sequence-number", QCBOR_TYPE_UINT64, item);
                             return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, errorMessage.str());
                         }
                         if (currentRci == nullptr) {
                             return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, "No current component");
                         }
-                        currentRci->ManifestSequenceNumber = item.val.uint64;
+                        currentRci->ManifestSequenceNumber = sequenceNumber;
+                        currentRci->HaveManifestSequenceNumber = true;
                         break;
+                    }
                     default:
                         errorMessage << "Unrecognized option label " << label << std::endl;
                         TeepLogMessage(errorMessage.str().c_str());
@@ -649,6 +746,13 @@ static teep_error_code_t TamHandleQueryResponse(
 #endif
             }
             break;
+        case TEEP_LABEL_SESSION_KEY_SHARE:
+            if (item.uDataType != QCBOR_TYPE_BYTE_STRING) {
+                REPORT_TYPE_ERROR(errorMessage, "session-key-share", QCBOR_TYPE_BYTE_STRING, item);
+                return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, errorMessage.str());
+            }
+            sessionKeyShare = item.val.string;
+            break;
         default:
             errorMessage << "Unrecognized option label " << label << std::endl;
             TeepLogMessage(errorMessage.str().c_str());
@@ -656,33 +760,64 @@ static teep_error_code_t TamHandleQueryResponse(
         }
     }
 
-    {
-        // Compose an Update message.
-        UsefulBufC update;
-        int count;
-        teep_error_code_t err = TamComposeUpdate(&update, currentComponentList.Next, requestedComponentList.Next, unneededComponentList.Next, TEEP_ERR_SUCCESS, errorMessage.str(), &count);
-        if (err != 0) {
-            return err;
+    // The agent signs with the suite it selected, so a mismatch means the
+    // suite cannot be used in both directions.
+    if (selectedKind != session->AgentKeyKind) {
+        return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_UNSUPPORTED_CIPHER_SUITES, "Selected cipher suite does not match the agent key");
+    }
+    session->SignatureKind = selectedKind;
+
+    // A key share answers the one in our QueryRequest.  The new key protects
+    // later exchanges with the device, while this one stays as it started.
+    if (sessionKeyShare.len > 0) {
+        if (!session->AgreementKey) {
+            return TamSendErrorUpdateMessage(sessionHandle, TEEP_ERR_PERMANENT_ERROR, "Unexpected session key share");
         }
-        if (count > 0) {
-            if (update.len == 0) {
-                return TEEP_ERR_TEMPORARY_ERROR;
-            }
+        std::shared_ptr<const TeepSessionKey> sessionKey;
+        teep_error_code_t result = TeepSessionKey::Derive(&session->AgreementKey->Key, sessionKeyShare, queryResponse, sessionKey);
+        if (result != TEEP_ERR_SUCCESS) {
+            return TamSendErrorUpdateMessage(sessionHandle, result, "Session key agreement failed");
+        }
+        session->SessionKey = sessionKey;
+    }
 
-            HexPrintBuffer("Sending CBOR message: ", update.ptr, update.len);
+    // Remember what was agreed with the device, for its later exchanges on
+    // whatever session they come.
+    TamDevice device;
+    (void)TamGetDevice(session->AgentKeyId, device);
+    device.AgentKeyKind = session->AgentKeyKind;
+    device.SignatureKind = selectedKind;
+    if (sessionKeyShare.len > 0) {
+        device.SessionKey = session->SessionKey;
+    }
+    TamSetDevice(session->AgentKeyId, device);
 
-            TeepLogMessage("Sending Update message...\n");
+    // A QueryResponse that did not follow a connect on this session is
+    // checked against the current repository.
+    std::shared_ptr<const ManifestRepository> repository = session->Repository;
+    if (!repository) {
+        repository = ManifestRepository::GetCurrent();
+    }
 
-            // TODO(#114): get correct signature kind from session
-            err = TamSendMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, &update, TEEP_SIGNATURE_ES256);
-            free((void*)update.ptr);
-            if (err != TEEP_ERR_SUCCESS) {
-                return err;
-            }
+    // In an exchange protected with a session key, the Update is MACed per
+    // session, so only the unsigned encoding is cached.
+    const TeepSessionKey* sendingKey = TamGetSendingSessionKey(*session);
+    if (sendingKey != nullptr) {
+        std::shared_ptr<const TeepOutboundMessage> update;
+        teep_error_code_t result = TamGetUpdate(*repository, currentComponentList.Next, requestedComponentList.Next, unneededComponentList.Next, TEEP_SIGNATURE_NONE, update);
+        if (result != TEEP_ERR_SUCCESS || !update) {
+            return result;
         }
+        TeepLogMessage("Sending Update message...\n");
+        TeepOutboundMessage message;
+        message.AppendShared(update);
+        return TamMacAndQueueOutboundMessage(sessionHandle, TEEP_CBOR_MEDIA_TYPE, std::move(message), *sendingKey);
     }
 
-    return TEEP_ERR_SUCCESS;
+    // Send an Update with whatever the device needs.  Devices that report
+    // the same inventory get the same Update, so it usually comes from the
+    // cache; otherwise it is signed on the signing stage.
+    return TamQueueUpdate(sessionHandle, TEEP_CBOR_MEDIA_TYPE, *repository, currentComponentList.Next, requestedComponentList.Next, unneededComponentList.Next, selectedKind);
 }
 
 static teep_error_code_t TamHandleSuccess(_In_ void* sessionHandle, _Inout_ QCBORDecodeContext* context)
@@ -764,42 +899,49 @@ static teep_error_code_t TamHandleError(
     return TEEP_ERR_SUCCESS;
 }
 
-static teep_error_code_t TamVerifyMessageSignature(
-    _In_ void* sessionHandle,
-    _In_reads_(messageLength) const char* message,
-    size_t messageLength,
-    _Out_ UsefulBufC* pencoded)
+// Returns true if the TAM trusts an agent key.
+static bool TamIsAgentKeyTrusted(_In_ const std::string& agentKeyId)
 {
-    UsefulBufC signed_cose;
-    signed_cose.ptr = message;
-    signed_cose.len = messageLength;
-    for (auto [kind, key_pair] : TamGetTeepAgentKeys()) {
-        teep_error_code_t teeperr = teep_verify_cbor_message(kind, &key_pair, &signed_cose, pencoded);
-        if (teeperr == TEEP_ERR_SUCCESS) {
-            // TODO(#114): save key_pair in session
-            return TEEP_ERR_SUCCESS;
-        }
+    UsefulBufC keyId = { agentKeyId.data(), agentKeyId.size() };
+    std::shared_ptr<const TamAgentKeyFiles> keyFiles = TamGetTeepAgentKeyFiles();
+    if (keyFiles->Index.find(agentKeyId) != keyFiles->Index.end()) {
+        return !TamGetAgentKeyStore().IsRevoked(keyId);
     }
-    TeepLogMessage("TAM failed verification of agent key\n");
-    return TEEP_ERR_PERMANENT_ERROR;
+    return TamGetAgentKeyStore().Find(keyId) != nullptr;
 }
 
-/* Handle an incoming message from a TEEP Agent. */
-static teep_error_code_t TamHandleMessage(
-    _In_ void* sessionHandle,
-    _In_reads_(messageLength) const char* message,
-    size_t messageLength)
+// Find the device that a COSE_Mac0 message claims to come from, by the
+// session key it names.  The message still has to be verified with the key.
+static teep_error_code_t TamFindMac0MessageDevice(
+    _In_ const UsefulBufC* maced_cose,
+    _Out_ std::string& agentKeyId,
+    _Out_ TamDevice& device)
 {
-    HexPrintBuffer("TamHandleCborMessage got COSE message:\n", message, messageLength);
-    TeepLogMessage("\n");
+    std::vector<UsefulBufC> keyIds;
+    teep_error_code_t teeperr = teep_get_cose_key_ids(maced_cose, keyIds);
+    if (teeperr != TEEP_ERR_SUCCESS || keyIds.size() != 1) {
+        TeepLogMessage("TAM could not parse COSE headers\n");
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+    if (!TamFindDeviceBySessionKeyId(keyIds[0], agentKeyId, device)) {
+        TeepLogMessage("TAM has no such session key\n");
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
 
-    // Verify signature and save which signing key was used.
-    UsefulBufC encoded;
-    teep_error_code_t teeperr = TamVerifyMessageSignature(sessionHandle, message, messageLength, &encoded);
-    if (teeperr != TEEP_ERR_SUCCESS) {
-        return teeperr;
+    // A session key is only as good as the agent key it was agreed under.
+    if (!TamIsAgentKeyTrusted(agentKeyId)) {
+        TeepLogMessage("TAM does not trust the agent key\n");
+        return TEEP_ERR_PERMANENT_ERROR;
     }
+    return TEEP_ERR_SUCCESS;
+}
 
+// Handle a message whose signature or MAC has been verified.
+static teep_error_code_t TamHandleVerifiedMessage(
+    _In_ void* sessionHandle,
+    UsefulBufC encoded,
+    bool maced)
+{
     HexPrintBuffer("Received CBOR message: ", encoded.ptr, encoded.len);
 
     QCBORDecodeContext context;
@@ -821,9 +963,27 @@ static teep_error_code_t TamHandleMessage(
 
     teep_message_type_t messageType = (teep_message_type_t)item.val.uint64;
     TeepLogMessage("Received CBOR TEEP message type=%d\n", messageType);
+
+    std::shared_ptr<TamSession> session = TamGetSession(sessionHandle);
+    session->MessagesReceived++;
+    session->LastMessageType = messageType;
+
+    // The QueryResponse identifies the device, by its signature or by a
+    // MAC with the session key agreed with it, and a MACed one means the
+    // rest of the exchange is MACed too.  Any other MACed message is only
+    // accepted once the device is identified.
+    if (messageType == TEEP_MESSAGE_QUERY_RESPONSE) {
+        session->DeviceIdentified = true;
+        session->MacExchange = maced;
+    } else if (maced && !session->DeviceIdentified) {
+        TeepLogMessage("TAM got a MACed message before a QueryResponse\n");
+        return TEEP_ERR_PERMANENT_ERROR;
+    }
+
+    teep_error_code_t teeperr;
     switch (messageType) {
     case TEEP_MESSAGE_QUERY_RESPONSE:
-        teeperr = TamHandleQueryResponse(sessionHandle, &context);
+        teeperr = TamHandleQueryResponse(sessionHandle, encoded, &context);
         break;
     case TEEP_MESSAGE_SUCCESS:
         teeperr = TamHandleSuccess(sessionHandle, &context);
@@ -843,6 +1003,135 @@ static teep_error_code_t TamHandleMessage(
     return (err == QCBOR_SUCCESS) ? TEEP_ERR_SUCCESS : TEEP_ERR_TEMPORARY_ERROR;
 }
 
+// Handle a message MACed with a session key.
+static teep_error_code_t TamHandleMacedMessage(
+    _In_ void* sessionHandle,
+    _In_ const UsefulBufC* maced_cose)
+{
+    // Once the device is identified, the MAC must be with the device's key.
+    UsefulBufC encoded;
+    std::shared_ptr<TamSession> session = TamGetSession(sessionHandle);
+    if (session->DeviceIdentified) {
+        if (!session->SessionKey) {
+            TeepLogMessage("TAM has no session key\n");
+            return TEEP_ERR_PERMANENT_ERROR;
+        }
+        teep_error_code_t teeperr = teep_verify_mac0_message(*session->SessionKey, maced_cose, &encoded);
+        if (teeperr != TEEP_ERR_SUCCESS) {
+            TeepLogMessage("TAM failed verification of session key MAC\n");
+            return teeperr;
+        }
+        return TamHandleVerifiedMessage(sessionHandle, encoded, true);
+    }
+
+    // Otherwise the MAC identifies the device, by proving it holds the
+    // session key agreed with it.  Only a QueryResponse may do that,
+    // which TamHandleVerifiedMessage checks once the message is decoded.
+    std::string agentKeyId;
+    TamDevice device;
+    teep_error_code_t teeperr = TamFindMac0MessageDevice(maced_cose, agentKeyId, device);
+    if (teeperr != TEEP_ERR_SUCCESS) {
+        return teeperr;
+    }
+    teeperr = teep_verify_mac0_message(*device.SessionKey, maced_cose, &encoded);
+    if (teeperr != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("TAM failed verification of session key MAC\n");
+        return teeperr;
+    }
+    session->AgentKeyId = agentKeyId;
+    session->AgentKeyKind = device.AgentKeyKind;
+    session->SignatureKind = device.SignatureKind;
+    session->SessionKey = device.SessionKey;
+    return TamHandleVerifiedMessage(sessionHandle, encoded, true);
+}
+
+// Handle a message signed with an agent key.  An EdDSA signature may be
+// verified later in a batch on the verification stage, and the message
+// handled there.
+static teep_error_code_t TamHandleSignedMessage(
+    _In_ void* sessionHandle,
+    _In_ const UsefulBufC* signed_cose)
+{
+    std::vector<UsefulBufC> keyIds;
+    teep_error_code_t teeperr = teep_get_cose_key_ids(signed_cose, keyIds);
+    if (teeperr != TEEP_ERR_SUCCESS) {
+        TeepLogMessage("TAM could not parse COSE headers\n");
+        return teeperr;
+    }
+
+    // Look in the configured key files first, then in the agent key store.
+    // Either way, the key is kept alive by whatever holds it until the
+    // signature has been checked.
+    std::shared_ptr<const TamAgentKeyFiles> keyFiles = TamGetTeepAgentKeyFiles();
+    const teep_key_index_t& keyIndex = keyFiles->Index;
+    for (const UsefulBufC& keyId : keyIds) {
+        std::string id((const char*)keyId.ptr, keyId.len);
+        teep_signature_kind_t kind;
+        std::shared_ptr<const struct t_cose_key> key;
+        auto it = keyIndex.find(id);
+        if (it != keyIndex.end()) {
+            if (TamGetAgentKeyStore().IsRevoked(keyId)) {
+                continue;
+            }
+            kind = it->second.kind;
+            key = std::shared_ptr<const struct t_cose_key>(keyFiles, &it->second.key);
+        } else {
+            std::shared_ptr<const AgentKey> agentKey = TamGetAgentKeyStore().Find(keyId);
+            if (!agentKey) {
+                continue;
+            }
+            kind = agentKey->Kind;
+            key = std::shared_ptr<const struct t_cose_key>(agentKey, &agentKey->Key);
+        }
+
+        return TamVerifyInboundMessage(kind, key, *signed_cose, [sessionHandle, id, kind](teep_error_code_t result, UsefulBufC encoded) {
+            if (result != TEEP_ERR_SUCCESS) {
+                TeepLogMessage("TAM failed verification of agent key\n");
+                return result;
+            }
+
+            // The device is now identified, so pick up what was negotiated
+            // with it before, whichever session that was on.  Nothing agreed
+            // with another device in this session applies to it.
+            std::shared_ptr<TamSession> session = TamGetSession(sessionHandle);
+            if (session->AgentKeyId != id) {
+                session->SessionKey.reset();
+                session->MacExchange = false;
+                session->DeviceIdentified = false;
+            }
+            session->AgentKeyId = id;
+            session->AgentKeyKind = kind;
+            TamDevice device;
+            session->SignatureKind = TamGetDevice(id, device) ? device.SignatureKind : TEEP_SIGNATURE_BOTH;
+            return TamHandleVerifiedMessage(sessionHandle, encoded, false);
+        });
+    }
+
+    TeepLogMessage("TAM does not trust the agent key\n");
+    return TEEP_ERR_PERMANENT_ERROR;
+}
+
+/* Handle an incoming message from a TEEP Agent. */
+static teep_error_code_t TamHandleMessage(
+    _In_ void* sessionHandle,
+    _In_reads_(messageLength) const char* message,
+    size_t messageLength)
+{
+    HexPrintBuffer("TamHandleCborMessage got COSE message:\n", message, messageLength);
+    TeepLogMessage("\n");
+
+    // Verify the signature or MAC, save which key was used, and handle
+    // the message.  In session mode, a message may be MACed with a session
+    // key.
+    UsefulBufC cose;
+    cose.ptr = message;
+    cose.len = messageLength;
+    if (teep_is_mac0_message(&cose)) {
+        return TamHandleMacedMessage(sessionHandle, &cose);
+    }
+    return TamHandleSignedMessage(sessionHandle, &cose);
+}
+
 teep_error_code_t TamProcessTeepMessage(
     _In_ void* sessionHandle,
     _In_z_ const char* mediaType,
@@ -0,0 +1,321 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <string.h>
+#include <unordered_map>
+#include "openssl/evp.h"
+#include "Manifest.h"
+#include "QueryRequestCache.h"
+#include "TamKeys.h"
+#include "TamSigningStage.h"
+#include "TeepTamLib.h"
+#include "UpdateCache.h"
+
+// Approximate bookkeeping cost of a cache entry beyond its message bytes.
+#define UPDATE_CACHE_ENTRY_OVERHEAD 128
+
+struct UpdateCacheEntry
+{
+    std::string Key; // SHA-256 hash.
+    std::shared_ptr<const TeepOutboundMessage> SignedMessage; // nullptr if no Update is needed.
+    size_t Cost;
+};
+
+typedef std::list<UpdateCacheEntry> UpdateCacheList;
+
+static std::mutex g_UpdateCacheLock;
+static UpdateCacheList g_UpdateCacheLru; // Most recently used first.
+static std::unordered_map<std::string, UpdateCacheList::iterator> g_UpdateCache;
+static size_t g_UpdateCacheBytes = 0;
+static size_t g_UpdateCacheCapacity = TAM_DEFAULT_UPDATE_CACHE_CAPACITY;
+static uint64_t g_UpdateCacheHits = 0;
+static uint64_t g_UpdateCacheMisses = 0;
+
+// Must be called with g_UpdateCacheLock held.
+static void TrimUpdateCache(void)
+{
+    while (g_UpdateCacheBytes > g_UpdateCacheCapacity && !g_UpdateCacheLru.empty()) {
+        UpdateCacheEntry& entry = g_UpdateCacheLru.back();
+        g_UpdateCacheBytes -= entry.Cost;
+        g_UpdateCache.erase(entry.Key);
+        g_UpdateCacheLru.pop_back();
+    }
+}
+
+void TamGetUpdateCacheStatistics(_Out_ TamUpdateCacheStatistics* statistics)
+{
+    std::lock_guard<std::mutex> lock(g_UpdateCacheLock);
+    statistics->Hits = g_UpdateCacheHits;
+    statistics->Misses = g_UpdateCacheMisses;
+    statistics->EntryCount = g_UpdateCache.size();
+    statistics->ByteCount = g_UpdateCacheBytes;
+}
+
+void TamSetUpdateCacheCapacity(size_t maxBytes)
+{
+    std::lock_guard<std::mutex> lock(g_UpdateCacheLock);
+    g_UpdateCacheCapacity = maxBytes;
+    TrimUpdateCache();
+}
+
+void TamInvalidateUpdateCache(void)
+{
+    std::lock_guard<std::mutex> lock(g_UpdateCacheLock);
+    g_UpdateCacheLru.clear();
+    g_UpdateCache.clear();
+    g_UpdateCacheBytes = 0;
+}
+
+static void HashUint64(_Inout_ EVP_MD_CTX* context, uint64_t value)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+    EVP_DigestUpdate(context, bytes, sizeof(bytes));
+}
+
+// Get the handle that identifies a component in a cache key, or
+// TEEP_NO_COMPONENT_HANDLE if it must be identified by its bytes.  Handles
+// are reused once nothing references them, so only the handles of
+// components in the repository snapshot, which holds them for as long as
+// its epoch is current, mean the same thing in every key.
+static teep_component_handle_t GetKeyHandle(
+    _In_ const ManifestRepository& repository,
+    _In_ const RequestedComponentInfo* rci)
+{
+    return (repository.FindRow(rci->ComponentHandle) != TAM_NO_MANIFEST_ROW) ?
+        rci->ComponentHandle : TEEP_NO_COMPONENT_HANDLE;
+}
+
+// Hash a component list in an order that does not depend on the order
+// in which the device listed the components.
+static void HashComponentList(
+    _Inout_ EVP_MD_CTX* context,
+    _In_ const ManifestRepository& repository,
+    _In_opt_ const RequestedComponentInfo* list,
+    _Inout_ std::vector<std::pair<teep_component_handle_t, const RequestedComponentInfo*>>& scratch)
+{
+    scratch.clear();
+    for (const RequestedComponentInfo* rci = list; rci != nullptr; rci = rci->Next) {
+        scratch.push_back({ GetKeyHandle(repository, rci), rci });
+    }
+    std::sort(scratch.begin(), scratch.end(),
+        [](const std::pair<teep_component_handle_t, const RequestedComponentInfo*>& leftEntry,
+           const std::pair<teep_component_handle_t, const RequestedComponentInfo*>& rightEntry) {
+            const RequestedComponentInfo* left = leftEntry.second;
+            const RequestedComponentInfo* right = rightEntry.second;
+            if (leftEntry.first != rightEntry.first) {
+                return leftEntry.first < rightEntry.first;
+            }
+            if (leftEntry.first == TEEP_NO_COMPONENT_HANDLE) {
+                int result = UsefulBuf_Compare(left->ComponentId, right->ComponentId);
+                if (result != 0) {
+                    return result < 0;
+                }
+            }
+            if (left->HaveManifestSequenceNumber != right->HaveManifestSequenceNumber) {
+                return left->HaveManifestSequenceNumber < right->HaveManifestSequenceNumber;
+            }
+            if (left->ManifestSequenceNumber != right->ManifestSequenceNumber) {
+                return left->ManifestSequenceNumber < right->ManifestSequenceNumber;
+            }
+            return left->HaveBinary < right->HaveBinary;
+        });
+
+    HashUint64(context, scratch.size());
+    for (const auto& entry : scratch) {
+        // Components the TAM has manifests for are identified by their
+        // handle.  Only other IDs need to be hashed in full.
+        const RequestedComponentInfo* rci = entry.second;
+        HashUint64(context, entry.first);
+        if (entry.first == TEEP_NO_COMPONENT_HANDLE) {
+            HashUint64(context, rci->ComponentId.len);
+            EVP_DigestUpdate(context, rci->ComponentId.ptr, rci->ComponentId.len);
+        }
+        HashUint64(context, rci->HaveManifestSequenceNumber ? 1 : 0);
+        HashUint64(context, rci->ManifestSequenceNumber);
+        HashUint64(context, rci->HaveBinary ? 1 : 0);
+    }
+}
+
+static teep_error_code_t ComputeUpdateCacheKey(
+    _In_ const ManifestRepository& repository,
+    _In_opt_ const RequestedComponentInfo* currentComponentList,
+    _In_opt_ const RequestedComponentInfo* requestedComponentList,
+    _In_opt_ const RequestedComponentInfo* unneededComponentList,
+    teep_signature_kind_t signatureKind,
+    _Out_ std::string& key)
+{
+    EVP_MD_CTX* context = EVP_MD_CTX_new();
+    if (context == nullptr) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    if (!EVP_DigestInit_ex(context, EVP_sha256(), nullptr)) {
+        EVP_MD_CTX_free(context);
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+
+    HashUint64(context, repository.GetEpoch());
+    HashUint64(context, TamGetSigningKeyGeneration());
+    HashUint64(context, signatureKind);
+    std::vector<std::pair<teep_component_handle_t, const RequestedComponentInfo*>> scratch;
+    HashComponentList(context, repository, currentComponentList, scratch);
+    HashComponentList(context, repository, requestedComponentList, scratch);
+    HashComponentList(context, repository, unneededComponentList, scratch);
+
+    uint8_t hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLength;
+    int ok = EVP_DigestFinal_ex(context, hash, &hashLength);
+    EVP_MD_CTX_free(context);
+    if (!ok) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    key.assign((const char*)hash, hashLength);
+    return TEEP_ERR_SUCCESS;
+}
+
+// Look up an Update in the cache.  Returns true on a hit.
+static bool LookUpUpdate(_In_ const std::string& key, _Out_ std::shared_ptr<const TeepOutboundMessage>& signedMessage)
+{
+    std::lock_guard<std::mutex> lock(g_UpdateCacheLock);
+    auto it = g_UpdateCache.find(key);
+    if (it == g_UpdateCache.end()) {
+        g_UpdateCacheMisses++;
+        return false;
+    }
+    g_UpdateCacheHits++;
+    g_UpdateCacheLru.splice(g_UpdateCacheLru.begin(), g_UpdateCacheLru, it->second);
+    signedMessage = it->second->SignedMessage;
+    return true;
+}
+
+static void InsertUpdate(_In_ const std::string& key, _In_ const std::shared_ptr<const TeepOutboundMessage>& signedMessage)
+{
+    std::lock_guard<std::mutex> lock(g_UpdateCacheLock);
+    size_t cost = UPDATE_CACHE_ENTRY_OVERHEAD + key.size() + ((signedMessage) ? signedMessage->GetLength() : 0);
+    if (cost > g_UpdateCacheCapacity || g_UpdateCache.find(key) != g_UpdateCache.end()) {
+        return;
+    }
+    g_UpdateCacheLru.push_front({ key, signedMessage, cost });
+    g_UpdateCache[key] = g_UpdateCacheLru.begin();
+    g_UpdateCacheBytes += cost;
+    TrimUpdateCache();
+}
+
+// Find the Update for a device's component lists in the cache, or plan and
+// encode it.  On return, if resolved is true, cachedMessage is the Update
+// to send, or nullptr if none is needed.  Otherwise unsignedUpdate still
+// needs to be signed with signatureKind and then cached under key.
+static teep_error_code_t LookUpOrComposeUpdate(
+    _In_ const ManifestRepository& repository,
+    _In_opt_ const RequestedComponentInfo* currentComponentList,
+    _In_opt_ const RequestedComponentInfo* requestedComponentList,
+    _In_opt_ const RequestedComponentInfo* unneededComponentList,
+    teep_signature_kind_t signatureKind,
+    _Out_ std::string& key,
+    _Out_ bool* resolved,
+    _Out_ std::shared_ptr<const TeepOutboundMessage>& cachedMessage,
+    _Out_ TeepOutboundMessage& unsignedUpdate)
+{
+    *resolved = false;
+    cachedMessage.reset();
+    teep_error_code_t result = ComputeUpdateCacheKey(repository, currentComponentList, requestedComponentList, unneededComponentList, signatureKind, key);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    if (LookUpUpdate(key, cachedMessage)) {
+        *resolved = true;
+        return TEEP_ERR_SUCCESS;
+    }
+
+    // Plan and encode outside the lock, so that devices with different
+    // inventories are not serialized.
+    UpdatePlan plan;
+    plan.Build(repository, currentComponentList, requestedComponentList, unneededComponentList);
+    int count;
+    result = TamComposeUpdate(unsignedUpdate, &plan, TEEP_ERR_SUCCESS, std::string(), &count);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    if (count == 0) {
+        InsertUpdate(key, nullptr);
+        *resolved = true;
+        return TEEP_ERR_SUCCESS;
+    }
+    if (unsignedUpdate.IsEmpty()) {
+        return TEEP_ERR_TEMPORARY_ERROR;
+    }
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TamGetUpdate(
+    _In_ const ManifestRepository& repository,
+    _In_opt_ const RequestedComponentInfo* currentComponentList,
+    _In_opt_ const RequestedComponentInfo* requestedComponentList,
+    _In_opt_ const RequestedComponentInfo* unneededComponentList,
+    teep_signature_kind_t signatureKind,
+    _Out_ std::shared_ptr<const TeepOutboundMessage>& signedMessage)
+{
+    std::string key;
+    bool resolved;
+    TeepOutboundMessage update;
+    teep_error_code_t result = LookUpOrComposeUpdate(repository, currentComponentList, requestedComponentList, unneededComponentList, signatureKind,
+                                                     key, &resolved, signedMessage, update);
+    if (result != TEEP_ERR_SUCCESS || resolved) {
+        return result;
+    }
+
+#ifdef TEEP_USE_COSE
+    if (signatureKind != TEEP_SIGNATURE_NONE) {
+        TeepOutboundMessage signedUpdate;
+        result = TamSignOutboundMessage(std::move(update), signatureKind, signedUpdate);
+        if (result != TEEP_ERR_SUCCESS) {
+            return result;
+        }
+        update = std::move(signedUpdate);
+    }
+#endif
+
+    signedMessage = std::make_shared<const TeepOutboundMessage>(std::move(update));
+    InsertUpdate(key, signedMessage);
+    return TEEP_ERR_SUCCESS;
+}
+
+teep_error_code_t TamQueueUpdate(
+    _In_ void* sessionHandle,
+    _In_z_ const char* mediaType,
+    _In_ const ManifestRepository& repository,
+    _In_opt_ const RequestedComponentInfo* currentComponentList,
+    _In_opt_ const RequestedComponentInfo* requestedComponentList,
+    _In_opt_ const RequestedComponentInfo* unneededComponentList,
+    teep_signature_kind_t signatureKind)
+{
+    std::string key;
+    bool resolved;
+    std::shared_ptr<const TeepOutboundMessage> cachedMessage;
+    TeepOutboundMessage update;
+    teep_error_code_t result = LookUpOrComposeUpdate(repository, currentComponentList, requestedComponentList, unneededComponentList, signatureKind,
+                                                     key, &resolved, cachedMessage, update);
+    if (result != TEEP_ERR_SUCCESS) {
+        return result;
+    }
+    if (resolved) {
+        if (!cachedMessage) {
+            return TEEP_ERR_SUCCESS;
+        }
+        TeepLogMessage("Sending Update message...\n");
+        TeepOutboundMessage message;
+        message.AppendShared(cachedMessage);
+        return TamSignAndQueueOutboundMessage(sessionHandle, mediaType, std::move(message), TEEP_SIGNATURE_NONE);
+    }
+
+    // The component lists belong to the request, so the Update was
+    // composed here, but signing is left to the signing stage, which
+    // caches the result.
+    TeepLogMessage("Sending Update message...\n");
+    return TamSignAndQueueOutboundMessage(sessionHandle, mediaType, std::move(update), signatureKind,
+        [key](const std::shared_ptr<const TeepOutboundMessage>& signedUpdate) { InsertUpdate(key, signedUpdate); });
+}
@@ -0,0 +1,68 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "OutboundMessage.h"
+#include "RequestedComponentInfo.h"
+#include "UpdatePlan.h"
+
+#define TAM_DEFAULT_UPDATE_CACHE_CAPACITY (16 * 1024 * 1024) // Bytes.
+
+// Implemented in TeepTamMessageHandler.cpp.
+teep_error_code_t TamComposeUpdate(
+    _Out_ TeepOutboundMessage& update,
+    _In_opt_ const UpdatePlan* plan,
+    _In_ teep_error_code_t errorCode,
+    _In_ const std::string& errorMessage,
+    _Out_ int* count);
+
+teep_error_code_t TamSignOutboundMessage(
+    _Inout_ TeepOutboundMessage&& unsignedMessage,
+    teep_signature_kind_t signatureKind,
+    _Out_ TeepOutboundMessage& signedMessage);
+
+// Get the signed Update to send in response to a QueryResponse, or nullptr
+// if the device needs no changes.  The TAM puts no token in an Update, so
+// devices reporting the same inventory get byte-identical Updates.  Each
+// Update is therefore cached under a SHA-256 hash of the epoch of the
+// manifest repository snapshot, the signing key generation and signature kind, and
+// the reported, requested, and unneeded component lists in canonical
+// (sorted) order; a hit skips planning, encoding, and signing.
+teep_error_code_t TamGetUpdate(
+    _In_ const ManifestRepository& repository,
+    _In_opt_ const RequestedComponentInfo* currentComponentList,
+    _In_opt_ const RequestedComponentInfo* requestedComponentList,
+    _In_opt_ const RequestedComponentInfo* unneededComponentList,
+    teep_signature_kind_t signatureKind,
+    _Out_ std::shared_ptr<const TeepOutboundMessage>& signedMessage);
+
+// Queue the Update for a QueryResponse on a session, if the device needs
+// one.  Same as TamGetUpdate, except that on a cache miss the Update is
+// signed by the signing stage, which caches it and queues it.
+teep_error_code_t TamQueueUpdate(
+    _In_ void* sessionHandle,
+    _In_z_ const char* mediaType,
+    _In_ const ManifestRepository& repository,
+    _In_opt_ const RequestedComponentInfo* currentComponentList,
+    _In_opt_ const RequestedComponentInfo* requestedComponentList,
+    _In_opt_ const RequestedComponentInfo* unneededComponentList,
+    teep_signature_kind_t signatureKind);
+
+typedef struct {
+    uint64_t Hits;
+    uint64_t Misses;
+    size_t EntryCount;
+    size_t ByteCount; // Approximate memory used by cached entries.
+} TamUpdateCacheStatistics;
+
+void TamGetUpdateCacheStatistics(_Out_ TamUpdateCacheStatistics* statistics);
+
+// Bound the memory used by cached Updates, evicting least recently used
+// entries as needed.  0 disables the cache.
+void TamSetUpdateCacheCapacity(size_t maxBytes);
+
+// Discard all cached Updates.  Called whenever signing keys change.
+void TamInvalidateUpdateCache(void);
@@ -0,0 +1,117 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#include <algorithm>
+#include <string.h>
+#include "UpdatePlan.h"
+
+void UpdatePlan::Clear(void)
+{
+    Install.clear();
+    Uninstall.clear();
+    Unchanged = 0;
+    _reported.clear();
+}
+
+// Get whether a device should be sent the manifest in a row, given what
+// it reports about its installed copy.  A device that does not report a
+// sequence number is not sent the same component again.
+static bool IsNewerThanReported(
+    _In_ const ManifestMetadataTable& metadata,
+    size_t row,
+    _In_ const RequestedComponentInfo* reported)
+{
+    return reported->HaveManifestSequenceNumber &&
+        (metadata.SequenceNumbers[row] > reported->ManifestSequenceNumber);
+}
+
+_Ret_maybenull_
+UpdatePlan::ReportedComponent* UpdatePlan::FindReported(size_t row)
+{
+    auto found = std::lower_bound(_reported.begin(), _reported.end(), row,
+        [](const ReportedComponent& reported, size_t row) { return reported.Row < row; });
+    return (found != _reported.end() && found->Row == row) ? &*found : nullptr;
+}
+
+void UpdatePlan::Build(
+    _In_ const ManifestRepository& repository,
+    _In_opt_ const RequestedComponentInfo* currentComponentList,
+    _In_opt_ const RequestedComponentInfo* requestedComponentList,
+    _In_opt_ const RequestedComponentInfo* unneededComponentList)
+{
+    Clear();
+
+    // Build the set of metadata table rows the device reports as
+    // installed, sorted by row.  Components with no row are not allowed
+    // by the repository, so they go straight to the uninstall set.
+    for (const RequestedComponentInfo* rci = currentComponentList; rci != nullptr; rci = rci->Next) {
+        size_t row = repository.FindRow(rci->ComponentHandle);
+        if (row == TAM_NO_MANIFEST_ROW) {
+            Uninstall.push_back(rci->ComponentId);
+            continue;
+        }
+        _reported.push_back({ (uint32_t)row, rci, false });
+    }
+    std::sort(_reported.begin(), _reported.end(),
+        [](const ReportedComponent& left, const ReportedComponent& right) { return left.Row < right.Row; });
+
+    // Optional components reported as unneeded are ok to delete on request,
+    // and are not upgraded meanwhile.
+    const ManifestMetadataTable& metadata = repository.Metadata();
+    for (const RequestedComponentInfo* rci = unneededComponentList; rci != nullptr; rci = rci->Next) {
+        size_t found = repository.FindRow(rci->ComponentHandle);
+        if ((found != TAM_NO_MANIFEST_ROW) && !metadata.IsRequired[found]) {
+            Uninstall.push_back(rci->ComponentId);
+            ReportedComponent* reported = FindReported(found);
+            if (reported != nullptr) {
+                reported->Unneeded = true;
+            }
+        }
+    }
+
+    // Merge the reported rows against the required rows, both in row
+    // order, touching a Manifest only to install it.  A reported component
+    // is sent again only if the repository has a strictly newer sequence
+    // number than the device.
+    const std::vector<uint32_t>& required = repository.RequiredRows();
+    auto reported = _reported.begin();
+    auto row = required.begin();
+    while (reported != _reported.end() || row != required.end()) {
+        if (row == required.end() || (reported != _reported.end() && reported->Row < *row)) {
+            // Installed but not required, so an allowed optional
+            // component: keep it, upgrading it if it is old, unless it is
+            // already in the uninstall set.
+            if (reported->Unneeded) {
+                // Counted in Uninstall.
+            } else if (IsNewerThanReported(metadata, reported->Row, reported->Info)) {
+                Install.push_back(repository.GetManifest(reported->Row));
+            } else {
+                Unchanged++;
+            }
+            ++reported;
+        } else if (reported == _reported.end() || *row < reported->Row) {
+            // Required but not reported, so install it.
+            Install.push_back(repository.GetManifest(*row));
+            ++row;
+        } else {
+            // Required and already installed, so upgrade it if it is old.
+            if (IsNewerThanReported(metadata, *row, reported->Info)) {
+                Install.push_back(repository.GetManifest(*row));
+            } else {
+                Unchanged++;
+            }
+            ++reported;
+            ++row;
+        }
+    }
+
+    // Optional components that were requested are ok to install on request,
+    // unless they are already installed, in which case the merge above
+    // already sent any newer version.
+    for (const RequestedComponentInfo* rci = requestedComponentList; rci != nullptr; rci = rci->Next) {
+        size_t found = repository.FindRow(rci->ComponentHandle);
+        if ((found != TAM_NO_MANIFEST_ROW) && !metadata.IsRequired[found] &&
+            (FindReported(found) == nullptr)) {
+            Install.push_back(repository.GetManifest(found));
+        }
+    }
+}
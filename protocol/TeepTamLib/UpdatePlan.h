@@ -0,0 +1,56 @@
+// Copyright (c) TEEP contributors
+// SPDX-License-Identifier: MIT
+#pragma once
+#include <vector>
+#include "ManifestRepository.h"
+#include "RequestedComponentInfo.h"
+
+// An UpdatePlan is the result of comparing a device's QueryResponse
+// against the manifest repository: which manifests to send, and which
+// installed components the device should remove.  A component the device
+// already has is only sent again if the repository's manifest has a
+// strictly newer sequence number than the one the device reports, so a
+// device that is up to date gets an empty plan.  The plan is computed
+// once and then consumed by the Update encoder.
+class UpdatePlan
+{
+public:
+    // Compute the plan against a repository snapshot, which must outlive
+    // the plan.  Any previous contents are discarded, but allocated
+    // capacity is kept so a plan object can be reused.
+    void Build(
+        _In_ const ManifestRepository& repository,
+        _In_opt_ const RequestedComponentInfo* currentComponentList,
+        _In_opt_ const RequestedComponentInfo* requestedComponentList,
+        _In_opt_ const RequestedComponentInfo* unneededComponentList);
+
+    void Clear(void);
+
+    // Number of entries that would go into an Update message.
+    size_t Count(void) const { return Install.size() + Uninstall.size(); }
+
+    // Manifests to send, in order, both new components and upgrades.
+    std::vector<const Manifest*> Install;
+
+    // Encoded component IDs to list in the unneeded manifest list, in
+    // order.  These come from the RequestedComponentInfo lists passed to
+    // Build(), which must outlive the plan.
+    std::vector<UsefulBufC> Uninstall;
+
+    // Number of reported components that need no change.  Components in
+    // Install or Uninstall are not counted.
+    size_t Unchanged = 0;
+
+private:
+    struct ReportedComponent
+    {
+        uint32_t Row; // In the repository's metadata table.
+        const RequestedComponentInfo* Info;
+        bool Unneeded; // Also in the unneeded manifest list.
+    };
+
+    _Ret_maybenull_ ReportedComponent* FindReported(size_t row);
+
+    // Scratch space for the set of reported components, sorted by row.
+    std::vector<ReportedComponent> _reported;
+};
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <vector>
 #include "HttpServer.h"
 #include "TeepTamBrokerLib.h"
 
@@ -17,32 +18,33 @@
 
 typedef struct {
     char OutboundMediaType[80];
-    const char* OutboundMessage;
-    size_t OutboundMessageLength;
+    TeepOutboundMessage OutboundMessage;
 } TeepBasicSession;
 
-TeepBasicSession g_Session = { NULL, 0 };
+TeepBasicSession g_Session;
 
-teep_error_code_t TamQueueOutboundTeepMessage(void* sessionHandle, const char* mediaType, const char* message, size_t messageLength)
+teep_error_code_t TamQueueOutboundTeepMessage(void* sessionHandle, const char* mediaType, TeepOutboundMessage&& message)
 {
     TeepBasicSession* session = (TeepBasicSession*)sessionHandle;
 
-    assert(session->OutboundMessage == nullptr);
+    assert(session->OutboundMessage.IsEmpty());
 
-    // Save message for later transmission.
-    char* data = (char*)malloc(messageLength);
-    if (data == nullptr) {
-        return TEEP_ERR_TEMPORARY_ERROR;
-    }
-    memcpy(data, message, messageLength);
-    session->OutboundMessage = data;
-    session->OutboundMessageLength = messageLength;
-    printf("Sending %zd bytes...\n", messageLength);
+    // Save message for later transmission.  The segments are sent as
+    // they are, so nothing is copied here.
+    session->OutboundMessage = std::move(message);
+    printf("Sending %zd bytes...\n", session->OutboundMessage.GetLength());
 
     strcpy_s(session->OutboundMediaType, sizeof(session->OutboundMediaType), mediaType);
     return TEEP_ERR_SUCCESS;
 }
 
+teep_error_code_t TamQueueOutboundTeepMessage(void* sessionHandle, const char* mediaType, const char* message, size_t messageLength)
+{
+    TeepOutboundMessage outboundMessage;
+    outboundMessage.AppendCopy({ message, messageLength });
+    return TamQueueOutboundTeepMessage(sessionHandle, mediaType, std::move(outboundMessage));
+}
+
 //
 // Macros.
 //
@@ -71,24 +73,19 @@ teep_error_code_t TamQueueOutboundTeepMessage(void* sessionHandle, const char* m
 
 // The following functions are based on code from https://docs.microsoft.com/en-us/windows/desktop/Http/http-server-sample-application
 
-DWORD SendHttpResponse(
+DWORD SendHttpResponseChunks(
     _In_ HANDLE hReqQueue,
     _In_ HTTP_REQUEST* pRequest,
     USHORT StatusCode,
     _In_z_ PCSTR pReason,
     _In_opt_z_ PCSTR pContentType,
-    _In_reads_opt_(EntityStringLength) PCSTR pEntityString,
-     size_t EntityStringLength)
+    _In_reads_opt_(ChunkCount) HTTP_DATA_CHUNK* pChunks,
+    USHORT ChunkCount)
 {
     HTTP_RESPONSE   response;
-    HTTP_DATA_CHUNK dataChunk;
     DWORD           result;
     DWORD           bytesSent;
 
-    if (EntityStringLength > ULONG_MAX) {
-        return ERROR_INVALID_PARAMETER;
-    }
-
     //
     // Initialize the HTTP response structure.
     //
@@ -102,17 +99,13 @@ DWORD SendHttpResponse(
         ADD_KNOWN_HEADER(response, HttpHeaderContentType, pContentType);
     }
 
-    if (pEntityString)
+    if (pChunks)
     {
         //
-        // Add an entity chunk.
+        // Add the entity chunks.
         //
-        dataChunk.DataChunkType = HttpDataChunkFromMemory;
-        dataChunk.FromMemory.pBuffer = (void*)pEntityString;
-        dataChunk.FromMemory.BufferLength = (ULONG)EntityStringLength;
-
-        response.EntityChunkCount = 1;
-        response.pEntityChunks = &dataChunk;
+        response.EntityChunkCount = ChunkCount;
+        response.pEntityChunks = pChunks;
     }
 
     //
@@ -141,6 +134,60 @@ DWORD SendHttpResponse(
     return result;
 }
 
+DWORD SendHttpResponse(
+    _In_ HANDLE hReqQueue,
+    _In_ HTTP_REQUEST* pRequest,
+    USHORT StatusCode,
+    _In_z_ PCSTR pReason,
+    _In_opt_z_ PCSTR pContentType,
+    _In_reads_opt_(EntityStringLength) PCSTR pEntityString,
+     size_t EntityStringLength)
+{
+    HTTP_DATA_CHUNK dataChunk;
+
+    if (EntityStringLength > ULONG_MAX) {
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (pEntityString == nullptr) {
+        return SendHttpResponseChunks(hReqQueue, pRequest, StatusCode, pReason, pContentType, nullptr, 0);
+    }
+
+    dataChunk.DataChunkType = HttpDataChunkFromMemory;
+    dataChunk.FromMemory.pBuffer = (void*)pEntityString;
+    dataChunk.FromMemory.BufferLength = (ULONG)EntityStringLength;
+    return SendHttpResponseChunks(hReqQueue, pRequest, StatusCode, pReason, pContentType, &dataChunk, 1);
+}
+
+// Send a TEEP message as the response, with one entity chunk per segment.
+DWORD SendHttpMessageResponse(
+    _In_ HANDLE hReqQueue,
+    _In_ HTTP_REQUEST* pRequest,
+    _In_z_ PCSTR pContentType,
+    _Inout_ TeepOutboundMessage& message)
+{
+    const std::vector<UsefulBufC>& segments = message.GetSegments();
+    if (segments.size() > USHRT_MAX) {
+        // Too many to gather, so send one contiguous copy.
+        std::vector<uint8_t> buffer;
+        message.Flatten(buffer);
+        message.Clear();
+        return SendHttpResponse(hReqQueue, pRequest, 200, "OK", pContentType, (PCSTR)buffer.data(), buffer.size());
+    }
+
+    std::vector<HTTP_DATA_CHUNK> chunks(segments.size());
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (segments[i].len > ULONG_MAX) {
+            return ERROR_INVALID_PARAMETER;
+        }
+        chunks[i].DataChunkType = HttpDataChunkFromMemory;
+        chunks[i].FromMemory.pBuffer = (void*)segments[i].ptr;
+        chunks[i].FromMemory.BufferLength = (ULONG)segments[i].len;
+    }
+    DWORD result = SendHttpResponseChunks(hReqQueue, pRequest, 200, "OK", pContentType, chunks.data(), (USHORT)chunks.size());
+    message.Clear();
+    return result;
+}
+
 // Handle an incoming POST request, which might be for any session.
 DWORD HandleHttpPost(
     _In_ HANDLE        hReqQueue,
@@ -206,18 +253,11 @@ DWORD HandleHttpPost(
                 0);
         }
 
-        result = SendHttpResponse(
+        result = SendHttpMessageResponse(
                 hReqQueue,
                 pRequest,
-                200,
-                "OK",
                 session->OutboundMediaType,
-                session->OutboundMessage,
-                session->OutboundMessageLength);
-
-        free((char*)session->OutboundMessage);
-        session->OutboundMessage = nullptr;
-        session->OutboundMessageLength = 0;
+                session->OutboundMessage);
 
         return result;
     }
@@ -242,23 +282,16 @@ DWORD HandleHttpPost(
             nullptr,
             0);
     } else {
-        result = SendHttpResponse(
+        result = SendHttpMessageResponse(
             hReqQueue,
             pRequest,
-            200,
-            "OK",
             session->OutboundMediaType,
-            session->OutboundMessage,
-            session->OutboundMessageLength);
+            session->OutboundMessage);
     }
 
     delete mediaType;
 
-    if (session->OutboundMessage != nullptr) {
-        free((char*)session->OutboundMessage);
-        session->OutboundMessage = nullptr;
-        session->OutboundMessageLength = 0;
-    }
+    session->OutboundMessage.Clear();
 
     FREE_MEM(inputBuffer);
     return 0;
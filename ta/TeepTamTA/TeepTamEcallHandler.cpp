@@ -22,6 +22,11 @@ int ecall_TamProcessTeepMessage(
         messageLength);
 }
 
+void ecall_TamCloseSession(void* sessionHandle)
+{
+    TamCloseSession(sessionHandle);
+}
+
 teep_error_code_t TamQueueOutboundTeepMessage(
     void* sessionHandle,
     const char* mediaType,
@@ -37,4 +42,16 @@ teep_error_code_t TamQueueOutboundTeepMessage(
         return TEEP_ERR_TEMPORARY_ERROR;
     }
     return TEEP_ERR_SUCCESS;
-}
\ No newline at end of file
+}
+
+// The ocall copies the message out of the enclave, so gather it first.
+teep_error_code_t TamQueueOutboundTeepMessage(
+    void* sessionHandle,
+    const char* mediaType,
+    TeepOutboundMessage&& message)
+{
+    std::vector<uint8_t> buffer;
+    message.Flatten(buffer);
+    message.Clear();
+    return TamQueueOutboundTeepMessage(sessionHandle, mediaType, (const char*)buffer.data(), buffer.size());
+}
@@ -35,6 +35,11 @@ teep_error_code_t TamProcessConnect(_In_ void* sessionHandle, _In_z_ const char*
     return err;
 }
 
+void TamCloseSession(_In_ void* sessionHandle)
+{
+    ecall_TamCloseSession(g_ta_eid, sessionHandle);
+}
+
 int TeepInitialize(void)
 {
     return ecall_Initialize(g_ta_eid);